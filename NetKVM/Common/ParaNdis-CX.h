@@ -3,6 +3,15 @@
 #include "ndis56common.h"
 #include "ParaNdis-AbstractPath.h"
 
+// commands in flight at once, each of them takes up to 4 descriptors
+// of the control queue (64 entries on QEMU)
+#define PARANDIS_CX_SLOTS     16
+#define PARANDIS_CX_SLOT_SIZE 512
+// the data of the commands waiting for a free slot (both VLAN tables)
+// and the number of runs of the same command they are kept in
+#define PARANDIS_CX_BACKLOG_SIZE 16384
+#define PARANDIS_CX_BACKLOG_RUNS 32
+
 class CParaNdisCX : public CParaNdisTemplatePath<CVirtQueue>, public CPlacementAllocatable
 {
   public:
@@ -13,6 +22,7 @@ class CParaNdisCX : public CParaNdisTemplatePath<CVirtQueue>, public CPlacementA
 
     virtual NDIS_STATUS SetupMessageIndex(u16 vector);
 
+    // waits for the result of the command
     BOOLEAN CParaNdisCX::SendControlMessage(UCHAR cls,
                                             UCHAR cmd,
                                             PVOID buffer1,
@@ -21,9 +31,116 @@ class CParaNdisCX : public CParaNdisTemplatePath<CVirtQueue>, public CPlacementA
                                             ULONG size2,
                                             int levelIfOK);
 
+    // queues the command without waiting, the result is only logged when
+    // the command is completed by the CX DPC or by a later command; when
+    // no slot is free the command is kept in the backlog
+    BOOLEAN SendControlMessageAsync(UCHAR cls,
+                                    UCHAR cmd,
+                                    PVOID buffer1,
+                                    ULONG size1,
+                                    PVOID buffer2,
+                                    ULONG size2,
+                                    int levelIfOK);
+
+    // queues the command only when a slot is free and the backlog is empty,
+    // returns FALSE at once otherwise; for the commands the caller repeats
+    // later, when the newer parameters replace the ones not sent
+    BOOLEAN TrySendControlMessageAsync(UCHAR cls,
+                                       UCHAR cmd,
+                                       PVOID buffer1,
+                                       ULONG size1,
+                                       PVOID buffer2,
+                                       ULONG size2,
+                                       int levelIfOK);
+
+    // queues nEntries commands of the same class and command, the data
+    // of each one is an entry of the array, with one kick for all the
+    // commands fitting into the free slots, the rest is copied to the
+    // backlog; does not wait, returns the number of accepted ones
+    ULONG SendControlMessageBatch(UCHAR cls, UCHAR cmd, PVOID entries, ULONG entrySize, ULONG nEntries, int levelIfOK);
+
+    // called by the CX DPC, refills the slots from the backlog
+    void ProcessCompletions();
+
+    // releases the commands the device will not complete
+    void Shutdown();
+
     bool FireDPC(ULONG messageId) override;
     KDPC m_DPC;
 
   protected:
     tCompletePhysicalAddress m_ControlData;
+
+  private:
+    enum class SlotState
+    {
+        Free,
+        Pending,
+        Completed
+    };
+
+    struct CXSlot
+    {
+        SlotState State;
+        // SendControlMessage waits for the slot and frees it
+        bool Waited;
+        BOOLEAN Result;
+        UCHAR Class;
+        UCHAR Command;
+        int LevelIfOK;
+        ULONG AckOffset;
+    };
+
+    CXSlot m_Slots[PARANDIS_CX_SLOTS] = {};
+    ULONG m_FreeSlots = 0;
+
+    // Count commands, the data of each one (Size1 + Size2 bytes)
+    // starts at Offset of the backlog data
+    struct CXRun
+    {
+        UCHAR Class;
+        UCHAR Command;
+        int LevelIfOK;
+        ULONG Size1;
+        ULONG Size2;
+        ULONG Offset;
+        ULONG Count;
+    };
+
+    CXRun m_Backlog[PARANDIS_CX_BACKLOG_RUNS] = {};
+    ULONG m_BacklogFirst = 0;
+    ULONG m_BacklogRuns = 0;
+    ULONG m_BacklogUsed = 0;
+    PUCHAR m_BacklogData = nullptr;
+
+    int SubmitNoLock(UCHAR cls,
+                     UCHAR cmd,
+                     PVOID buffer1,
+                     ULONG size1,
+                     PVOID buffer2,
+                     ULONG size2,
+                     int levelIfOK,
+                     bool waited);
+    void CompleteSlotNoLock(int index, UINT len);
+    void ReleaseSlotNoLock(int index);
+    UINT ProcessCompletionsNoLock();
+    ULONG QueueNoLock(UCHAR cls,
+                      UCHAR cmd,
+                      PVOID buffer1,
+                      ULONG size1,
+                      PVOID buffer2,
+                      ULONG size2,
+                      ULONG nEntries,
+                      int levelIfOK);
+    ULONG AppendBacklogNoLock(UCHAR cls,
+                              UCHAR cmd,
+                              PVOID buffer1,
+                              ULONG size1,
+                              PVOID buffer2,
+                              ULONG size2,
+                              ULONG nEntries,
+                              int levelIfOK);
+    ULONG SubmitBacklogNoLock();
+    void DropBacklogNoLock();
+    bool WaitForCompletion(int waitedSlot);
 };
@@ -7,8 +7,12 @@
 
 #if PARANDIS_SUPPORT_RSS
 
+#include "ParaNdis_Toeplitz.h"
+
 #define PARANDIS_RSS_MAX_RECEIVE_QUEUES (32)
 
+static_assert(NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_2 == TOEPLITZ_KEY_SIZE, "unexpected RSS key size");
+
 typedef enum class _tagPARANDIS_RSS_MODE
 {
     PARANDIS_RSS_DISABLED = 0,
@@ -58,6 +62,8 @@ class PARANDIS_RSS_PARAMS
 
     PARANDIS_HASHING_SETTINGS ActiveHashingSettings = {};
     PARANDIS_SCALING_SETTINGS ActiveRSSScalingSettings = {};
+    // built from ActiveHashingSettings.HashSecretKey
+    tToeplitzTable ToeplitzTable = {};
 
     mutable CNdisRWLock rwLock;
 };
@@ -94,6 +100,14 @@ VOID ParaNdis6_RSSAnalyzeReceivedPacket(PARANDIS_RSS_PARAMS *RSSParameters,
                                         PVOID dataBuffer,
                                         struct _tagNET_PACKET_INFO *packetInfo);
 
+ULONG ParaNdis6_RSSHashReportToHashType(USHORT report);
+
+/* false if the device did not hash the packet with an enabled hash type */
+bool ParaNdis6_RSSSetReportedHash(PARANDIS_RSS_PARAMS *RSSParameters,
+                                  USHORT hashReport,
+                                  ULONG hashValue,
+                                  struct _tagNET_PACKET_INFO *packetInfo);
+
 CCHAR ParaNdis6_RSSGetScalingDataForPacket(PARANDIS_RSS_PARAMS *RSSParameters,
                                            struct _tagNET_PACKET_INFO *packetInfo,
                                            PPROCESSOR_NUMBER targetProcessor);
@@ -18,6 +18,11 @@ class CParaNdisRX : public CParaNdisTemplatePath<CVirtQueue>, public CNdisAlloca
 
     void ReuseReceiveBuffer(pRxNetDescriptor pBuffersDescriptor)
     {
+        if (m_ReturnCacheEnabled && ReturnToCache(pBuffersDescriptor))
+        {
+            return;
+        }
+
         TPassiveSpinLocker autoLock(m_Lock);
 
         ReuseReceiveBufferNoLock(pBuffersDescriptor);
@@ -32,12 +37,34 @@ class CParaNdisRX : public CParaNdisTemplatePath<CVirtQueue>, public CNdisAlloca
 
     BOOLEAN RestartQueue();
 
+    // waits up to the busy poll budget for a packet before
+    // the caller re-enables the interrupt with RestartQueue
+    bool BusyPoll()
+    {
+        return m_VirtQueue.BusyPoll();
+    }
+
+    void GetBusyPollCounters(ULONGLONG &Hits, ULONGLONG &Misses) const
+    {
+        m_VirtQueue.GetBusyPollCounters(Hits, Misses);
+    }
+
+    // software RSC: the packets indicated with coalesced segments
+    // and the total number of segments in them
+    void GetRscCounters(ULONGLONG &Packets, ULONGLONG &Segments) const
+    {
+        Packets = m_RscPackets;
+        Segments = m_RscSegments;
+    }
+
     void Shutdown()
     {
         TPassiveSpinLocker autoLock(m_Lock);
 
         m_VirtQueue.Shutdown();
         m_Reinsert = false;
+        DropMergedPacketNoLock();
+        RefillFromCacheNoLock();
     }
 
     void KickRXRing();
@@ -52,6 +79,32 @@ class CParaNdisRX : public CParaNdisTemplatePath<CVirtQueue>, public CNdisAlloca
     }
     BOOLEAN AllocateMore();
 
+    // adaptive notification coalescing: sends the parameters chosen
+    // by ProcessRxRing, called after it out of the lock
+    void UpdateCoalescing();
+    void ResetCoalescing();
+    void GetCoalescingCounters(ULONG &Updates, ULONG &Deferred) const
+    {
+        Updates = m_CoalescingUpdates;
+        Deferred = m_CoalescingDeferred;
+    }
+
+    // return cache: the bulk refills of the ring, the buffers added by them,
+    // the total and the longest time (in 100 ns) the oldest returned buffer
+    // waited in the cache and the refills that found the ring empty
+    void GetRefillCounters(ULONGLONG &Refills,
+                           ULONGLONG &Buffers,
+                           ULONGLONG &TotalLatency,
+                           ULONGLONG &MaxLatency,
+                           ULONGLONG &Starved) const
+    {
+        Refills = m_Refills;
+        Buffers = m_RefilledBuffers;
+        TotalLatency = m_RefillTotalLatency;
+        MaxLatency = m_RefillMaxLatency;
+        Starved = m_RefillStarved;
+    }
+
   private:
     /* list of Rx buffers available for data (under VIRTIO management) */
     LIST_ENTRY m_NetReceiveBuffers;
@@ -66,12 +119,97 @@ class CParaNdisRX : public CParaNdisTemplatePath<CVirtQueue>, public CNdisAlloca
 
     PARANDIS_RECEIVE_QUEUE m_UnclassifiedPacketsQueue;
 
+    /* mergeable buffers: the packet being collected from several buffers */
+    pRxNetDescriptor m_MergedHead = NULL;
+    pRxNetDescriptor m_MergedTail = NULL;
+    UINT m_MergedBuffers = 0;
+    UINT m_MergedBuffersLeft = 0;
+    UINT m_MergedLength = 0;
+    // the rest of a dropped packet, returned to the ring as it arrives
+    UINT m_MergedBuffersToSkip = 0;
+
     void ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor);
+    void ReuseOneReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor);
+    bool MergeRxBuffer(pRxNetDescriptor &pBufferDescriptor, unsigned int &nFullLength);
+    void DropMergedPacketNoLock();
+
+    void ReuseMergedBuffersNoLock(pRxNetDescriptor pBuffersDescriptor);
+    void ClassifyReceivedPacket(pRxNetDescriptor pBufferDescriptor, CCHAR nCurrCpuReceiveQueue);
+    void PublishClassifiedPackets(CCHAR nCurrCpuReceiveQueue);
+
+#ifdef PARANDIS_SUPPORT_RSS
+    /* the packets classified to each receive queue, chained by the Flink
+       of ReceiveQueueListEntry until PublishClassifiedPackets */
+    struct
+    {
+        PLIST_ENTRY Head;
+        PLIST_ENTRY Tail;
+        ULONG Count;
+        PROCESSOR_NUMBER TargetProcessor;
+    } m_PendingPackets[PARANDIS_RSS_MAX_RECEIVE_QUEUES] = {};
+    ULONG m_PendingQueues = 0;
+    static_assert(PARANDIS_RSS_MAX_RECEIVE_QUEUES <= sizeof(ULONG) * 8, "m_PendingQueues is too small");
+#endif
+
+#if PARANDIS_SUPPORT_RSC
+    /* software RSC: the flows of the current ProcessRxRing pass whose
+       packets are held until no more segments can be coalesced into them */
+    static const UINT m_RscMaxFlows = 8;
+    struct
+    {
+        pRxNetDescriptor Head;
+        pRxNetDescriptor Tail;
+        ULONG NextSeq;
+        ULONG SegmentSize;
+    } m_RscFlows[m_RscMaxFlows] = {};
+    UINT m_RscNextVictim = 0;
+
+    bool CoalesceRxPacket(pRxNetDescriptor pBufferDescriptor, CCHAR nCurrCpuReceiveQueue);
+    void FlushRscFlow(UINT Index, CCHAR nCurrCpuReceiveQueue);
+#endif
+    ULONGLONG m_RscPackets = 0;
+    ULONGLONG m_RscSegments = 0;
+
+    /* adaptive notification coalescing, see EvaluateCoalescingNoLock */
+    ULONGLONG m_CoalescingTimestamp = 0;
+    ULONGLONG m_CoalescingPackets = 0;
+    UINT m_CoalescingLevel = 0;
+    // the level to send to the device, -1 if none
+    LONG m_CoalescingUpdate = -1;
+    // the last level the control queue took, the one of m_CoalescingLevel
+    // is sent again at the next interval while they differ
+    LONG m_CoalescingSent = 0;
+    ULONG m_CoalescingUpdates = 0;
+    ULONG m_CoalescingDeferred = 0;
+
+    void EvaluateCoalescingNoLock();
+
+    /* the returned buffers waiting for a bulk refill of the ring, see ReturnToCache */
+    CLockFreeQueue<RxNetDescriptor> m_ReturnCache;
+    bool m_ReturnCacheEnabled = false;
+    volatile LONG m_ReturnCacheCount = 0;
+    // when the oldest buffer in the cache was returned, 0 if none
+    volatile LONG64 m_ReturnCacheTimestamp = 0;
+    UINT m_RefillWatermark = 0;
+    // the buffers of the refill are kicked once, by RefillFromCacheNoLock
+    bool m_BulkRefill = false;
+    ULONGLONG m_Refills = 0;
+    ULONGLONG m_RefilledBuffers = 0;
+    ULONGLONG m_RefillTotalLatency = 0;
+    ULONGLONG m_RefillMaxLatency = 0;
+    ULONGLONG m_RefillStarved = 0;
+
+    bool ReturnToCache(pRxNetDescriptor pBuffersDescriptor);
+    void RefillFromCacheNoLock();
 
   private:
+    // number of buffers added to or retrieved from the virtqueue at once
+    static const UINT m_BatchSize = 32;
+
     int PrepareReceiveBuffers();
     pRxNetDescriptor CreateRxDescriptorOnInit();
     void RecalculateLimits();
+    void FillVirtQueueBuf(struct virtqueue_buf &Buf, pRxNetDescriptor pBufferDescriptor);
 };
 
 #ifdef PARANDIS_SUPPORT_RSS
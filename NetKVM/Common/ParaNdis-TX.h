@@ -4,6 +4,7 @@
 #include "ParaNdis_GuestAnnounce.h"
 #include "ParaNdis_LockFreeQueue.h"
 #include "ParaNdis_DebugHistory.h"
+#include "ParaNdis_Segmentation.h"
 
 /* Must be a power of 2 */
 #define PARANDIS_TX_LOCK_FREE_QUEUE_DEFAULT_SIZE 2048
@@ -15,6 +16,11 @@
 refer linux kernel code #define MAX_SKB_FRAGS (65536/PAGE_SIZE + 1), */
 #define MAX_PACKET_PAGES                         17
 
+/* when a packet has more SG elements than the descriptor has room for, the
+payload elements shorter than this are copied together with their short
+neighbours to one bounce segment and the others are still mapped */
+#define PARANDIS_TX_COALESCE_THRESHOLD           256
+
 class CNB;
 class CParaNdisTX;
 
@@ -59,6 +65,7 @@ class CNB : public CNdisAllocatableViaHelper<CNB>
     }
 
     bool ScheduleBuildSGListForTx();
+    void ReturnSGListBuffer();
 
     void MappingDone(PSCATTER_GATHER_LIST SGL);
     void ReleaseResources();
@@ -77,6 +84,42 @@ class CNB : public CNdisAllocatableViaHelper<CNB>
     void Report(int level, bool Success);
     void ReturnPages();
 
+    // software segmentation: each segment is bound to its own descriptor,
+    // the segments not submitted yet are sent when the queue has room
+    NBMappingStatus PrepareSegmentation(CTXDescriptor &Descriptor);
+    NBMappingStatus BindSegmentToDescriptor(CTXDescriptor &Descriptor);
+    bool IsSegmentationPrepared() const
+    {
+        return m_Segmentation.Segments != 0;
+    }
+    ULONG GetSegmentsLeft() const
+    {
+        return m_Segmentation.Segments - m_NextSegment;
+    }
+    bool HasSegmentsInFlight() const
+    {
+        return m_SegmentsInFlight != 0;
+    }
+    void SegmentSubmitted()
+    {
+        m_NextSegment++;
+        m_SegmentsInFlight++;
+    }
+    // the segments that could not be bound are not sent
+    void DropSegmentsLeft()
+    {
+        m_NextSegment = m_Segmentation.Segments;
+    }
+    // called for each completed descriptor, true when the NB is done
+    bool SegmentCompleted()
+    {
+        if (!m_SegmentsInFlight)
+        {
+            return true;
+        }
+        return !--m_SegmentsInFlight && !GetSegmentsLeft();
+    }
+
   private:
     ULONG Copy(PVOID Dst, ULONG Length) const;
     static ULONG CopyFromMdlChain(PVOID Dst, ULONG Length, PMDL &Source, ULONG &Offset);
@@ -92,17 +135,32 @@ class CNB : public CNdisAllocatableViaHelper<CNB>
     void DoIPHdrCSO(PVOID EthHeaders, ULONG HeadersLength) const;
     void SetupCSO(virtio_net_hdr *VirtioHeader, ULONG L4HeaderOffset) const;
     NBMappingStatus FillDescriptorSGList(CTXDescriptor &Descriptor, ULONG DataOffset);
+    ULONG CountDataElements(ULONG Offset) const;
     NBMappingStatus MapDataToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset) const;
     void PopulateIPLength(IPHeader *IpHeader, USHORT IpLength) const;
     NBMappingStatus MapCopyDataToVirtioSGL(CTXDescriptor &Descriptor) const;
+    NBMappingStatus BorrowExtraPages(ULONG Pages);
     NBMappingStatus AllocateAndFillCopySGL(ULONG ParsedHeadersLength);
+    ULONG CountCoalescedEntries(ULONG Offset, ULONG &Pages) const;
+    NBMappingStatus CoalesceDataToVirtioSGL(CTXDescriptor &Descriptor,
+                                            ULONG ParsedHeadersLength,
+                                            ULONG Pages,
+                                            ULONG &CopiedBytes);
+    NBMappingStatus MapSegmentToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset, ULONG Length) const;
+    bool ChecksumFromMdlChain(UINT_PTR &Sum, ULONG Offset, ULONG Length) const;
 
     PNET_BUFFER m_NB;
     CNBL *m_ParentNBL;
     PPARANDIS_ADAPTER m_Context;
     PSCATTER_GATHER_LIST m_SGL = nullptr;
+    // the buffer of m_SGL when it comes from the SG list cache of the TX path
+    PSCATTER_GATHER_LIST m_SGListBuffer = nullptr;
     CExtendedNBStorage *m_ExtraNBStorage = nullptr;
 
+    tSegmentationInfo m_Segmentation = {};
+    ULONG m_NextSegment = 0;
+    ULONG m_SegmentsInFlight = 0;
+
     CNB(const CNB &) = delete;
     CNB &operator=(const CNB &) = delete;
 
@@ -327,6 +385,11 @@ class CNBL : public CNdisAllocatableViaHelper<CNBL>, public CRefCountingObject,
     {
         return m_CsoInfo.Transmit.IpHeaderChecksum;
     }
+    // LSO or USO the device does not support, segmented by the driver
+    bool IsSoftwareSegmentation()
+    {
+        return m_SoftwareSegmentation;
+    }
     void UpdateLSOTxStats(ULONG ChunkSize)
     {
         if (m_LsoInfo.LsoV1TransmitComplete.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V1_TYPE)
@@ -396,6 +459,7 @@ class CNBL : public CNdisAllocatableViaHelper<CNBL>, public CRefCountingObject,
     ULONG_PTR m_CNB_Storage[(sizeof(CNB) + sizeof(ULONG_PTR) - 1) / sizeof(ULONG_PTR)];
     bool m_HaveFailedMappings = false;
     bool m_AllNBCompleted = false;
+    bool m_SoftwareSegmentation = false;
 
     CNdisList<CNB, CRawAccess, CNonCountingObject> m_Buffers;
 
@@ -473,7 +537,7 @@ class CParaNdisTX : public CParaNdisTemplatePath<CTXVirtQueue>, public CNdisAllo
         return m_VirtQueue.GetFreeHWBuffers();
     }
 
-    bool DoPendingTasks(CNBL *nblHolder);
+    bool DoPendingTasks(bool bFromDpc);
 
     void CompleteOutstandingNBLChain(PNET_BUFFER_LIST NBL, ULONG Flags = 0);
     void CompleteOutstandingInternalNBL(PNET_BUFFER_LIST NBL, BOOLEAN UnregisterOutstanding = TRUE);
@@ -482,10 +546,38 @@ class CParaNdisTX : public CParaNdisTemplatePath<CTXVirtQueue>, public CNdisAllo
     void ReturnPages(CExtendedNBStorage *extraNBStorage);
     void CheckStuckPackets(ULONG GraceTimeMillies);
 
+    // called on any CPU, nullptr when the cache is empty or disabled
+    PSCATTER_GATHER_LIST AllocateSGListBuffer(ULONG &Size);
+    void FreeSGListBuffer(PSCATTER_GATHER_LIST Buffer);
+
+    // the notifications of the device and the NBs submitted before them
+    void GetKickCounters(ULONGLONG &Kicks, ULONGLONG &Packets) const
+    {
+        Kicks = m_Kicks;
+        Packets = m_KickedPackets;
+    }
+
+    // budgeted reclaim from the DPC: the passes, the descriptors they
+    // released, the passes that left used descriptors for the next one
+    // and the most descriptors found in flight at the start of a pass
+    void GetReclaimCounters(ULONGLONG &Passes, ULONGLONG &Released, ULONGLONG &Lagging, ULONG &MaxInFlight) const
+    {
+        Passes = m_ReclaimPasses;
+        Released = m_ReclaimedDescriptors;
+        Lagging = m_ReclaimLaggingPasses;
+        MaxInFlight = m_ReclaimMaxInFlight;
+    }
+
+    void GetSGListCacheCounters(ULONGLONG &Hits, ULONGLONG &Misses) const
+    {
+        Hits = m_SGListCacheHits;
+        Misses = m_SGListCacheMisses;
+    }
+
   private:
     virtual void Notify(SMNotifications message) override;
 
-    bool SendMapped(bool IsInterrupt, CRawCNBLList &toWaitingList);
+    bool SendMapped(bool IsInterrupt, CRawCNBLList &toWaitingList, bool &NeedKick);
 
     void DropAllNBls(CRawCNBLList &Completed, NDIS_STATUS Status);
 
@@ -510,6 +602,8 @@ class CParaNdisTX : public CParaNdisTemplatePath<CTXVirtQueue>, public CNdisAllo
 
     bool AllocateExtraPages();
     void FreeExtraPages();
+    void CreateSGListCache();
+    bool ReclaimCompletions(CRawCNBList &nbToFree, UINT Budget);
 
     ULONG IsStuck();
 
@@ -518,6 +612,17 @@ class CParaNdisTX : public CParaNdisTemplatePath<CTXVirtQueue>, public CNdisAllo
 
     // indication that DPC waits on TX lock
     CNdisRefCounter m_DpcWaiting;
+    // Send calls starting the mapping of their NBLs, they send
+    // the mapped NBLs when they are done, see NBLMappingDone
+    CNdisRefCounter m_SendsStarting;
+
+    ULONGLONG m_Kicks = 0;
+    ULONGLONG m_KickedPackets = 0;
+
+    ULONGLONG m_ReclaimPasses = 0;
+    ULONGLONG m_ReclaimedDescriptors = 0;
+    ULONGLONG m_ReclaimLaggingPasses = 0;
+    ULONG m_ReclaimMaxInFlight = 0;
 
     CLockFreeCNBLQueue m_SendQueue;
 
@@ -526,6 +631,15 @@ class CParaNdisTX : public CParaNdisTemplatePath<CTXVirtQueue>, public CNdisAllo
 
     CRawPageList m_ExtraPages;
 
+    /* buffers for the SG lists of the NBs being sent, so
+       NdisMAllocateNetBufferSGList does not allocate one each time */
+    CLockFreeQueue<SCATTER_GATHER_LIST> m_SGListCache;
+    PVOID m_SGListCacheMemory = nullptr;
+    ULONG m_SGListCacheMemorySize = 0;
+    ULONG m_SGListBufferSize = 0;
+    volatile LONGLONG m_SGListCacheHits = 0;
+    volatile LONGLONG m_SGListCacheMisses = 0;
+
     struct
     {
         ULONGLONG LastTxProcess;
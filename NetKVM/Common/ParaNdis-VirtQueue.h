@@ -239,6 +239,34 @@ class CVirtQueue
 
     u16 SetMSIVector(u16 vector);
 
+    // 0 - interrupt as soon as a buffer is used, otherwise
+    // the maximal delay (in microseconds) of adaptive coalescing
+    void SetCoalescing(ULONG MaxDelayUs);
+
+    // 0 - no busy polling, otherwise the maximal spin
+    // time (in microseconds) of BusyPoll
+    void SetBusyPoll(ULONG BudgetUs);
+
+    // Restart enables the interrupt as with adaptive coalescing,
+    // when the driver reclaims the used buffers by other means
+    void SetDelayedRestart(bool Delayed)
+    {
+        m_DelayedRestart = Delayed;
+    }
+
+    // spins until a buffer is used or the budget runs out,
+    // returns true in the first case
+    bool BusyPoll()
+    {
+        return m_VirtQueue != nullptr && CanTouchHardware() && virtqueue_busy_poll(m_VirtQueue);
+    }
+
+    void GetBusyPollCounters(ULONGLONG &Hits, ULONGLONG &Misses) const
+    {
+        Hits = m_VirtQueue ? m_VirtQueue->busy_poll.hits : 0;
+        Misses = m_VirtQueue ? m_VirtQueue->busy_poll.misses : 0;
+    }
+
     int AddBuf(struct VirtIOBufferDescriptor sg[],
                unsigned int out_num,
                unsigned int in_num,
@@ -249,11 +277,24 @@ class CVirtQueue
         return virtqueue_add_buf(m_VirtQueue, sg, out_num, in_num, data, va_indirect, phys_indirect);
     }
 
+    // adds up to num buffers and exposes them to the device at once,
+    // returns the number of buffers added
+    UINT AddBufs(struct virtqueue_buf bufs[], UINT num)
+    {
+        return virtqueue_add_bufs(m_VirtQueue, bufs, num);
+    }
+
     void *GetBuf(unsigned int *len)
     {
         return virtqueue_get_buf(m_VirtQueue, len);
     }
 
+    // returns the number of buffers retrieved into opaque[] and len[]
+    UINT GetBufs(void *opaque[], unsigned int len[], UINT num)
+    {
+        return virtqueue_get_bufs(m_VirtQueue, opaque, len, num);
+    }
+
     // TODO: Needs review / temporary
     void Kick()
     {
@@ -266,9 +307,13 @@ class CVirtQueue
         virtqueue_notify(m_VirtQueue);
     }
 
+    // with adaptive coalescing or SetDelayedRestart the interrupt
+    // is delayed until enough buffers are used, see SetCoalescing
     bool Restart()
     {
-        if (!virtqueue_enable_cb(m_VirtQueue))
+        bool bDrained = (m_CoalescingDelay || m_DelayedRestart) ? virtqueue_enable_cb_delayed(m_VirtQueue)
+                                                                : virtqueue_enable_cb(m_VirtQueue);
+        if (!bDrained)
         {
             virtqueue_disable_cb(m_VirtQueue);
             return false;
@@ -311,6 +356,9 @@ class CVirtQueue
 
     UINT m_Index;
     VirtIODevice *m_IODevice;
+    ULONG m_CoalescingDelay = 0;
+    ULONG m_BusyPollBudget = 0;
+    bool m_DelayedRestart = false;
 
     CNdisSharedMemory m_SharedMemory;
     struct virtqueue *m_VirtQueue = nullptr;
@@ -339,7 +387,9 @@ class CTXVirtQueue : public CVirtQueue
 
     SubmitTxPacketResult SubmitPacket(CNB &NB);
 
-    void ProcessTXCompletions(CRawCNBList &listDone, bool bKill = false);
+    // releases up to Budget used buffers (all of them if 0),
+    // returns the number of released ones
+    UINT ProcessTXCompletions(CRawCNBList &listDone, bool bKill = false, UINT Budget = 0);
     bool Alive()
     {
         return !m_Killed;
@@ -362,11 +412,16 @@ class CTXVirtQueue : public CVirtQueue
         return m_TotalDescriptors;
     }
 
+    ULONG GetDescriptorsInFlight()
+    {
+        return m_TotalDescriptors - m_Descriptors.GetCount();
+    }
+
     // TODO: Needs review
     void Shutdown();
 
   private:
-    UINT ReleaseTransmitBuffers(CRawCNBList &listDone);
+    UINT ReleaseTransmitBuffers(CRawCNBList &listDone, UINT Budget);
     void ReleaseOneBuffer(CTXDescriptor *TXDescriptor, CRawCNBList &listDone);
     bool PrepareBuffers();
     void FreeBuffers();
@@ -375,6 +430,7 @@ class CTXVirtQueue : public CVirtQueue
 
     void KickQueueOnOverflow();
     void UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor);
+    SubmitTxPacketResult SubmitSegmentedPacket(CNB &NB);
 
     CNdisList<CTXDescriptor, CRawAccess, CCountingObject> m_Descriptors;
     CNdisList<CTXDescriptor, CRawAccess, CNonCountingObject> m_DescriptorsInUse;
@@ -19,18 +19,30 @@ CParaNdisCX::~CParaNdisCX()
     {
         ParaNdis_FreePhysicalMemory(m_Context, &m_ControlData);
     }
+    if (m_BacklogData != nullptr)
+    {
+        NdisFreeMemoryWithTagPriority(m_Context->MiniportHandle, m_BacklogData, PARANDIS_MEMORY_TAG);
+    }
 }
 
 bool CParaNdisCX::Create(UINT DeviceQueueIndex)
 {
     m_queueIndex = (u16)DeviceQueueIndex;
 
-    if (!ParaNdis_InitialAllocatePhysicalMemory(m_Context, 512, &m_ControlData))
+    if (!ParaNdis_InitialAllocatePhysicalMemory(m_Context, PARANDIS_CX_SLOTS * PARANDIS_CX_SLOT_SIZE, &m_ControlData))
     {
         DPrintf(0, "CParaNdisCX::Create - ParaNdis_InitialAllocatePhysicalMemory failed for %u\n", DeviceQueueIndex);
         m_ControlData.Virtual = nullptr;
         return false;
     }
+    m_FreeSlots = PARANDIS_CX_SLOTS;
+
+    m_BacklogData = (PUCHAR)ParaNdis_AllocateMemory(m_Context, PARANDIS_CX_BACKLOG_SIZE);
+    if (!m_BacklogData)
+    {
+        DPrintf(0, "CParaNdisCX::Create - ParaNdis_AllocateMemory failed for the backlog\n");
+        return false;
+    }
 
     m_Context->m_CxStateMachine.Start();
 
@@ -39,6 +51,332 @@ bool CParaNdisCX::Create(UINT DeviceQueueIndex)
     return m_VirtQueue.Create(DeviceQueueIndex, &m_Context->IODevice, m_Context->MiniportHandle);
 }
 
+// returns the index of the slot of the queued command, -1 on failure
+int CParaNdisCX::SubmitNoLock(UCHAR cls,
+                              UCHAR cmd,
+                              PVOID buffer1,
+                              ULONG size1,
+                              PVOID buffer2,
+                              ULONG size2,
+                              int levelIfOK,
+                              bool waited)
+{
+    if (!m_ControlData.Virtual || PARANDIS_CX_SLOT_SIZE <= (size1 + size2 + 16) || !m_VirtQueue.IsValid() ||
+        !m_VirtQueue.CanTouchHardware())
+    {
+        DPrintf(0, "%s (buffer %d,%d) - ERROR: message too LARGE\n", __FUNCTION__, size1, size2);
+        return -1;
+    }
+
+    int index = 0;
+    while (index < PARANDIS_CX_SLOTS && m_Slots[index].State != SlotState::Free)
+    {
+        index++;
+    }
+    if (index == PARANDIS_CX_SLOTS)
+    {
+        DPrintf(0, "%s - ERROR: no free slot\n", __FUNCTION__);
+        return -1;
+    }
+
+    struct VirtIOBufferDescriptor sg[4];
+    PUCHAR pBase = (PUCHAR)m_ControlData.Virtual + index * PARANDIS_CX_SLOT_SIZE;
+    PHYSICAL_ADDRESS phBase = m_ControlData.Physical;
+    ULONG offset = 0;
+    UINT nOut = 1;
+
+    phBase.QuadPart += index * PARANDIS_CX_SLOT_SIZE;
+    ((virtio_net_ctrl_hdr *)pBase)->class_of_command = cls;
+    ((virtio_net_ctrl_hdr *)pBase)->cmd = cmd;
+    sg[0].physAddr = phBase;
+    sg[0].length = sizeof(virtio_net_ctrl_hdr);
+    offset += sg[0].length;
+    offset = (offset + 3) & ~3;
+    if (size1)
+    {
+        NdisMoveMemory(pBase + offset, buffer1, size1);
+        sg[nOut].physAddr = phBase;
+        sg[nOut].physAddr.QuadPart += offset;
+        sg[nOut].length = size1;
+        offset += size1;
+        offset = (offset + 3) & ~3;
+        nOut++;
+    }
+    if (size2)
+    {
+        NdisMoveMemory(pBase + offset, buffer2, size2);
+        sg[nOut].physAddr = phBase;
+        sg[nOut].physAddr.QuadPart += offset;
+        sg[nOut].length = size2;
+        offset += size2;
+        offset = (offset + 3) & ~3;
+        nOut++;
+    }
+    sg[nOut].physAddr = phBase;
+    sg[nOut].physAddr.QuadPart += offset;
+    sg[nOut].length = sizeof(virtio_net_ctrl_ack);
+    *(virtio_net_ctrl_ack *)(pBase + offset) = VIRTIO_NET_ERR;
+
+    if (!m_Context->m_CxStateMachine.RegisterOutstandingItem())
+    {
+        DPrintf(0, "%s - ERROR: the control flow is stopped\n", __FUNCTION__);
+        return -1;
+    }
+    // the cookie of the buffer is the 1-based index of the slot
+    if (0 > m_VirtQueue.AddBuf(sg, nOut, 1, (PVOID)(ULONG_PTR)(index + 1), NULL, 0))
+    {
+        m_Context->m_CxStateMachine.UnregisterOutstandingItem();
+        DPrintf(0, "%s - ERROR: add_buf failed\n", __FUNCTION__);
+        return -1;
+    }
+
+    CXSlot &slot = m_Slots[index];
+    slot.State = SlotState::Pending;
+    slot.Waited = waited;
+    slot.Result = FALSE;
+    slot.Class = cls;
+    slot.Command = cmd;
+    slot.LevelIfOK = levelIfOK;
+    slot.AckOffset = offset;
+    m_FreeSlots--;
+    return index;
+}
+
+void CParaNdisCX::CompleteSlotNoLock(int index, UINT len)
+{
+    CXSlot &slot = m_Slots[index];
+    virtio_net_ctrl_ack ack = *(virtio_net_ctrl_ack *)((PUCHAR)m_ControlData.Virtual + index * PARANDIS_CX_SLOT_SIZE +
+                                                      slot.AckOffset);
+
+    if (len != sizeof(virtio_net_ctrl_ack))
+    {
+        DPrintf(0, "%s - ERROR: wrong len %d\n", __FUNCTION__, len);
+    }
+    else if (ack != VIRTIO_NET_OK)
+    {
+        DPrintf(0, "%s - ERROR: error %d returned for class %d\n", __FUNCTION__, ack, slot.Class);
+    }
+    else
+    {
+        // everything is OK
+        DPrintf(slot.LevelIfOK, "%s OK(%d.%d)\n", __FUNCTION__, slot.Class, slot.Command);
+        slot.Result = TRUE;
+    }
+    slot.State = SlotState::Completed;
+    m_Context->m_CxStateMachine.UnregisterOutstandingItem();
+    if (!slot.Waited)
+    {
+        ReleaseSlotNoLock(index);
+    }
+}
+
+void CParaNdisCX::ReleaseSlotNoLock(int index)
+{
+    m_Slots[index].State = SlotState::Free;
+    m_FreeSlots++;
+}
+
+UINT CParaNdisCX::ProcessCompletionsNoLock()
+{
+    UINT len, n = 0;
+    void *p;
+
+    if (!m_VirtQueue.IsValid())
+    {
+        return 0;
+    }
+    while (NULL != (p = m_VirtQueue.GetBuf(&len)))
+    {
+        CompleteSlotNoLock((int)(ULONG_PTR)p - 1, len);
+        n++;
+    }
+    return n;
+}
+
+// copies up to nEntries commands to the backlog, the data of the i-th
+// one is the i-th entry (size1 bytes) of buffer1 followed by buffer2;
+// returns the number of copied ones
+ULONG CParaNdisCX::AppendBacklogNoLock(UCHAR cls,
+                                       UCHAR cmd,
+                                       PVOID buffer1,
+                                       ULONG size1,
+                                       PVOID buffer2,
+                                       ULONG size2,
+                                       ULONG nEntries,
+                                       int levelIfOK)
+{
+    ULONG entrySize = size1 + size2;
+    ULONG nCopied = nEntries;
+
+    if (!m_BacklogData || !m_VirtQueue.IsValid() || !m_VirtQueue.CanTouchHardware())
+    {
+        return 0;
+    }
+    if (entrySize && nCopied > (PARANDIS_CX_BACKLOG_SIZE - m_BacklogUsed) / entrySize)
+    {
+        nCopied = (PARANDIS_CX_BACKLOG_SIZE - m_BacklogUsed) / entrySize;
+    }
+    if (!nCopied)
+    {
+        return 0;
+    }
+
+    // the data of the last run ends where the new one starts
+    CXRun *run = m_BacklogRuns > m_BacklogFirst ? &m_Backlog[m_BacklogRuns - 1] : NULL;
+    if (!run || run->Class != cls || run->Command != cmd || run->LevelIfOK != levelIfOK || run->Size1 != size1 ||
+        run->Size2 != size2)
+    {
+        if (m_BacklogRuns == PARANDIS_CX_BACKLOG_RUNS)
+        {
+            return 0;
+        }
+        run = &m_Backlog[m_BacklogRuns++];
+        run->Class = cls;
+        run->Command = cmd;
+        run->LevelIfOK = levelIfOK;
+        run->Size1 = size1;
+        run->Size2 = size2;
+        run->Offset = m_BacklogUsed;
+        run->Count = 0;
+    }
+    for (ULONG i = 0; i < nCopied; ++i)
+    {
+        if (size1)
+        {
+            NdisMoveMemory(m_BacklogData + m_BacklogUsed, (PUCHAR)buffer1 + (ULONG_PTR)i * size1, size1);
+        }
+        if (size2)
+        {
+            NdisMoveMemory(m_BacklogData + m_BacklogUsed + size1, buffer2, size2);
+        }
+        m_BacklogUsed += entrySize;
+    }
+    run->Count += nCopied;
+    return nCopied;
+}
+
+// moves the commands of the backlog to the free slots, in order;
+// returns the number of submitted ones, the caller kicks the queue
+ULONG CParaNdisCX::SubmitBacklogNoLock()
+{
+    ULONG nSubmitted = 0;
+
+    while (m_BacklogFirst < m_BacklogRuns && m_FreeSlots)
+    {
+        CXRun &run = m_Backlog[m_BacklogFirst];
+        PUCHAR entry = m_BacklogData + run.Offset;
+
+        if (SubmitNoLock(run.Class, run.Command, entry, run.Size1, entry + run.Size1, run.Size2, run.LevelIfOK, false) <
+            0)
+        {
+            DPrintf(0, "%s - ERROR: dropping %u commands %d.%d\n", __FUNCTION__, run.Count, run.Class, run.Command);
+            run.Count = 0;
+        }
+        else
+        {
+            run.Offset += run.Size1 + run.Size2;
+            run.Count--;
+            nSubmitted++;
+        }
+        if (!run.Count)
+        {
+            m_BacklogFirst++;
+        }
+    }
+    if (m_BacklogFirst == m_BacklogRuns)
+    {
+        m_BacklogFirst = 0;
+        m_BacklogRuns = 0;
+        m_BacklogUsed = 0;
+    }
+    return nSubmitted;
+}
+
+void CParaNdisCX::DropBacklogNoLock()
+{
+    for (ULONG i = m_BacklogFirst; i < m_BacklogRuns; ++i)
+    {
+        DPrintf(0,
+                "[%s] dropping %u commands %d.%d\n",
+                __FUNCTION__,
+                m_Backlog[i].Count,
+                m_Backlog[i].Class,
+                m_Backlog[i].Command);
+    }
+    m_BacklogFirst = 0;
+    m_BacklogRuns = 0;
+    m_BacklogUsed = 0;
+}
+
+// submits the backlog and then the new commands into the free slots with
+// one kick, the ones not fitting go to the backlog behind the older ones
+// and are submitted by the CX DPC; never waits, returns the number of
+// accepted commands
+ULONG CParaNdisCX::QueueNoLock(UCHAR cls,
+                               UCHAR cmd,
+                               PVOID buffer1,
+                               ULONG size1,
+                               PVOID buffer2,
+                               ULONG size2,
+                               ULONG nEntries,
+                               int levelIfOK)
+{
+    ULONG nQueued = 0;
+    ULONG nSubmitted;
+    bool bFailed = false;
+
+    ProcessCompletionsNoLock();
+    nSubmitted = SubmitBacklogNoLock();
+    while (!m_BacklogRuns && m_FreeSlots && nQueued < nEntries)
+    {
+        PVOID entry = (PUCHAR)buffer1 + (ULONG_PTR)nQueued * size1;
+        if (SubmitNoLock(cls, cmd, entry, size1, buffer2, size2, levelIfOK, false) < 0)
+        {
+            bFailed = true;
+            break;
+        }
+        nQueued++;
+        nSubmitted++;
+    }
+    if (nSubmitted)
+    {
+        m_VirtQueue.Kick();
+    }
+    if (!bFailed && nQueued < nEntries)
+    {
+        PVOID entry = (PUCHAR)buffer1 + (ULONG_PTR)nQueued * size1;
+        nQueued += AppendBacklogNoLock(cls, cmd, entry, size1, buffer2, size2, nEntries - nQueued, levelIfOK);
+    }
+    return nQueued;
+}
+
+// polls the queue until the command of waitedSlot is completed or,
+// when it is -1, until the backlog is submitted and some slot is free;
+// used only by SendControlMessage
+bool CParaNdisCX::WaitForCompletion(int waitedSlot)
+{
+    auto Done = [&]() {
+        return waitedSlot < 0 ? m_FreeSlots != 0 && !m_BacklogRuns
+                              : m_Slots[waitedSlot].State == SlotState::Completed;
+    };
+    auto Poll = [&]() {
+        ProcessCompletionsNoLock();
+        if (SubmitBacklogNoLock())
+        {
+            m_VirtQueue.Kick();
+        }
+    };
+
+    Poll();
+    for (int i = 0; i < 500000 && !Done(); ++i)
+    {
+        UINT interval = 1;
+        NdisStallExecution(interval);
+        Poll();
+    }
+    return Done();
+}
+
 BOOLEAN CParaNdisCX::SendControlMessage(UCHAR cls,
                                         UCHAR cmd,
                                         PVOID buffer1,
@@ -50,95 +388,128 @@ BOOLEAN CParaNdisCX::SendControlMessage(UCHAR cls,
     BOOLEAN bOK = FALSE;
     CLockedContext<CNdisSpinLock> autoLock(m_Lock);
 
-    if (m_ControlData.Virtual && m_ControlData.size > (size1 + size2 + 16) && m_VirtQueue.IsValid() &&
-        m_VirtQueue.CanTouchHardware())
+    // the command goes after the ones of the backlog
+    if ((!m_FreeSlots || m_BacklogRuns) && !WaitForCompletion(-1))
     {
-        struct VirtIOBufferDescriptor sg[4];
-        PUCHAR pBase = (PUCHAR)m_ControlData.Virtual;
-        PHYSICAL_ADDRESS phBase = m_ControlData.Physical;
-        ULONG offset = 0;
-        UINT nOut = 1;
+        DPrintf(0, "%s - ERROR: no free slot\n", __FUNCTION__);
+        return FALSE;
+    }
 
-        ((virtio_net_ctrl_hdr *)pBase)->class_of_command = cls;
-        ((virtio_net_ctrl_hdr *)pBase)->cmd = cmd;
-        sg[0].physAddr = phBase;
-        sg[0].length = sizeof(virtio_net_ctrl_hdr);
-        offset += sg[0].length;
-        offset = (offset + 3) & ~3;
-        if (size1)
+    int index = SubmitNoLock(cls, cmd, buffer1, size1, buffer2, size2, levelIfOK, true);
+    if (index >= 0)
+    {
+        m_VirtQueue.Kick();
+        if (WaitForCompletion(index))
         {
-            NdisMoveMemory(pBase + offset, buffer1, size1);
-            sg[nOut].physAddr = phBase;
-            sg[nOut].physAddr.QuadPart += offset;
-            sg[nOut].length = size1;
-            offset += size1;
-            offset = (offset + 3) & ~3;
-            nOut++;
+            bOK = m_Slots[index].Result;
+            ReleaseSlotNoLock(index);
         }
-        if (size2)
+        else
         {
-            NdisMoveMemory(pBase + offset, buffer2, size2);
-            sg[nOut].physAddr = phBase;
-            sg[nOut].physAddr.QuadPart += offset;
-            sg[nOut].length = size2;
-            offset += size2;
-            offset = (offset + 3) & ~3;
-            nOut++;
+            // the slot is freed when the command is completed
+            DPrintf(0, "%s - ERROR: get_buf failed\n", __FUNCTION__);
+            m_Slots[index].Waited = false;
         }
-        sg[nOut].physAddr = phBase;
-        sg[nOut].physAddr.QuadPart += offset;
-        sg[nOut].length = sizeof(virtio_net_ctrl_ack);
-        *(virtio_net_ctrl_ack *)(pBase + offset) = VIRTIO_NET_ERR;
+    }
+    return bOK;
+}
 
-        if (0 <= m_VirtQueue.AddBuf(sg, nOut, 1, (PVOID)1, NULL, 0))
-        {
-            UINT len;
-            void *p;
-            m_Context->m_CxStateMachine.RegisterOutstandingItem();
+BOOLEAN CParaNdisCX::SendControlMessageAsync(UCHAR cls,
+                                             UCHAR cmd,
+                                             PVOID buffer1,
+                                             ULONG size1,
+                                             PVOID buffer2,
+                                             ULONG size2,
+                                             int levelIfOK)
+{
+    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
 
-            m_VirtQueue.Kick();
-            p = m_VirtQueue.GetBuf(&len);
-            for (int i = 0; i < 500000 && !p; ++i)
-            {
-                UINT interval = 1;
-                NdisStallExecution(interval);
-                p = m_VirtQueue.GetBuf(&len);
-            }
-            m_Context->m_CxStateMachine.UnregisterOutstandingItem();
+    if (!QueueNoLock(cls, cmd, buffer1, size1, buffer2, size2, 1, levelIfOK))
+    {
+        DPrintf(0, "%s - ERROR: command %d.%d is not queued\n", __FUNCTION__, cls, cmd);
+        return FALSE;
+    }
+    return TRUE;
+}
 
-            if (!p)
-            {
-                DPrintf(0, "%s - ERROR: get_buf failed\n", __FUNCTION__);
-            }
-            else if (len != sizeof(virtio_net_ctrl_ack))
-            {
-                DPrintf(0, "%s - ERROR: wrong len %d\n", __FUNCTION__, len);
-            }
-            else if (*(virtio_net_ctrl_ack *)(pBase + offset) != VIRTIO_NET_OK)
-            {
-                DPrintf(0,
-                        "%s - ERROR: error %d returned for class %d\n",
-                        __FUNCTION__,
-                        *(virtio_net_ctrl_ack *)(pBase + offset),
-                        cls);
-            }
-            else
-            {
-                // everything is OK
-                DPrintf(levelIfOK, "%s OK(%d.%d,buffers of %d and %d) \n", __FUNCTION__, cls, cmd, size1, size2);
-                bOK = TRUE;
-            }
-        }
-        else
+BOOLEAN CParaNdisCX::TrySendControlMessageAsync(UCHAR cls,
+                                                UCHAR cmd,
+                                                PVOID buffer1,
+                                                ULONG size1,
+                                                PVOID buffer2,
+                                                ULONG size2,
+                                                int levelIfOK)
+{
+    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+
+    ProcessCompletionsNoLock();
+    if (m_BacklogRuns || !m_FreeSlots)
+    {
+        return FALSE;
+    }
+    if (SubmitNoLock(cls, cmd, buffer1, size1, buffer2, size2, levelIfOK, false) < 0)
+    {
+        return FALSE;
+    }
+    m_VirtQueue.Kick();
+    return TRUE;
+}
+
+ULONG CParaNdisCX::SendControlMessageBatch(UCHAR cls,
+                                           UCHAR cmd,
+                                           PVOID entries,
+                                           ULONG entrySize,
+                                           ULONG nEntries,
+                                           int levelIfOK)
+{
+    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+
+    ULONG nQueued = QueueNoLock(cls, cmd, entries, entrySize, NULL, 0, nEntries, levelIfOK);
+    DPrintf(nQueued == nEntries ? levelIfOK : 0,
+            "%s %u of %u commands (%d.%d) queued\n",
+            __FUNCTION__,
+            nQueued,
+            nEntries,
+            cls,
+            cmd);
+    return nQueued;
+}
+
+void CParaNdisCX::ProcessCompletions()
+{
+    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+
+    if (!m_VirtQueue.IsValid() || !m_VirtQueue.CanTouchHardware())
+    {
+        return;
+    }
+    do
+    {
+        ProcessCompletionsNoLock();
+        if (SubmitBacklogNoLock())
         {
-            DPrintf(0, "%s - ERROR: add_buf failed\n", __FUNCTION__);
+            m_VirtQueue.Kick();
         }
-    }
-    else
+    } while (!m_VirtQueue.Restart());
+}
+
+void CParaNdisCX::Shutdown()
+{
+    CLockedContext<CNdisSpinLock> autoLock(m_Lock);
+
+    ProcessCompletionsNoLock();
+    DropBacklogNoLock();
+    for (int i = 0; i < PARANDIS_CX_SLOTS; i++)
     {
-        DPrintf(0, "%s (buffer %d,%d) - ERROR: message too LARGE\n", __FUNCTION__, size1, size2);
+        if (m_Slots[i].State == SlotState::Pending)
+        {
+            DPrintf(0, "[%s] dropping command %d.%d\n", __FUNCTION__, m_Slots[i].Class, m_Slots[i].Command);
+            m_Slots[i].State = SlotState::Completed;
+            m_Context->m_CxStateMachine.UnregisterOutstandingItem();
+            ReleaseSlotNoLock(i);
+        }
     }
-    return bOK;
+    m_VirtQueue.Shutdown();
 }
 
 NDIS_STATUS CParaNdisCX::SetupMessageIndex(u16 vector)
@@ -0,0 +1,186 @@
+#pragma once
+
+/*
+ * Raw (unfinalized) Internet checksum of a flat buffer, used by the SW offload
+ * in sw_offload.cpp. It has no dependency on NDIS, so DebugTools/Netchecksum
+ * can build it on the host and compare the vector loops with the scalar one.
+ *
+ * The x64 loop uses SSE2 and the ARM64 one NEON: both are part of the base
+ * instruction set and the kernel keeps their registers for drivers, so there
+ * is nothing to detect at run time. AVX2 would need KeSaveExtendedProcessorState
+ * around each packet, which costs more than it saves on MTU-sized buffers.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if defined(_WIN64) && !defined(_ARM64_)
+#include <emmintrin.h>
+#define PARANDIS_CHECKSUM_SSE2
+#elif defined(_ARM64_)
+#ifdef _MSC_VER
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#define PARANDIS_CHECKSUM_NEON
+#endif
+
+// bytes per iteration of the vector loops
+#define CHECKSUM_VECTOR_BLOCK 64
+
+// the reference implementation, also sums the tail of the vector loops
+static __inline UINT_PTR RawCheckSumCalculatorScalar(PVOID buffer, ULONG len)
+{
+    UINT_PTR val = 0;
+    PUCHAR ptr = (PUCHAR)buffer;
+#if defined(_WIN64) && !defined(_ARM64_)
+    ULONG count = len >> 2;
+    while (count--)
+    {
+        val += *(PUINT32)ptr;
+        ptr += 4;
+    }
+    if (len & 2)
+    {
+        val += *(PUINT16)ptr;
+        ptr += 2;
+    }
+#elif defined(_ARM64_)
+    ULONG count = len >> 1;
+    while (count--)
+    {
+        val += ptr[0];
+        val += ptr[1] << 8;
+        ptr += 2;
+    }
+#else
+    ULONG count = len >> 1;
+    while (count--)
+    {
+        val += *(PUINT16)ptr;
+        ptr += 2;
+    }
+#endif
+    if (len & 1)
+    {
+        val += *ptr;
+    }
+    return val;
+}
+
+#if defined(PARANDIS_CHECKSUM_SSE2)
+// the low and high 16 bits of each 32-bit word are summed separately in 32-bit
+// lanes (2^16 is 1 modulo 0xFFFF), flushed to the result before they can overflow
+#define CHECKSUM_SSE2_MAX_BLOCKS 0x4000
+
+static __inline UINT_PTR RawCheckSumCalculatorVector(PUCHAR &ptr, ULONG &len)
+{
+    const __m128i mask = _mm_set1_epi32(0xFFFF);
+    UINT_PTR val = 0;
+
+    while (len >= CHECKSUM_VECTOR_BLOCK)
+    {
+        ULONG blocks = min(len / CHECKSUM_VECTOR_BLOCK, CHECKSUM_SSE2_MAX_BLOCKS);
+        __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        __m128i lo2 = _mm_setzero_si128(), hi2 = _mm_setzero_si128();
+
+        len -= blocks * CHECKSUM_VECTOR_BLOCK;
+        while (blocks--)
+        {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)ptr);
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(ptr + 16));
+            __m128i v2 = _mm_loadu_si128((const __m128i *)(ptr + 32));
+            __m128i v3 = _mm_loadu_si128((const __m128i *)(ptr + 48));
+
+            lo = _mm_add_epi32(lo, _mm_and_si128(v0, mask));
+            hi = _mm_add_epi32(hi, _mm_srli_epi32(v0, 16));
+            lo2 = _mm_add_epi32(lo2, _mm_and_si128(v1, mask));
+            hi2 = _mm_add_epi32(hi2, _mm_srli_epi32(v1, 16));
+            lo = _mm_add_epi32(lo, _mm_and_si128(v2, mask));
+            hi = _mm_add_epi32(hi, _mm_srli_epi32(v2, 16));
+            lo2 = _mm_add_epi32(lo2, _mm_and_si128(v3, mask));
+            hi2 = _mm_add_epi32(hi2, _mm_srli_epi32(v3, 16));
+            ptr += CHECKSUM_VECTOR_BLOCK;
+        }
+
+        // widen the 32-bit lanes to 64 bits and add them up
+        const __m128i zero = _mm_setzero_si128();
+        __m128i sum = _mm_add_epi64(_mm_unpacklo_epi32(lo, zero), _mm_unpackhi_epi32(lo, zero));
+        sum = _mm_add_epi64(sum, _mm_add_epi64(_mm_unpacklo_epi32(hi, zero), _mm_unpackhi_epi32(hi, zero)));
+        sum = _mm_add_epi64(sum, _mm_add_epi64(_mm_unpacklo_epi32(lo2, zero), _mm_unpackhi_epi32(lo2, zero)));
+        sum = _mm_add_epi64(sum, _mm_add_epi64(_mm_unpacklo_epi32(hi2, zero), _mm_unpackhi_epi32(hi2, zero)));
+        sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+        val += (UINT_PTR)_mm_cvtsi128_si64(sum);
+    }
+    return val;
+}
+#elif defined(PARANDIS_CHECKSUM_NEON)
+static __inline UINT_PTR RawCheckSumCalculatorVector(PUCHAR &ptr, ULONG &len)
+{
+    uint64x2_t acc0 = vdupq_n_u64(0), acc1 = vdupq_n_u64(0);
+    uint64x2_t acc2 = vdupq_n_u64(0), acc3 = vdupq_n_u64(0);
+    ULONG blocks = len / CHECKSUM_VECTOR_BLOCK;
+
+    len -= blocks * CHECKSUM_VECTOR_BLOCK;
+    // pairs of 32-bit words are added into 64-bit lanes
+    while (blocks--)
+    {
+        acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(ptr)));
+        acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(ptr + 16)));
+        acc2 = vpadalq_u32(acc2, vreinterpretq_u32_u8(vld1q_u8(ptr + 32)));
+        acc3 = vpadalq_u32(acc3, vreinterpretq_u32_u8(vld1q_u8(ptr + 48)));
+        ptr += CHECKSUM_VECTOR_BLOCK;
+    }
+    return vaddvq_u64(vaddq_u64(vaddq_u64(acc0, acc1), vaddq_u64(acc2, acc3)));
+}
+#endif
+
+// the sum may differ from the scalar one, but it is congruent modulo 0xFFFF
+// and 0 only for a zero buffer, so RawCheckSumFinalize gives the same result
+static __inline UINT_PTR RawCheckSumCalculator(PVOID buffer, ULONG len)
+{
+    PUCHAR ptr = (PUCHAR)buffer;
+    UINT_PTR val = 0;
+
+#if defined(PARANDIS_CHECKSUM_SSE2) || defined(PARANDIS_CHECKSUM_NEON)
+    val = RawCheckSumCalculatorVector(ptr, len);
+#endif
+    return val + RawCheckSumCalculatorScalar(ptr, len);
+}
+
+static __inline USHORT RawCheckSumFinalize(UINT_PTR sum)
+{
+    UINT32 sum32;
+    UINT16 sum16;
+
+#ifdef _WIN64
+    sum32 = (((sum >> 32) | (sum << 32)) + sum) >> 32;
+#else
+    sum32 = sum;
+#endif
+    sum16 = (((sum32 >> 16) | (sum32 << 16)) + sum32) >> 16;
+    return ~sum16;
+}
@@ -102,6 +102,7 @@ typedef struct _tagConfigurationEntries
 #if PARANDIS_SUPPORT_RSC
     tConfigurationEntry RSCIPv4Supported;
     tConfigurationEntry RSCIPv6Supported;
+    tConfigurationEntry SoftwareRsc;
 #endif
 #if PARANDIS_SUPPORT_USO
     tConfigurationEntry USOv4Supported;
@@ -109,6 +110,20 @@ typedef struct _tagConfigurationEntries
 #endif
     tConfigurationEntry MinRxBufferPercent;
     tConfigurationEntry PollMode;
+    tConfigurationEntry CoalescingMaxDelay;
+    tConfigurationEntry BusyPollBudget;
+    tConfigurationEntry MergeableRxBuffers;
+    tConfigurationEntry TxSGListCache;
+    tConfigurationEntry TxBatchNBLs;
+    tConfigurationEntry TxReclaimBudget;
+    tConfigurationEntry InterruptModeration;
+    tConfigurationEntry AdaptiveCoalescing;
+    tConfigurationEntry RxCoalescePackets;
+    tConfigurationEntry RxCoalesceUsecs;
+    tConfigurationEntry TxCoalescePackets;
+    tConfigurationEntry TxCoalesceUsecs;
+    tConfigurationEntry SoftwareSegmentation;
+    tConfigurationEntry RxRefillWatermark;
 } tConfigurationEntries;
 
 // clang-format off
@@ -143,6 +158,7 @@ static const tConfigurationEntries defaultConfiguration =
 #if PARANDIS_SUPPORT_RSC
     { "*RscIPv4", 1, 0, 1},
     { "*RscIPv6", 1, 0, 1},
+    { "SoftwareRsc", 0, 0, 64},
 #endif
 #if PARANDIS_SUPPORT_USO
     { "*UsoIPv4", 1, 0, 1},
@@ -150,6 +166,20 @@ static const tConfigurationEntries defaultConfiguration =
 #endif
     { "MinRxBufferPercent", PARANDIS_MIN_RX_BUFFER_PERCENT_DEFAULT, 0, 100},
     { "*NdisPoll", 0, 0, 1},
+    { "CoalescingMaxDelay", 0, 0, 1000},
+    { "BusyPollBudget", 0, 0, 1000},
+    { "MergeableRxBuffers", 1, 0, 1},
+    { "TxSGListCache", 128, 0, 4096},
+    { "TxBatchNBLs", 32, 1, 1024},
+    { "TxReclaimBudget", 0, 0, 4096},
+    { "*InterruptModeration", 1, 0, 1},
+    { "AdaptiveCoalescing", 1, 0, 1},
+    { "RxCoalescePackets", 0, 0, 1024},
+    { "RxCoalesceUsecs", 0, 0, 1000},
+    { "TxCoalescePackets", 0, 0, 1024},
+    { "TxCoalesceUsecs", 0, 0, 1000},
+    { "SoftwareSegmentation", 1, 0, 1},
+    { "RxRefillWatermark", 16, 0, 256},
 };
 
 static void ParaNdis_ResetVirtIONetDevice(PARANDIS_ADAPTER *pContext)
@@ -279,6 +309,7 @@ static bool ReadNicConfiguration(PARANDIS_ADAPTER *pContext, PUCHAR pNewMACAddre
 #if PARANDIS_SUPPORT_RSC
             GetConfigurationEntry(cfg, &pConfiguration->RSCIPv4Supported);
             GetConfigurationEntry(cfg, &pConfiguration->RSCIPv6Supported);
+            GetConfigurationEntry(cfg, &pConfiguration->SoftwareRsc);
 #endif
 #if PARANDIS_SUPPORT_USO
             GetConfigurationEntry(cfg, &pConfiguration->USOv4Supported);
@@ -286,6 +317,20 @@ static bool ReadNicConfiguration(PARANDIS_ADAPTER *pContext, PUCHAR pNewMACAddre
 #endif
             GetConfigurationEntry(cfg, &pConfiguration->MinRxBufferPercent);
             GetConfigurationEntry(cfg, &pConfiguration->PollMode);
+            GetConfigurationEntry(cfg, &pConfiguration->CoalescingMaxDelay);
+            GetConfigurationEntry(cfg, &pConfiguration->BusyPollBudget);
+            GetConfigurationEntry(cfg, &pConfiguration->MergeableRxBuffers);
+            GetConfigurationEntry(cfg, &pConfiguration->TxSGListCache);
+            GetConfigurationEntry(cfg, &pConfiguration->TxBatchNBLs);
+            GetConfigurationEntry(cfg, &pConfiguration->TxReclaimBudget);
+            GetConfigurationEntry(cfg, &pConfiguration->InterruptModeration);
+            GetConfigurationEntry(cfg, &pConfiguration->AdaptiveCoalescing);
+            GetConfigurationEntry(cfg, &pConfiguration->RxCoalescePackets);
+            GetConfigurationEntry(cfg, &pConfiguration->RxCoalesceUsecs);
+            GetConfigurationEntry(cfg, &pConfiguration->TxCoalescePackets);
+            GetConfigurationEntry(cfg, &pConfiguration->TxCoalesceUsecs);
+            GetConfigurationEntry(cfg, &pConfiguration->SoftwareSegmentation);
+            GetConfigurationEntry(cfg, &pConfiguration->RxRefillWatermark);
 
             bDebugPrint = pConfiguration->isLogEnabled.ulValue;
             virtioDebugLevel = pConfiguration->debugLevel.ulValue;
@@ -297,6 +342,24 @@ static bool ReadNicConfiguration(PARANDIS_ADAPTER *pContext, PUCHAR pNewMACAddre
             pContext->bDoSupportPriority = pConfiguration->PrioritySupport.ulValue != 0;
             pContext->Offload.flagsValue = 0;
             pContext->MinRxBufferPercent = pConfiguration->MinRxBufferPercent.ulValue;
+            pContext->uCoalescingMaxDelay = pConfiguration->CoalescingMaxDelay.ulValue;
+            pContext->uBusyPollBudget = pConfiguration->BusyPollBudget.ulValue;
+            // the returned RX buffers refilled at once, 0 - one by one
+            pContext->uRxRefillWatermark = pConfiguration->RxRefillWatermark.ulValue;
+            // confirmed by VIRTIO_NET_F_MRG_RXBUF during the feature negotiation
+            pContext->bUseMergedBuffers = pConfiguration->MergeableRxBuffers.ulValue != 0;
+            pContext->uTxSGListCacheSize = pConfiguration->TxSGListCache.ulValue;
+            pContext->uTxBatchNBLs = pConfiguration->TxBatchNBLs.ulValue;
+            pContext->uTxReclaimBudget = pConfiguration->TxReclaimBudget.ulValue;
+            // used only with VIRTIO_NET_F_NOTF_COAL
+            pContext->bInterruptModeration = pConfiguration->InterruptModeration.ulValue != 0;
+            pContext->bAdaptiveCoalescing = pConfiguration->AdaptiveCoalescing.ulValue != 0;
+            pContext->NotifyCoalescing.RxMaxPackets = pConfiguration->RxCoalescePackets.ulValue;
+            pContext->NotifyCoalescing.RxUsecs = pConfiguration->RxCoalesceUsecs.ulValue;
+            pContext->NotifyCoalescing.TxMaxPackets = pConfiguration->TxCoalescePackets.ulValue;
+            pContext->NotifyCoalescing.TxUsecs = pConfiguration->TxCoalesceUsecs.ulValue;
+            // used only when the device has no TSO or USO
+            pContext->SoftwareSegmentation.bEnabled = pConfiguration->SoftwareSegmentation.ulValue != 0;
             // TX caps: 1 - TCP, 2 - UDP, 4 - IP, 8 - TCPv6, 16 - UDPv6
             if (pConfiguration->OffloadTxChecksum.ulValue & 1)
             {
@@ -385,6 +448,7 @@ static bool ReadNicConfiguration(PARANDIS_ADAPTER *pContext, PUCHAR pNewMACAddre
 #if PARANDIS_SUPPORT_RSC
             pContext->RSC.bIPv4SupportedSW = (UCHAR)pConfiguration->RSCIPv4Supported.ulValue;
             pContext->RSC.bIPv6SupportedSW = (UCHAR)pConfiguration->RSCIPv6Supported.ulValue;
+            pContext->RSC.uSoftwareMaxSegments = pConfiguration->SoftwareRsc.ulValue;
 #endif
             pContext->uMaxFragmentsInOneNB = MAX_FRAGMENTS_IN_ONE_NB;
 #if PARANDIS_SUPPORT_POLL
@@ -509,6 +573,7 @@ static void DumpVirtIOFeatures(PPARANDIS_ADAPTER pContext)
         {VIRTIO_RING_F_EVENT_IDX, "VIRTIO_RING_F_EVENT_IDX"},
         {VIRTIO_F_VERSION_1, "VIRTIO_F_VERSION_1"},
         {VIRTIO_F_RING_PACKED, "VIRTIO_F_RING_PACKED"},
+        {VIRTIO_F_IN_ORDER, "VIRTIO_F_IN_ORDER"},
         {VIRTIO_F_ACCESS_PLATFORM, "VIRTIO_F_ACCESS_PLATFORM"},
         {VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, "VIRTIO_NET_F_CTRL_GUEST_OFFLOADS" },
         {VIRTIO_NET_F_RSC_EXT, "VIRTIO_NET_F_RSC_EXT" },
@@ -516,6 +581,8 @@ static void DumpVirtIOFeatures(PPARANDIS_ADAPTER pContext)
         {VIRTIO_NET_F_HASH_REPORT, "VIRTIO_NET_F_HASH_REPORT" },
         {VIRTIO_NET_F_STANDBY, "VIRTIO_NET_F_STANDBY" },
         {VIRTIO_NET_F_HOST_USO, "VIRTIO_NET_F_HOST_USO" },
+        {VIRTIO_NET_F_NOTF_COAL, "VIRTIO_NET_F_NOTF_COAL" },
+        {VIRTIO_NET_F_VQ_NOTF_COAL, "VIRTIO_NET_F_VQ_NOTF_COAL" },
     };
     UINT i;
     for (i = 0; i < sizeof(Features) / sizeof(Features[0]); ++i)
@@ -566,11 +633,138 @@ static void PrintStatistics(PARANDIS_ADAPTER *pContext)
             pContext->extraStatistics.minFreeTxBuffers,
             pContext->extraStatistics.droppedTxPackets);
     DPrintf(0,
-            "[Diag!] Rx frames %I64u, Rx.Pri %d, RxHwCS.OK %d, FiltOut %d\n",
+            "[Diag!] Tx bytes copied %I64u, mapped %I64u, packets copied %d, coalesced %d\n",
+            pContext->extraStatistics.copiedTxBytes,
+            pContext->extraStatistics.mappedTxBytes,
+            pContext->extraStatistics.copiedTxPackets,
+            pContext->extraStatistics.coalescedTxPackets);
+    if (pContext->SoftwareSegmentation.bTSOv4 || pContext->SoftwareSegmentation.bTSOv6 ||
+        pContext->SoftwareSegmentation.bUSO)
+    {
+        DPrintf(0,
+                "[Diag!] Tx segmented by driver %d, segments %I64u\n",
+                pContext->extraStatistics.framesSoftwareSegmented,
+                pContext->extraStatistics.softwareSegments);
+    }
+    DPrintf(0,
+            "[Diag!] Rx frames %I64u, Rx.Pri %d, RxHwCS.OK %d, FiltOut %d, Merged %d\n",
             totalRxFrames,
             pContext->extraStatistics.framesRxPriority,
             pContext->extraStatistics.framesRxCSHwOK,
-            pContext->extraStatistics.framesFilteredOut);
+            pContext->extraStatistics.framesFilteredOut,
+            pContext->extraStatistics.framesRxMerged);
+    DPrintf(0,
+            "[Diag!] Rx hash from device %u, by driver %u\n",
+            pContext->extraStatistics.framesRSSHashDevice,
+            pContext->extraStatistics.framesRSSHashDriver);
+    {
+        ULONGLONG kicks = 0, packets = 0;
+        for (UINT i = 0; i < pContext->nPathBundles; i++)
+        {
+            ULONGLONG queueKicks, queuePackets;
+            pContext->pPathBundles[i].txPath.GetKickCounters(queueKicks, queuePackets);
+            kicks += queueKicks;
+            packets += queuePackets;
+        }
+        DPrintf(0, "[Diag!] Tx kicks %I64u for %I64u packets\n", kicks, packets);
+    }
+    if (pContext->bAdaptiveCoalescing)
+    {
+        ULONG updates = 0, deferred = 0;
+        for (UINT i = 0; i < pContext->nPathBundles; i++)
+        {
+            ULONG queueUpdates, queueDeferred;
+            pContext->pPathBundles[i].rxPath.GetCoalescingCounters(queueUpdates, queueDeferred);
+            updates += queueUpdates;
+            deferred += queueDeferred;
+        }
+        DPrintf(0, "[Diag!] Rx coalescing updates %u, deferred %u\n", updates, deferred);
+    }
+    if (pContext->uTxReclaimBudget)
+    {
+        ULONGLONG passes = 0, released = 0, lagging = 0;
+        ULONG maxInFlight = 0;
+        for (UINT i = 0; i < pContext->nPathBundles; i++)
+        {
+            ULONGLONG queuePasses, queueReleased, queueLagging;
+            ULONG queueInFlight;
+            pContext->pPathBundles[i].txPath.GetReclaimCounters(queuePasses,
+                                                                queueReleased,
+                                                                queueLagging,
+                                                                queueInFlight);
+            passes += queuePasses;
+            released += queueReleased;
+            lagging += queueLagging;
+            maxInFlight = max(maxInFlight, queueInFlight);
+        }
+        DPrintf(0,
+                "[Diag!] Tx reclaim passes %I64u, released %I64u, lagging %I64u, max in flight %u\n",
+                passes,
+                released,
+                lagging,
+                maxInFlight);
+    }
+    if (pContext->uTxSGListCacheSize)
+    {
+        ULONGLONG hits = 0, misses = 0;
+        for (UINT i = 0; i < pContext->nPathBundles; i++)
+        {
+            ULONGLONG queueHits, queueMisses;
+            pContext->pPathBundles[i].txPath.GetSGListCacheCounters(queueHits, queueMisses);
+            hits += queueHits;
+            misses += queueMisses;
+        }
+        DPrintf(0, "[Diag!] Tx SG list cache hits %I64u, misses %I64u\n", hits, misses);
+    }
+    if (pContext->uBusyPollBudget)
+    {
+        ULONGLONG hits = 0, misses = 0;
+        for (UINT i = 0; i < pContext->nPathBundles; i++)
+        {
+            ULONGLONG queueHits, queueMisses;
+            pContext->pPathBundles[i].rxPath.GetBusyPollCounters(queueHits, queueMisses);
+            hits += queueHits;
+            misses += queueMisses;
+        }
+        DPrintf(0, "[Diag!] Rx busy poll hits %I64u, misses %I64u\n", hits, misses);
+    }
+    if (pContext->uRxRefillWatermark)
+    {
+        ULONGLONG refills = 0, buffers = 0, totalLatency = 0, maxLatency = 0, starved = 0;
+        for (UINT i = 0; i < pContext->nPathBundles; i++)
+        {
+            ULONGLONG queueRefills, queueBuffers, queueTotalLatency, queueMaxLatency, queueStarved;
+            pContext->pPathBundles[i].rxPath.GetRefillCounters(queueRefills,
+                                                               queueBuffers,
+                                                               queueTotalLatency,
+                                                               queueMaxLatency,
+                                                               queueStarved);
+            refills += queueRefills;
+            buffers += queueBuffers;
+            totalLatency += queueTotalLatency;
+            maxLatency = max(maxLatency, queueMaxLatency);
+            starved += queueStarved;
+        }
+        // the latencies are in 100 ns units
+        DPrintf(0,
+                "[Diag!] Rx refills %I64u of %I64u buffers, latency avg %I64u max %I64u us, ring empty %I64u\n",
+                refills,
+                buffers,
+                refills ? totalLatency / refills / 10 : 0,
+                maxLatency / 10,
+                starved);
+    }
+#if PARANDIS_SUPPORT_RSC
+    if (pContext->RSC.bIPv4Software || pContext->RSC.bIPv6Software)
+    {
+        for (UINT i = 0; i < pContext->nPathBundles; i++)
+        {
+            ULONGLONG packets, segments;
+            pContext->pPathBundles[i].rxPath.GetRscCounters(packets, segments);
+            DPrintf(0, "[Diag!] Rx queue %u: software RSC %I64u packets of %I64u segments\n", i, packets, segments);
+        }
+    }
+#endif
 }
 
 static VOID InitializeRSCState(PPARANDIS_ADAPTER pContext)
@@ -608,15 +802,32 @@ static VOID InitializeRSCState(PPARANDIS_ADAPTER pContext)
         pContext->RSC.bIPv6SupportedHW = virtio_is_feature_enabled(pContext->u64HostFeatures, VIRTIO_NET_F_GUEST_TSO6);
     }
 
+    // without guest TSO the driver coalesces the segments of the
+    // same flow, up to the configured number of segments per packet
+    if (pContext->RSC.uSoftwareMaxSegments > 1)
+    {
+        if (pContext->RSC.bIPv4SupportedSW && !pContext->RSC.bIPv4SupportedHW)
+        {
+            pContext->RSC.bIPv4Enabled = pContext->RSC.bIPv4Software = TRUE;
+        }
+        if (pContext->RSC.bIPv6SupportedSW && !pContext->RSC.bIPv6SupportedHW)
+        {
+            pContext->RSC.bIPv6Enabled = pContext->RSC.bIPv6Software = TRUE;
+        }
+    }
+
     pContext->RSC.bHasDynamicConfig = bDynamicOffloadsPossible;
     pContext->RSC.bQemuSupported = bQemuRscSupport;
 
     DPrintf(0,
-            "[%s] Guest TSO state: IP4=%d, IP6=%d, Dynamic=%d\n",
+            "[%s] Guest TSO state: IP4=%d, IP6=%d, Dynamic=%d, Software IP4=%d, IP6=%d (%u segments)\n",
             __FUNCTION__,
             pContext->RSC.bIPv4Enabled,
             pContext->RSC.bIPv6Enabled,
-            pContext->RSC.bHasDynamicConfig);
+            pContext->RSC.bHasDynamicConfig,
+            pContext->RSC.bIPv4Software,
+            pContext->RSC.bIPv6Software,
+            pContext->RSC.uSoftwareMaxSegments);
 
     DPrintf(0,
             "[%s] Guest QEMU RSC support state: %sresent\n",
@@ -890,10 +1101,15 @@ NDIS_STATUS ParaNdis_InitializeContext(PARANDIS_ADAPTER *pContext, PNDIS_RESOURC
         pContext->bControlQueueSupported = AckFeature(pContext, VIRTIO_NET_F_CTRL_VQ);
         pContext->bGuestAnnounceSupported = pContext->bLinkDetectSupported && pContext->bControlQueueSupported &&
                                             AckFeature(pContext, VIRTIO_NET_F_GUEST_ANNOUNCE);
+        pContext->bNotifyCoalescingSupported = pContext->bControlQueueSupported &&
+                                               AckFeature(pContext, VIRTIO_NET_F_NOTF_COAL);
+        // the adaptive mode sets the parameters of each receive queue
+        pContext->bAdaptiveCoalescing = pContext->bAdaptiveCoalescing && pContext->bNotifyCoalescingSupported &&
+                                        AckFeature(pContext, VIRTIO_NET_F_VQ_NOTF_COAL);
         InitializeMAC(pContext, CurrentMAC);
         InitializeMaxMTUConfig(pContext);
 
-        pContext->bUseMergedBuffers = AckFeature(pContext, VIRTIO_NET_F_MRG_RXBUF);
+        pContext->bUseMergedBuffers = pContext->bUseMergedBuffers && AckFeature(pContext, VIRTIO_NET_F_MRG_RXBUF);
         pContext->nVirtioHeaderSize = (pContext->bUseMergedBuffers) ? sizeof(virtio_net_hdr_mrg_rxbuf)
                                                                     : sizeof(virtio_net_hdr);
         AckFeature(pContext, VIRTIO_RING_F_EVENT_IDX);
@@ -988,12 +1204,28 @@ NDIS_STATUS ParaNdis_InitializeContext(PARANDIS_ADAPTER *pContext, PNDIS_RESOURC
 
     if (pContext->Offload.flags.fTxLso && !AckFeature(pContext, VIRTIO_NET_F_HOST_TSO4))
     {
-        DisableLSOv4Permanently(pContext, __FUNCTION__, "Host does not support TSOv4\n");
+        if (pContext->SoftwareSegmentation.bEnabled)
+        {
+            DPrintf(0, "[%s] Host does not support TSOv4, the driver segments the packets\n", __FUNCTION__);
+            pContext->SoftwareSegmentation.bTSOv4 = true;
+        }
+        else
+        {
+            DisableLSOv4Permanently(pContext, __FUNCTION__, "Host does not support TSOv4\n");
+        }
     }
 
     if (pContext->Offload.flags.fTxLsov6 && !AckFeature(pContext, VIRTIO_NET_F_HOST_TSO6))
     {
-        DisableLSOv6Permanently(pContext, __FUNCTION__, "Host does not support TSOv6");
+        if (pContext->SoftwareSegmentation.bEnabled)
+        {
+            DPrintf(0, "[%s] Host does not support TSOv6, the driver segments the packets\n", __FUNCTION__);
+            pContext->SoftwareSegmentation.bTSOv6 = true;
+        }
+        else
+        {
+            DisableLSOv6Permanently(pContext, __FUNCTION__, "Host does not support TSOv6");
+        }
     }
 
     if (pContext->Offload.flags.fUsov4 || pContext->Offload.flags.fUsov6)
@@ -1009,7 +1241,15 @@ NDIS_STATUS ParaNdis_InitializeContext(PARANDIS_ADAPTER *pContext, PNDIS_RESOURC
         }
         else if (!AckFeature(pContext, VIRTIO_NET_F_HOST_USO))
         {
-            message = "host without USO support";
+            if (pContext->SoftwareSegmentation.bEnabled)
+            {
+                DPrintf(0, "[%s] Host does not support USO, the driver segments the packets\n", __FUNCTION__);
+                pContext->SoftwareSegmentation.bUSO = true;
+            }
+            else
+            {
+                message = "host without USO support";
+            }
         }
         if (message)
         {
@@ -1034,6 +1274,11 @@ NDIS_STATUS ParaNdis_InitializeContext(PARANDIS_ADAPTER *pContext, PNDIS_RESOURC
             DPrintf(0, "[%s] Using PACKED ring\n", __FUNCTION__);
         }
 
+        if (AckFeature(pContext, VIRTIO_F_IN_ORDER))
+        {
+            DPrintf(0, "[%s] Using in-order completion\n", __FUNCTION__);
+        }
+
         if (AckFeature(pContext, VIRTIO_F_ORDER_PLATFORM))
         {
             DPrintf(0, "[%s] Ack VIRTIO_F_ORDER_PLATFORM to device\n", __FUNCTION__);
@@ -1158,6 +1403,39 @@ static NDIS_STATUS SetupDPCTarget(PARANDIS_ADAPTER *pContext)
     return NDIS_STATUS_SUCCESS;
 }
 
+/**************************************************************************
+With mergeable buffers each RX buffer is a single page: the device writes
+the virtio header and the beginning of the packet into the first buffer
+and spreads the rest over as many buffers as needed (num_buffers).
+The indirect entries are not used (one descriptor per buffer), instead
+the data pages of the assembled packet are collected in PhysicalPages
+of its first buffer: the block itself and one entry per buffer.
+***************************************************************************/
+static void PrepareMergeableRXLayout(PARANDIS_ADAPTER *pContext)
+{
+    USHORT maxBuffersPerPacket = USHORT((pContext->MaxPacketSize.nMaxDataSizeHwRx + pContext->nVirtioHeaderSize +
+                                         PAGE_SIZE - 1) /
+                                        PAGE_SIZE);
+
+    pContext->RxLayout.ReserveForHeader = (USHORT)pContext->nVirtioHeaderSize;
+    pContext->RxLayout.ReserveForIndirectArea = 0;
+    pContext->RxLayout.ReserveForPacketTail = 0;
+    pContext->RxLayout.HeaderPageAllocation = PAGE_SIZE;
+    pContext->RxLayout.TotalAllocationsPerBuffer = 1;
+    pContext->RxLayout.IndirectEntries = PARANDIS_FIRST_RX_DATA_PAGE + maxBuffersPerPacket;
+
+    // RxCapacity is the number of full-size packets, with the same memory
+    // we can have this many pages, the ring size is the actual limit
+    pContext->maxRxBufferPerQueue *= maxBuffersPerPacket;
+
+    TraceNoPrefix(0,
+                  "[%s]: header %d, up to %d buffers per packet, up to %d buffers per queue\n",
+                  __FUNCTION__,
+                  pContext->RxLayout.ReserveForHeader,
+                  maxBuffersPerPacket,
+                  pContext->maxRxBufferPerQueue);
+}
+
 /**************************************************************************
 For each RX packet we need:
 0 or more page-sized blocks for data (eth header and up)
@@ -1166,6 +1444,11 @@ the remainder of the packet that is less than a page
 ***************************************************************************/
 static void PrepareRXLayout(PARANDIS_ADAPTER *pContext)
 {
+    if (pContext->bUseMergedBuffers)
+    {
+        PrepareMergeableRXLayout(pContext);
+        return;
+    }
 // #define RX_LAYOUT_AS_BEFORE
 #ifndef RX_LAYOUT_AS_BEFORE
     USHORT alignment = 32;
@@ -1290,6 +1573,17 @@ static NDIS_STATUS ParaNdis_VirtIONetInit(PARANDIS_ADAPTER *pContext)
         pContext->pPathBundles[i].txCreated = true;
     }
 
+#ifdef PARANDIS_SUPPORT_RSS
+    for (i = 0; i < (UINT)pContext->RSSMaxQueuesNumber && i < ARRAYSIZE(pContext->ReceiveQueues); i++)
+    {
+        // without the ring the packets go through the overflow list
+        if (!pContext->ReceiveQueues[i].Buffers.Create(pContext, pContext->maxRxBufferPerQueue))
+        {
+            DPrintf(0, "%s: ring of receive queue %u not allocated\n", __FUNCTION__, i);
+        }
+    }
+#endif
+
     if (pContext->bCXPathCreated)
     {
         pContext->pPathBundles[0].cxPath = &pContext->CXPath;
@@ -1321,8 +1615,12 @@ void ParaNdis_DeviceConfigureRSC(PARANDIS_ADAPTER *pContext)
 #if PARANDIS_SUPPORT_RSC
     UINT64 GuestOffloads;
 
-    GuestOffloads = 1 << VIRTIO_NET_F_GUEST_CSUM | ((pContext->RSC.bIPv4Enabled) ? (1 << VIRTIO_NET_F_GUEST_TSO4) : 0) |
-                    ((pContext->RSC.bIPv6Enabled) ? (1 << VIRTIO_NET_F_GUEST_TSO6) : 0) |
+    // the software RSC does not need the device
+    BOOLEAN bIPv4 = pContext->RSC.bIPv4Enabled && pContext->RSC.bIPv4SupportedHW;
+    BOOLEAN bIPv6 = pContext->RSC.bIPv6Enabled && pContext->RSC.bIPv6SupportedHW;
+
+    GuestOffloads = 1 << VIRTIO_NET_F_GUEST_CSUM | (bIPv4 ? (1 << VIRTIO_NET_F_GUEST_TSO4) : 0) |
+                    (bIPv6 ? (1 << VIRTIO_NET_F_GUEST_TSO6) : 0) |
                     ((pContext->RSC.bQemuSupported) ? (1LL << VIRTIO_NET_F_RSC_EXT) : 0);
 
     if (pContext->RSC.bHasDynamicConfig)
@@ -1418,6 +1716,7 @@ NDIS_STATUS ParaNdis_DeviceEnterD0(PARANDIS_ADAPTER *pContext)
     ParaNdis_AddDriverOKStatus(pContext);
     ParaNdis_DeviceConfigureMultiQueue(pContext);
     ParaNdis_DeviceConfigureRSC(pContext);
+    ParaNdis_UpdateNotificationCoalescing(pContext);
     ParaNdis_UpdateMAC(pContext);
     ParaNdis_KickRX(pContext);
 
@@ -1649,19 +1948,13 @@ static __inline CCHAR GetReceiveQueueForCurrentCPU(PARANDIS_ADAPTER *pContext)
 
 static __inline pRxNetDescriptor ReceiveQueueGetBuffer(PPARANDIS_RECEIVE_QUEUE pQueue)
 {
-    PLIST_ENTRY pListEntry = NdisInterlockedRemoveHeadList(&pQueue->BuffersList, &pQueue->Lock);
+    PLIST_ENTRY pListEntry = pQueue->Buffers.Dequeue();
     return pListEntry ? CONTAINING_RECORD(pListEntry, RxNetDescriptor, ReceiveQueueListEntry) : NULL;
 }
 
 static __inline BOOLEAN ReceiveQueueHasBuffers(PPARANDIS_RECEIVE_QUEUE pQueue)
 {
-    BOOLEAN res;
-
-    NdisAcquireSpinLock(&pQueue->Lock);
-    res = !IsListEmpty(&pQueue->BuffersList);
-    NdisReleaseSpinLock(&pQueue->Lock);
-
-    return res;
+    return !pQueue->Buffers.IsEmpty();
 }
 
 static VOID UpdateReceiveSuccessStatistics(PPARANDIS_ADAPTER pContext,
@@ -1704,52 +1997,64 @@ static BOOLEAN ProcessReceiveQueue(PARANDIS_ADAPTER *pContext,
                                    PNET_BUFFER_LIST *indicateTail,
                                    ULONG *nIndicate)
 {
-    pRxNetDescriptor pBufferDescriptor;
+    PLIST_ENTRY Entries[32];
     BOOLEAN isRxBufferShortage = FALSE;
 
-    while ((*pnPacketsToIndicateLeft > 0) && (NULL != (pBufferDescriptor = ReceiveQueueGetBuffer(pTargetReceiveQueue))))
+    while (*pnPacketsToIndicateLeft > 0)
     {
-        PNET_PACKET_INFO pPacketInfo = &pBufferDescriptor->PacketInfo;
+        // every packet dequeued is either indicated or returned
+        LONG nEntries = (LONG)min(*pnPacketsToIndicateLeft, ARRAYSIZE(Entries));
 
-        if (ParaNdis_IsTxRxPossible(pContext))
+        nEntries = pTargetReceiveQueue->Buffers.DequeueBatch(Entries, nEntries);
+        if (nEntries == 0)
+        {
+            break;
+        }
+        for (LONG i = 0; i < nEntries; i++)
         {
-            UINT nCoalescedSegmentsCount;
-            PNET_BUFFER_LIST packet = ParaNdis_PrepareReceivedPacket(pContext,
-                                                                     pBufferDescriptor,
-                                                                     &nCoalescedSegmentsCount);
-            if (packet != NULL)
+            pRxNetDescriptor pBufferDescriptor = CONTAINING_RECORD(Entries[i], RxNetDescriptor, ReceiveQueueListEntry);
+            PNET_PACKET_INFO pPacketInfo = &pBufferDescriptor->PacketInfo;
+
+            if (ParaNdis_IsTxRxPossible(pContext))
             {
-                UpdateReceiveSuccessStatistics(pContext, pPacketInfo, nCoalescedSegmentsCount);
-                if (*indicate == nullptr)
+                UINT nCoalescedSegmentsCount;
+                PNET_BUFFER_LIST packet = ParaNdis_PrepareReceivedPacket(pContext,
+                                                                         pBufferDescriptor,
+                                                                         &nCoalescedSegmentsCount);
+                if (packet != NULL)
                 {
-                    *indicate = *indicateTail = packet;
+                    UpdateReceiveSuccessStatistics(pContext, pPacketInfo, nCoalescedSegmentsCount);
+                    if (*indicate == nullptr)
+                    {
+                        *indicate = *indicateTail = packet;
+                    }
+                    else
+                    {
+                        NET_BUFFER_LIST_NEXT_NBL(*indicateTail) = packet;
+                        *indicateTail = packet;
+                    }
+
+                    NET_BUFFER_LIST_NEXT_NBL(*indicateTail) = NULL;
+                    (*pnPacketsToIndicateLeft)--;
+                    (*nIndicate)++;
+
+                    if (!isRxBufferShortage)
+                    {
+                        isRxBufferShortage = pBufferDescriptor->Queue->IsRxBuffersShortage();
+                    }
                 }
                 else
                 {
-                    NET_BUFFER_LIST_NEXT_NBL(*indicateTail) = packet;
-                    *indicateTail = packet;
-                }
-
-                NET_BUFFER_LIST_NEXT_NBL(*indicateTail) = NULL;
-                (*pnPacketsToIndicateLeft)--;
-                (*nIndicate)++;
-
-                if (!isRxBufferShortage)
-                {
-                    isRxBufferShortage = pBufferDescriptor->Queue->IsRxBuffersShortage();
+                    UpdateReceiveFailStatistics(pContext, nCoalescedSegmentsCount);
+                    pBufferDescriptor->Queue->ReuseReceiveBuffer(pBufferDescriptor);
                 }
             }
             else
             {
-                UpdateReceiveFailStatistics(pContext, nCoalescedSegmentsCount);
+                pContext->extraStatistics.framesFilteredOut++;
                 pBufferDescriptor->Queue->ReuseReceiveBuffer(pBufferDescriptor);
             }
         }
-        else
-        {
-            pContext->extraStatistics.framesFilteredOut++;
-            pBufferDescriptor->Queue->ReuseReceiveBuffer(pBufferDescriptor);
-        }
     }
     return isRxBufferShortage;
 }
@@ -1799,6 +2104,7 @@ static BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBund
         rxPathOwner = pathBundle->rxPath.UnclassifiedPacketsQueue().Ownership.Acquire();
 
         pathBundle->rxPath.ProcessRxRing(CurrCpuReceiveQueue);
+        pathBundle->rxPath.UpdateCoalescing();
 
         if (rxPathOwner)
         {
@@ -1865,6 +2171,13 @@ static BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBund
         pathBundle->rxPath.UnclassifiedPacketsQueue().Ownership.Release();
     }
 
+    // with busy polling a packet arriving within the budget is processed
+    // by the next round without re-enabling the interrupt
+    if (pathBundle != nullptr && res == 0 && pathBundle->rxPath.BusyPoll())
+    {
+        res = TRUE;
+    }
+
     // we do not need to make a check of rx queue restart etc. if we already know
     // that we need to respawn the DPC to get more data from the queue
     if (pathBundle != nullptr && res == 0)
@@ -1893,6 +2206,7 @@ void RxPoll(PARANDIS_ADAPTER *pContext, UINT BundleIndex, NDIS_POLL_RECEIVE_DATA
         rxPathOwner = pathBundle->rxPath.UnclassifiedPacketsQueue().Ownership.Acquire();
 
         pathBundle->rxPath.ProcessRxRing((CCHAR)BundleIndex);
+        pathBundle->rxPath.UpdateCoalescing();
 
         if (rxPathOwner)
         {
@@ -1975,6 +2289,11 @@ void ParaNdis_CXDPCWorkBody(PARANDIS_ADAPTER *pContext)
             pContext->bDeviceNeedsReset = TRUE;
         }
 
+        if (pContext->bCXPathCreated)
+        {
+            pContext->CXPath.ProcessCompletions();
+        }
+
         ReadLinkState(pContext);
         if (pContext->bLinkDetectSupported)
         {
@@ -1984,13 +2303,13 @@ void ParaNdis_CXDPCWorkBody(PARANDIS_ADAPTER *pContext)
         if (pContext->bGuestAnnounceSupported && pContext->bGuestAnnounced)
         {
             ParaNdis_SendGratuitousArpPacket(pContext);
-            pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_ANNOUNCE,
-                                                VIRTIO_NET_CTRL_ANNOUNCE_ACK,
-                                                NULL,
-                                                0,
-                                                NULL,
-                                                0,
-                                                0);
+            pContext->CXPath.SendControlMessageAsync(VIRTIO_NET_CTRL_ANNOUNCE,
+                                                     VIRTIO_NET_CTRL_ANNOUNCE_ACK,
+                                                     NULL,
+                                                     0,
+                                                     NULL,
+                                                     0,
+                                                     0);
             pContext->bGuestAnnounced = FALSE;
         }
     }
@@ -2030,7 +2349,7 @@ bool ParaNdis_RXTXDPCWorkBody(PARANDIS_ADAPTER *pContext, ULONG ulMaxPacketsToIn
             stillRequiresProcessing = true;
         }
 
-        if (pathBundle != nullptr && pathBundle->txPath.DoPendingTasks(nullptr))
+        if (pathBundle != nullptr && pathBundle->txPath.DoPendingTasks(true))
         {
             stillRequiresProcessing = true;
         }
@@ -2080,6 +2399,9 @@ NDIS_STATUS ParaNdis_SetMulticastList(PARANDIS_ADAPTER *pContext,
             NdisMoveMemory(pContext->MulticastData.MulticastList, Buffer, length);
         }
         pContext->MulticastData.nofMulticastEntries = length / ETH_ALEN;
+        MulticastFilterBuild(&pContext->MulticastFilter,
+                             pContext->MulticastData.MulticastList,
+                             pContext->MulticastData.nofMulticastEntries);
         DPrintf(1, "[%s] New multicast list of %d bytes\n", __FUNCTION__, length);
         *pBytesRead = length;
         status = NDIS_STATUS_SUCCESS;
@@ -2143,64 +2465,88 @@ static VOID ParaNdis_DeviceFiltersUpdateRxMode(PARANDIS_ADAPTER *pContext)
     u8 val;
     ULONG f = pContext->PacketFilter;
     val = (f & NDIS_PACKET_TYPE_PROMISCUOUS) ? 1 : 0;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, &val, sizeof(val), NULL, 0, 2);
+    pContext->CXPath.SendControlMessageAsync(VIRTIO_NET_CTRL_RX,
+                                             VIRTIO_NET_CTRL_RX_PROMISC,
+                                             &val,
+                                             sizeof(val),
+                                             NULL,
+                                             0,
+                                             2);
     val = (f & NDIS_PACKET_TYPE_ALL_MULTICAST) ? 1 : 0;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_ALLMULTI, &val, sizeof(val), NULL, 0, 2);
+    pContext->CXPath.SendControlMessageAsync(VIRTIO_NET_CTRL_RX,
+                                             VIRTIO_NET_CTRL_RX_ALLMULTI,
+                                             &val,
+                                             sizeof(val),
+                                             NULL,
+                                             0,
+                                             2);
 
     if (pContext->bCtrlRXExtraFiltersSupported)
     {
         val = (f & (NDIS_PACKET_TYPE_MULTICAST | NDIS_PACKET_TYPE_ALL_MULTICAST)) ? 0 : 1;
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX,
-                                            VIRTIO_NET_CTRL_RX_NOMULTI,
-                                            &val,
-                                            sizeof(val),
-                                            NULL,
-                                            0,
-                                            2);
+        pContext->CXPath.SendControlMessageAsync(VIRTIO_NET_CTRL_RX,
+                                                 VIRTIO_NET_CTRL_RX_NOMULTI,
+                                                 &val,
+                                                 sizeof(val),
+                                                 NULL,
+                                                 0,
+                                                 2);
         val = (f & NDIS_PACKET_TYPE_DIRECTED) ? 0 : 1;
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX,
-                                            VIRTIO_NET_CTRL_RX_NOUNI,
-                                            &val,
-                                            sizeof(val),
-                                            NULL,
-                                            0,
-                                            2);
+        pContext->CXPath.SendControlMessageAsync(VIRTIO_NET_CTRL_RX,
+                                                 VIRTIO_NET_CTRL_RX_NOUNI,
+                                                 &val,
+                                                 sizeof(val),
+                                                 NULL,
+                                                 0,
+                                                 2);
         val = (f & NDIS_PACKET_TYPE_BROADCAST) ? 0 : 1;
-        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_RX,
-                                            VIRTIO_NET_CTRL_RX_NOBCAST,
-                                            &val,
-                                            sizeof(val),
-                                            NULL,
-                                            0,
-                                            2);
+        pContext->CXPath.SendControlMessageAsync(VIRTIO_NET_CTRL_RX,
+                                                 VIRTIO_NET_CTRL_RX_NOBCAST,
+                                                 &val,
+                                                 sizeof(val),
+                                                 NULL,
+                                                 0,
+                                                 2);
     }
 }
 
 static VOID ParaNdis_DeviceFiltersUpdateAddresses(PARANDIS_ADAPTER *pContext)
 {
     u32 u32UniCastEntries = 0;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_MAC,
-                                        VIRTIO_NET_CTRL_MAC_TABLE_SET,
-                                        &u32UniCastEntries,
-                                        sizeof(u32UniCastEntries),
-                                        &pContext->MulticastData,
-                                        sizeof(pContext->MulticastData.nofMulticastEntries) + (ULONGLONG)pContext->MulticastData.nofMulticastEntries * ETH_ALEN,
-                                        2);
+    pContext->CXPath.SendControlMessageAsync(VIRTIO_NET_CTRL_MAC,
+                                             VIRTIO_NET_CTRL_MAC_TABLE_SET,
+                                             &u32UniCastEntries,
+                                             sizeof(u32UniCastEntries),
+                                             &pContext->MulticastData,
+                                             sizeof(pContext->MulticastData.nofMulticastEntries) + (ULONGLONG)pContext->MulticastData.nofMulticastEntries * ETH_ALEN,
+                                             2);
 }
 
 static VOID SetSingleVlanFilter(PARANDIS_ADAPTER *pContext, ULONG vlanId, BOOLEAN bOn, int levelIfOK)
 {
     u16 val = vlanId & 0xfff;
     UCHAR cmd = bOn ? VIRTIO_NET_CTRL_VLAN_ADD : VIRTIO_NET_CTRL_VLAN_DEL;
-    pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_VLAN, cmd, &val, sizeof(val), NULL, 0, levelIfOK);
+    pContext->CXPath.SendControlMessageAsync(VIRTIO_NET_CTRL_VLAN, cmd, &val, sizeof(val), NULL, 0, levelIfOK);
 }
 
+// the commands of the whole table are pipelined in the control queue
 static VOID SetAllVlanFilters(PARANDIS_ADAPTER *pContext, BOOLEAN bOn)
 {
-    ULONG i;
-    for (i = 0; i <= MAX_VLAN_ID; ++i)
+    u16 vlans[256];
+    UCHAR cmd = bOn ? VIRTIO_NET_CTRL_VLAN_ADD : VIRTIO_NET_CTRL_VLAN_DEL;
+
+    for (ULONG first = 0; first <= MAX_VLAN_ID; first += ARRAYSIZE(vlans))
     {
-        SetSingleVlanFilter(pContext, i, bOn, 7);
+        ULONG count = min((ULONG)ARRAYSIZE(vlans), MAX_VLAN_ID + 1 - first);
+        for (ULONG i = 0; i < count; ++i)
+        {
+            vlans[i] = (u16)(first + i);
+        }
+        if (pContext->CXPath.SendControlMessageBatch(VIRTIO_NET_CTRL_VLAN, cmd, vlans, sizeof(vlans[0]), count, 7) !=
+            count)
+        {
+            break;
+        }
     }
 }
 
@@ -2260,6 +2606,64 @@ VOID ParaNdis_UpdateDeviceFilters(PARANDIS_ADAPTER *pContext)
     ParaNdis_DeviceFiltersUpdateVlanId(pContext);
 }
 
+// the parameters of all the queues, the adaptive mode
+// then changes the ones of each receive queue
+VOID ParaNdis_UpdateNotificationCoalescing(PARANDIS_ADAPTER *pContext)
+{
+    if (!pContext->bNotifyCoalescingSupported)
+    {
+        return;
+    }
+
+    BOOLEAN bOn = pContext->bInterruptModeration;
+    virtio_net_ctrl_coal tx = {}, rx = {};
+    if (bOn)
+    {
+        tx.max_packets = pContext->NotifyCoalescing.TxMaxPackets;
+        tx.max_usecs = pContext->NotifyCoalescing.TxUsecs;
+        rx.max_packets = pContext->NotifyCoalescing.RxMaxPackets;
+        rx.max_usecs = pContext->NotifyCoalescing.RxUsecs;
+    }
+    pContext->CXPath.SendControlMessageAsync(VIRTIO_NET_CTRL_NOTF_COAL,
+                                             VIRTIO_NET_CTRL_NOTF_COAL_TX_SET,
+                                             &tx,
+                                             sizeof(tx),
+                                             NULL,
+                                             0,
+                                             2);
+    pContext->CXPath.SendControlMessageAsync(VIRTIO_NET_CTRL_NOTF_COAL,
+                                             VIRTIO_NET_CTRL_NOTF_COAL_RX_SET,
+                                             &rx,
+                                             sizeof(rx),
+                                             NULL,
+                                             0,
+                                             2);
+    for (UINT i = 0; i < pContext->nPathBundles; i++)
+    {
+        pContext->pPathBundles[i].rxPath.ResetCoalescing();
+    }
+}
+
+// called by the RX DPC, does not wait for a free slot of the control
+// queue; on FALSE the caller sends the parameters later
+BOOLEAN ParaNdis_SetQueueNotificationCoalescing(PARANDIS_ADAPTER *pContext,
+                                                UINT QueueIndex,
+                                                ULONG MaxPackets,
+                                                ULONG Usecs)
+{
+    virtio_net_ctrl_coal_vq cfg = {};
+    cfg.vqn = (u16)QueueIndex;
+    cfg.coal.max_packets = MaxPackets;
+    cfg.coal.max_usecs = Usecs;
+    return pContext->CXPath.TrySendControlMessageAsync(VIRTIO_NET_CTRL_NOTF_COAL,
+                                                       VIRTIO_NET_CTRL_NOTF_COAL_VQ_SET,
+                                                       &cfg,
+                                                       sizeof(cfg),
+                                                       NULL,
+                                                       0,
+                                                       3);
+}
+
 static VOID ParaNdis_UpdateMAC(PARANDIS_ADAPTER *pContext)
 {
     if (pContext->bCtrlMACAddrSupported)
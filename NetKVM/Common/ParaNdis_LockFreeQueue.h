@@ -15,12 +15,15 @@
  *
  */
 
+// the producers and the consumers keep their indices on separate cache lines
+#define PARANDIS_LOCK_FREE_QUEUE_CACHE_LINE 64
+
 template <typename TEntryType> class CLockFreeQueue
 {
   public:
     CLockFreeQueue()
-        : m_Context(nullptr), m_ProducerSize(0), m_ConsumerSize(0), m_ProducerMask(0), m_ConsumerMask(0),
-          m_ProducerHead(0), m_ConsumerHead(0), m_ProducerTail(0), m_ConsumerTail(0), m_PQueueRing(nullptr)
+        : m_ProducerHead(0), m_ProducerTail(0), m_ProducerSize(0), m_ProducerMask(0), m_ConsumerHead(0),
+          m_ConsumerTail(0), m_ConsumerSize(0), m_ConsumerMask(0), m_PQueueRing(nullptr), m_Context(nullptr)
     {
     }
 
@@ -64,23 +67,43 @@ template <typename TEntryType> class CLockFreeQueue
      */
 
     bool Enqueue(TEntryType *entry)
+    {
+        return EnqueueBatch(&entry, 1);
+    }
+
+    /*
+     * multi-producer safe enqueue of several entries at once:
+     * one CAS reserves the slots for all of them, either all of
+     * them are published together or none
+     */
+
+    bool EnqueueBatch(TEntryType **entries, LONG count)
     {
         LONG producer_head, producer_next, consumer_tail;
+        ULONG spins = 1;
         /* Critical section */
         {
-            do
+            for (;;)
             {
                 producer_head = m_ProducerHead;
-                producer_next = (producer_head + 1) & m_ProducerMask;
+                producer_next = (producer_head + count) & m_ProducerMask;
                 consumer_tail = m_ConsumerTail;
 
-                if (producer_next == consumer_tail)
+                if (((consumer_tail - producer_head - 1) & m_ProducerMask) < count)
                 {
                     return FALSE;
                 }
-            } while (InterlockedCompareExchange(&m_ProducerHead, producer_next, producer_head) != producer_head);
+                if (InterlockedCompareExchange(&m_ProducerHead, producer_next, producer_head) == producer_head)
+                {
+                    break;
+                }
+                Backoff(spins);
+            }
 
-            m_PQueueRing[producer_head] = entry;
+            for (LONG i = 0; i < count; i++)
+            {
+                m_PQueueRing[(producer_head + i) & m_ProducerMask] = entries[i];
+            }
             KeMemoryBarrier();
 
             /*
@@ -88,8 +111,10 @@ template <typename TEntryType> class CLockFreeQueue
              * that preceded us, we need to wait for them
              * to complete
              */
+            spins = 1;
             while (m_ProducerTail != producer_head)
             {
+                Backoff(spins);
             }
 
             m_ProducerTail = producer_next;
@@ -126,40 +151,97 @@ template <typename TEntryType> class CLockFreeQueue
         return entry;
     }
 
+    /*
+     * single-consumer dequeue of up to count entries,
+     * returns the number of entries dequeued
+     * should be called under lock!
+     */
+
+    LONG DequeueBatch(TEntryType **entries, LONG count)
+    {
+        LONG consumer_head = m_ConsumerHead;
+        LONG available = (m_ProducerTail - consumer_head) & m_ConsumerMask;
+
+        if (count > available)
+        {
+            count = available;
+        }
+        if (count == 0)
+        {
+            return 0;
+        }
+        KeMemoryBarrier();
+        for (LONG i = 0; i < count; i++)
+        {
+            entries[i] = m_PQueueRing[(consumer_head + i) & m_ConsumerMask];
+        }
+        KeMemoryBarrier();
+
+        m_ConsumerHead = (consumer_head + count) & m_ConsumerMask;
+        m_ConsumerTail = m_ConsumerHead;
+        return count;
+    }
+
     TEntryType *DequeueMC()
     {
-        LONG consumer_head, consumer_next, producer_tail;
-        TEntryType *entry;
+        TEntryType *entry = nullptr;
+
+        return DequeueBatchMC(&entry, 1) ? entry : nullptr;
+    }
+
+    /*
+     * multi-consumer safe dequeue of up to count entries,
+     * one CAS reserves all of them
+     */
+
+    LONG DequeueBatchMC(TEntryType **entries, LONG count)
+    {
+        LONG consumer_head, consumer_next, available;
+        ULONG spins = 1;
 
         /* Critical section */
         {
-            do
+            for (;;)
             {
                 consumer_head = m_ConsumerHead;
-                producer_tail = m_ProducerTail;
-                consumer_next = (consumer_head + 1) & m_ConsumerMask;
+                available = (m_ProducerTail - consumer_head) & m_ConsumerMask;
 
-                if (consumer_head == producer_tail)
+                if (available == 0)
+                {
+                    return 0;
+                }
+                if (count > available)
+                {
+                    count = available;
+                }
+                consumer_next = (consumer_head + count) & m_ConsumerMask;
+                if (InterlockedCompareExchange(&m_ConsumerHead, consumer_next, consumer_head) == consumer_head)
                 {
-                    return nullptr;
+                    break;
                 }
-            } while (InterlockedCompareExchange(&m_ConsumerHead, consumer_next, consumer_head) != consumer_head);
+                Backoff(spins);
+            }
 
-            entry = m_PQueueRing[consumer_head];
+            for (LONG i = 0; i < count; i++)
+            {
+                entries[i] = m_PQueueRing[(consumer_head + i) & m_ConsumerMask];
+            }
             KeMemoryBarrier();
 
             /*
-             * If there are other enqueues in progress
+             * If there are other dequeues in progress
              * that preceded us, we need to wait for them
              * to complete
              */
+            spins = 1;
             while (m_ConsumerTail != consumer_head)
             {
+                Backoff(spins);
             }
 
             m_ConsumerTail = consumer_next;
         }
-        return entry;
+        return count;
     }
 
     /*
@@ -187,14 +269,35 @@ template <typename TEntryType> class CLockFreeQueue
     }
 
   private:
+    static const ULONG m_MaxBackoffSpins = 64;
+
+    /*
+     * waits for the other CPU to complete its part,
+     * twice longer each time up to m_MaxBackoffSpins
+     */
+    static void Backoff(ULONG &spins)
+    {
+        for (ULONG i = 0; i < spins; i++)
+        {
+            YieldProcessor();
+        }
+        if (spins < m_MaxBackoffSpins)
+        {
+            spins *= 2;
+        }
+    }
+
+    UCHAR m_HeadPad[PARANDIS_LOCK_FREE_QUEUE_CACHE_LINE];
     volatile LONG m_ProducerHead;
     volatile LONG m_ProducerTail;
     INT m_ProducerSize;
     INT m_ProducerMask;
+    UCHAR m_ProducerPad[PARANDIS_LOCK_FREE_QUEUE_CACHE_LINE];
     volatile LONG m_ConsumerHead;
     volatile LONG m_ConsumerTail;
     INT m_ConsumerSize;
     INT m_ConsumerMask;
+    UCHAR m_ConsumerPad[PARANDIS_LOCK_FREE_QUEUE_CACHE_LINE];
     TEntryType **m_PQueueRing;
 
     PPARANDIS_ADAPTER m_Context;
@@ -304,7 +407,9 @@ template <typename TEntryType> class CLockFreeDynamicQueue : public CPlacementAl
             /* LockedContext Locker will always be locked during all of it's lifetime,
             especially when it's being destructed. SDV does not recognize that due to encapsulation
             so the warning is suppressed*/
+#ifdef _MSC_VER
 #pragma warning(suppress : 26110)
+#endif
             TPassiveSpinLocker LockedContext(m_QueueFullListLock);
             do
             {
@@ -336,3 +441,110 @@ template <typename TEntryType> class CLockFreeDynamicQueue : public CPlacementAl
     volatile LONG m_ElementCount;
     volatile LONG m_Size;
 };
+
+/*
+ * Multiple producer queue of LIST_ENTRY without size limit: the producers
+ * publish the entries to the lock free ring and only while it is full to
+ * the overflow list, under the spin lock that serializes the consumers.
+ * The entries of one producer are dequeued in the order it enqueued them:
+ * nothing goes to the ring while the overflow list has entries and the
+ * consumer empties the ring before the overflow list.
+ */
+
+class CLockFreeListEntryQueue
+{
+  public:
+    CLockFreeListEntryQueue() : m_RingCreated(false), m_Overflow(0)
+    {
+        InitializeListHead(&m_OverflowList);
+    }
+
+    // the ring has room for at least minSize entries, up to the ring limit;
+    // without the ring all the entries go to the overflow list
+    BOOLEAN Create(PPARANDIS_ADAPTER pContext, ULONG minSize)
+    {
+        INT size = 2;
+
+        while (size <= (INT)minSize && size < m_MaxRingSize)
+        {
+            size *= 2;
+        }
+        if (!m_RingCreated)
+        {
+            m_RingCreated = m_Ring.Create(pContext, size) != FALSE;
+        }
+        return m_RingCreated;
+    }
+
+    // Multiple Producer Safe Enqueue
+    void Enqueue(PLIST_ENTRY entry)
+    {
+        if (!m_Overflow && m_RingCreated && m_Ring.Enqueue(entry))
+        {
+            return;
+        }
+        TPassiveSpinLocker LockedContext(m_Lock);
+        InsertTailList(&m_OverflowList, entry);
+        InterlockedIncrement(&m_Overflow);
+    }
+
+    // Multiple Producer Safe, the entries are published at once
+    void EnqueueBatch(PLIST_ENTRY *entries, LONG count)
+    {
+        if (!m_Overflow && m_RingCreated && m_Ring.EnqueueBatch(entries, count))
+        {
+            return;
+        }
+        TPassiveSpinLocker LockedContext(m_Lock);
+        for (LONG i = 0; i < count; i++)
+        {
+            InsertTailList(&m_OverflowList, entries[i]);
+        }
+        InterlockedExchangeAdd(&m_Overflow, count);
+    }
+
+    // Multiple Consumer Safe, the consumers are serialized by the lock
+    PLIST_ENTRY Dequeue()
+    {
+        TPassiveSpinLocker LockedContext(m_Lock);
+        PLIST_ENTRY entry = m_RingCreated ? m_Ring.Dequeue() : nullptr;
+
+        if (entry == nullptr && m_Overflow)
+        {
+            entry = RemoveHeadList(&m_OverflowList);
+            InterlockedDecrement(&m_Overflow);
+        }
+        return entry;
+    }
+
+    // Multiple Consumer Safe, up to count entries under one lock,
+    // returns the number of entries dequeued
+    LONG DequeueBatch(PLIST_ENTRY *entries, LONG count)
+    {
+        TPassiveSpinLocker LockedContext(m_Lock);
+        LONG n = m_RingCreated ? m_Ring.DequeueBatch(entries, count) : 0;
+
+        for (; n < count && m_Overflow; n++)
+        {
+            entries[n] = RemoveHeadList(&m_OverflowList);
+            InterlockedDecrement(&m_Overflow);
+        }
+        return n;
+    }
+
+    // This procedure is for informational purpose only
+    // see note NOTE1
+    BOOLEAN IsEmpty()
+    {
+        return (m_Ring.IsEmpty() && !m_Overflow) ? TRUE : FALSE;
+    }
+
+  private:
+    static const INT m_MaxRingSize = 4096;
+
+    CLockFreeQueue<LIST_ENTRY> m_Ring;
+    bool m_RingCreated;
+    CNdisSpinLock m_Lock;
+    LIST_ENTRY m_OverflowList;
+    volatile LONG m_Overflow;
+};
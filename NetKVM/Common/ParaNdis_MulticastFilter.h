@@ -0,0 +1,96 @@
+#pragma once
+
+/*
+ * Multicast address filter of the RX path: the addresses set by
+ * OID_802_3_MULTICAST_LIST are kept in an open addressing hash table,
+ * so ShallPassPacket does not scan the whole list for each multicast
+ * frame. It has no dependency on NDIS, so DebugTools/MulticastFilter
+ * can build it on the host and compare it with the linear search.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// the table has at least twice as many slots as the list has entries,
+// so a lookup probes less than 2 slots on average
+#ifndef PARANDIS_MULTICAST_FILTER_BITS
+#define PARANDIS_MULTICAST_FILTER_BITS 7
+#endif
+#define PARANDIS_MULTICAST_FILTER_SLOTS (1 << PARANDIS_MULTICAST_FILTER_BITS)
+
+static_assert(PARANDIS_MULTICAST_FILTER_SLOTS >= 2 * PARANDIS_MULTICAST_LIST_SIZE,
+              "the multicast filter is too small for the multicast list");
+static_assert(PARANDIS_MULTICAST_LIST_SIZE < 256, "the multicast filter slots are 8 bit");
+
+typedef struct _tagMulticastFilter
+{
+    // 1-based index of the address in Addresses, 0 for an empty slot
+    UCHAR Slots[PARANDIS_MULTICAST_FILTER_SLOTS];
+    UCHAR Addresses[PARANDIS_MULTICAST_LIST_SIZE][ETH_ALEN];
+} tMulticastFilter;
+
+static __inline ULONG MulticastFilterHash(const UCHAR *Address)
+{
+    // the group of IPv4 (01:00:5e) and IPv6 (33:33) multicast
+    // addresses is in the low order bytes, the prefix is mixed in
+    // for the others
+    ULONG val = ((ULONG)Address[2] << 24) | ((ULONG)Address[3] << 16) | ((ULONG)Address[4] << 8) | Address[5];
+    val ^= ((ULONG)Address[0] << 8) | Address[1];
+    return (val * 0x9E3779B1) >> (32 - PARANDIS_MULTICAST_FILTER_BITS);
+}
+
+// called when the multicast list changes
+static __inline void MulticastFilterBuild(tMulticastFilter *Filter, const UCHAR *List, ULONG nEntries)
+{
+    RtlZeroMemory(Filter->Slots, sizeof(Filter->Slots));
+    for (ULONG i = 0; i < nEntries && i < PARANDIS_MULTICAST_LIST_SIZE; i++)
+    {
+        ULONG slot = MulticastFilterHash(&List[i * ETH_ALEN]);
+        while (Filter->Slots[slot])
+        {
+            slot = (slot + 1) & (PARANDIS_MULTICAST_FILTER_SLOTS - 1);
+        }
+        RtlCopyMemory(Filter->Addresses[i], &List[i * ETH_ALEN], ETH_ALEN);
+        Filter->Slots[slot] = (UCHAR)(i + 1);
+    }
+}
+
+static __inline bool MulticastFilterMatch(const tMulticastFilter *Filter, const UCHAR *Address)
+{
+    ULONG slot = MulticastFilterHash(Address);
+    UCHAR index;
+
+    while ((index = Filter->Slots[slot]) != 0)
+    {
+        const UCHAR *Entry = Filter->Addresses[index - 1];
+        if (*(const UNALIGNED ULONG *)Entry == *(const UNALIGNED ULONG *)Address &&
+            *(const UNALIGNED USHORT *)(Entry + 4) == *(const UNALIGNED USHORT *)(Address + 4))
+        {
+            return true;
+        }
+        slot = (slot + 1) & (PARANDIS_MULTICAST_FILTER_SLOTS - 1);
+    }
+    return false;
+}
@@ -2,6 +2,7 @@
 #include "kdebugprint.h"
 #include "ParaNdis_DebugHistory.h"
 #include "Trace.h"
+#include "ParaNdis_Checksum.h"
 #ifdef NETKVM_WPP_ENABLED
 #include "ParaNdis_RX.tmh"
 #endif
@@ -12,7 +13,7 @@
 
 static FORCEINLINE VOID ParaNdis_ReceiveQueueAddBuffer(PPARANDIS_RECEIVE_QUEUE pQueue, pRxNetDescriptor pBuffer)
 {
-    NdisInterlockedInsertTailList(&pQueue->BuffersList, &pBuffer->ReceiveQueueListEntry, &pQueue->Lock);
+    pQueue->Buffers.Enqueue(&pBuffer->ReceiveQueueListEntry);
 }
 
 static void ParaNdis_UnbindRxBufferFromPacket(pRxNetDescriptor p)
@@ -29,6 +30,14 @@ static void ParaNdis_UnbindRxBufferFromPacket(pRxNetDescriptor p)
         NdisFreeMdl(pThisMDL);
         ulPageDescIndex++;
     }
+    p->Holder = NULL;
+
+    if (p->MergedHolder)
+    {
+        NdisAdjustMdlLength(p->MergedHolder, p->PhysicalPages[0].size);
+        NdisFreeMdl(p->MergedHolder);
+        p->MergedHolder = NULL;
+    }
 }
 
 static BOOLEAN ParaNdis_BindRxBufferToPacket(PARANDIS_ADAPTER *pContext, pRxNetDescriptor p)
@@ -50,6 +59,24 @@ static BOOLEAN ParaNdis_BindRxBufferToPacket(PARANDIS_ADAPTER *pContext, pRxNetD
     }
     *NextMdlLinkage = NULL;
 
+    if (pContext->bUseMergedBuffers)
+    {
+        // the data of the first buffer of a packet follows the header,
+        // other buffers of the packet hold the data from the beginning
+        p->Holder = NdisAllocateMdl(pContext->MiniportHandle,
+                                    p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual,
+                                    p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size);
+        p->MergedHolder = NdisAllocateMdl(pContext->MiniportHandle,
+                                          p->PhysicalPages[0].Virtual,
+                                          p->PhysicalPages[0].size);
+        if (p->Holder == NULL || p->MergedHolder == NULL)
+        {
+            goto error_exit;
+        }
+        NDIS_MDL_LINKAGE(p->Holder) = NULL;
+        NDIS_MDL_LINKAGE(p->MergedHolder) = NULL;
+    }
+
     return TRUE;
 
 error_exit:
@@ -113,6 +140,7 @@ void CParaNdisRX::RecalculateLimits()
 {
     m_nReusedRxBuffersLimit = m_NetMaxReceiveBuffers / 4 + 1;
     m_nReusedRxBuffersCounter = 0;
+    m_RefillWatermark = min(m_Context->uRxRefillWatermark, m_nReusedRxBuffersLimit);
     m_MinRxBufferLimit = m_NetMaxReceiveBuffers * m_Context->MinRxBufferPercent / 100;
     DPrintf(0,
             "[%s] m_NetMaxReceiveBuffers %d, m_MinRxBufferLimit %u\n",
@@ -136,6 +164,25 @@ bool CParaNdisRX::Create(PPARANDIS_ADAPTER Context, UINT DeviceQueueIndex)
         DPrintf(0, ("CParaNdisRX::Create - virtqueue creation failed\n"));
         return false;
     }
+    // no adaptive coalescing here: all the posted buffers are outstanding,
+    // so a few packets after a burst would wait for the next ones
+    m_VirtQueue.SetBusyPoll(Context->uBusyPollBudget);
+
+    // without the ring the packets go through the overflow list
+    m_UnclassifiedPacketsQueue.Buffers.Create(Context, Context->maxRxBufferPerQueue);
+
+    // without the cache the buffers return to the ring under the lock
+    if (Context->uRxRefillWatermark)
+    {
+        INT ringSize = 2;
+
+        // the ring holds one entry less than its size
+        while ((ULONG)ringSize <= Context->maxRxBufferPerQueue)
+        {
+            ringSize *= 2;
+        }
+        m_ReturnCacheEnabled = m_ReturnCache.Create(Context, ringSize) != FALSE;
+    }
 
     PrepareReceiveBuffers();
 
@@ -249,6 +296,23 @@ pRxNetDescriptor CParaNdisRX::CreateRxDescriptorOnInit()
         p->BufferSGLength++;
     }
 
+    if (m_Context->bUseMergedBuffers)
+    {
+        // the whole block is posted as one buffer, the data part of it is
+        // the data page of the packet when the buffer is the first one
+        p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Physical.QuadPart = p->PhysicalPages[0].Physical.QuadPart +
+                                                                          m_Context->nVirtioHeaderSize;
+        p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual = RtlOffsetToPointer(p->PhysicalPages[0].Virtual,
+                                                                                   m_Context->nVirtioHeaderSize);
+        p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size = p->PhysicalPages[0].size - m_Context->nVirtioHeaderSize;
+
+        if (!ParaNdis_BindRxBufferToPacket(m_Context, p))
+        {
+            goto error_exit;
+        }
+        return p;
+    }
+
     // First page is for virtio header, size needs to be adjusted correspondingly
     p->BufferSGArray[0].length = m_Context->nVirtioHeaderSize;
 
@@ -334,6 +398,16 @@ BOOLEAN CParaNdisRX::AllocateMore()
     return result;
 }
 
+void CParaNdisRX::FillVirtQueueBuf(struct virtqueue_buf &Buf, pRxNetDescriptor pBufferDescriptor)
+{
+    Buf.sg = pBufferDescriptor->BufferSGArray;
+    Buf.out_num = 0;
+    Buf.in_num = pBufferDescriptor->BufferSGLength;
+    Buf.opaque = pBufferDescriptor;
+    Buf.va_indirect = m_Context->bUseIndirect ? pBufferDescriptor->IndirectArea.Virtual : NULL;
+    Buf.phys_indirect = m_Context->bUseIndirect ? pBufferDescriptor->IndirectArea.Physical.QuadPart : 0;
+}
+
 /* TODO - make it method in pRXNetDescriptor */
 BOOLEAN CParaNdisRX::AddRxBufferToQueue(pRxNetDescriptor pBufferDescriptor)
 {
@@ -350,6 +424,8 @@ BOOLEAN CParaNdisRX::AddRxBufferToQueue(pRxNetDescriptor pBufferDescriptor)
 
 void CParaNdisRX::FreeRxDescriptorsFromList()
 {
+    RefillFromCacheNoLock();
+
     while (!IsListEmpty(&m_NetReceiveBuffers))
     {
         pRxNetDescriptor pBufferDescriptor = (pRxNetDescriptor)RemoveHeadList(&m_NetReceiveBuffers);
@@ -361,6 +437,52 @@ void CParaNdisRX::ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor)
 {
     DEBUG_ENTRY(4);
 
+    if (pBuffersDescriptor->CoalescedNext)
+    {
+        NDIS_MDL_LINKAGE(pBuffersDescriptor->Holder) = pBuffersDescriptor->HolderLinkage;
+    }
+
+    // the segments coalesced into the packet return with it
+    while (pBuffersDescriptor)
+    {
+        pRxNetDescriptor pNext = pBuffersDescriptor->CoalescedNext;
+
+        pBuffersDescriptor->CoalescedNext = NULL;
+        if (pBuffersDescriptor->CoalescedMdl)
+        {
+            NdisFreeMdl(pBuffersDescriptor->CoalescedMdl);
+            pBuffersDescriptor->CoalescedMdl = NULL;
+        }
+        ReuseMergedBuffersNoLock(pBuffersDescriptor);
+        pBuffersDescriptor = pNext;
+    }
+}
+
+void CParaNdisRX::ReuseMergedBuffersNoLock(pRxNetDescriptor pBuffersDescriptor)
+{
+    if (!m_Context->bUseMergedBuffers)
+    {
+        ReuseOneReceiveBufferNoLock(pBuffersDescriptor);
+        return;
+    }
+
+    // the buffers of a merged packet return to the ring one by one
+    while (pBuffersDescriptor)
+    {
+        pRxNetDescriptor pNext = pBuffersDescriptor->MergedNext;
+        tCompletePhysicalAddress *pPages = pBuffersDescriptor->PhysicalPages;
+
+        pBuffersDescriptor->MergedNext = NULL;
+        NDIS_MDL_LINKAGE(pBuffersDescriptor->Holder) = NULL;
+        NDIS_MDL_LINKAGE(pBuffersDescriptor->MergedHolder) = NULL;
+        pPages[PARANDIS_FIRST_RX_DATA_PAGE].size = pPages[0].size - m_Context->nVirtioHeaderSize;
+        ReuseOneReceiveBufferNoLock(pBuffersDescriptor);
+        pBuffersDescriptor = pNext;
+    }
+}
+
+void CParaNdisRX::ReuseOneReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor)
+{
     if (!m_Reinsert)
     {
         InsertTailList(&m_NetReceiveBuffers, &pBuffersDescriptor->listEntry);
@@ -381,7 +503,7 @@ void CParaNdisRX::ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor)
         }
 
         /* TODO - nReusedRXBuffers per queue or per context ?*/
-        if (++m_nReusedRxBuffersCounter >= m_nReusedRxBuffersLimit)
+        if (!m_BulkRefill && ++m_nReusedRxBuffersCounter >= m_nReusedRxBuffersLimit)
         {
             m_nReusedRxBuffersCounter = 0;
             m_VirtQueue.Kick();
@@ -401,6 +523,170 @@ VOID CParaNdisRX::KickRXRing()
     m_VirtQueue.Kick();
 }
 
+/*
+The returned buffers are collected in the cache without the lock and
+added to the ring together, with one kick, when m_RefillWatermark of them
+are in the cache or when the ring has less than m_RefillWatermark buffers.
+The buffers left below the watermark are refilled by ProcessRxRing.
+Returns false when the cache is full, then the caller reuses the buffer.
+*/
+bool CParaNdisRX::ReturnToCache(pRxNetDescriptor pBuffersDescriptor)
+{
+    if (!m_ReturnCache.Enqueue(pBuffersDescriptor))
+    {
+        return false;
+    }
+    if (InterlockedIncrement(&m_ReturnCacheCount) == 1)
+    {
+        ULONGLONG now;
+        UpdateTimestamp(now);
+        InterlockedExchange64(&m_ReturnCacheTimestamp, (LONG64)now);
+    }
+    if ((UINT)m_ReturnCacheCount >= m_RefillWatermark || m_NetNofReceiveBuffers < m_RefillWatermark)
+    {
+        TPassiveSpinLocker autoLock(m_Lock);
+
+        RefillFromCacheNoLock();
+    }
+    return true;
+}
+
+void CParaNdisRX::RefillFromCacheNoLock()
+{
+    pRxNetDescriptor Descriptors[m_BatchSize];
+    LONG nDescriptors;
+    UINT nFreeBuffers = m_NetNofReceiveBuffers;
+
+    if (!m_ReturnCacheEnabled || m_ReturnCache.IsEmpty())
+    {
+        return;
+    }
+
+    InterlockedExchange(&m_ReturnCacheCount, 0);
+    LONG64 returned = InterlockedExchange64(&m_ReturnCacheTimestamp, 0);
+
+    m_BulkRefill = true;
+    while (0 != (nDescriptors = m_ReturnCache.DequeueBatch(Descriptors, ARRAYSIZE(Descriptors))))
+    {
+        for (LONG i = 0; i < nDescriptors; i++)
+        {
+            ReuseReceiveBufferNoLock(Descriptors[i]);
+        }
+    }
+    m_BulkRefill = false;
+
+    // during the shutdown the buffers only return to the list
+    if (!m_Reinsert || m_NetNofReceiveBuffers <= nFreeBuffers)
+    {
+        return;
+    }
+
+    m_nReusedRxBuffersCounter = 0;
+    m_VirtQueue.Kick();
+
+    m_Refills++;
+    m_RefilledBuffers += m_NetNofReceiveBuffers - nFreeBuffers;
+    if (returned)
+    {
+        ULONGLONG now;
+        UpdateTimestamp(now);
+        ULONGLONG latency = now - (ULONGLONG)returned;
+        m_RefillTotalLatency += latency;
+        m_RefillMaxLatency = max(m_RefillMaxLatency, latency);
+    }
+    if (!nFreeBuffers)
+    {
+        m_RefillStarved++;
+    }
+    if (m_Context->extraStatistics.minFreeRxBuffers > nFreeBuffers)
+    {
+        m_Context->extraStatistics.minFreeRxBuffers = nFreeBuffers;
+    }
+}
+
+// mergeable buffers: returns true when the packet is complete, then
+// pBufferDescriptor is its first buffer and nFullLength its total length
+bool CParaNdisRX::MergeRxBuffer(pRxNetDescriptor &pBufferDescriptor, unsigned int &nFullLength)
+{
+    if (m_MergedBuffersToSkip)
+    {
+        // a buffer of the dropped packet, its data is not a header
+        ReuseReceiveBufferNoLock(pBufferDescriptor);
+        m_MergedBuffersToSkip--;
+        return false;
+    }
+    if (m_MergedHead == NULL)
+    {
+        virtio_net_hdr_mrg_rxbuf *pHeader = (virtio_net_hdr_mrg_rxbuf *)pBufferDescriptor->PhysicalPages[0].Virtual;
+        UINT nBuffers = pHeader->num_buffers;
+
+        if (nBuffers <= 1)
+        {
+            return true;
+        }
+        if (nBuffers > (UINT)m_Context->RxLayout.IndirectEntries - PARANDIS_FIRST_RX_DATA_PAGE ||
+            nFullLength < m_Context->nVirtioHeaderSize)
+        {
+            DPrintf(0,
+                    "[%s] ERROR: packet of %u buffers, %u bytes in the first one\n",
+                    __FUNCTION__,
+                    nBuffers,
+                    nFullLength);
+            ReuseReceiveBufferNoLock(pBufferDescriptor);
+            m_Context->Statistics.ifInErrors++;
+            m_Context->Statistics.ifInDiscards++;
+            // the other buffers of the packet follow, none of them is a head
+            m_MergedBuffersToSkip = nBuffers - 1;
+            return false;
+        }
+        pBufferDescriptor->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size = nFullLength - m_Context->nVirtioHeaderSize;
+        m_MergedHead = m_MergedTail = pBufferDescriptor;
+        m_MergedBuffers = 1;
+        m_MergedBuffersLeft = nBuffers - 1;
+        m_MergedLength = nFullLength;
+        return false;
+    }
+
+    // this buffer is the next data page of the packet, the last page keeps
+    // the size of the block, the holder of the packet ends there anyway
+    tCompletePhysicalAddress &DataPage = m_MergedHead->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE + m_MergedBuffers];
+    DataPage = pBufferDescriptor->PhysicalPages[0];
+    if (m_MergedBuffersLeft > 1)
+    {
+        DataPage.size = nFullLength;
+    }
+
+    PMDL pTailMdl = (m_MergedTail == m_MergedHead) ? m_MergedTail->Holder : m_MergedTail->MergedHolder;
+    NDIS_MDL_LINKAGE(pTailMdl) = pBufferDescriptor->MergedHolder;
+    m_MergedTail->MergedNext = pBufferDescriptor;
+    m_MergedTail = pBufferDescriptor;
+    m_MergedBuffers++;
+    m_MergedLength += nFullLength;
+
+    if (--m_MergedBuffersLeft)
+    {
+        return false;
+    }
+
+    pBufferDescriptor = m_MergedHead;
+    nFullLength = m_MergedLength;
+    m_MergedHead = m_MergedTail = NULL;
+    m_Context->extraStatistics.framesRxMerged++;
+    return true;
+}
+
+// the rest of the packet will not arrive (the queue is shut down)
+void CParaNdisRX::DropMergedPacketNoLock()
+{
+    m_MergedBuffersToSkip = 0;
+    if (m_MergedHead)
+    {
+        ReuseReceiveBufferNoLock(m_MergedHead);
+        m_MergedHead = m_MergedTail = NULL;
+        m_MergedBuffersLeft = 0;
+    }
+}
+
 #if PARANDIS_SUPPORT_RSS
 static FORCEINLINE VOID ParaNdis_QueueRSSDpc(PARANDIS_ADAPTER *pContext,
                                              ULONG MessageIndex,
@@ -419,8 +705,6 @@ static FORCEINLINE CCHAR ParaNdis_GetScalingDataForPacket(PARANDIS_ADAPTER *pCon
 
 static ULONG ShallPassPacket(PARANDIS_ADAPTER *pContext, PNET_PACKET_INFO pPacketInfo)
 {
-    ULONG i;
-
     if (pPacketInfo->dataLength > pContext->MaxPacketSize.nMaxFullSizeOsRx + ETH_PRIORITY_HEADER_SIZE)
     {
         return FALSE;
@@ -474,20 +758,7 @@ static ULONG ShallPassPacket(PARANDIS_ADAPTER *pContext, PNET_PACKET_INFO pPacke
         return FALSE;
     }
 
-    for (i = 0; i < pContext->MulticastData.nofMulticastEntries; i++)
-    {
-        ULONG Res;
-        PUCHAR CurrMcastAddr = &pContext->MulticastData.MulticastList[i * ETH_ALEN];
-
-        ETH_COMPARE_NETWORK_ADDRESSES_EQ_SAFE(pPacketInfo->ethDestAddr, CurrMcastAddr, &Res);
-
-        if (!Res)
-        {
-            return TRUE;
-        }
-    }
-
-    return FALSE;
+    return MulticastFilterMatch(&pContext->MulticastFilter, pPacketInfo->ethDestAddr);
 }
 
 #define LogRedirectedPacket(p)
@@ -596,107 +867,563 @@ static void LogRedirectedPacket(pRxNetDescriptor pBufferDescriptor)
 }
 #endif
 
-VOID CParaNdisRX::ProcessRxRing(CCHAR nCurrCpuReceiveQueue)
+// places the packet on the receive queue of its target CPU
+void CParaNdisRX::ClassifyReceivedPacket(pRxNetDescriptor pBufferDescriptor, CCHAR nCurrCpuReceiveQueue)
 {
-    pRxNetDescriptor pBufferDescriptor;
-    unsigned int nFullLength;
+#ifdef PARANDIS_SUPPORT_RSS
+    if (m_Context->RSSParameters.RSSMode != PARANDIS_RSS_MODE::PARANDIS_RSS_DISABLED)
+    {
+        virtio_net_hdr_v1_hash *pHeader = (virtio_net_hdr_v1_hash *)pBufferDescriptor->PhysicalPages[0].Virtual;
+        if (m_Context->bHashReportedByDevice && ParaNdis6_RSSSetReportedHash(&m_Context->RSSParameters,
+                                                                             pHeader->hash_report,
+                                                                             pHeader->hash_value,
+                                                                             &pBufferDescriptor->PacketInfo))
+        {
+            m_Context->extraStatistics.framesRSSHashDevice++;
+        }
+        else
+        {
+            ParaNdis6_RSSAnalyzeReceivedPacket(&m_Context->RSSParameters,
+                                               pBufferDescriptor->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual,
+                                               &pBufferDescriptor->PacketInfo);
+            m_Context->extraStatistics.framesRSSHashDriver++;
+        }
+    }
+    CCHAR nTargetReceiveQueueNum;
+    PROCESSOR_NUMBER TargetProcessor;
+
+    nTargetReceiveQueueNum = ParaNdis_GetScalingDataForPacket(m_Context,
+                                                              &pBufferDescriptor->PacketInfo,
+                                                              &TargetProcessor);
 
-#ifndef PARANDIS_SUPPORT_RSS
+    if (nTargetReceiveQueueNum == PARANDIS_RECEIVE_UNCLASSIFIED_PACKET)
+    {
+        ParaNdis_ReceiveQueueAddBuffer(&m_UnclassifiedPacketsQueue, pBufferDescriptor);
+        m_Context->extraStatistics.framesRSSUnclassified++;
+    }
+    else
+    {
+        // published to the receive queue by PublishClassifiedPackets
+        auto &pending = m_PendingPackets[nTargetReceiveQueueNum];
+        pBufferDescriptor->ReceiveQueueListEntry.Flink = NULL;
+        if (pending.Count++)
+        {
+            pending.Tail->Flink = &pBufferDescriptor->ReceiveQueueListEntry;
+        }
+        else
+        {
+            pending.Head = &pBufferDescriptor->ReceiveQueueListEntry;
+            m_PendingQueues |= 1UL << nTargetReceiveQueueNum;
+        }
+        pending.Tail = &pBufferDescriptor->ReceiveQueueListEntry;
+
+        if (nTargetReceiveQueueNum != nCurrCpuReceiveQueue)
+        {
+            pending.TargetProcessor = TargetProcessor;
+            m_Context->extraStatistics.framesRSSMisses++;
+            LogRedirectedPacket(pBufferDescriptor);
+        }
+        else
+        {
+            m_Context->extraStatistics.framesRSSHits++;
+        }
+    }
+#else
     UNREFERENCED_PARAMETER(nCurrCpuReceiveQueue);
+    ParaNdis_ReceiveQueueAddBuffer(&m_UnclassifiedPacketsQueue, pBufferDescriptor);
 #endif
+}
 
-    TDPCSpinLocker autoLock(m_Lock);
+// publishes the packets classified to each receive queue at once and
+// notifies the CPUs of the other queues once
+void CParaNdisRX::PublishClassifiedPackets(CCHAR nCurrCpuReceiveQueue)
+{
+#ifdef PARANDIS_SUPPORT_RSS
+    while (m_PendingQueues)
+    {
+        ULONG nTargetReceiveQueueNum;
+        _BitScanForward(&nTargetReceiveQueueNum, m_PendingQueues);
+        m_PendingQueues &= ~(1UL << nTargetReceiveQueueNum);
 
-    if (m_Context->extraStatistics.minFreeRxBuffers > m_NetNofReceiveBuffers)
+        auto &pending = m_PendingPackets[nTargetReceiveQueueNum];
+        PLIST_ENTRY Entries[m_BatchSize];
+        PLIST_ENTRY pEntry = pending.Head;
+
+        while (pEntry)
+        {
+            LONG nEntries = 0;
+            for (; pEntry && nEntries < (LONG)ARRAYSIZE(Entries); pEntry = pEntry->Flink)
+            {
+                Entries[nEntries++] = pEntry;
+            }
+            m_Context->ReceiveQueues[nTargetReceiveQueueNum].Buffers.EnqueueBatch(Entries, nEntries);
+        }
+        pending.Head = pending.Tail = NULL;
+        pending.Count = 0;
+
+        if ((CCHAR)nTargetReceiveQueueNum != nCurrCpuReceiveQueue)
+        {
+            if (m_Context->bPollModeEnabled)
+            {
+                // ensure the NDIS just schedules the other poll and does not do anything
+                // otherwise if both polls are configured to the same CPU
+                // this may cause a deadlock in return nbl path
+                KIRQL prev = KeRaiseIrqlToSynchLevel();
+                ParaNdisPollNotify(m_Context, nTargetReceiveQueueNum, "RSS");
+                KeLowerIrql(prev);
+            }
+            else
+            {
+                GROUP_AFFINITY TargetAffinity;
+                ParaNdis_ProcessorNumberToGroupAffinity(&TargetAffinity, &pending.TargetProcessor);
+                ParaNdis_QueueRSSDpc(m_Context, m_messageIndex, &TargetAffinity);
+            }
+        }
+    }
+#else
+    UNREFERENCED_PARAMETER(nCurrCpuReceiveQueue);
+#endif
+}
+
+#if PARANDIS_SUPPORT_RSC
+/* Software RSC, used when the device has no guest TSO.
+
+In-order TCP segments of the same flow retrieved in one ProcessRxRing pass
+are indicated as one packet: the headers of the first segment describe the
+whole packet and the payload of the next ones is chained after its data
+by partial MDLs. The flow is flushed to its receive queue when a segment
+can't be appended (out of order, different flags, options or ACK), when it
+has PSH or is shorter than the first one, at the configured number of
+segments or 64K and at the end of the pass. */
+
+#define RSC_TCP_FLAG_PSH 0x08
+#define RSC_TCP_FLAG_ACK 0x10
+
+static FORCEINLINE PVOID RscIpHeader(pRxNetDescriptor p)
+{
+    return RtlOffsetToPointer(p->PacketInfo.headersBuffer, p->PacketInfo.L2HdrLen);
+}
+
+static FORCEINLINE TCPHeader *RscTcpHeader(pRxNetDescriptor p)
+{
+    return (TCPHeader *)RtlOffsetToPointer(RscIpHeader(p), p->PacketInfo.L3HdrLen);
+}
+
+static FORCEINLINE UCHAR RscTcpFlags(TCPHeader *pTcpHeader)
+{
+    return (UCHAR)(pTcpHeader->tcp_flags >> 8);
+}
+
+// the length of the IP packet, without the Ethernet padding
+static ULONG RscIpPacketLength(pRxNetDescriptor p)
+{
+    if (p->PacketInfo.isIP4)
     {
-        m_Context->extraStatistics.minFreeRxBuffers = m_NetNofReceiveBuffers;
+        return RtlUshortByteSwap(((IPv4Header *)RscIpHeader(p))->ip_length);
+    }
+    return sizeof(IPv6Header) + RtlUshortByteSwap(((IPv6Header *)RscIpHeader(p))->ip6_payload_len);
+}
+
+// returns the TCP payload length when the packet is a segment that can be
+// coalesced: no IP options or extension headers, only ACK and PSH flags,
+// the TCP checksum verified by the device and all of it in the first page
+static ULONG RscSegmentPayload(PARANDIS_ADAPTER *pContext, pRxNetDescriptor p)
+{
+    PNET_PACKET_INFO pi = &p->PacketInfo;
+    virtio_net_hdr_mrg_rxbuf *pHeader = (virtio_net_hdr_mrg_rxbuf *)p->PhysicalPages[0].Virtual;
+
+    if (pi->isIP4 ? !(pContext->RSC.bIPv4Software && pContext->RSC.bIPv4Enabled)
+                  : !(pContext->RSC.bIPv6Software && pContext->RSC.bIPv6Enabled))
+    {
+        return 0;
+    }
+    if (p->MergedNext || pHeader->hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+        !(pHeader->hdr.flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)))
+    {
+        return 0;
+    }
+    if (pi->L3HdrLen != (pi->isIP4 ? sizeof(IPv4Header) : sizeof(IPv6Header)) ||
+        pi->dataLength < pi->L2HdrLen + pi->L3HdrLen + sizeof(TCPHeader))
+    {
+        return 0;
+    }
+
+    TCPHeader *pTcpHeader = RscTcpHeader(p);
+    ULONG nTcpHeaderLength = TCP_HEADER_LENGTH(pTcpHeader);
+    ULONG nIpLength = RscIpPacketLength(p);
+
+    if (nTcpHeaderLength < sizeof(TCPHeader) || nIpLength <= pi->L3HdrLen + nTcpHeaderLength ||
+        pi->L2HdrLen + nIpLength > pi->dataLength ||
+        pi->L2HdrLen + nIpLength > p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size)
+    {
+        return 0;
+    }
+    if ((RscTcpFlags(pTcpHeader) & ~RSC_TCP_FLAG_PSH) != RSC_TCP_FLAG_ACK)
+    {
+        return 0;
+    }
+    // the device validates only the TCP checksum
+    if (pi->isIP4 && RawCheckSumFinalize(RawCheckSumCalculator(RscIpHeader(p), sizeof(IPv4Header))))
+    {
+        return 0;
+    }
+    return nIpLength - pi->L3HdrLen - nTcpHeaderLength;
+}
+
+// the same Ethernet header, addresses and ports
+static bool RscSameFlow(pRxNetDescriptor p1, pRxNetDescriptor p2)
+{
+    PNET_PACKET_INFO pi1 = &p1->PacketInfo;
+    PNET_PACKET_INFO pi2 = &p2->PacketInfo;
+    ULONG nAddressesOffset = pi1->isIP4 ? FIELD_OFFSET(IPv4Header, ip_src) : FIELD_OFFSET(IPv6Header, ip6_src_address);
+    ULONG nAddressesLength = pi1->isIP4 ? 2 * sizeof(ULONG) : 2 * sizeof(IPV6_ADDRESS);
+
+    if (pi1->isIP4 != pi2->isIP4 || pi1->L2HdrLen != pi2->L2HdrLen ||
+        pi2->dataLength < pi2->L2HdrLen + pi2->L3HdrLen + 2 * sizeof(USHORT))
+    {
+        return false;
     }
+    return RtlEqualMemory(pi1->headersBuffer, pi2->headersBuffer, pi1->L2HdrLen) &&
+           RtlEqualMemory(RtlOffsetToPointer(RscIpHeader(p1), nAddressesOffset),
+                          RtlOffsetToPointer(RscIpHeader(p2), nAddressesOffset),
+                          nAddressesLength) &&
+           RtlEqualMemory(RscTcpHeader(p1), RscTcpHeader(p2), 2 * sizeof(USHORT));
+}
+
+// the segment continues the flow and its headers differ from
+// the ones of the first segment only in the fields RSC merges
+static bool RscCanAppend(pRxNetDescriptor pHead, pRxNetDescriptor p, ULONG nNextSeq, ULONG nSegmentSize, ULONG nPayload)
+{
+    TCPHeader *pHeadTcp = RscTcpHeader(pHead);
+    TCPHeader *pTcp = RscTcpHeader(p);
+    ULONG nTcpHeaderLength = TCP_HEADER_LENGTH(pTcp);
 
-    while (NULL != (pBufferDescriptor = (pRxNetDescriptor)m_VirtQueue.GetBuf(&nFullLength)))
+    if (RtlUlongByteSwap(pTcp->tcp_seq) != nNextSeq || nPayload > nSegmentSize ||
+        RscIpPacketLength(pHead) + pHead->CoalescedLength + nPayload > MAXUSHORT)
+    {
+        return false;
+    }
+    if (TCP_HEADER_LENGTH(pHeadTcp) != nTcpHeaderLength || pHeadTcp->tcp_ack != pTcp->tcp_ack ||
+        pHeadTcp->tcp_window != pTcp->tcp_window ||
+        !RtlEqualMemory(pHeadTcp + 1, pTcp + 1, nTcpHeaderLength - sizeof(TCPHeader)))
     {
-        RemoveEntryList(&pBufferDescriptor->listEntry);
-        m_NetNofReceiveBuffers--;
+        return false;
+    }
+    if (pHead->PacketInfo.isIP4)
+    {
+        IPv4Header *pHeadIp = (IPv4Header *)RscIpHeader(pHead);
+        IPv4Header *pIp = (IPv4Header *)RscIpHeader(p);
+        return pHeadIp->ip_tos == pIp->ip_tos && pHeadIp->ip_ttl == pIp->ip_ttl &&
+               pHeadIp->ip_offset == pIp->ip_offset;
+    }
+    IPv6Header *pHeadIp = (IPv6Header *)RscIpHeader(pHead);
+    IPv6Header *pIp = (IPv6Header *)RscIpHeader(p);
+    return RtlEqualMemory(pHeadIp, pIp, FIELD_OFFSET(IPv6Header, ip6_payload_len)) &&
+           pHeadIp->ip6_hoplimit == pIp->ip6_hoplimit;
+}
 
-        // basic MAC-based analysis + L3 header info
-        BOOLEAN packetAnalysisRC = ParaNdis_AnalyzeReceivedPacket(pBufferDescriptor->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual,
-                                                                  nFullLength - m_Context->nVirtioHeaderSize,
-                                                                  &pBufferDescriptor->PacketInfo);
+// returns true when the packet is held in a flow, to be classified when the flow is flushed
+bool CParaNdisRX::CoalesceRxPacket(pRxNetDescriptor pBufferDescriptor, CCHAR nCurrCpuReceiveQueue)
+{
+    if (!pBufferDescriptor->PacketInfo.isTCP)
+    {
+        return false;
+    }
+
+    ULONG nPayload = RscSegmentPayload(m_Context, pBufferDescriptor);
+    UINT nFree = m_RscMaxFlows;
+
+    for (UINT i = 0; i < m_RscMaxFlows; i++)
+    {
+        auto &Flow = m_RscFlows[i];
 
-        if (!packetAnalysisRC)
+        if (!Flow.Head)
         {
-            pBufferDescriptor->Queue->ReuseReceiveBufferNoLock(pBufferDescriptor);
-            m_Context->Statistics.ifInErrors++;
-            m_Context->Statistics.ifInDiscards++;
+            nFree = min(nFree, i);
             continue;
         }
-
-        // filtering based on prev stage analysis
-        if (!ShallPassPacket(m_Context, &pBufferDescriptor->PacketInfo))
+        if (!RscSameFlow(Flow.Head, pBufferDescriptor))
         {
-            pBufferDescriptor->Queue->ReuseReceiveBufferNoLock(pBufferDescriptor);
-            m_Context->Statistics.ifInDiscards++;
-            m_Context->extraStatistics.framesFilteredOut++;
             continue;
         }
-#ifdef PARANDIS_SUPPORT_RSS
-        if (m_Context->RSSParameters.RSSMode != PARANDIS_RSS_MODE::PARANDIS_RSS_DISABLED)
+        if (nPayload && RscCanAppend(Flow.Head, pBufferDescriptor, Flow.NextSeq, Flow.SegmentSize, nPayload) &&
+            Flow.Head->CoalescedSegments < m_Context->RSC.uSoftwareMaxSegments)
         {
-            ParaNdis6_RSSAnalyzeReceivedPacket(&m_Context->RSSParameters,
-                                               pBufferDescriptor->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual,
-                                               &pBufferDescriptor->PacketInfo);
+            TCPHeader *pTcpHeader = RscTcpHeader(pBufferDescriptor);
+            PMDL pMdl = NdisAllocateMdl(m_Context->MiniportHandle,
+                                        RtlOffsetToPointer(pTcpHeader, TCP_HEADER_LENGTH(pTcpHeader)),
+                                        nPayload);
+            if (pMdl)
+            {
+                NDIS_MDL_LINKAGE(pMdl) = NULL;
+                pBufferDescriptor->CoalescedMdl = pMdl;
+                if (Flow.Tail != Flow.Head)
+                {
+                    NDIS_MDL_LINKAGE(Flow.Tail->CoalescedMdl) = pMdl;
+                }
+                Flow.Tail->CoalescedNext = pBufferDescriptor;
+                Flow.Tail = pBufferDescriptor;
+                Flow.Head->CoalescedLength += nPayload;
+                Flow.Head->CoalescedSegments++;
+                Flow.NextSeq += nPayload;
+
+                if ((RscTcpFlags(pTcpHeader) & RSC_TCP_FLAG_PSH) || nPayload < Flow.SegmentSize ||
+                    Flow.Head->CoalescedSegments >= m_Context->RSC.uSoftwareMaxSegments)
+                {
+                    FlushRscFlow(i, nCurrCpuReceiveQueue);
+                }
+                return true;
+            }
         }
-        CCHAR nTargetReceiveQueueNum;
-        GROUP_AFFINITY TargetAffinity;
-        PROCESSOR_NUMBER TargetProcessor;
+        // the segment must not overtake the ones held in the flow
+        FlushRscFlow(i, nCurrCpuReceiveQueue);
+        nFree = i;
+        break;
+    }
+
+    if (!nPayload || (RscTcpFlags(RscTcpHeader(pBufferDescriptor)) & RSC_TCP_FLAG_PSH))
+    {
+        return false;
+    }
+    if (nFree == m_RscMaxFlows)
+    {
+        nFree = m_RscNextVictim;
+        m_RscNextVictim = (m_RscNextVictim + 1) % m_RscMaxFlows;
+        FlushRscFlow(nFree, nCurrCpuReceiveQueue);
+    }
+
+    auto &Flow = m_RscFlows[nFree];
+    Flow.Head = Flow.Tail = pBufferDescriptor;
+    Flow.NextSeq = RtlUlongByteSwap(RscTcpHeader(pBufferDescriptor)->tcp_seq) + nPayload;
+    Flow.SegmentSize = nPayload;
+    pBufferDescriptor->CoalescedLength = 0;
+    pBufferDescriptor->CoalescedSegments = 1;
+    return true;
+}
+
+void CParaNdisRX::FlushRscFlow(UINT Index, CCHAR nCurrCpuReceiveQueue)
+{
+    pRxNetDescriptor pHead = m_RscFlows[Index].Head;
+    pRxNetDescriptor pTail = m_RscFlows[Index].Tail;
+
+    if (!pHead)
+    {
+        return;
+    }
+    m_RscFlows[Index].Head = m_RscFlows[Index].Tail = NULL;
 
-        nTargetReceiveQueueNum = ParaNdis_GetScalingDataForPacket(m_Context,
-                                                                  &pBufferDescriptor->PacketInfo,
-                                                                  &TargetProcessor);
+    if (pHead->CoalescedNext)
+    {
+        PNET_PACKET_INFO pi = &pHead->PacketInfo;
+        ULONG nIpLength = RscIpPacketLength(pHead);
+        ULONG nTotalIpLength = nIpLength + pHead->CoalescedLength;
 
-        if (nTargetReceiveQueueNum == PARANDIS_RECEIVE_UNCLASSIFIED_PACKET)
+        // the headers of the first segment describe the whole packet,
+        // the push flag comes from the last one
+        if (pi->isIP4)
         {
-            ParaNdis_ReceiveQueueAddBuffer(&m_UnclassifiedPacketsQueue, pBufferDescriptor);
-            m_Context->extraStatistics.framesRSSUnclassified++;
+            IPv4Header *pIpHeader = (IPv4Header *)RscIpHeader(pHead);
+            pIpHeader->ip_length = RtlUshortByteSwap((USHORT)nTotalIpLength);
+            pIpHeader->ip_xsum = 0;
+            pIpHeader->ip_xsum = RawCheckSumFinalize(RawCheckSumCalculator(pIpHeader, sizeof(*pIpHeader)));
         }
         else
         {
-            ParaNdis_ReceiveQueueAddBuffer(&m_Context->ReceiveQueues[nTargetReceiveQueueNum], pBufferDescriptor);
+            IPv6Header *pIpHeader = (IPv6Header *)RscIpHeader(pHead);
+            pIpHeader->ip6_payload_len = RtlUshortByteSwap((USHORT)(nTotalIpLength - sizeof(*pIpHeader)));
+        }
+        RscTcpHeader(pHead)->tcp_flags |= (USHORT)(RscTcpHeader(pTail)->tcp_flags & (RSC_TCP_FLAG_PSH << 8));
+
+        pi->dataLength = pi->L2HdrLen + nIpLength;
+        pi->L2PayloadLen = nTotalIpLength;
+        pHead->HolderLinkage = NDIS_MDL_LINKAGE(pHead->Holder);
+
+        m_RscPackets++;
+        m_RscSegments += pHead->CoalescedSegments;
+    }
+
+    ClassifyReceivedPacket(pHead, nCurrCpuReceiveQueue);
+}
+#endif
+
+VOID CParaNdisRX::ProcessRxRing(CCHAR nCurrCpuReceiveQueue)
+{
+    pRxNetDescriptor pBufferDescriptor;
+    unsigned int nFullLength;
+    void *Buffers[m_BatchSize];
+    unsigned int Lengths[m_BatchSize];
+    UINT nBuffers;
+
+    TDPCSpinLocker autoLock(m_Lock);
+
+    if (m_Context->extraStatistics.minFreeRxBuffers > m_NetNofReceiveBuffers)
+    {
+        m_Context->extraStatistics.minFreeRxBuffers = m_NetNofReceiveBuffers;
+    }
 
-            if (nTargetReceiveQueueNum != nCurrCpuReceiveQueue)
+#if PARANDIS_SUPPORT_RSC
+    bool bCoalesce = m_Context->RSC.bIPv4Software || m_Context->RSC.bIPv6Software;
+#endif
+
+    while (0 != (nBuffers = m_VirtQueue.GetBufs(Buffers, Lengths, ARRAYSIZE(Buffers))))
+    {
+        m_CoalescingPackets += nBuffers;
+        for (UINT i = 0; i < nBuffers; i++)
+        {
+            pBufferDescriptor = (pRxNetDescriptor)Buffers[i];
+            nFullLength = Lengths[i];
+
+            RemoveEntryList(&pBufferDescriptor->listEntry);
+            m_NetNofReceiveBuffers--;
+
+            if (m_Context->bUseMergedBuffers && !MergeRxBuffer(pBufferDescriptor, nFullLength))
             {
-                if (m_Context->bPollModeEnabled)
-                {
-                    // ensure the NDIS just schedules the other poll and does not do anything
-                    // otherwise if both polls are configured to the same CPU
-                    // this may cause a deadlock in return nbl path
-                    KIRQL prev = KeRaiseIrqlToSynchLevel();
-                    ParaNdisPollNotify(m_Context, nTargetReceiveQueueNum, "RSS");
-                    KeLowerIrql(prev);
-                }
-                else
-                {
-                    ParaNdis_ProcessorNumberToGroupAffinity(&TargetAffinity, &TargetProcessor);
-                    ParaNdis_QueueRSSDpc(m_Context, m_messageIndex, &TargetAffinity);
-                }
-                m_Context->extraStatistics.framesRSSMisses++;
-                LogRedirectedPacket(pBufferDescriptor);
+                continue;
             }
-            else
+
+            // basic MAC-based analysis + L3 header info
+            BOOLEAN packetAnalysisRC = ParaNdis_AnalyzeReceivedPacket(pBufferDescriptor->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual,
+                                                                      nFullLength - m_Context->nVirtioHeaderSize,
+                                                                      &pBufferDescriptor->PacketInfo);
+
+            if (!packetAnalysisRC)
+            {
+                pBufferDescriptor->Queue->ReuseReceiveBufferNoLock(pBufferDescriptor);
+                m_Context->Statistics.ifInErrors++;
+                m_Context->Statistics.ifInDiscards++;
+                continue;
+            }
+
+            // filtering based on prev stage analysis
+            if (!ShallPassPacket(m_Context, &pBufferDescriptor->PacketInfo))
             {
-                m_Context->extraStatistics.framesRSSHits++;
+                pBufferDescriptor->Queue->ReuseReceiveBufferNoLock(pBufferDescriptor);
+                m_Context->Statistics.ifInDiscards++;
+                m_Context->extraStatistics.framesFilteredOut++;
+                continue;
             }
+#if PARANDIS_SUPPORT_RSC
+            if (bCoalesce && CoalesceRxPacket(pBufferDescriptor, nCurrCpuReceiveQueue))
+            {
+                continue;
+            }
+#endif
+            ClassifyReceivedPacket(pBufferDescriptor, nCurrCpuReceiveQueue);
         }
-#else
-        ParaNdis_ReceiveQueueAddBuffer(&m_UnclassifiedPacketsQueue, pBufferDescriptor);
+        PublishClassifiedPackets(nCurrCpuReceiveQueue);
+    }
+
+#if PARANDIS_SUPPORT_RSC
+    for (UINT i = 0; i < m_RscMaxFlows; i++)
+    {
+        FlushRscFlow(i, nCurrCpuReceiveQueue);
+    }
+    PublishClassifiedPackets(nCurrCpuReceiveQueue);
 #endif
+
+    // the buffers returned below the watermark
+    RefillFromCacheNoLock();
+
+    if (m_Context->bAdaptiveCoalescing && m_Context->bInterruptModeration)
+    {
+        EvaluateCoalescingNoLock();
     }
 }
 
+// the parameters of the adaptive coalescing by the packet rate
+// of the queue: none at low rate for the latency, then more
+// packets per notification as the rate grows
+static const struct
+{
+    ULONG PacketsPerSecond;
+    ULONG MaxPackets;
+    ULONG Usecs;
+} CoalescingLevels[] = {
+    {0, 0, 0},
+    {20000, 8, 20},
+    {100000, 32, 50},
+    {400000, 64, 100},
+};
+
+// 100 ms in units of NdisGetCurrentSystemTime
+#define PARANDIS_COALESCING_INTERVAL 1000000
+
+void CParaNdisRX::EvaluateCoalescingNoLock()
+{
+    ULONGLONG now;
+    UpdateTimestamp(now);
+
+    ULONGLONG elapsed = now - m_CoalescingTimestamp;
+    if (elapsed < PARANDIS_COALESCING_INTERVAL)
+    {
+        return;
+    }
+
+    ULONGLONG rate = m_CoalescingPackets * 10000000 / elapsed;
+    UINT level = m_CoalescingLevel;
+    m_CoalescingTimestamp = now;
+    m_CoalescingPackets = 0;
+
+    // up at the rate of the next level, down at half of the rate of the current one
+    while (level + 1 < ARRAYSIZE(CoalescingLevels) && rate >= CoalescingLevels[level + 1].PacketsPerSecond)
+    {
+        level++;
+    }
+    while (level > 0 && rate < CoalescingLevels[level].PacketsPerSecond / 2)
+    {
+        level--;
+    }
+    // also repeats the level the control queue had no free slot for
+    if (level != m_CoalescingLevel || (LONG)level != m_CoalescingSent)
+    {
+        m_CoalescingLevel = level;
+        InterlockedExchange(&m_CoalescingUpdate, (LONG)level);
+    }
+}
+
+void CParaNdisRX::UpdateCoalescing()
+{
+    LONG level = InterlockedExchange(&m_CoalescingUpdate, -1);
+
+    if (level < 0)
+    {
+        return;
+    }
+    if (ParaNdis_SetQueueNotificationCoalescing(m_Context,
+                                                m_queueIndex,
+                                                CoalescingLevels[level].MaxPackets,
+                                                CoalescingLevels[level].Usecs))
+    {
+        m_CoalescingSent = level;
+        m_CoalescingUpdates++;
+    }
+    else
+    {
+        // no free slot, EvaluateCoalescingNoLock retries at the next interval
+        m_CoalescingDeferred++;
+    }
+}
+
+// the device has the parameters of ParaNdis_UpdateNotificationCoalescing
+void CParaNdisRX::ResetCoalescing()
+{
+    TPassiveSpinLocker autoLock(m_Lock);
+
+    m_CoalescingLevel = 0;
+    m_CoalescingSent = 0;
+    m_CoalescingPackets = 0;
+    UpdateTimestamp(m_CoalescingTimestamp);
+    InterlockedExchange(&m_CoalescingUpdate, -1);
+}
+
 void CParaNdisRX::PopulateQueue()
 {
     LIST_ENTRY TempList;
     TPassiveSpinLocker autoLock(m_Lock);
 
+    // m_Reinsert is false, the buffers of the cache go to the list
+    RefillFromCacheNoLock();
+
     InitializeListHead(&TempList);
 
     while (!IsListEmpty(&m_NetReceiveBuffers))
@@ -707,14 +1434,24 @@ void CParaNdisRX::PopulateQueue()
     m_NetNofReceiveBuffers = 0;
     while (!IsListEmpty(&TempList))
     {
-        pRxNetDescriptor pBufferDescriptor = (pRxNetDescriptor)RemoveHeadList(&TempList);
-        if (AddRxBufferToQueue(pBufferDescriptor))
+        struct virtqueue_buf Bufs[m_BatchSize];
+        PLIST_ENTRY Entry = TempList.Flink;
+        UINT nBufs = 0, nAdded;
+
+        for (; nBufs < ARRAYSIZE(Bufs) && Entry != &TempList; nBufs++, Entry = Entry->Flink)
+        {
+            FillVirtQueueBuf(Bufs[nBufs], (pRxNetDescriptor)Entry);
+        }
+        nAdded = m_VirtQueue.AddBufs(Bufs, nBufs);
+        for (UINT i = 0; i < nAdded; i++)
         {
+            pRxNetDescriptor pBufferDescriptor = (pRxNetDescriptor)RemoveHeadList(&TempList);
             InsertTailList(&m_NetReceiveBuffers, &pBufferDescriptor->listEntry);
             m_NetNofReceiveBuffers++;
         }
-        else
+        if (nAdded < nBufs)
         {
+            pRxNetDescriptor pBufferDescriptor = (pRxNetDescriptor)RemoveHeadList(&TempList);
             /* TODO - NetMaxReceiveBuffers should take into account all queues */
             DPrintf(0, "FAILED TO REUSE THE BUFFER!!!!\n");
             ParaNdis_FreeRxBufferDescriptor(m_Context, pBufferDescriptor);
@@ -737,16 +1474,13 @@ VOID ParaNdis_ResetRxClassification(PARANDIS_ADAPTER *pContext)
     for (i = PARANDIS_FIRST_RSS_RECEIVE_QUEUE; i < ARRAYSIZE(pContext->ReceiveQueues); i++)
     {
         PPARANDIS_RECEIVE_QUEUE pCurrQueue = &pContext->ReceiveQueues[i];
-        NdisAcquireSpinLock(&pCurrQueue->Lock);
+        PLIST_ENTRY pListEntry;
 
-        while (!IsListEmpty(&pCurrQueue->BuffersList))
+        while ((pListEntry = pCurrQueue->Buffers.Dequeue()) != NULL)
         {
-            PLIST_ENTRY pListEntry = RemoveHeadList(&pCurrQueue->BuffersList);
             pRxNetDescriptor pBufferDescriptor = CONTAINING_RECORD(pListEntry, RxNetDescriptor, ReceiveQueueListEntry);
             ParaNdis_ReceiveQueueAddBuffer(&pBufferDescriptor->Queue->UnclassifiedPacketsQueue(), pBufferDescriptor);
         }
-
-        NdisReleaseSpinLock(&pCurrQueue->Lock);
     }
 }
 #endif
@@ -0,0 +1,286 @@
+#pragma once
+
+/*
+ * Software segmentation of the TX path: the headers of each MSS-sized
+ * frame of a large TCP (LSO) or UDP (USO) packet are built from the
+ * headers of the packet, when the device has no TSO or USO. It has no
+ * dependency on NDIS, so DebugTools/Segmentation can build it on the host
+ * and compare the frames with a reference segmentation.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "ParaNdis_Checksum.h"
+
+#define SEGMENTATION_IPV4_MIN_HEADER 20
+#define SEGMENTATION_IPV6_HEADER     40
+#define SEGMENTATION_TCP_MIN_HEADER  20
+#define SEGMENTATION_UDP_HEADER      8
+
+// the flags of the large packet kept only in its first or last segment
+#define SEGMENTATION_TCP_FIN 0x01
+#define SEGMENTATION_TCP_PSH 0x08
+#define SEGMENTATION_TCP_CWR 0x80
+
+typedef struct _tagSegmentationInfo
+{
+    // offsets from the start of the frame
+    ULONG IpHeaderOffset;
+    ULONG L4HeaderOffset;
+    // the headers repeated in each segment, up to the end of the L4 header
+    ULONG HeadersLength;
+    ULONG PayloadLength;
+    ULONG SegmentSize;
+    ULONG Segments;
+    bool IsIPv4;
+    bool IsUdp;
+    // of the large packet, in host order
+    USHORT IpId;
+    ULONG TcpSeq;
+    UCHAR TcpFlags;
+} tSegmentationInfo;
+
+static __inline USHORT SegmentationGet16(const UCHAR *p)
+{
+    return (USHORT)((p[0] << 8) | p[1]);
+}
+
+static __inline ULONG SegmentationGet32(const UCHAR *p)
+{
+    return ((ULONG)p[0] << 24) | ((ULONG)p[1] << 16) | ((ULONG)p[2] << 8) | p[3];
+}
+
+static __inline void SegmentationPut16(UCHAR *p, ULONG Value)
+{
+    p[0] = (UCHAR)(Value >> 8);
+    p[1] = (UCHAR)Value;
+}
+
+static __inline void SegmentationPut32(UCHAR *p, ULONG Value)
+{
+    SegmentationPut16(p, Value >> 16);
+    SegmentationPut16(p + 2, Value);
+}
+
+// the checksums are kept in the byte order of the memory, as sw_offload.cpp does
+static __inline void SegmentationPutChecksum(UCHAR *p, USHORT Checksum)
+{
+    p[0] = (UCHAR)Checksum;
+    p[1] = (UCHAR)(Checksum >> 8);
+}
+
+// the 16-bit one's complement sum of a raw checksum
+static __inline USHORT SegmentationFold(UINT_PTR Sum)
+{
+    return (USHORT)~RawCheckSumFinalize(Sum);
+}
+
+/*
+ * Adds a part of the payload of a segment to its sum, Offset is the
+ * position of the part in the payload: a part at an odd position (an
+ * MDL may end anywhere) is summed with its bytes swapped.
+ */
+static __inline UINT_PTR SegmentationChecksumAdd(UINT_PTR Sum, const void *Buffer, ULONG Length, ULONG Offset)
+{
+    USHORT Part = SegmentationFold(RawCheckSumCalculator((PVOID)Buffer, Length));
+
+    if (Offset & 1)
+    {
+        Part = (USHORT)((Part << 8) | (Part >> 8));
+    }
+    return Sum + Part;
+}
+
+/*
+ * Validates the headers of the large packet and fills Info,
+ * Available is the number of bytes of the frame in Headers.
+ * Returns false when the packet can not be segmented.
+ */
+static __inline bool SegmentationPrepare(tSegmentationInfo *Info,
+                                         const UCHAR *Headers,
+                                         ULONG Available,
+                                         ULONG IpHeaderOffset,
+                                         ULONG L4HeaderOffset,
+                                         ULONG FrameLength,
+                                         ULONG SegmentSize,
+                                         bool IsUdp)
+{
+    const UCHAR *Ip = Headers + IpHeaderOffset;
+    ULONG L4HeaderLength = IsUdp ? SEGMENTATION_UDP_HEADER : SEGMENTATION_TCP_MIN_HEADER;
+
+    RtlZeroMemory(Info, sizeof(*Info));
+    if (!SegmentSize || L4HeaderOffset <= IpHeaderOffset || L4HeaderOffset + L4HeaderLength > Available)
+    {
+        return false;
+    }
+
+    switch (Ip[0] >> 4)
+    {
+        case 4:
+            if ((ULONG)(Ip[0] & 0xF) * 4 < SEGMENTATION_IPV4_MIN_HEADER ||
+                IpHeaderOffset + (Ip[0] & 0xF) * 4 > L4HeaderOffset)
+            {
+                return false;
+            }
+            Info->IsIPv4 = true;
+            Info->IpId = SegmentationGet16(Ip + 4);
+            break;
+        case 6:
+            // the extension headers are between the two offsets
+            if (IpHeaderOffset + SEGMENTATION_IPV6_HEADER > L4HeaderOffset)
+            {
+                return false;
+            }
+            break;
+        default:
+            return false;
+    }
+
+    if (!IsUdp)
+    {
+        const UCHAR *Tcp = Headers + L4HeaderOffset;
+        L4HeaderLength = (Tcp[12] >> 4) * 4;
+        if (L4HeaderLength < SEGMENTATION_TCP_MIN_HEADER)
+        {
+            return false;
+        }
+        Info->TcpSeq = SegmentationGet32(Tcp + 4);
+        Info->TcpFlags = Tcp[13];
+    }
+
+    Info->HeadersLength = L4HeaderOffset + L4HeaderLength;
+    if (Info->HeadersLength > Available || Info->HeadersLength > FrameLength)
+    {
+        return false;
+    }
+    Info->IpHeaderOffset = IpHeaderOffset;
+    Info->L4HeaderOffset = L4HeaderOffset;
+    Info->PayloadLength = FrameLength - Info->HeadersLength;
+    Info->SegmentSize = SegmentSize;
+    Info->IsUdp = IsUdp;
+    Info->Segments = Info->PayloadLength ? (Info->PayloadLength + SegmentSize - 1) / SegmentSize : 1;
+
+    // the IP length of the largest segment
+    if (Info->HeadersLength - IpHeaderOffset + min(SegmentSize, Info->PayloadLength) > 0xFFFF)
+    {
+        return false;
+    }
+    return true;
+}
+
+static __inline ULONG SegmentationPayloadOffset(const tSegmentationInfo *Info, ULONG Index)
+{
+    return Info->HeadersLength + Index * Info->SegmentSize;
+}
+
+static __inline ULONG SegmentationPayloadLength(const tSegmentationInfo *Info, ULONG Index)
+{
+    ULONG Offset = Index * Info->SegmentSize;
+
+    return min(Info->SegmentSize, Info->PayloadLength - Offset);
+}
+
+/*
+ * Turns Headers, a copy of the headers of the large packet, into the
+ * headers of the segment Index: the IP length and ID, the TCP sequence
+ * and flags or the UDP length, and the checksums. PayloadSum is the sum
+ * of the payload of the segment collected by SegmentationChecksumAdd.
+ */
+static __inline void SegmentationBuildHeaders(const tSegmentationInfo *Info,
+                                              UCHAR *Headers,
+                                              ULONG Index,
+                                              UINT_PTR PayloadSum)
+{
+    UCHAR *Ip = Headers + Info->IpHeaderOffset;
+    UCHAR *L4 = Headers + Info->L4HeaderOffset;
+    ULONG L4HeaderLength = Info->HeadersLength - Info->L4HeaderOffset;
+    ULONG L4Length = L4HeaderLength + SegmentationPayloadLength(Info, Index);
+    UCHAR Protocol = Info->IsUdp ? 17 : 6;
+    UCHAR Pseudo[SEGMENTATION_IPV6_HEADER];
+    ULONG PseudoLength;
+    ULONG ChecksumOffset;
+
+    if (Info->IsIPv4)
+    {
+        ULONG IpHeaderLength = (Ip[0] & 0xF) * 4;
+
+        SegmentationPut16(Ip + 2, Info->L4HeaderOffset - Info->IpHeaderOffset + L4Length);
+        SegmentationPut16(Ip + 4, (USHORT)(Info->IpId + Index));
+        Ip[10] = Ip[11] = 0;
+        SegmentationPutChecksum(Ip + 10, RawCheckSumFinalize(RawCheckSumCalculator(Ip, IpHeaderLength)));
+
+        RtlCopyMemory(Pseudo, Ip + 12, 8);
+        Pseudo[8] = 0;
+        Pseudo[9] = Protocol;
+        SegmentationPut16(Pseudo + 10, L4Length);
+        PseudoLength = 12;
+    }
+    else
+    {
+        SegmentationPut16(Ip + 4, Info->L4HeaderOffset - Info->IpHeaderOffset - SEGMENTATION_IPV6_HEADER + L4Length);
+
+        RtlCopyMemory(Pseudo, Ip + 8, 32);
+        SegmentationPut32(Pseudo + 32, L4Length);
+        Pseudo[36] = Pseudo[37] = Pseudo[38] = 0;
+        Pseudo[39] = Protocol;
+        PseudoLength = SEGMENTATION_IPV6_HEADER;
+    }
+
+    if (Info->IsUdp)
+    {
+        SegmentationPut16(L4 + 4, L4Length);
+        ChecksumOffset = 6;
+    }
+    else
+    {
+        UCHAR Flags = Info->TcpFlags;
+
+        if (Index)
+        {
+            Flags &= ~SEGMENTATION_TCP_CWR;
+        }
+        if (Index + 1 < Info->Segments)
+        {
+            Flags &= ~(SEGMENTATION_TCP_FIN | SEGMENTATION_TCP_PSH);
+        }
+        SegmentationPut32(L4 + 4, Info->TcpSeq + Index * Info->SegmentSize);
+        L4[13] = Flags;
+        ChecksumOffset = 16;
+    }
+
+    // both the pseudo header and the L4 header have an even length,
+    // so the payload starts at an even position of the sum
+    L4[ChecksumOffset] = L4[ChecksumOffset + 1] = 0;
+    PayloadSum += SegmentationFold(RawCheckSumCalculator(Pseudo, PseudoLength));
+    PayloadSum += SegmentationFold(RawCheckSumCalculator(L4, L4HeaderLength));
+
+    USHORT Checksum = RawCheckSumFinalize(PayloadSum);
+    if (Info->IsUdp && !Checksum)
+    {
+        Checksum = 0xFFFF;
+    }
+    SegmentationPutChecksum(L4 + ChecksumOffset, Checksum);
+}
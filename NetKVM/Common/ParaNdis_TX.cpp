@@ -241,6 +241,15 @@ bool CNBL::ParseOffloads()
         {
             return false;
         }
+        if (m_LsoInfo.LsoV2Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE &&
+            m_LsoInfo.LsoV2Transmit.IPVersion == NDIS_TCP_LARGE_SEND_OFFLOAD_IPv6)
+        {
+            m_SoftwareSegmentation = m_Context->SoftwareSegmentation.bTSOv6;
+        }
+        else
+        {
+            m_SoftwareSegmentation = m_Context->SoftwareSegmentation.bTSOv4;
+        }
     }
     else if (IsUSO())
     {
@@ -248,6 +257,7 @@ bool CNBL::ParseOffloads()
         {
             return false;
         }
+        m_SoftwareSegmentation = m_Context->SoftwareSegmentation.bUSO;
     }
     else if (IsIP4CSO())
     {
@@ -349,6 +359,12 @@ CParaNdisTX::~CParaNdisTX()
     }
 
     FreeExtraPages();
+
+    if (m_SGListCacheMemory)
+    {
+        NdisFreeMemory(m_SGListCacheMemory, m_SGListCacheMemorySize, 0);
+        m_SGListCacheMemory = nullptr;
+    }
 }
 
 bool CParaNdisTX::Create(PPARANDIS_ADAPTER Context, UINT DeviceQueueIndex)
@@ -370,13 +386,23 @@ bool CParaNdisTX::Create(PPARANDIS_ADAPTER Context, UINT DeviceQueueIndex)
         return false;
     }
 
-    return m_VirtQueue.Create(DeviceQueueIndex,
-                              &m_Context->IODevice,
-                              m_Context->MiniportHandle,
-                              m_Context->maxFreeTxDescriptors,
-                              m_Context->nVirtioHeaderSize,
-                              m_Context) &&
-           m_SendQueue.Create(Context,
+    CreateSGListCache();
+
+    if (!m_VirtQueue.Create(DeviceQueueIndex,
+                            &m_Context->IODevice,
+                            m_Context->MiniportHandle,
+                            m_Context->maxFreeTxDescriptors,
+                            m_Context->nVirtioHeaderSize,
+                            m_Context))
+    {
+        return false;
+    }
+    m_VirtQueue.SetCoalescing(Context->uCoalescingMaxDelay);
+    // the DPC reclaims the used descriptors on each pass, the TX interrupt
+    // is needed only when the queue fills up while the DPC does not run
+    m_VirtQueue.SetDelayedRestart(Context->uTxReclaimBudget != 0);
+
+    return m_SendQueue.Create(Context,
                               IsPowerOfTwo(m_Context->maxFreeTxDescriptors) ? 8 * m_Context->maxFreeTxDescriptors
                                                                             : PARANDIS_TX_LOCK_FREE_QUEUE_DEFAULT_SIZE);
 }
@@ -487,7 +513,27 @@ void CParaNdisTX::Send(PNET_BUFFER_LIST NBL)
         }
     }
 
-    chain.ForEachDetached([](CNBL *nbl) { nbl->StartMapping(); });
+    // the NBLs mapped meanwhile are submitted together with one kick,
+    // at most uTxBatchNBLs of them
+    ULONG started = 0;
+    m_SendsStarting.AddRef();
+    chain.ForEachDetached([&](CNBL *nbl) {
+        nbl->StartMapping();
+        if (++started == m_Context->uTxBatchNBLs)
+        {
+            started = 0;
+            if (m_DpcWaiting == 0)
+            {
+                DoPendingTasks(false);
+            }
+        }
+    });
+    m_SendsStarting.Release();
+    // including the NBLs other CPUs have left for this Send
+    if (m_DpcWaiting == 0 && HaveMappedNBLs())
+    {
+        DoPendingTasks(false);
+    }
 }
 
 void CParaNdisTX::NBLMappingDone(CNBL *NBLHolder)
@@ -499,12 +545,18 @@ void CParaNdisTX::NBLMappingDone(CNBL *NBLHolder)
         UpdateTimestamp(m_AuditState.LastSendTime);
         m_SendQueue.Enqueue(NBLHolder);
 
+        // a Send still starting the mapping of its NBLs sends this one as well;
+        // the barrier orders the enqueue before the reads of the counters, as
+        // the interlocked decrement of m_SendsStarting does it on the Send side,
+        // so either the Send finds this NBL in the queue or we see the Send gone
+        KeMemoryBarrier();
         LONG isDpcThere = m_DpcWaiting;
-        NBLHolder->AddHistory(__FUNCTION__, "", "", NULL, "Skip processing", isDpcThere);
+        LONG isSendThere = m_SendsStarting;
+        NBLHolder->AddHistory(__FUNCTION__, "", "", NULL, "Skip processing", isDpcThere + isSendThere);
 
-        if (isDpcThere == 0)
+        if (isDpcThere == 0 && isSendThere == 0)
         {
-            DoPendingTasks(NBLHolder);
+            DoPendingTasks(false);
         }
     }
     else
@@ -562,6 +614,61 @@ bool CParaNdisTX::BorrowPages(CExtendedNBStorage *extraNBStorage, ULONG NeedPage
     return true;
 }
 
+// the cache is optional, the TX path works without it when it can't be allocated
+void CParaNdisTX::CreateSGListCache()
+{
+    ULONG count = m_Context->uTxSGListCacheSize;
+    ULONG size = ALIGN_UP_BY(m_Context->ulSGListSize, MEMORY_ALLOCATION_ALIGNMENT);
+    INT ringSize = 2;
+
+    if (!count || !size)
+    {
+        return;
+    }
+    // the ring holds one entry less than its size
+    while ((ULONG)ringSize <= count)
+    {
+        ringSize *= 2;
+    }
+    m_SGListCacheMemorySize = count * size;
+    m_SGListCacheMemory = ParaNdis_AllocateMemory(m_Context, m_SGListCacheMemorySize);
+    if (m_SGListCacheMemory == nullptr || !m_SGListCache.Create(m_Context, ringSize))
+    {
+        DPrintf(0, "[%s] failed to allocate %d SG lists of %d bytes\n", __FUNCTION__, count, size);
+        return;
+    }
+    for (ULONG i = 0; i < count; i++)
+    {
+        m_SGListCache.Enqueue((PSCATTER_GATHER_LIST)RtlOffsetToPointer(m_SGListCacheMemory, i * size));
+    }
+    m_SGListBufferSize = size;
+}
+
+PSCATTER_GATHER_LIST CParaNdisTX::AllocateSGListBuffer(ULONG &Size)
+{
+    PSCATTER_GATHER_LIST buffer;
+
+    if (!m_SGListBufferSize)
+    {
+        return nullptr;
+    }
+    buffer = m_SGListCache.DequeueMC();
+    if (buffer == nullptr)
+    {
+        InterlockedIncrement64(&m_SGListCacheMisses);
+        return nullptr;
+    }
+    InterlockedIncrement64(&m_SGListCacheHits);
+    Size = m_SGListBufferSize;
+    return buffer;
+}
+
+// the cache has room for all its buffers
+void CParaNdisTX::FreeSGListBuffer(PSCATTER_GATHER_LIST Buffer)
+{
+    m_SGListCache.Enqueue(Buffer);
+}
+
 void CParaNdisTX::ReturnPages(CExtendedNBStorage *extraNBStorage)
 {
     if (extraNBStorage)
@@ -872,8 +979,8 @@ bool CParaNdisTX::RestartQueue()
 }
 
 // called with TX lock held
-// returns queue restart status
-bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBLList &toWaitingList)
+// returns queue restart status, sets NeedKick when the queue shall be kicked
+bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBLList &toWaitingList, bool &NeedKick)
 {
     bool SentOutSomeBuffers = false;
     bool bRestartStatus = false;
@@ -922,6 +1029,7 @@ bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBLList &toWaitingList)
                         if (result == SubmitTxPacketResult::SUBMIT_SUCCESS)
                         {
                             SentOutSomeBuffers = true;
+                            m_KickedPackets++;
                         }
                         else
                         {
@@ -953,7 +1061,7 @@ bool CParaNdisTX::SendMapped(bool IsInterrupt, CRawCNBLList &toWaitingList)
 
     if (SentOutSomeBuffers || !HaveBuffers)
     {
-        m_VirtQueue.Kick();
+        NeedKick = true;
     }
 
     return bRestartStatus;
@@ -1013,17 +1121,17 @@ void CParaNdisTX::CheckStuckPackets(ULONG GraceTimeMillies)
     {
         DPrintf(0, "[%s] STUCK condition=%d detected TXQ#%d\n", __FUNCTION__, flags, m_queueIndex);
         m_AuditState.Stucks++;
-        DoPendingTasks(NULL);
+        DoPendingTasks(true);
         flags = IsStuck();
         DPrintf(0, "[%s] On recovery: condition=%d TXQ#%d\n", __FUNCTION__, flags, m_queueIndex);
         m_AuditState.Recovered += flags == 0;
     }
 }
 
-bool CParaNdisTX::DoPendingTasks(CNBL *nblHolder)
+bool CParaNdisTX::DoPendingTasks(bool bFromDpc)
 {
     bool bRestartQueueStatus = false;
-    bool bFromDpc = nblHolder == nullptr;
+    bool bKick = false;
     CRawCNBList nbToFree;
     CRawCNBLList completedNBLs;
 
@@ -1033,7 +1141,8 @@ bool CParaNdisTX::DoPendingTasks(CNBL *nblHolder)
     }
 
     DoWithTXLock([&]() {
-        m_VirtQueue.ProcessTXCompletions(nbToFree);
+        UINT budget = bFromDpc ? m_Context->uTxReclaimBudget : 0;
+        bool bLagging = ReclaimCompletions(nbToFree, budget);
 
         if (bFromDpc)
         {
@@ -1042,14 +1151,23 @@ bool CParaNdisTX::DoPendingTasks(CNBL *nblHolder)
 
         if (bFromDpc || 0 == (LONG)m_DpcWaiting)
         {
-            bRestartQueueStatus = SendMapped(bFromDpc, completedNBLs);
+            bRestartQueueStatus = SendMapped(bFromDpc, completedNBLs, bKick);
             if (bRestartQueueStatus)
             {
                 // we can enter here only when we called from DPC
                 // if we can't enable interrupts on queue right now,
                 // we can retrieve completed packets and try again
-                m_VirtQueue.ProcessTXCompletions(nbToFree);
-                bRestartQueueStatus = SendMapped(true, completedNBLs);
+                bLagging = ReclaimCompletions(nbToFree, budget);
+                bRestartQueueStatus = SendMapped(true, completedNBLs, bKick);
+            }
+            // the budget is exhausted, the DPC runs once more
+            // instead of waiting for the delayed interrupt
+            bRestartQueueStatus = bRestartQueueStatus || bLagging;
+            // one notification for everything submitted in this pass
+            if (bKick)
+            {
+                m_VirtQueue.Kick();
+                m_Kicks++;
             }
             UpdateTimestamp(m_AuditState.LastTxProcess);
         }
@@ -1065,6 +1183,33 @@ bool CParaNdisTX::DoPendingTasks(CNBL *nblHolder)
     return bRestartQueueStatus;
 }
 
+// called under TX lock, with a budget only from the DPC,
+// returns true when used descriptors may be left in the queue
+bool CParaNdisTX::ReclaimCompletions(CRawCNBList &nbToFree, UINT Budget)
+{
+    if (!Budget)
+    {
+        m_VirtQueue.ProcessTXCompletions(nbToFree);
+        return false;
+    }
+
+    ULONG inFlight = m_VirtQueue.GetDescriptorsInFlight();
+    UINT released = m_VirtQueue.ProcessTXCompletions(nbToFree, false, Budget);
+
+    m_ReclaimPasses++;
+    m_ReclaimedDescriptors += released;
+    if (inFlight > m_ReclaimMaxInFlight)
+    {
+        m_ReclaimMaxInFlight = inFlight;
+    }
+    if (released < Budget)
+    {
+        return false;
+    }
+    m_ReclaimLaggingPasses++;
+    return true;
+}
+
 void CNB::MappingDone(PSCATTER_GATHER_LIST SGL)
 {
     m_SGL = SGL;
@@ -1079,6 +1224,7 @@ CNB::~CNB()
     {
         NdisMFreeNetBufferSGList(m_Context->DmaHandle, m_SGL, m_NB);
     }
+    ReturnSGListBuffer();
     if (m_ExtraNBStorage)
     {
         // for unknown case it was not freed before
@@ -1093,14 +1239,34 @@ void CNB::ReleaseResources()
         NdisMFreeNetBufferSGList(m_Context->DmaHandle, m_SGL, m_NB);
         m_SGL = nullptr;
     }
+    ReturnSGListBuffer();
+}
+
+// NDIS does not use the buffer after NdisMFreeNetBufferSGList
+// or after a failed NdisMAllocateNetBufferSGList
+void CNB::ReturnSGListBuffer()
+{
+    if (m_SGListBuffer != nullptr)
+    {
+        m_ParentNBL->GetParentTXPath()->FreeSGListBuffer(m_SGListBuffer);
+        m_SGListBuffer = nullptr;
+    }
 }
 
 bool CNB::ScheduleBuildSGListForTx()
 {
+    ULONG BufferSize = 0;
+
     NETKVM_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
 
-    return NdisMAllocateNetBufferSGList(m_Context->DmaHandle, m_NB, this, NDIS_SG_LIST_WRITE_TO_DEVICE, nullptr, 0) ==
-           NDIS_STATUS_SUCCESS;
+    // without a buffer NDIS allocates one
+    m_SGListBuffer = m_ParentNBL->GetParentTXPath()->AllocateSGListBuffer(BufferSize);
+    return NdisMAllocateNetBufferSGList(m_Context->DmaHandle,
+                                        m_NB,
+                                        this,
+                                        NDIS_SG_LIST_WRITE_TO_DEVICE,
+                                        m_SGListBuffer,
+                                        BufferSize) == NDIS_STATUS_SUCCESS;
 }
 
 void CNB::PopulateIPLength(IPHeader *IpHeader, USHORT IpLength) const
@@ -1225,23 +1391,61 @@ void CNB::DoIPHdrCSO(PVOID IpHeader, ULONG EthPayloadLength) const
 
 NBMappingStatus CNB::FillDescriptorSGList(CTXDescriptor &Descriptor, ULONG ParsedHeadersLength)
 {
+    ULONG Offset = ParsedHeadersLength + NET_BUFFER_DATA_OFFSET(m_NB);
+    ULONG CopiedBytes = ParsedHeadersLength;
+    ULONG Pages;
+    NBMappingStatus res;
+
     if (!Descriptor.SetupHeaders(ParsedHeadersLength))
     {
         return NBMappingStatus::FAILURE;
     }
-    if (Descriptor.HasRoom(m_SGL->NumberOfElements))
+
+    // the pages of a previous attempt, the NB is bound again
+    // when the descriptor did not fit into the queue
+    ReturnPages();
+
+    if (Descriptor.HasRoom(CountDataElements(Offset)))
+    {
+        res = MapDataToVirtioSGL(Descriptor, Offset);
+    }
+    else if (Descriptor.HasRoom(CountCoalescedEntries(Offset, Pages)) && Pages && Pages <= MAX_PACKET_PAGES)
     {
-        return MapDataToVirtioSGL(Descriptor, ParsedHeadersLength + NET_BUFFER_DATA_OFFSET(m_NB));
+        res = CoalesceDataToVirtioSGL(Descriptor, ParsedHeadersLength, Pages, CopiedBytes);
+        if (res == NBMappingStatus::SUCCESS)
+        {
+            m_Context->extraStatistics.coalescedTxPackets++;
+        }
     }
     else
     {
-        auto res = AllocateAndFillCopySGL(ParsedHeadersLength);
-        if (res != NBMappingStatus::SUCCESS)
+        res = AllocateAndFillCopySGL(ParsedHeadersLength);
+        if (res == NBMappingStatus::SUCCESS)
         {
-            return res;
+            res = MapCopyDataToVirtioSGL(Descriptor);
         }
-        return MapCopyDataToVirtioSGL(Descriptor);
+        CopiedBytes = GetDataLength();
     }
+
+    if (res == NBMappingStatus::SUCCESS)
+    {
+        m_Context->extraStatistics.copiedTxBytes += CopiedBytes;
+        m_Context->extraStatistics.mappedTxBytes += GetDataLength() - CopiedBytes;
+    }
+    return res;
+}
+
+// the SG elements of the payload, the headers are in the headers area
+ULONG CNB::CountDataElements(ULONG Offset) const
+{
+    ULONG i = 0;
+
+    while (i < m_SGL->NumberOfElements && Offset >= m_SGL->Elements[i].Length)
+    {
+        Offset -= m_SGL->Elements[i].Length;
+        i++;
+    }
+    return m_SGL->NumberOfElements - i;
 }
 
 NBMappingStatus CNB::MapDataToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset) const
@@ -1385,6 +1589,157 @@ NBMappingStatus CNB::BindToDescriptor(CTXDescriptor &Descriptor)
     return FillDescriptorSGList(Descriptor, HeadersLength);
 }
 
+/*
+ * Software segmentation, for LSO and USO packets the device can not segment:
+ * the headers of each segment are built in the headers area of its own
+ * descriptor, its payload is mapped from the SG list of the NB and summed
+ * from the MDLs, so the payload is not copied.
+ */
+NBMappingStatus CNB::PrepareSegmentation(CTXDescriptor &Descriptor)
+{
+    auto &HeadersArea = Descriptor.HeadersAreaAccessor();
+    auto EthHeaders = static_cast<PUCHAR>(HeadersArea.EthHeadersAreaVA());
+    bool IsUdp = m_ParentNBL->IsUSO();
+    ULONG L4HeaderOffset = IsUdp ? m_ParentNBL->UsoHeaderOffset() : m_ParentNBL->TCPHeaderOffset();
+    ULONG SegmentSize = IsUdp ? m_ParentNBL->UsoMSS() : m_ParentNBL->MSS();
+    ULONG Available;
+
+    if (m_SGL == nullptr)
+    {
+        return NBMappingStatus::FAILURE;
+    }
+
+    if (!L4HeaderOffset)
+    {
+        // a short LSO packet without the offset and the MSS, sent as is
+        Available = Copy(EthHeaders, HeadersArea.MaxEthHeadersSize());
+        L4HeaderOffset = QueryL4HeaderOffset(EthHeaders, m_Context->Offload.ipHeaderOffset);
+    }
+    else
+    {
+        Available = Copy(EthHeaders, min(L4HeaderOffset + MAX_TCP_HEADER_SIZE, HeadersArea.MaxEthHeadersSize()));
+    }
+    if (!SegmentSize)
+    {
+        SegmentSize = GetDataLength();
+    }
+
+    m_NextSegment = 0;
+    m_SegmentsInFlight = 0;
+    if (!SegmentationPrepare(&m_Segmentation,
+                             EthHeaders,
+                             Available,
+                             m_Context->Offload.ipHeaderOffset,
+                             L4HeaderOffset,
+                             GetDataLength(),
+                             SegmentSize,
+                             IsUdp))
+    {
+        DPrintf(0, "[%s] ERROR: packet of %d bytes can not be segmented\n", __FUNCTION__, GetDataLength());
+        return NBMappingStatus::FAILURE;
+    }
+    return NBMappingStatus::SUCCESS;
+}
+
+NBMappingStatus CNB::BindSegmentToDescriptor(CTXDescriptor &Descriptor)
+{
+    ULONG HeadersLength = m_Segmentation.HeadersLength;
+    ULONG PayloadOffset = SegmentationPayloadOffset(&m_Segmentation, m_NextSegment);
+    ULONG PayloadLength = SegmentationPayloadLength(&m_Segmentation, m_NextSegment);
+    UINT_PTR PayloadSum = 0;
+
+    Descriptor.SetNB(this);
+
+    auto &HeadersArea = Descriptor.HeadersAreaAccessor();
+    auto EthHeaders = static_cast<PUCHAR>(HeadersArea.EthHeadersAreaVA());
+
+    if (Copy(EthHeaders, HeadersLength) != HeadersLength ||
+        !ChecksumFromMdlChain(PayloadSum, PayloadOffset, PayloadLength))
+    {
+        return NBMappingStatus::FAILURE;
+    }
+
+    SegmentationBuildHeaders(&m_Segmentation, EthHeaders, m_NextSegment, PayloadSum);
+    BuildPriorityHeader(HeadersArea.EthHeader(), HeadersArea.VlanHeader());
+    // the frame is complete, nothing is left to the device
+    *HeadersArea.VirtioHeader() = {};
+
+    if (!Descriptor.SetupHeaders(HeadersLength))
+    {
+        return NBMappingStatus::FAILURE;
+    }
+
+    auto res = MapSegmentToVirtioSGL(Descriptor, PayloadOffset + NET_BUFFER_DATA_OFFSET(m_NB), PayloadLength);
+    if (res == NBMappingStatus::SUCCESS)
+    {
+        m_Context->extraStatistics.copiedTxBytes += HeadersLength;
+        m_Context->extraStatistics.mappedTxBytes += PayloadLength;
+    }
+    return res;
+}
+
+NBMappingStatus CNB::MapSegmentToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset, ULONG Length) const
+{
+    for (ULONG i = 0; i < m_SGL->NumberOfElements && Length; i++)
+    {
+        if (Offset < m_SGL->Elements[i].Length)
+        {
+            PHYSICAL_ADDRESS PA;
+            ULONG Chunk = min(m_SGL->Elements[i].Length - Offset, Length);
+            PA.QuadPart = m_SGL->Elements[i].Address.QuadPart + Offset;
+
+            if (!Descriptor.AddDataChunk(PA, Chunk))
+            {
+                return NBMappingStatus::FAILURE;
+            }
+
+            Length -= Chunk;
+            Offset = 0;
+        }
+        else
+        {
+            Offset -= m_SGL->Elements[i].Length;
+        }
+    }
+
+    return Length ? NBMappingStatus::FAILURE : NBMappingStatus::SUCCESS;
+}
+
+// adds Length bytes of the NB at Offset to the sum, as SegmentationChecksumAdd does
+bool CNB::ChecksumFromMdlChain(UINT_PTR &Sum, ULONG Offset, ULONG Length) const
+{
+    PMDL Mdl = NET_BUFFER_CURRENT_MDL(m_NB);
+    ULONG MdlOffset = Offset + NET_BUFFER_CURRENT_MDL_OFFSET(m_NB);
+    ULONG Done = 0;
+
+    while (Mdl && MmGetMdlByteCount(Mdl) <= MdlOffset)
+    {
+        MdlOffset -= MmGetMdlByteCount(Mdl);
+        Mdl = Mdl->Next;
+    }
+
+    while (Mdl && Done < Length)
+    {
+        ULONG MdlLength;
+        PVOID MdlAddress = nullptr;
+
+        NdisQueryMdl(Mdl, &MdlAddress, &MdlLength, MM_PAGE_PRIORITY(LowPagePriority | MdlMappingNoExecute));
+
+        if (MdlAddress == nullptr)
+        {
+            return false;
+        }
+
+        ULONG Chunk = min(MdlLength - MdlOffset, Length - Done);
+        Sum = SegmentationChecksumAdd(Sum, RtlOffsetToPointer(MdlAddress, MdlOffset), Chunk, Done);
+        Done += Chunk;
+        MdlOffset = 0;
+        Mdl = Mdl->Next;
+    }
+
+    return Done == Length;
+}
+
 ULONG CNB::Copy(PVOID Dst, ULONG Length) const
 {
     ULONG CurrOffset = NET_BUFFER_CURRENT_MDL_OFFSET(m_NB);
@@ -1492,12 +1847,8 @@ void CNB::ReturnPages()
     m_ExtraNBStorage = nullptr;
 }
 
-NBMappingStatus CNB::AllocateAndFillCopySGL(ULONG ParsedHeadersLength)
+NBMappingStatus CNB::BorrowExtraPages(ULONG Pages)
 {
-    // Calculate the number of pages needed for data, excluding protocol header length.
-    ULONG DataLength = GetDataLength() - ParsedHeadersLength;
-    ULONG Pages = (DataLength + PAGE_SIZE - 1) / PAGE_SIZE;
-
     m_ExtraNBStorage = (CExtendedNBStorage *)ParaNdis_AllocateMemory(m_Context, sizeof(CExtendedNBStorage));
 
     if (m_ExtraNBStorage == nullptr)
@@ -1513,6 +1864,20 @@ NBMappingStatus CNB::AllocateAndFillCopySGL(ULONG ParsedHeadersLength)
         m_ExtraNBStorage = NULL;
         return NBMappingStatus::NO_RESOURCE;
     }
+    return NBMappingStatus::SUCCESS;
+}
+
+NBMappingStatus CNB::AllocateAndFillCopySGL(ULONG ParsedHeadersLength)
+{
+    // Calculate the number of pages needed for data, excluding protocol header length.
+    ULONG DataLength = GetDataLength() - ParsedHeadersLength;
+    ULONG Pages = (DataLength + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    auto res = BorrowExtraPages(Pages);
+    if (res != NBMappingStatus::SUCCESS)
+    {
+        return res;
+    }
 
     PMDL mdl = NET_BUFFER_CURRENT_MDL(m_NB);
     ULONG DataOffset = ParsedHeadersLength + NET_BUFFER_CURRENT_MDL_OFFSET(m_NB);
@@ -1533,6 +1898,149 @@ NBMappingStatus CNB::AllocateAndFillCopySGL(ULONG ParsedHeadersLength)
     return NBMappingStatus::SUCCESS;
 }
 
+/*
+ * The descriptor entries and the extra pages CoalesceDataToVirtioSGL needs:
+ * one entry per payload element of PARANDIS_TX_COALESCE_THRESHOLD bytes or more
+ * and one per run of shorter elements, a run is split where a page ends.
+ */
+ULONG CNB::CountCoalescedEntries(ULONG Offset, ULONG &Pages) const
+{
+    ULONG Entries = 0;
+    ULONG PageUsed = PAGE_SIZE;
+    bool InRun = false;
+
+    Pages = 0;
+    for (ULONG i = 0; i < m_SGL->NumberOfElements; i++)
+    {
+        ULONG Length = m_SGL->Elements[i].Length;
+
+        if (Offset >= Length)
+        {
+            Offset -= Length;
+            continue;
+        }
+        Length -= Offset;
+        Offset = 0;
+
+        if (Length >= PARANDIS_TX_COALESCE_THRESHOLD)
+        {
+            Entries++;
+            InRun = false;
+            continue;
+        }
+        while (Length)
+        {
+            if (PageUsed == PAGE_SIZE)
+            {
+                Pages++;
+                PageUsed = 0;
+                InRun = false;
+            }
+            if (!InRun)
+            {
+                Entries++;
+                InRun = true;
+            }
+            ULONG Chunk = min(Length, PAGE_SIZE - PageUsed);
+            PageUsed += Chunk;
+            Length -= Chunk;
+        }
+    }
+    return Entries;
+}
+
+/*
+ * Maps the long payload elements as MapDataToVirtioSGL does and copies the
+ * runs of short ones to bounce segments in the extra pages, in the layout
+ * CountCoalescedEntries has planned.
+ */
+NBMappingStatus CNB::CoalesceDataToVirtioSGL(CTXDescriptor &Descriptor,
+                                             ULONG ParsedHeadersLength,
+                                             ULONG Pages,
+                                             ULONG &CopiedBytes)
+{
+    ULONG Offset = ParsedHeadersLength + NET_BUFFER_DATA_OFFSET(m_NB);
+    PMDL Mdl = NET_BUFFER_CURRENT_MDL(m_NB);
+    ULONG MdlOffset = ParsedHeadersLength + NET_BUFFER_CURRENT_MDL_OFFSET(m_NB);
+    ULONG Page = 0;
+    ULONG PageUsed = PAGE_SIZE;
+    ULONG RunStart = 0;
+    bool InRun = false;
+
+    auto res = BorrowExtraPages(Pages);
+    if (res != NBMappingStatus::SUCCESS)
+    {
+        return res;
+    }
+
+    auto FlushRun = [&]() {
+        if (!InRun)
+        {
+            return true;
+        }
+        PHYSICAL_ADDRESS PA = m_ExtraNBStorage->m_UsedPages[Page - 1]->GetPA();
+        PA.QuadPart += RunStart;
+        InRun = false;
+        return Descriptor.AddDataChunk(PA, PageUsed - RunStart);
+    };
+
+    for (ULONG i = 0; i < m_SGL->NumberOfElements; i++)
+    {
+        ULONG Length = m_SGL->Elements[i].Length;
+
+        if (Offset >= Length)
+        {
+            Offset -= Length;
+            continue;
+        }
+        PHYSICAL_ADDRESS PA;
+        PA.QuadPart = m_SGL->Elements[i].Address.QuadPart + Offset;
+        Length -= Offset;
+        Offset = 0;
+
+        if (Length >= PARANDIS_TX_COALESCE_THRESHOLD)
+        {
+            if (!FlushRun() || !Descriptor.AddDataChunk(PA, Length))
+            {
+                return NBMappingStatus::FAILURE;
+            }
+            // CopyFromMdlChain skips the mapped data on the next copy
+            MdlOffset += Length;
+            continue;
+        }
+        while (Length)
+        {
+            if (PageUsed == PAGE_SIZE)
+            {
+                if (!FlushRun())
+                {
+                    return NBMappingStatus::FAILURE;
+                }
+                Page++;
+                PageUsed = 0;
+            }
+            if (!InRun)
+            {
+                RunStart = PageUsed;
+                InRun = true;
+            }
+            ULONG Chunk = min(Length, PAGE_SIZE - PageUsed);
+            PVOID Destination = RtlOffsetToPointer(m_ExtraNBStorage->m_UsedPages[Page - 1]->GetVA(), PageUsed);
+            ULONG Copied = CopyFromMdlChain(Destination, Chunk, Mdl, MdlOffset);
+            if (Copied != Chunk)
+            {
+                DPrintf(0, "[%s] copy failed! expected %lu, copied %lu bytes\n", __FUNCTION__, Chunk, Copied);
+                return NBMappingStatus::FAILURE;
+            }
+            PageUsed += Chunk;
+            Length -= Chunk;
+            CopiedBytes += Chunk;
+        }
+    }
+
+    return FlushRun() ? NBMappingStatus::SUCCESS : NBMappingStatus::FAILURE;
+}
+
 NBMappingStatus CNB::MapCopyDataToVirtioSGL(CTXDescriptor &Descriptor) const
 {
     for (ULONG i = 0; i < m_ExtraNBStorage->m_UsedPagesCount; i++)
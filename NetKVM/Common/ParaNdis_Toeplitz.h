@@ -0,0 +1,169 @@
+#pragma once
+
+/*
+ * Toeplitz hash of the software RSS: the key is expanded into one
+ * table of 256 partial hashes per byte position of the hashed input
+ * when the key is set, so the hash of a packet is one lookup per byte
+ * instead of one step per bit. On x64 CPUs with PCLMULQDQ each 4 bytes
+ * of input are hashed with one carry-less multiplication instead.
+ * It has no dependency on NDIS, so DebugTools/RSS-Toeplitz can build it
+ * on the host and compare it with the bit-by-bit implementation.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if defined(_WIN64) && !defined(_ARM64_)
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TOEPLITZ_CLMUL_TARGET
+#else
+#define TOEPLITZ_CLMUL_TARGET __attribute__((target("pclmul,sse2")))
+#endif
+#define PARANDIS_TOEPLITZ_CLMUL
+#endif
+
+// the longest hashed input: IPv6 source and destination addresses and ports
+#define TOEPLITZ_MAX_INPUT 36
+// the key of NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_2, hashes up to TOEPLITZ_MAX_INPUT bytes
+#define TOEPLITZ_KEY_SIZE  (TOEPLITZ_MAX_INPUT + 4)
+
+typedef struct _tagToeplitzTable
+{
+    // Bytes[p][b]: the hash of byte b at position p of the input
+    UINT32 Bytes[TOEPLITZ_MAX_INPUT][256];
+#ifdef PARANDIS_TOEPLITZ_CLMUL
+    // Windows[p]: the 64 key bits starting at byte p, in reverse order
+    UINT64 Windows[TOEPLITZ_MAX_INPUT];
+    bool UseClmul;
+#endif
+} tToeplitzTable;
+
+#ifdef PARANDIS_TOEPLITZ_CLMUL
+static __inline UINT64 ToeplitzReverse64(UINT64 val)
+{
+    val = ((val >> 1) & 0x5555555555555555ULL) | ((val & 0x5555555555555555ULL) << 1);
+    val = ((val >> 2) & 0x3333333333333333ULL) | ((val & 0x3333333333333333ULL) << 2);
+    val = ((val >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((val & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    val = ((val >> 8) & 0x00FF00FF00FF00FFULL) | ((val & 0x00FF00FF00FF00FFULL) << 8);
+    val = ((val >> 16) & 0x0000FFFF0000FFFFULL) | ((val & 0x0000FFFF0000FFFFULL) << 16);
+    return (val >> 32) | (val << 32);
+}
+
+static __inline bool ToeplitzClmulSupported()
+{
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 1);
+    return (regs[2] & (1 << 1)) != 0;
+#else
+    return __builtin_cpu_supports("pclmul");
+#endif
+}
+#endif
+
+// called when the key changes, Key is TOEPLITZ_KEY_SIZE bytes
+static __inline void ToeplitzBuildTable(tToeplitzTable *Table, const UCHAR *Key)
+{
+    // the key is followed by zeroes, so the windows of the last positions
+    // can be read as whole words, these bits are never used
+    UCHAR key[TOEPLITZ_KEY_SIZE + 8] = {};
+
+    RtlCopyMemory(key, Key, TOEPLITZ_KEY_SIZE);
+    for (ULONG pos = 0; pos < TOEPLITZ_MAX_INPUT; pos++)
+    {
+        UINT64 window = 0;
+        for (ULONG i = 0; i < 8; i++)
+        {
+            window = (window << 8) | key[pos + i];
+        }
+#ifdef PARANDIS_TOEPLITZ_CLMUL
+        Table->Windows[pos] = ToeplitzReverse64(window);
+#endif
+        // bit j (from the MSB) of the byte selects the 32 key bits starting at bit j
+        UINT32 *bytes = Table->Bytes[pos];
+        bytes[0] = 0;
+        for (ULONG j = 0; j < 8; j++)
+        {
+            bytes[0x80 >> j] = (UINT32)(window >> (32 - j));
+        }
+        for (ULONG b = 3; b < 256; b++)
+        {
+            if (b & (b - 1))
+            {
+                bytes[b] = bytes[b & (b - 1)] ^ bytes[b & (0 - b)];
+            }
+        }
+    }
+#ifdef PARANDIS_TOEPLITZ_CLMUL
+    Table->UseClmul = ToeplitzClmulSupported();
+#endif
+}
+
+// the hash of Len bytes at byte Position of the input, the hash of the
+// whole input is the XOR of the hashes of its parts
+static __inline UINT32 ToeplitzHashBytes(const tToeplitzTable *Table, const UCHAR *Data, ULONG Len, ULONG Position)
+{
+    UINT32 res = 0;
+    for (ULONG i = 0; i < Len; i++)
+    {
+        res ^= Table->Bytes[Position + i][Data[i]];
+    }
+    return res;
+}
+
+#ifdef PARANDIS_TOEPLITZ_CLMUL
+// the product of the reversed 64 key bits at the position and 32 input
+// bits has the reversed hash of these input bits in its bits 31..62
+TOEPLITZ_CLMUL_TARGET
+static __inline UINT32 ToeplitzHashClmul(const tToeplitzTable *Table, const UCHAR *Data, ULONG Len, ULONG Position)
+{
+    __m128i acc = _mm_setzero_si128();
+    ULONG i;
+
+    for (i = 0; i + 4 <= Len; i += 4)
+    {
+        UINT32 val = ((UINT32)Data[i] << 24) | ((UINT32)Data[i + 1] << 16) | ((UINT32)Data[i + 2] << 8) | Data[i + 3];
+        __m128i window = _mm_cvtsi64_si128((long long)Table->Windows[Position + i]);
+        acc = _mm_xor_si128(acc, _mm_clmulepi64_si128(window, _mm_cvtsi32_si128((int)val), 0x00));
+    }
+    UINT32 res = (UINT32)(ToeplitzReverse64((UINT64)_mm_cvtsi128_si64(acc) >> 31) >> 32);
+
+    return res ^ ToeplitzHashBytes(Table, Data + i, Len - i, Position + i);
+}
+#endif
+
+// Position + Len must not exceed TOEPLITZ_MAX_INPUT
+static __inline UINT32 ToeplitzHashChunk(const tToeplitzTable *Table, const UCHAR *Data, ULONG Len, ULONG Position)
+{
+#ifdef PARANDIS_TOEPLITZ_CLMUL
+    if (Table->UseClmul)
+    {
+        return ToeplitzHashClmul(Table, Data, Len, Position);
+    }
+#endif
+    return ToeplitzHashBytes(Table, Data, Len, Position);
+}
@@ -44,6 +44,38 @@ void CVirtQueue::Renew()
         DPrintf(0, "[%s] - queue setup failed for index %u with error %x\n", __FUNCTION__, m_Index, status);
         m_VirtQueue = nullptr;
     }
+    else
+    {
+        if (m_CoalescingDelay)
+        {
+            virtqueue_set_coalescing(m_VirtQueue, VIRTQUEUE_COALESCING_ADAPTIVE, m_CoalescingDelay, 0);
+        }
+        if (m_BusyPollBudget)
+        {
+            virtqueue_set_busy_poll(m_VirtQueue, m_BusyPollBudget, 0);
+        }
+    }
+}
+
+void CVirtQueue::SetCoalescing(ULONG MaxDelayUs)
+{
+    m_CoalescingDelay = MaxDelayUs;
+    if (m_VirtQueue != nullptr)
+    {
+        virtqueue_set_coalescing(m_VirtQueue,
+                                 MaxDelayUs ? VIRTQUEUE_COALESCING_ADAPTIVE : VIRTQUEUE_COALESCING_FIXED,
+                                 MaxDelayUs,
+                                 0);
+    }
+}
+
+void CVirtQueue::SetBusyPoll(ULONG BudgetUs)
+{
+    m_BusyPollBudget = BudgetUs;
+    if (m_VirtQueue != nullptr)
+    {
+        virtqueue_set_busy_poll(m_VirtQueue, BudgetUs, 0);
+    }
 }
 
 bool CVirtQueue::Create(UINT Index, VirtIODevice *IODevice, NDIS_HANDLE DrvHandle)
@@ -236,6 +268,11 @@ void CTXVirtQueue::UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor)
 
 SubmitTxPacketResult CTXVirtQueue::SubmitPacket(CNB &NB)
 {
+    if (NB.GetParentNBL()->IsSoftwareSegmentation())
+    {
+        return SubmitSegmentedPacket(NB);
+    }
+
     if (!m_Descriptors.GetCount())
     {
         KickQueueOnOverflow();
@@ -296,27 +333,104 @@ SubmitTxPacketResult CTXVirtQueue::SubmitPacket(CNB &NB)
     return res;
 }
 
+/*
+ * Each segment of the NB takes a descriptor. When the queue is full the
+ * segments submitted so far stay in it and the NB is submitted again
+ * later for the rest, it is completed with the last of its segments.
+ */
+SubmitTxPacketResult CTXVirtQueue::SubmitSegmentedPacket(CNB &NB)
+{
+    CTXDescriptor *LastDescriptor = nullptr;
+
+    if (!m_Descriptors.GetCount())
+    {
+        KickQueueOnOverflow();
+        return SubmitTxPacketResult::SUBMIT_NO_PLACE_IN_QUEUE;
+    }
+
+    if (!NB.IsSegmentationPrepared())
+    {
+        // the headers of the NB are parsed in the headers area of any descriptor
+        auto TXDescriptor = m_Descriptors.Pop();
+        auto status = NB.PrepareSegmentation(*TXDescriptor);
+        m_Descriptors.Push(TXDescriptor);
+        if (status != NBMappingStatus::SUCCESS)
+        {
+            NB.Report(0, false);
+            return SubmitTxPacketResult::SUBMIT_FAILURE;
+        }
+    }
+
+    while (NB.GetSegmentsLeft())
+    {
+        if (!m_Descriptors.GetCount())
+        {
+            KickQueueOnOverflow();
+            return SubmitTxPacketResult::SUBMIT_NO_PLACE_IN_QUEUE;
+        }
+
+        auto TXDescriptor = m_Descriptors.Pop();
+        auto res = SubmitTxPacketResult::SUBMIT_FAILURE;
+
+        if (NB.BindSegmentToDescriptor(*TXDescriptor) == NBMappingStatus::SUCCESS)
+        {
+            res = TXDescriptor->Enqueue(this, m_TotalHWBuffers, m_FreeHWBuffers);
+        }
+        if (res == SubmitTxPacketResult::SUBMIT_NO_PLACE_IN_QUEUE)
+        {
+            m_Descriptors.Push(TXDescriptor);
+            KickQueueOnOverflow();
+            return res;
+        }
+        if (res != SubmitTxPacketResult::SUBMIT_SUCCESS)
+        {
+            m_Descriptors.Push(TXDescriptor);
+            NB.DropSegmentsLeft();
+            NB.Report(0, false);
+            // the segments in the queue complete the NB
+            return NB.HasSegmentsInFlight() ? SubmitTxPacketResult::SUBMIT_SUCCESS : res;
+        }
+
+        m_FreeHWBuffers -= TXDescriptor->GetUsedBuffersNum();
+        m_DescriptorsInUse.PushBack(TXDescriptor);
+        NB.SegmentSubmitted();
+        m_Context->extraStatistics.softwareSegments++;
+        LastDescriptor = TXDescriptor;
+    }
+
+    // the headers of the last segment are still in its descriptor
+    m_Context->extraStatistics.framesSoftwareSegmented++;
+    UpdateTXStats(NB, *LastDescriptor);
+    NB.Report(1, true);
+    return SubmitTxPacketResult::SUBMIT_SUCCESS;
+}
+
 void CTXVirtQueue::ReleaseOneBuffer(CTXDescriptor *TXDescriptor, CRawCNBList &listDone)
 {
+    auto NB = TXDescriptor->GetNB();
+
     if (!TXDescriptor->GetUsedBuffersNum())
     {
         DPrintf(0, "[%s] ERROR: nofUsedBuffers not set!\n", __FUNCTION__);
     }
-    TXDescriptor->GetNB()->ReturnPages();
+    NB->ReturnPages();
     m_FreeHWBuffers += TXDescriptor->GetUsedBuffersNum();
-    listDone.PushBack(TXDescriptor->GetNB());
+    if (NB->SegmentCompleted())
+    {
+        listDone.PushBack(NB);
+    }
     m_Descriptors.Push(TXDescriptor);
     DPrintf(3, "[%s] Free Tx: desc %d, buff %d\n", __FUNCTION__, m_Descriptors.GetCount(), m_FreeHWBuffers);
 }
 
-UINT CTXVirtQueue::ReleaseTransmitBuffers(CRawCNBList &listDone)
+UINT CTXVirtQueue::ReleaseTransmitBuffers(CRawCNBList &listDone, UINT Budget)
 {
     UINT len, i = 0;
     CTXDescriptor *TXDescriptor;
 
     DEBUG_ENTRY(4);
 
-    while (NULL != (TXDescriptor = (CTXDescriptor *)GetBuf(&len)))
+    while ((!Budget || i < Budget) && NULL != (TXDescriptor = (CTXDescriptor *)GetBuf(&len)))
     {
         m_DescriptorsInUse.Remove(TXDescriptor);
         ReleaseOneBuffer(TXDescriptor, listDone);
@@ -332,13 +446,15 @@ UINT CTXVirtQueue::ReleaseTransmitBuffers(CRawCNBList &listDone)
 }
 
 // TODO: Needs review
-void CTXVirtQueue::ProcessTXCompletions(CRawCNBList &listDone, bool bKill)
+UINT CTXVirtQueue::ProcessTXCompletions(CRawCNBList &listDone, bool bKill, UINT Budget)
 {
+    UINT nReleased = 0;
+
     if (m_Descriptors.GetCount() < m_TotalDescriptors)
     {
         if (!bKill && !m_Killed)
         {
-            ReleaseTransmitBuffers(listDone);
+            nReleased = ReleaseTransmitBuffers(listDone, Budget);
         }
         else
         {
@@ -350,6 +466,7 @@ void CTXVirtQueue::ProcessTXCompletions(CRawCNBList &listDone, bool bKill)
             });
         }
     }
+    return nReleased;
 }
 
 void CTXVirtQueue::Shutdown()
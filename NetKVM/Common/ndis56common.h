@@ -149,19 +149,13 @@ typedef struct _tagRxNetDescriptor RxNetDescriptor, *pRxNetDescriptor;
 
 static __inline BOOLEAN ParaNDIS_IsQueueInterruptEnabled(struct virtqueue *_vq);
 
+#include "ParaNdis_LockFreeQueue.h"
+
 struct PARANDIS_RECEIVE_QUEUE
 {
-    PARANDIS_RECEIVE_QUEUE()
-    {
-        InitializeListHead(&BuffersList);
-        NdisAllocateSpinLock(&Lock);
-    }
-    ~PARANDIS_RECEIVE_QUEUE()
-    {
-        NdisFreeSpinLock(&Lock);
-    }
-    NDIS_SPIN_LOCK Lock;
-    LIST_ENTRY BuffersList;
+    // ReceiveQueueListEntry of the packets classified to the queue,
+    // the RX paths publish them without taking a lock
+    CLockFreeListEntryQueue Buffers;
     COwnership Ownership;
 };
 typedef PARANDIS_RECEIVE_QUEUE *PPARANDIS_RECEIVE_QUEUE;
@@ -389,6 +383,8 @@ typedef struct _tagLinkProperties
 #define MAX_HW_RX_PACKET_SIZE (MAX_IP4_DATAGRAM_SIZE + ETH_HEADER_SIZE + ETH_PRIORITY_HEADER_SIZE)
 #define MAX_OS_RX_PACKET_SIZE (MAX_IP4_DATAGRAM_SIZE + ETH_HEADER_SIZE)
 
+#include "ParaNdis_MulticastFilter.h"
+
 typedef struct _tagMulticastData
 {
     ULONG nofMulticastEntries;
@@ -448,6 +444,18 @@ struct _tagRxNetDescriptor
     ULONG BufferSGLength;
     tCompletePhysicalAddress IndirectArea;
     tPacketHolderType Holder;
+    // mergeable buffers only: the holder of the whole block, used when the
+    // buffer continues a packet, and the next buffer of the same packet
+    tPacketHolderType MergedHolder;
+    pRxNetDescriptor MergedNext;
+    // software RSC: the next segment coalesced into the packet and the MDL
+    // of its TCP payload; the first segment keeps the original linkage of
+    // its holder, the coalesced payload length and the number of segments
+    pRxNetDescriptor CoalescedNext;
+    PMDL CoalescedMdl;
+    PMDL HolderLinkage;
+    ULONG CoalescedLength;
+    USHORT CoalescedSegments;
 
     NET_PACKET_INFO PacketInfo;
 
@@ -504,11 +512,26 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
     BOOLEAN bMultiQueue = false;
     BOOLEAN bPollModeTry = false;
     BOOLEAN bPollModeEnabled = false;
+    // notification coalescing of the device, see ParaNdis_UpdateNotificationCoalescing
+    BOOLEAN bNotifyCoalescingSupported = false;
+    BOOLEAN bInterruptModeration = false;
+    BOOLEAN bAdaptiveCoalescing = false;
+    struct
+    {
+        ULONG RxMaxPackets;
+        ULONG RxUsecs;
+        ULONG TxMaxPackets;
+        ULONG TxUsecs;
+    } NotifyCoalescing = {};
     USHORT nHardwareQueues = false;
     ULONG ulCurrentVlansFilterSet = false;
     tMulticastData MulticastData = {};
+    tMulticastFilter MulticastFilter = {};
     UINT uNumberOfHandledRXPacketsInDPC = 0;
     UINT MinRxBufferPercent;
+    ULONG uCoalescingMaxDelay = 0;
+    ULONG uBusyPollBudget = 0;
+    ULONG uRxRefillWatermark = 0;
     LONG counterDPCInside = 0;
     ULONG ulPriorityVlanSetting = 0;
     ULONG VlanId = 0;
@@ -539,15 +562,24 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
         ULONG framesRxPriority;
         ULONG framesRxCSHwOK;
         ULONG framesFilteredOut;
+        ULONG framesRxMerged;
         ULONG framesCoalescedHost;
         ULONG framesCoalescedWindows;
+        ULONG framesCoalescedDriver;
         ULONG framesRSSHits;
         ULONG framesRSSMisses;
         ULONG framesRSSUnclassified;
         ULONG framesRSSError;
+        ULONG framesRSSHashDevice;
+        ULONG framesRSSHashDriver;
         ULONG minFreeTxBuffers;
         ULONG droppedTxPackets;
         ULONG copiedTxPackets;
+        ULONG coalescedTxPackets;
+        ULONG framesSoftwareSegmented;
+        ULONGLONG softwareSegments;
+        ULONGLONG copiedTxBytes;
+        ULONGLONG mappedTxBytes;
         ULONG minFreeRxBuffers;
         ULONG allocatedSharedMemory;
         LARGE_INTEGER totalRxIndicates;
@@ -587,6 +619,14 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
 
     PIO_INTERRUPT_MESSAGE_INFO pMSIXInfoTable = NULL;
     NDIS_HANDLE DmaHandle = NULL;
+    // the size NDIS needs for the SG list of a NET_BUFFER
+    ULONG ulSGListSize = 0;
+    // SG lists kept by each TX path for NdisMAllocateNetBufferSGList
+    ULONG uTxSGListCacheSize = 0;
+    // NBLs of a Send call mapped before they are submitted together
+    ULONG uTxBatchNBLs = 1;
+    // used TX descriptors reclaimed by one DPC pass, 0 - all of them
+    ULONG uTxReclaimBudget = 0;
     ULONG ulIrqReceived = 0;
     NDIS_OFFLOAD ReportedOffloadCapabilities = {};
     NDIS_OFFLOAD ReportedOffloadConfiguration = {};
@@ -598,6 +638,15 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
     BOOLEAN bHashReportedByDevice = false;
     CSystemThread systemThread;
 
+    // LSO and USO without the support of the device, the TX path segments the packets
+    struct
+    {
+        BOOLEAN bEnabled;
+        BOOLEAN bTSOv4;
+        BOOLEAN bTSOv6;
+        BOOLEAN bUSO;
+    } SoftwareSegmentation = {};
+
 #if PARANDIS_SUPPORT_RSS
     BOOLEAN bRSSOffloadSupported = false;
     NDIS_RECEIVE_SCALE_CAPABILITIES RSSCapabilities = {};
@@ -624,6 +673,11 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
         BOOLEAN bIPv6Enabled;
         BOOLEAN bQemuSupported;
         BOOLEAN bHasDynamicConfig;
+        // no guest TSO on the device, the segments are coalesced by the driver
+        BOOLEAN bIPv4Software;
+        BOOLEAN bIPv6Software;
+        // software coalescing: the maximal number of segments in a packet
+        ULONG uSoftwareMaxSegments;
         struct
         {
             LARGE_INTEGER CoalescedPkts;
@@ -704,6 +758,13 @@ VOID ParaNdis_PowerOff(PARANDIS_ADAPTER *pContext);
 
 void ParaNdis_DeviceConfigureRSC(PARANDIS_ADAPTER *pContext);
 
+VOID ParaNdis_UpdateNotificationCoalescing(PARANDIS_ADAPTER *pContext);
+
+BOOLEAN ParaNdis_SetQueueNotificationCoalescing(PARANDIS_ADAPTER *pContext,
+                                                UINT QueueIndex,
+                                                ULONG MaxPackets,
+                                                ULONG Usecs);
+
 void ParaNdis_ResetOffloadSettings(PARANDIS_ADAPTER *pContext, tOffloadSettingsFlags *pDest, PULONG from);
 
 tChecksumCheckResult ParaNdis_CheckRxChecksum(PARANDIS_ADAPTER *pContext,
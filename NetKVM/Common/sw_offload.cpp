@@ -27,6 +27,7 @@
  * SUCH DAMAGE.
  */
 #include "ndis56common.h"
+#include "ParaNdis_Checksum.h"
 #include "kdebugprint.h"
 #include "Trace.h"
 #ifdef NETKVM_WPP_ENABLED
@@ -114,59 +115,6 @@ typedef struct _tagIP6_TYPE2_ROUTING_HEADER
 
 #define IP6_EXT_HDR_GRANULARITY         (8)
 
-static UINT_PTR RawCheckSumCalculator(PVOID buffer, ULONG len)
-{
-    UINT_PTR val = 0;
-    PUCHAR ptr = (PUCHAR)buffer;
-#if defined(_WIN64) && !defined(_ARM64_)
-    ULONG count = len >> 2;
-    while (count--)
-    {
-        val += *(PUINT32)ptr;
-        ptr += 4;
-    }
-    if (len & 2)
-    {
-        val += *(PUINT16)ptr;
-        ptr += 2;
-    }
-#elif defined(_ARM64_)
-    ULONG count = len >> 1;
-    while (count--)
-    {
-        val += ptr[0];
-        val += ptr[1] << 8;
-        ptr += 2;
-    }
-#else
-    ULONG count = len >> 1;
-    while (count--)
-    {
-        val += *(PUINT16)ptr;
-        ptr += 2;
-    }
-#endif
-    if (len & 1)
-    {
-        val += *ptr;
-    }
-    return val;
-}
-
-static __inline USHORT RawCheckSumFinalize(UINT_PTR sum)
-{
-    UINT32 sum32;
-    UINT16 sum16;
-
-#ifdef _WIN64
-    sum32 = (((sum >> 32) | (sum << 32)) + sum) >> 32;
-#else
-    sum32 = sum;
-#endif
-    sum16 = (((sum32 >> 16) | (sum32 << 16)) + sum32) >> 16;
-    return ~sum16;
-}
-
 static __inline USHORT CheckSumCalculatorFlat(PVOID buffer, ULONG len)
 {
     return RawCheckSumFinalize(RawCheckSumCalculator(buffer, len));
@@ -59,6 +59,10 @@
 
 #define VIRTIO_NET_F_GUEST_RSC4_DONT_USE	41	/* reserved */
 #define VIRTIO_NET_F_GUEST_RSC6_DONT_USE	42	/* reserved */
+#define VIRTIO_NET_F_VQ_NOTF_COAL 52	/* Device supports virtqueue
+					 * notification coalescing */
+#define VIRTIO_NET_F_NOTF_COAL	53	/* Device supports notifications
+					 * coalescing */
 #define VIRTIO_NET_F_HOST_USO               56  /* Host can handle USO in. */
 #define VIRTIO_NET_F_HASH_REPORT  57
 #define VIRTIO_NET_F_RSS    	  60
@@ -327,6 +331,32 @@ struct virtio_net_rss_config {
 #define VIRTIO_NET_CTRL_GUEST_OFFLOADS    5
  #define VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET        0
 
+/*
+* Control notifications coalescing
+*
+* The TX_SET and RX_SET commands set the parameters of all the
+* transmit or receive virtqueues, they are available with the
+* VIRTIO_NET_F_NOTF_COAL feature bit. The VQ_SET command sets the
+* parameters of one virtqueue, it is available with the
+* VIRTIO_NET_F_VQ_NOTF_COAL feature bit.
+*/
+#define VIRTIO_NET_CTRL_NOTF_COAL    6
+ #define VIRTIO_NET_CTRL_NOTF_COAL_TX_SET          0
+ #define VIRTIO_NET_CTRL_NOTF_COAL_RX_SET          1
+ #define VIRTIO_NET_CTRL_NOTF_COAL_VQ_SET          2
+ #define VIRTIO_NET_CTRL_NOTF_COAL_VQ_GET          3
+
+struct virtio_net_ctrl_coal {
+    __virtio32 max_packets;
+    __virtio32 max_usecs;
+};
+
+struct virtio_net_ctrl_coal_vq {
+    __virtio16 vqn;
+    __virtio16 reserved;
+    struct virtio_net_ctrl_coal coal;
+};
+
 #include <poppack.h>
 
 #endif /* _LINUX_VIRTIO_NET_H */
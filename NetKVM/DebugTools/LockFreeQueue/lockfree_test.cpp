@@ -0,0 +1,445 @@
+/*
+ * Host (Linux) stress test and benchmark of ParaNdis_LockFreeQueue.h:
+ * several producer threads enqueue numbered entries one by one and in
+ * batches, the way the TX paths queue NBLs and the RX paths publish
+ * packets to the receive queues, while consumer threads dequeue them one
+ * by one and in batches. Every entry must be dequeued once and the entries
+ * of each producer in the order it enqueued them, also when the ring of
+ * the receive queue overflows.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <sched.h>
+#include <atomic>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+// the few Windows definitions ParaNdis_LockFreeQueue.h depends on
+typedef int LONG, INT;
+typedef unsigned int ULONG;
+typedef unsigned char BOOLEAN;
+typedef struct _PARANDIS_ADAPTER *PPARANDIS_ADAPTER;
+#define TRUE  1
+#define FALSE 0
+
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+static inline void InitializeListHead(PLIST_ENTRY head)
+{
+    head->Flink = head->Blink = head;
+}
+
+static inline void InsertTailList(PLIST_ENTRY head, PLIST_ENTRY entry)
+{
+    entry->Flink = head;
+    entry->Blink = head->Blink;
+    head->Blink->Flink = entry;
+    head->Blink = entry;
+}
+
+static inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY head)
+{
+    PLIST_ENTRY entry = head->Flink;
+    head->Flink = entry->Flink;
+    entry->Flink->Blink = head;
+    return entry;
+}
+
+static inline BOOLEAN IsPowerOfTwo(ULONG n)
+{
+    return ((n != 0) && ((n & (~n + 1)) == n));
+}
+
+#define InterlockedCompareExchange(p, exchange, comparand) __sync_val_compare_and_swap((p), (comparand), (exchange))
+#define InterlockedIncrement(p)                            __sync_add_and_fetch((p), 1)
+#define InterlockedDecrement(p)                            __sync_sub_and_fetch((p), 1)
+#define InterlockedExchangeAdd(p, v)                       __sync_fetch_and_add((p), (v))
+#define InterlockedExchange(p, v)                          __sync_lock_test_and_set((p), (v))
+#define KeMemoryBarrier()                                  __sync_synchronize()
+// unlike the driver at DISPATCH_LEVEL, a thread of the test can be preempted
+// between reserving its slots and publishing them, so the backoff of the
+// others gives up the CPU instead of spinning on it
+#define YieldProcessor()                                   sched_yield()
+typedef unsigned char UCHAR;
+#define ParaNdis_AllocateMemory(context, size)             malloc(size)
+#define NdisFreeMemory(p, l, f)                            free(p)
+
+class CPlacementAllocatable
+{
+};
+class CRawAccess;
+class CNonCountingObject;
+template <typename TEntryType, typename TAccessStrategy, typename TCountingStrategy> class CNdisList;
+
+class CNdisSpinLock
+{
+  public:
+    void Lock()
+    {
+        m_Mutex.lock();
+    }
+    void Unlock()
+    {
+        m_Mutex.unlock();
+    }
+
+  private:
+    mutex m_Mutex;
+};
+
+class TPassiveSpinLocker
+{
+  public:
+    TPassiveSpinLocker(CNdisSpinLock &lock) : m_Lock(lock)
+    {
+        m_Lock.Lock();
+    }
+    ~TPassiveSpinLocker()
+    {
+        m_Lock.Unlock();
+    }
+
+  private:
+    CNdisSpinLock &m_Lock;
+};
+
+#include "../../Common/ParaNdis_LockFreeQueue.h"
+
+struct Entry
+{
+    LIST_ENTRY link;
+    ULONG producer;
+    ULONG seq;
+};
+
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static atomic<unsigned long> failures;
+
+// the queues under test with the same interface: Enqueue publishes all the
+// entries or none, Dequeue returns up to count entries
+
+// the receive queue: never full, single or multiple consumers
+class CListEntryQueue
+{
+  public:
+    bool Create(ULONG size)
+    {
+        return !size || m_Queue.Create(nullptr, size);
+    }
+    bool Enqueue(Entry **entries, LONG count)
+    {
+        PLIST_ENTRY links[32];
+        for (LONG i = 0; i < count; i++)
+        {
+            links[i] = &entries[i]->link;
+        }
+        if (count == 1)
+        {
+            m_Queue.Enqueue(links[0]);
+        }
+        else
+        {
+            m_Queue.EnqueueBatch(links, count);
+        }
+        return true;
+    }
+    LONG Dequeue(Entry **entries, LONG count)
+    {
+        PLIST_ENTRY links[32];
+        if (count == 1)
+        {
+            links[0] = m_Queue.Dequeue();
+            count = links[0] ? 1 : 0;
+        }
+        else
+        {
+            count = m_Queue.DequeueBatch(links, count);
+        }
+        for (LONG i = 0; i < count; i++)
+        {
+            entries[i] = (Entry *)((char *)links[i] - offsetof(Entry, link));
+        }
+        return count;
+    }
+    bool IsEmpty()
+    {
+        return m_Queue.IsEmpty();
+    }
+
+  private:
+    CLockFreeListEntryQueue m_Queue;
+};
+
+// the ring itself: the producers retry while it is full, a single
+// consumer uses Dequeue/DequeueBatch, several ones DequeueMC/DequeueBatchMC
+template <bool MultiConsumer> class CRingQueue
+{
+  public:
+    bool Create(ULONG size)
+    {
+        return m_Queue.Create(nullptr, size);
+    }
+    bool Enqueue(Entry **entries, LONG count)
+    {
+        return count == 1 ? m_Queue.Enqueue(entries[0]) : m_Queue.EnqueueBatch(entries, count);
+    }
+    LONG Dequeue(Entry **entries, LONG count)
+    {
+        if (count == 1)
+        {
+            entries[0] = MultiConsumer ? m_Queue.DequeueMC() : m_Queue.Dequeue();
+            return entries[0] ? 1 : 0;
+        }
+        return MultiConsumer ? m_Queue.DequeueBatchMC(entries, count) : m_Queue.DequeueBatch(entries, count);
+    }
+    bool IsEmpty()
+    {
+        return m_Queue.IsEmpty();
+    }
+
+  private:
+    CLockFreeQueue<Entry> m_Queue;
+};
+
+struct Job
+{
+    const char *name;
+    ULONG ringSize;  // 0 for a receive queue without ring
+    ULONG producers;
+    ULONG consumers;
+    ULONG maxBatch;  // 1 for one entry at a time
+};
+
+// each consumer checks the order of the entries it sees, with one
+// consumer it sees all the entries of each producer
+template <typename TQueue> static bool RunJob(const Job &job, ULONG perProducer, double &seconds)
+{
+    TQueue queue;
+    vector<Entry> entries((size_t)job.producers * perProducer);
+    vector<atomic<unsigned char>> seen(entries.size());
+    atomic<ULONG> producersLeft(job.producers);
+    atomic<unsigned long> dequeued(0);
+    vector<thread> threads;
+    unsigned long failuresBefore = failures;
+
+    if (!queue.Create(job.ringSize))
+    {
+        cerr << job.name << ": FAILED to create the ring" << endl;
+        failures++;
+        return false;
+    }
+    for (auto &s : seen)
+    {
+        s = 0;
+    }
+
+    auto start = chrono::steady_clock::now();
+    for (ULONG p = 0; p < job.producers; p++)
+    {
+        threads.emplace_back([&, p]() {
+            mt19937 rng(p);
+            Entry *batch[32];
+            ULONG seq = 0;
+
+            while (seq < perProducer)
+            {
+                LONG count = job.maxBatch > 1 ? 1 + rng() % job.maxBatch : 1;
+                count = min(count, (LONG)(perProducer - seq));
+                for (LONG i = 0; i < count; i++)
+                {
+                    Entry &e = entries[(size_t)p * perProducer + seq + i];
+                    e.producer = p;
+                    e.seq = seq + i;
+                    batch[i] = &e;
+                }
+                while (!queue.Enqueue(batch, count))
+                {
+                    this_thread::yield();
+                }
+                seq += count;
+            }
+            producersLeft--;
+        });
+    }
+    for (ULONG c = 0; c < job.consumers; c++)
+    {
+        threads.emplace_back([&, c]() {
+            mt19937 rng(1000 + c);
+            vector<long> last(job.producers, -1);
+            Entry *batch[32];
+            for (;;)
+            {
+                // read before the queue is found empty for the last time
+                bool done = producersLeft == 0;
+                LONG count = queue.Dequeue(batch, job.maxBatch > 1 ? 1 + rng() % job.maxBatch : 1);
+                if (count == 0)
+                {
+                    if (done)
+                    {
+                        break;
+                    }
+                    this_thread::yield();
+                    continue;
+                }
+                for (LONG i = 0; i < count; i++)
+                {
+                    Entry *e = batch[i];
+                    size_t index = e - entries.data();
+                    if (index >= entries.size() || seen[index]++)
+                    {
+                        cerr << job.name << ": FAILED, entry " << index << " dequeued twice" << endl;
+                        failures++;
+                        continue;
+                    }
+                    if ((long)e->seq <= last[e->producer] ||
+                        (job.consumers == 1 && (long)e->seq != last[e->producer] + 1))
+                    {
+                        cerr << job.name << ": FAILED, producer " << e->producer << " entry " << e->seq << " after "
+                             << last[e->producer] << endl;
+                        failures++;
+                    }
+                    last[e->producer] = e->seq;
+                }
+                dequeued += count;
+            }
+        });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    seconds = elapsed.count();
+
+    if (dequeued != entries.size() || !queue.IsEmpty())
+    {
+        cerr << job.name << ": FAILED, " << dequeued << " of " << entries.size() << " entries dequeued" << endl;
+        failures++;
+    }
+    return failures == failuresBefore;
+}
+
+template <typename TQueue> static double BestRate(const Job &job, ULONG perProducer, ULONG rounds)
+{
+    double best = 0;
+    for (ULONG i = 0; i < rounds; i++)
+    {
+        double seconds;
+        if (RunJob<TQueue>(job, perProducer, seconds))
+        {
+            best = max(best, job.producers * (double)perProducer / seconds / 1e6);
+        }
+    }
+    return best;
+}
+
+template <typename TQueue>
+static void RunJobs(const char *what, const Job *jobs, size_t n, ULONG perProducer, ULONG rounds)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        const Job &job = jobs[i];
+        double rate = BestRate<TQueue>(job, perProducer, rounds);
+        cout << setw(14) << what << setw(10) << job.name << ": " << setw(2) << job.producers << " producers, "
+             << job.consumers << " consumers, " << fixed << setprecision(1) << rate << " M entries/s" << endl;
+    }
+}
+
+static const Job listJobs[] = {
+    {"single", 1024, 1, 1, 1},
+    {"batches", 1024, 4, 1, 32},
+    {"overflow", 16, 4, 1, 32},
+    {"no ring", 0, 4, 1, 8},
+    {"consumers", 64, 4, 3, 16},
+};
+
+static const Job ringJobs[] = {
+    {"single", 1024, 1, 1, 1},
+    {"batches", 1024, 8, 1, 32},
+    {"full", 16, 8, 1, 8},
+};
+
+static const Job ringMCJobs[] = {
+    {"single", 1024, 4, 4, 1},
+    {"batches", 1024, 8, 4, 32},
+    {"full", 16, 8, 4, 8},
+};
+
+// many producers and one consumer as on the TX path, with and without batches
+static void Benchmark(ULONG perProducer)
+{
+    ULONG cpus = max(2U, thread::hardware_concurrency());
+
+    cout << "producers  Mentries/s batch 1  batch 8  batch 32" << endl;
+    for (ULONG producers = 1; producers < 2 * cpus; producers *= 2)
+    {
+        cout << setw(9) << producers;
+        for (ULONG batch : {1U, 8U, 32U})
+        {
+            Job job = {"bench", 4096, producers, 1, batch};
+            cout << fixed << setprecision(1) << setw(batch == 1 ? 18 : 9)
+                 << BestRate<CRingQueue<false>>(job, perProducer / producers, 3);
+        }
+        cout << endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ULONG perProducer = argc > 1 ? strtoul(argv[1], NULL, 0) : 200000;
+    ULONG rounds = argc > 2 ? strtoul(argv[2], NULL, 0) : 3;
+    bool benchmark = argc > 3 && !strcmp(argv[3], "bench");
+
+    RunJobs<CListEntryQueue>("receive queue", listJobs, ARRAYSIZE(listJobs), perProducer, rounds);
+    RunJobs<CRingQueue<false>>("ring", ringJobs, ARRAYSIZE(ringJobs), perProducer, rounds);
+    RunJobs<CRingQueue<true>>("ring MC", ringMCJobs, ARRAYSIZE(ringMCJobs), perProducer, rounds);
+    if (failures)
+    {
+        cout << "FAILED: " << failures << " errors" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    if (benchmark)
+    {
+        Benchmark(perProducer * 8);
+    }
+    return 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * Host (Linux) test of ParaNdis_MulticastFilter.h: the hash table lookup
+ * is compared with the linear search of the multicast list that it
+ * replaces in ShallPassPacket, then both are timed.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+using namespace std;
+
+// the few Windows definitions ParaNdis_MulticastFilter.h depends on
+typedef unsigned char UCHAR;
+typedef unsigned short USHORT;
+typedef unsigned int ULONG;
+#define UNALIGNED
+#define ETH_ALEN                      6
+#define RtlZeroMemory(d, l)           memset((d), 0, (l))
+#define RtlCopyMemory(d, s, l)        memcpy((d), (s), (l))
+// the driver's value unless the Makefile overrides it
+#ifndef PARANDIS_MULTICAST_LIST_SIZE
+#define PARANDIS_MULTICAST_LIST_SIZE 32
+#endif
+
+#include "../../Common/ParaNdis_MulticastFilter.h"
+
+typedef vector<UCHAR> address_list;
+
+static unsigned long failures;
+static mt19937 rng(2024);
+
+// the loop ShallPassPacket had before the filter
+static bool LinearMatch(const address_list &list, const UCHAR *address)
+{
+    for (size_t i = 0; i < list.size(); i += ETH_ALEN)
+    {
+        if (!memcmp(&list[i], address, ETH_ALEN))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// IPv6 solicited-node and other IPv6 groups, IPv4 groups and arbitrary
+// multicast addresses, the way guests join them
+static void RandomGroup(UCHAR *address)
+{
+    ULONG r = (ULONG)rng();
+    switch (rng() % 4)
+    {
+        case 0:
+            address[0] = 0x33;
+            address[1] = 0x33;
+            address[2] = 0xFF;
+            break;
+        case 1:
+            address[0] = 0x33;
+            address[1] = 0x33;
+            address[2] = (UCHAR)(r >> 24);
+            break;
+        case 2:
+            address[0] = 0x01;
+            address[1] = 0x00;
+            address[2] = (UCHAR)(0x5E);
+            r &= 0x7FFFFF;
+            break;
+        default:
+            address[0] = (UCHAR)(rng() | 1);
+            address[1] = (UCHAR)rng();
+            address[2] = (UCHAR)rng();
+            break;
+    }
+    address[3] = (UCHAR)(r >> 16);
+    address[4] = (UCHAR)(r >> 8);
+    address[5] = (UCHAR)r;
+}
+
+static address_list RandomList(ULONG count)
+{
+    address_list list(count * ETH_ALEN);
+    for (ULONG i = 0; i < count; i++)
+    {
+        RandomGroup(&list[i * ETH_ALEN]);
+    }
+    return list;
+}
+
+static void Check(const tMulticastFilter &filter, const address_list &list, const UCHAR *address, const char *what)
+{
+    bool expected = LinearMatch(list, address);
+    if (MulticastFilterMatch(&filter, address) != expected)
+    {
+        cerr << what << ": FAILED for " << hex;
+        for (int i = 0; i < ETH_ALEN; i++)
+        {
+            cerr << setw(2) << setfill('0') << (unsigned)address[i] << (i < ETH_ALEN - 1 ? ":" : "");
+        }
+        cerr << dec << setfill(' ') << " of " << list.size() / ETH_ALEN << " groups, expected "
+             << (expected ? "match" : "no match") << endl;
+        failures++;
+    }
+}
+
+// every group of the list, the same groups with one bit changed and random ones
+static void CheckList(const address_list &list, const char *what)
+{
+    tMulticastFilter filter;
+
+    // the filter is rebuilt over the previous content, as on OID_802_3_MULTICAST_LIST
+    memset(&filter, 0xA5, sizeof(filter));
+    MulticastFilterBuild(&filter, list.data(), (ULONG)list.size() / ETH_ALEN);
+    for (size_t i = 0; i < list.size(); i += ETH_ALEN)
+    {
+        UCHAR address[ETH_ALEN];
+        Check(filter, list, &list[i], what);
+        for (int bit = 0; bit < ETH_ALEN * 8; bit++)
+        {
+            memcpy(address, &list[i], ETH_ALEN);
+            address[bit / 8] ^= (UCHAR)(1 << (bit % 8));
+            Check(filter, list, address, what);
+        }
+    }
+    for (int i = 0; i < 1000; i++)
+    {
+        UCHAR address[ETH_ALEN];
+        RandomGroup(address);
+        Check(filter, list, address, what);
+    }
+}
+
+static void TestLists(ULONG iterations)
+{
+    // no groups at all
+    CheckList(address_list(), "empty");
+
+    // random lists of all sizes
+    for (ULONG i = 0; i < iterations; i++)
+    {
+        CheckList(RandomList(1 + i % PARANDIS_MULTICAST_LIST_SIZE), "random");
+    }
+
+    // the same group several times
+    address_list list = RandomList(PARANDIS_MULTICAST_LIST_SIZE / 2);
+    list.insert(list.end(), list.begin(), list.end());
+    CheckList(list, "duplicates");
+
+    // all the groups in the same slot, the lookup probes the whole cluster,
+    // including the wrap around the end of the table
+    for (ULONG target : {0U, (ULONG)PARANDIS_MULTICAST_FILTER_SLOTS - 1})
+    {
+        list.clear();
+        while (list.size() < PARANDIS_MULTICAST_LIST_SIZE * ETH_ALEN)
+        {
+            UCHAR address[ETH_ALEN];
+            RandomGroup(address);
+            if (MulticastFilterHash(address) == target && !LinearMatch(list, address))
+            {
+                list.insert(list.end(), address, address + ETH_ALEN);
+            }
+        }
+        CheckList(list, "collisions");
+    }
+
+    // the list is replaced: the groups of the previous one must not match
+    tMulticastFilter filter;
+    address_list first = RandomList(PARANDIS_MULTICAST_LIST_SIZE), second = RandomList(3);
+    MulticastFilterBuild(&filter, first.data(), (ULONG)first.size() / ETH_ALEN);
+    MulticastFilterBuild(&filter, second.data(), (ULONG)second.size() / ETH_ALEN);
+    for (size_t i = 0; i < first.size(); i += ETH_ALEN)
+    {
+        Check(filter, second, &first[i], "replaced");
+    }
+    cout << "lists: " << iterations << " random lists of up to " << PARANDIS_MULTICAST_LIST_SIZE << " groups checked"
+         << endl;
+}
+
+// lookups of a mix of received groups: the given percentage is in the list
+template <typename T> static double Measure(T func, const address_list &list, ULONG hitPercent)
+{
+    const ULONG count = 4096;
+    address_list received(count * ETH_ALEN);
+    ULONG groups = (ULONG)list.size() / ETH_ALEN;
+    volatile ULONG sink = 0;
+    double best = 0;
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        if (groups && rng() % 100 < hitPercent)
+        {
+            memcpy(&received[i * ETH_ALEN], &list[(rng() % groups) * ETH_ALEN], ETH_ALEN);
+        }
+        else
+        {
+            RandomGroup(&received[i * ETH_ALEN]);
+        }
+    }
+    for (int attempt = 0; attempt < 5; attempt++)
+    {
+        ULONG matches = 0;
+        auto start = chrono::steady_clock::now();
+        for (int round = 0; round < 200; round++)
+        {
+            for (ULONG i = 0; i < count; i++)
+            {
+                matches += func(&received[i * ETH_ALEN]);
+            }
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        sink = sink + matches;
+        double rate = count * 200.0 / elapsed.count() / 1e6;
+        best = max(best, rate);
+    }
+    return best;
+}
+
+static void Benchmark()
+{
+    cout << " groups  hits%  linear Mlookups/s  filter Mlookups/s" << endl;
+    for (ULONG groups = 1; groups <= PARANDIS_MULTICAST_LIST_SIZE; groups *= 2)
+    {
+        address_list list = RandomList(groups);
+        tMulticastFilter filter;
+        MulticastFilterBuild(&filter, list.data(), groups);
+        for (ULONG hits : {0U, 50U, 100U})
+        {
+            double linear = Measure([&](const UCHAR *a) { return LinearMatch(list, a); }, list, hits);
+            double hashed = Measure([&](const UCHAR *a) { return MulticastFilterMatch(&filter, a); }, list, hits);
+            cout << setw(7) << groups << setw(7) << hits << fixed << setprecision(1) << setw(19) << linear << setw(19)
+                 << hashed << endl;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ULONG iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+    bool benchmark = argc > 2 && !strcmp(argv[2], "bench");
+
+    TestLists(iterations);
+    if (failures)
+    {
+        cout << "FAILED: " << failures << " mismatches" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    if (benchmark)
+    {
+        Benchmark();
+    }
+    return 0;
+}
@@ -0,0 +1,324 @@
+/*
+ * Host (Linux) test of ParaNdis_Checksum.h: the vector checksum loops are
+ * compared bit-for-bit with the scalar one on the packets used by netchecksum
+ * and on random buffers, then both are timed.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+using namespace std;
+
+// the few Windows definitions ParaNdis_Checksum.h depends on
+typedef void *PVOID;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef unsigned int ULONG;
+typedef uintptr_t UINT_PTR;
+typedef uint32_t UINT32, *PUINT32;
+typedef uint16_t UINT16, *PUINT16, USHORT;
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#if defined(__x86_64__)
+#define _WIN64
+#elif defined(__aarch64__)
+#define _WIN64
+#define _ARM64_
+#endif
+
+#include "../../Common/ParaNdis_Checksum.h"
+
+#if !defined(PARANDIS_CHECKSUM_SSE2) && !defined(PARANDIS_CHECKSUM_NEON)
+#error "the host has no vector checksum to compare with the scalar one"
+#endif
+
+typedef vector<UCHAR> byte_array;
+
+static unsigned long failures;
+
+static USHORT VectorCheckSum(const UCHAR *buffer, ULONG len)
+{
+    return RawCheckSumFinalize(RawCheckSumCalculator((PVOID)buffer, len));
+}
+
+static USHORT ScalarCheckSum(const UCHAR *buffer, ULONG len)
+{
+    return RawCheckSumFinalize(RawCheckSumCalculatorScalar((PVOID)buffer, len));
+}
+
+static bool Compare(const UCHAR *buffer, ULONG len, const char *what)
+{
+    USHORT vector = VectorCheckSum(buffer, len);
+    USHORT scalar = ScalarCheckSum(buffer, len);
+    if (vector != scalar)
+    {
+        cerr << what << ": FAILED at length " << len << ", vector " << hex << vector << ", scalar " << scalar << dec
+             << endl;
+        failures++;
+        return false;
+    }
+    return true;
+}
+
+// same format as netchecksum: hex byte pairs up to the first word
+static bool ReadPacket(const char *name, byte_array &packet)
+{
+    FILE *f = fopen(name, "rt");
+    int c, prev = -1;
+
+    if (!f)
+    {
+        cerr << name << ": can't open" << endl;
+        return false;
+    }
+    while ((c = fgetc(f)) != EOF)
+    {
+        if (prev < 0 && isxdigit(c))
+        {
+            prev = c;
+        }
+        else if (prev >= 0 && isxdigit(c))
+        {
+            char s[3] = {(char)prev, (char)c, 0};
+            packet.push_back((UCHAR)strtoul(s, NULL, 16));
+            prev = -1;
+        }
+        else if (isalpha(c) || isalpha(prev))
+        {
+            break;
+        }
+        else
+        {
+            prev = -1;
+        }
+    }
+    fclose(f);
+    return packet.size() > 14;
+}
+
+// raw sum of the IPv4/IPv6 pseudo header, the way the device computes it
+static UINT_PTR PseudoHeaderSum(const UCHAR *ip, UCHAR protocol, ULONG l4len)
+{
+    UCHAR ph[40] = {};
+    ULONG addresses = (ip[0] >> 4) == 4 ? 8 : 32;
+
+    memcpy(ph, ip + (addresses == 8 ? 12 : 8), addresses);
+    ph[addresses] = (UCHAR)(l4len >> 8);
+    ph[addresses + 1] = (UCHAR)l4len;
+    ph[addresses + 3] = protocol;
+    return RawCheckSumCalculatorScalar(ph, addresses + 4);
+}
+
+struct
+{
+    const char *file;
+    bool ipvalid;
+    int l4valid; // -1 when the packet carries a partial (pseudo header) checksum
+} Packets[] = {
+    {"tcp-cs.txt", true, 1},
+    {"tcp-badcs.txt", true, 0},
+    {"tcp-ph.txt", true, -1},
+    {"tcp-short.txt", false, -1},
+    {"tcpv6-cs.txt", true, 1},
+    {"udpv6-cs.txt", true, 1},
+};
+
+static void TestPackets()
+{
+    for (auto &job : Packets)
+    {
+        byte_array packet;
+        if (!ReadPacket(job.file, packet))
+        {
+            failures++;
+            continue;
+        }
+        const UCHAR *ip = &packet[14];
+        ULONG iplen = (ULONG)packet.size() - 14;
+        ULONG l3len, l4len;
+        UCHAR protocol;
+
+        if ((ip[0] >> 4) == 4)
+        {
+            l3len = (ip[0] & 0xF) * 4;
+            l4len = min((ULONG)((ip[2] << 8) | ip[3]), iplen) - l3len;
+            protocol = ip[9];
+            if ((VectorCheckSum(ip, l3len) == 0) != job.ipvalid)
+            {
+                cerr << job.file << ": FAILED, unexpected IP header checksum" << endl;
+                failures++;
+            }
+        }
+        else
+        {
+            l3len = 40;
+            l4len = min((ULONG)((ip[4] << 8) | ip[5]), iplen - l3len);
+            protocol = ip[6];
+        }
+
+        // every sub-range of the packet, so all alignments and tails are covered
+        for (ULONG start = 0; start < packet.size(); start++)
+        {
+            for (ULONG len = 0; start + len <= packet.size(); len++)
+            {
+                if (!Compare(&packet[start], len, job.file))
+                {
+                    break;
+                }
+            }
+        }
+
+        if (job.l4valid >= 0)
+        {
+            UINT_PTR sum = PseudoHeaderSum(ip, protocol, l4len) + RawCheckSumCalculator((PVOID)(ip + l3len), l4len);
+            bool valid = RawCheckSumFinalize(sum) == 0;
+            if (valid != (job.l4valid != 0))
+            {
+                cerr << job.file << ": FAILED, L4 checksum is " << (valid ? "valid" : "invalid") << endl;
+                failures++;
+            }
+        }
+        cout << job.file << ": " << packet.size() << " bytes checked" << endl;
+    }
+}
+
+static void TestRandom(unsigned long iterations)
+{
+    mt19937 rng(2024);
+    byte_array buffer(0x10000 + 64);
+    // past CHECKSUM_SSE2_MAX_BLOCKS blocks, where the SSE2 lanes are flushed
+    byte_array large(0x4000 * 3 * CHECKSUM_VECTOR_BLOCK + 61);
+
+    for (auto &b : buffer)
+    {
+        b = (UCHAR)rng();
+    }
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        ULONG offset = rng() % 64;
+        ULONG len = rng() % 9100;
+        // some runs of all-ones bytes, the worst case for the accumulators
+        if ((i & 7) == 0)
+        {
+            memset(&buffer[offset], 0xFF, len);
+        }
+        Compare(&buffer[offset], len, "random");
+        // the partial sums of several fragments, as in CheckSumCalculator
+        ULONG split = (rng() % (len + 1)) & ~1;
+        UINT_PTR vector = RawCheckSumCalculator(&buffer[offset], split) +
+                          RawCheckSumCalculator(&buffer[offset + split], len - split);
+        UINT_PTR scalar = RawCheckSumCalculatorScalar(&buffer[offset], split) +
+                          RawCheckSumCalculatorScalar(&buffer[offset + split], len - split);
+        if (RawCheckSumFinalize(vector) != RawCheckSumFinalize(scalar))
+        {
+            cerr << "fragments: FAILED at length " << len << ", split " << split << endl;
+            failures++;
+        }
+        if ((i & 7) == 0)
+        {
+            for (ULONG j = 0; j < len; j++)
+            {
+                buffer[offset + j] = (UCHAR)rng();
+            }
+        }
+    }
+
+    memset(large.data(), 0, large.size());
+    Compare(large.data(), (ULONG)large.size(), "zeroes");
+    memset(large.data(), 0xFF, large.size());
+    Compare(large.data(), (ULONG)large.size(), "ones");
+    Compare(large.data() + 1, (ULONG)large.size() - 1, "ones");
+    for (auto &b : large)
+    {
+        b = (UCHAR)rng();
+    }
+    Compare(large.data(), (ULONG)large.size(), "large");
+    Compare(large.data() + 3, (ULONG)large.size() - 3, "large");
+    cout << "random: " << iterations << " buffers checked" << endl;
+}
+
+template <typename T> static double Measure(T func, const byte_array &buffer, ULONG len)
+{
+    volatile USHORT sink = 0;
+    unsigned long rounds = max(1000000UL / (len / 64 + 1), 1000UL);
+    double best = 0;
+
+    for (int attempt = 0; attempt < 5; attempt++)
+    {
+        auto start = chrono::steady_clock::now();
+        for (unsigned long i = 0; i < rounds; i++)
+        {
+            sink = sink + func(buffer.data() + (i & 1), len);
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        double rate = (double)len * rounds / elapsed.count() / 1e9;
+        best = max(best, rate);
+    }
+    return best;
+}
+
+static void Benchmark()
+{
+    byte_array buffer(0x10000 + 64, 0x5A);
+    const ULONG sizes[] = {64, 1500, 9000, 0x10000};
+
+    cout << "  bytes  scalar GB/s  vector GB/s" << endl;
+    for (ULONG len : sizes)
+    {
+        cout << setw(7) << len << fixed << setprecision(2) << setw(13) << Measure(ScalarCheckSum, buffer, len)
+             << setw(13) << Measure(VectorCheckSum, buffer, len) << endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+    bool benchmark = argc > 2 && !strcmp(argv[2], "bench");
+
+    TestPackets();
+    TestRandom(iterations);
+    if (failures)
+    {
+        cout << "FAILED: " << failures << " mismatches" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    if (benchmark)
+    {
+        Benchmark();
+    }
+    return 0;
+}
@@ -1,5 +1,9 @@
+#ifdef _WIN32
 #include "stdafx.h"
-#include "winToeplitz.h"
+#else
+#include "toeplitz_host.h"
+#endif
+#include "WinToeplitz.h"
 
 uint8_t workingkey[WTEP_MAX_KEY_SIZE];
 
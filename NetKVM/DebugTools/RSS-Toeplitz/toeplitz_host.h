@@ -0,0 +1,18 @@
+/*
+ * The few Windows definitions WinToeplitz.c and ParaNdis_Toeplitz.h
+ * depend on, for the host (Linux) build of toeplitz_test.
+ */
+
+#pragma once
+
+#include <string.h>
+
+typedef unsigned char UCHAR, BYTE, *PBYTE, UINT8;
+typedef unsigned short USHORT;
+typedef unsigned int UINT, ULONG, UINT32;
+typedef unsigned long long UINT64;
+#define _byteswap_ulong(x)     __builtin_bswap32(x)
+#define RtlCopyMemory(d, s, l) memcpy((d), (s), (l))
+#if defined(__x86_64__)
+#define _WIN64
+#endif
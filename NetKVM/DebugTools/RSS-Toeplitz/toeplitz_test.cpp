@@ -0,0 +1,273 @@
+/*
+ * Host (Linux) test of ParaNdis_Toeplitz.h: the table and the carry-less
+ * multiplication hashes are compared with the bit-by-bit ToeplitzHash of
+ * WinToeplitz.c on the Microsoft verification vectors and on random keys
+ * and inputs, then all of them are timed.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+#include "toeplitz_host.h"
+#include "../../Common/ParaNdis_Toeplitz.h"
+
+// its uint32_t differs from the one of the host
+namespace WinToeplitz
+{
+#include "WinToeplitz.h"
+}
+
+static unsigned long failures;
+static mt19937 rng(2024);
+
+static const UCHAR verificationKey[TOEPLITZ_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3,
+    0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3,
+    0x80, 0x30, 0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa};
+
+// clang-format off
+static const struct
+{
+    UINT32 resultIP;
+    UINT32 resultTCP;
+    UCHAR source[16];
+    UCHAR dest[16];
+    USHORT sourcePort;
+    USHORT destPort;
+    bool ipv6;
+} verificationData[] =
+{
+    { 0x323e8fc2, 0x51ccc178, { 66, 9, 149, 187 }, { 161, 142, 100, 80 }, 2794, 1766, false },
+    { 0xd718262a, 0xc626b0ea, { 199, 92, 111, 2 }, { 65, 69, 140, 83 }, 14230, 4739, false },
+    { 0xd2d0a5de, 0x5c2b394a, { 24, 19, 198, 95 }, { 12, 22, 207, 184 }, 12898, 38024, false },
+    { 0x82989176, 0xafc7327f, { 38, 27, 205, 30 }, { 209, 142, 163, 6 }, 48228, 2217, false },
+    { 0x5d1809c5, 0x10e828a2, { 153, 39, 163, 191 }, { 202, 188, 127, 2 }, 44251, 1303, false },
+    { 0x2cc18cd5, 0x40207d3d,
+      { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff, 0, 0, 0, 0, 0, 0, 0, 0x07 },
+      { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03, 0, 0, 0, 0, 0, 0, 0, 0x01 }, 2794, 1766, true },
+    { 0x0f0c461c, 0xdde51bbf,
+      { 0x3f, 0xfe, 0x05, 0x01, 0x00, 0x08, 0, 0, 0x02, 0x60, 0x97, 0xff, 0xfe, 0x40, 0xef, 0xab },
+      { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01 }, 14230, 4739, true },
+    { 0x4b61e985, 0x02d1feef,
+      { 0x3f, 0xfe, 0x19, 0x00, 0x45, 0x45, 0x00, 0x03, 0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf },
+      { 0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf }, 44251, 38024, true },
+};
+// clang-format on
+
+struct Chunk
+{
+    const UCHAR *ptr;
+    ULONG len;
+};
+
+// the same way as ToeplitzHash of ParaNdis6_RSS.cpp
+template <typename T> static UINT32 HashChunks(T func, const tToeplitzTable &table, const Chunk *chunks, int n)
+{
+    UINT32 res = 0;
+    ULONG position = 0;
+    for (int i = 0; i < n; i++)
+    {
+        res ^= func(&table, chunks[i].ptr, chunks[i].len, position);
+        position += chunks[i].len;
+    }
+    return res;
+}
+
+static UINT32 ReferenceHash(const UCHAR *key, const Chunk *chunks, int n)
+{
+    WinToeplitz::HASH_CALC_SG_BUF_ENTRY sg[4];
+    for (int i = 0; i < n; i++)
+    {
+        sg[i].chunkPtr = (PBYTE)chunks[i].ptr;
+        sg[i].chunkLen = chunks[i].len;
+    }
+    return WinToeplitz::ToeplitzHash(sg, n, (UINT8 *)key);
+}
+
+// all the implementations on the same chunks, expected is 0 when unknown
+static void Check(const UCHAR *key, const tToeplitzTable &table, const Chunk *chunks, int n, UINT32 expected,
+                  const char *what)
+{
+    UINT32 reference = ReferenceHash(key, chunks, n);
+    UINT32 bytes = HashChunks(ToeplitzHashBytes, table, chunks, n);
+    UINT32 chunk = HashChunks(ToeplitzHashChunk, table, chunks, n);
+#ifdef PARANDIS_TOEPLITZ_CLMUL
+    UINT32 clmul = table.UseClmul ? HashChunks(ToeplitzHashClmul, table, chunks, n) : reference;
+#else
+    UINT32 clmul = reference;
+#endif
+    if ((expected && reference != expected) || bytes != reference || chunk != reference || clmul != reference)
+    {
+        cerr << what << ": FAILED, expected " << hex << expected << ", reference " << reference << ", table "
+             << bytes << ", clmul " << clmul << dec << endl;
+        failures++;
+    }
+}
+
+static void TestVerification()
+{
+    tToeplitzTable table;
+
+    ToeplitzBuildTable(&table, verificationKey);
+    for (auto &v : verificationData)
+    {
+        ULONG addressLen = v.ipv6 ? 16 : 4;
+        UCHAR ports[4] = {(UCHAR)(v.sourcePort >> 8), (UCHAR)v.sourcePort, (UCHAR)(v.destPort >> 8),
+                          (UCHAR)v.destPort};
+        Chunk chunks[3] = {{v.source, addressLen}, {v.dest, addressLen}, {ports, 4}};
+        Check(verificationKey, table, chunks, 2, v.resultIP, v.ipv6 ? "IPv6" : "IPv4");
+        Check(verificationKey, table, chunks, 3, v.resultTCP, v.ipv6 ? "TCP/IPv6" : "TCP/IPv4");
+    }
+    cout << "verification: " << sizeof(verificationData) / sizeof(verificationData[0]) << " vectors checked"
+         << endl;
+}
+
+static void TestRandom(unsigned long iterations)
+{
+    UCHAR key[TOEPLITZ_KEY_SIZE];
+    UCHAR input[TOEPLITZ_MAX_INPUT];
+    tToeplitzTable table;
+
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        if (i % 100 == 0)
+        {
+            for (auto &b : key)
+            {
+                b = (UCHAR)rng();
+            }
+            // the table is rebuilt over the previous one, as on a new key
+            ToeplitzBuildTable(&table, key);
+        }
+        for (auto &b : input)
+        {
+            b = (UCHAR)rng();
+        }
+        // the chunks of the driver: addresses and ports
+        Chunk v4[2] = {{input, 8}, {input + 8, 4}};
+        Chunk v6[3] = {{input, 16}, {input + 16, 16}, {input + 32, 4}};
+        Check(key, table, v4, 1, 0, "IPv4");
+        Check(key, table, v4, 2, 0, "TCP/IPv4");
+        Check(key, table, v6, 2, 0, "IPv6");
+        Check(key, table, v6, 3, 0, "TCP/IPv6");
+
+        // any split of any length, with the tails of the 32 bit words
+        ULONG len = rng() % (TOEPLITZ_MAX_INPUT + 1);
+        ULONG first = rng() % (len + 1);
+        ULONG second = rng() % (len - first + 1);
+        Chunk split[3] = {{input, first}, {input + first, second}, {input + first + second, len - first - second}};
+        Check(key, table, split, 3, 0, "split");
+    }
+    cout << "random: " << iterations << " inputs checked" << endl;
+}
+
+template <typename T> static double Measure(T func, const UCHAR *input, ULONG len)
+{
+    volatile UINT32 sink = 0;
+    const unsigned long rounds = 1000000;
+    double best = 0;
+
+    for (int attempt = 0; attempt < 5; attempt++)
+    {
+        auto start = chrono::steady_clock::now();
+        for (unsigned long i = 0; i < rounds; i++)
+        {
+            // as much as possible of the input from the previous hash
+            sink = sink + func(input + (i & 3) * TOEPLITZ_MAX_INPUT, len);
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        best = max(best, rounds / elapsed.count() / 1e6);
+    }
+    return best;
+}
+
+static void Benchmark()
+{
+    UCHAR input[4 * TOEPLITZ_MAX_INPUT];
+    tToeplitzTable table;
+
+    for (auto &b : input)
+    {
+        b = (UCHAR)rng();
+    }
+    ToeplitzBuildTable(&table, verificationKey);
+    cout << "  bytes  bit-by-bit Mhash/s  table Mhash/s  clmul Mhash/s" << endl;
+    for (ULONG len : {8U, 12U, 32U, 36U})
+    {
+        double reference = Measure(
+            [&](const UCHAR *p, ULONG l) {
+                Chunk c = {p, l};
+                return ReferenceHash(verificationKey, &c, 1);
+            },
+            input, len);
+        double bytes = Measure([&](const UCHAR *p, ULONG l) { return ToeplitzHashBytes(&table, p, l, 0); }, input,
+                               len);
+        cout << setw(7) << len << fixed << setprecision(1) << setw(20) << reference << setw(15) << bytes;
+#ifdef PARANDIS_TOEPLITZ_CLMUL
+        if (table.UseClmul)
+        {
+            cout << setw(15)
+                 << Measure([&](const UCHAR *p, ULONG l) { return ToeplitzHashClmul(&table, p, l, 0); }, input, len);
+        }
+#endif
+        cout << endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+    bool benchmark = argc > 2 && !strcmp(argv[2], "bench");
+
+#ifdef PARANDIS_TOEPLITZ_CLMUL
+    if (!ToeplitzClmulSupported())
+    {
+        cout << "the host has no PCLMULQDQ, only the tables are checked" << endl;
+    }
+#endif
+    TestVerification();
+    TestRandom(iterations);
+    if (failures)
+    {
+        cout << "FAILED: " << failures << " mismatches" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    if (benchmark)
+    {
+        Benchmark();
+    }
+    return 0;
+}
@@ -0,0 +1,520 @@
+/*
+ * Host (Linux) test of ParaNdis_Segmentation.h: the frames built from the
+ * headers it produces are compared byte-for-byte with the frames of a
+ * straightforward reference segmentation, then the segmentation is timed.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+using namespace std;
+
+// the few Windows definitions ParaNdis_Segmentation.h depends on
+typedef void *PVOID;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef unsigned int ULONG;
+typedef uintptr_t UINT_PTR;
+typedef uint32_t UINT32, *PUINT32;
+typedef uint16_t UINT16, *PUINT16, USHORT;
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#if defined(__x86_64__)
+#define _WIN64
+#elif defined(__aarch64__)
+#define _WIN64
+#define _ARM64_
+#endif
+#define RtlZeroMemory(d, l) memset((d), 0, (l))
+#define RtlCopyMemory(d, s, l) memcpy((d), (s), (l))
+
+#include "../../Common/ParaNdis_Segmentation.h"
+
+typedef vector<UCHAR> byte_array;
+
+struct packet
+{
+    byte_array frame;
+    ULONG ipOffset;
+    ULONG l4Offset;
+    ULONG mss;
+    bool udp;
+    const char *name;
+};
+
+static unsigned long failures;
+static mt19937 rng(2024);
+
+static ULONG Random(ULONG from, ULONG to)
+{
+    return from + rng() % (to - from + 1);
+}
+
+static void RandomBytes(UCHAR *p, ULONG len)
+{
+    while (len--)
+    {
+        *p++ = (UCHAR)rng();
+    }
+}
+
+static ULONG Get16(const UCHAR *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static ULONG Get32(const UCHAR *p)
+{
+    return ((ULONG)p[0] << 24) | ((ULONG)p[1] << 16) | ((ULONG)p[2] << 8) | p[3];
+}
+
+static void Put16(UCHAR *p, ULONG v)
+{
+    p[0] = (UCHAR)(v >> 8);
+    p[1] = (UCHAR)v;
+}
+
+static void Put32(UCHAR *p, ULONG v)
+{
+    Put16(p, v >> 16);
+    Put16(p + 2, v);
+}
+
+// RFC 1071, on big endian 16-bit words
+static ULONG RefSum(const UCHAR *p, size_t len, ULONG sum = 0)
+{
+    for (size_t i = 0; i + 1 < len; i += 2)
+    {
+        sum += Get16(p + i);
+    }
+    if (len & 1)
+    {
+        sum += p[len - 1] << 8;
+    }
+    return sum;
+}
+
+static ULONG RefChecksum(ULONG sum)
+{
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return ~sum & 0xFFFF;
+}
+
+// the large packet as the stack passes it for LSO or USO
+static packet RandomPacket(bool udp, bool ipv6, ULONG payload, ULONG mss)
+{
+    packet p = {};
+    ULONG ipHeader = ipv6 ? 40 : 20 + 4 * Random(0, 10);
+    ULONG extension = ipv6 && Random(0, 1) ? 8 * Random(1, 4) : 0;
+    ULONG l4Header = udp ? 8 : 20 + 4 * Random(0, 10);
+
+    // with and without a VLAN tag in the frame
+    p.ipOffset = Random(0, 3) ? 14 : 18;
+    p.l4Offset = p.ipOffset + ipHeader + extension;
+    p.mss = mss;
+    p.udp = udp;
+    p.frame.resize(p.l4Offset + l4Header + payload);
+    RandomBytes(p.frame.data(), (ULONG)p.frame.size());
+
+    UCHAR *ip = &p.frame[p.ipOffset];
+    UCHAR protocol = udp ? 17 : 6;
+    if (ipv6)
+    {
+        ip[0] = 0x60 | (ip[0] & 0xF);
+        ip[6] = extension ? 0 : protocol;
+        if (extension)
+        {
+            ip[40] = protocol;
+            ip[41] = (UCHAR)(extension / 8 - 1);
+        }
+    }
+    else
+    {
+        ip[0] = (UCHAR)(0x40 | ipHeader / 4);
+        ip[9] = protocol;
+        // the stack may leave the length to the miniport
+        if (Random(0, 1))
+        {
+            Put16(ip + 2, 0);
+        }
+    }
+    if (!udp)
+    {
+        UCHAR *tcp = &p.frame[p.l4Offset];
+        tcp[12] = (UCHAR)((l4Header / 4) << 4);
+    }
+    p.name = udp ? (ipv6 ? "UDPv6" : "UDPv4") : (ipv6 ? "TCPv6" : "TCPv4");
+    return p;
+}
+
+// the frames of the packet, built field by field
+static vector<byte_array> Reference(const packet &p)
+{
+    vector<byte_array> result;
+    ULONG headers = p.l4Offset + (p.udp ? 8 : (p.frame[p.l4Offset + 12] >> 4) * 4);
+    ULONG payload = (ULONG)p.frame.size() - headers;
+    ULONG segments = payload ? (payload + p.mss - 1) / p.mss : 1;
+    bool ipv6 = (p.frame[p.ipOffset] >> 4) == 6;
+
+    for (ULONG i = 0; i < segments; i++)
+    {
+        ULONG offset = headers + i * p.mss;
+        ULONG length = min(p.mss, payload - i * p.mss);
+        byte_array f(p.frame.begin(), p.frame.begin() + headers);
+        f.insert(f.end(), p.frame.begin() + offset, p.frame.begin() + offset + length);
+
+        UCHAR *ip = &f[p.ipOffset];
+        UCHAR *l4 = &f[p.l4Offset];
+        ULONG l4Length = (ULONG)f.size() - p.l4Offset;
+        UCHAR pseudo[40] = {};
+        ULONG pseudoLength;
+        if (ipv6)
+        {
+            Put16(ip + 4, (ULONG)f.size() - p.ipOffset - 40);
+            memcpy(pseudo, ip + 8, 32);
+            Put32(pseudo + 32, l4Length);
+            pseudo[39] = p.udp ? 17 : 6;
+            pseudoLength = 40;
+        }
+        else
+        {
+            ULONG ipHeader = (ip[0] & 0xF) * 4;
+            Put16(ip + 2, (ULONG)f.size() - p.ipOffset);
+            Put16(ip + 4, Get16(&p.frame[p.ipOffset + 4]) + i);
+            Put16(ip + 10, 0);
+            Put16(ip + 10, RefChecksum(RefSum(ip, ipHeader)));
+            memcpy(pseudo, ip + 12, 8);
+            pseudo[9] = p.udp ? 17 : 6;
+            Put16(pseudo + 10, l4Length);
+            pseudoLength = 12;
+        }
+        ULONG checksumOffset;
+        if (p.udp)
+        {
+            Put16(l4 + 4, l4Length);
+            checksumOffset = 6;
+        }
+        else
+        {
+            Put32(l4 + 4, Get32(&p.frame[p.l4Offset + 4]) + i * p.mss);
+            if (i > 0)
+            {
+                l4[13] &= ~0x80;
+            }
+            if (i < segments - 1)
+            {
+                l4[13] &= ~0x09;
+            }
+            checksumOffset = 16;
+        }
+        Put16(l4 + checksumOffset, 0);
+        ULONG checksum = RefChecksum(RefSum(l4, l4Length, RefSum(pseudo, pseudoLength)));
+        if (p.udp && !checksum)
+        {
+            checksum = 0xFFFF;
+        }
+        Put16(l4 + checksumOffset, checksum);
+        result.push_back(f);
+    }
+    return result;
+}
+
+// the reference checks: the checksums are valid and the payloads are the original one
+static bool Verify(const packet &p, const vector<byte_array> &frames)
+{
+    ULONG headers = p.l4Offset + (p.udp ? 8 : (p.frame[p.l4Offset + 12] >> 4) * 4);
+    byte_array payload;
+
+    for (auto &f : frames)
+    {
+        const UCHAR *ip = &f[p.ipOffset];
+        ULONG l4Length = (ULONG)f.size() - p.l4Offset;
+        ULONG sum;
+        if ((ip[0] >> 4) == 4)
+        {
+            if (RefChecksum(RefSum(ip, (ip[0] & 0xF) * 4)) != 0)
+            {
+                return false;
+            }
+            UCHAR pseudo[12] = {};
+            memcpy(pseudo, ip + 12, 8);
+            pseudo[9] = ip[9];
+            Put16(pseudo + 10, l4Length);
+            sum = RefSum(pseudo, sizeof(pseudo));
+        }
+        else
+        {
+            UCHAR pseudo[40] = {};
+            memcpy(pseudo, ip + 8, 32);
+            Put32(pseudo + 32, l4Length);
+            pseudo[39] = p.udp ? 17 : 6;
+            sum = RefSum(pseudo, sizeof(pseudo));
+        }
+        if (RefChecksum(RefSum(&f[p.l4Offset], l4Length, sum)) != 0)
+        {
+            return false;
+        }
+        payload.insert(payload.end(), f.begin() + headers, f.end());
+    }
+    return equal(payload.begin(), payload.end(), p.frame.begin() + headers);
+}
+
+/*
+ * Segments the packet the way the TX path does: the payload is summed
+ * in the pieces of an MDL chain cut at random places, from a buffer at
+ * a random alignment.
+ */
+static bool Segment(const packet &p, vector<byte_array> &frames)
+{
+    tSegmentationInfo info;
+    ULONG available = min((ULONG)p.frame.size(), p.l4Offset + 60);
+
+    if (!SegmentationPrepare(&info,
+                             p.frame.data(),
+                             available,
+                             p.ipOffset,
+                             p.l4Offset,
+                             (ULONG)p.frame.size(),
+                             p.mss,
+                             p.udp))
+    {
+        return false;
+    }
+
+    byte_array buffer(p.frame.size() + 8);
+    UCHAR *data = buffer.data() + Random(0, 7);
+    memcpy(data, p.frame.data(), p.frame.size());
+
+    vector<ULONG> cuts = {0, (ULONG)p.frame.size()};
+    for (ULONG i = Random(0, 8); i > 0; i--)
+    {
+        cuts.push_back(Random(0, (ULONG)p.frame.size()));
+    }
+    sort(cuts.begin(), cuts.end());
+
+    frames.clear();
+    for (ULONG i = 0; i < info.Segments; i++)
+    {
+        ULONG start = SegmentationPayloadOffset(&info, i);
+        ULONG end = start + SegmentationPayloadLength(&info, i);
+        UINT_PTR sum = 0;
+
+        for (size_t c = 0; c + 1 < cuts.size(); c++)
+        {
+            ULONG from = max(cuts[c], start), to = min(cuts[c + 1], end);
+            if (from < to)
+            {
+                sum = SegmentationChecksumAdd(sum, data + from, to - from, from - start);
+            }
+        }
+
+        byte_array f(data, data + info.HeadersLength);
+        SegmentationBuildHeaders(&info, f.data(), i, sum);
+        f.insert(f.end(), data + start, data + end);
+        frames.push_back(f);
+    }
+    return true;
+}
+
+static void Report(const packet &p, const char *what, size_t segment = 0, size_t offset = 0)
+{
+    cerr << p.name << " of " << p.frame.size() << " bytes, MSS " << p.mss << ", IP at " << p.ipOffset << ", L4 at "
+         << p.l4Offset << ": " << what;
+    if (segment || offset)
+    {
+        cerr << " (segment " << segment << ", byte " << offset << ")";
+    }
+    cerr << endl;
+    failures++;
+}
+
+static void Check(const packet &p)
+{
+    vector<byte_array> expected = Reference(p), frames;
+    ULONG largest = (ULONG)expected[0].size() - p.ipOffset;
+
+    if (!Verify(p, expected))
+    {
+        Report(p, "the reference is wrong");
+        return;
+    }
+    if (!Segment(p, frames))
+    {
+        // only when a segment is too long for the IP length
+        if (largest <= 0xFFFF)
+        {
+            Report(p, "not segmented");
+        }
+        return;
+    }
+    if (largest > 0xFFFF)
+    {
+        Report(p, "segmented with too long segments");
+        return;
+    }
+    if (frames.size() != expected.size())
+    {
+        Report(p, "wrong number of segments");
+        return;
+    }
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        if (frames[i].size() != expected[i].size())
+        {
+            Report(p, "wrong length", i);
+            return;
+        }
+        auto diff = mismatch(frames[i].begin(), frames[i].end(), expected[i].begin());
+        if (diff.first != frames[i].end())
+        {
+            Report(p, "different content", i, diff.first - frames[i].begin());
+            return;
+        }
+    }
+}
+
+static void CheckInvalid()
+{
+    packet p = RandomPacket(false, false, 3000, 1448);
+    vector<byte_array> frames;
+    const struct
+    {
+        const char *name;
+        void (*spoil)(packet &p);
+    } cases[] = {
+        {"MSS 0", [](packet &p) { p.mss = 0; }},
+        {"not IP", [](packet &p) { p.frame[p.ipOffset] = 0x55; }},
+        {"IP header length", [](packet &p) { p.frame[p.ipOffset] = 0x44; }},
+        {"IP header over L4", [](packet &p) { p.l4Offset -= 4; }},
+        {"TCP header length", [](packet &p) { p.frame[p.l4Offset + 12] = 0x40; }},
+        {"L4 out of the frame", [](packet &p) { p.frame.resize(p.l4Offset + 10); }},
+    };
+
+    for (auto &c : cases)
+    {
+        packet bad = p;
+        c.spoil(bad);
+        if (Segment(bad, frames))
+        {
+            cerr << c.name << ": FAILED, segmented" << endl;
+            failures++;
+        }
+    }
+}
+
+static ULONG RandomMss()
+{
+    static const ULONG typical[] = {1, 2, 3, 536, 1220, 1440, 1448, 1460, 1472, 8948, 8960};
+    return Random(0, 3) ? typical[Random(0, sizeof(typical) / sizeof(typical[0]) - 1)] : Random(1, 9000);
+}
+
+static void TestPackets(ULONG iterations)
+{
+    for (ULONG i = 0; i < iterations; i++)
+    {
+        bool udp = Random(0, 1), ipv6 = Random(0, 1);
+        ULONG mss = RandomMss();
+        ULONG payload;
+
+        switch (Random(0, 4))
+        {
+            case 0:
+                // nothing to split
+                payload = Random(0, mss);
+                break;
+            case 1:
+                // exact multiple of the MSS
+                payload = mss * Random(1, min(64000 / mss, 200U));
+                break;
+            default:
+                payload = Random(0, min(64000U, mss * 200));
+                break;
+        }
+        Check(RandomPacket(udp, ipv6, payload, mss));
+    }
+    // segments too long for the IP length
+    Check(RandomPacket(false, false, 70000, 65500));
+    Check(RandomPacket(true, true, 70000, 65500));
+    CheckInvalid();
+    cout << "packets: " << iterations << " random packets checked" << endl;
+}
+
+static void Benchmark()
+{
+    cout << " type   payload   MSS  segments  Gbit/s" << endl;
+    for (bool udp : {false, true})
+    {
+        for (ULONG mss : {536U, 1448U, 8948U})
+        {
+            packet p = RandomPacket(udp, false, 64000, mss);
+            vector<byte_array> frames;
+            double best = 0;
+            for (int attempt = 0; attempt < 5; attempt++)
+            {
+                auto start = chrono::steady_clock::now();
+                for (int round = 0; round < 200; round++)
+                {
+                    Segment(p, frames);
+                }
+                chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+                best = max(best, 64000 * 8 * 200.0 / elapsed.count() / 1e9);
+            }
+            cout << setw(5) << (udp ? "UDP" : "TCP") << setw(10) << 64000 << setw(6) << mss << setw(10)
+                 << frames.size() << fixed << setprecision(1) << setw(8) << best << endl;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ULONG iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+    bool benchmark = argc > 2 && !strcmp(argv[2], "bench");
+
+    TestPackets(iterations);
+    if (failures)
+    {
+        cout << "FAILED: " << failures << " mismatches" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    if (benchmark)
+    {
+        Benchmark();
+    }
+    return 0;
+}
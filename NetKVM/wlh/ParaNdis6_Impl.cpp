@@ -727,6 +727,7 @@ NDIS_STATUS ParaNdis_FinishSpecificInitialization(PARANDIS_ADAPTER *pContext)
         else
         {
             DPrintf(0, "[%s] SG recommended size %d\n", __FUNCTION__, sgDesc.ScatterGatherListSize);
+            pContext->ulSGListSize = sgDesc.ScatterGatherListSize;
         }
     }
 
@@ -801,42 +802,6 @@ static void ParaNdis_AdjustRxBufferHolderLength(pRxNetDescriptor p, ULONG ulData
     NETKVM_ASSERT(ulBytesLeft == 0);
 }
 
-#if PARANDIS_SUPPORT_RSS
-static ULONG HashReportToHashType(USHORT report)
-{
-    static const ULONG table[VIRTIO_NET_HASH_REPORT_MAX + 1] = {
-#if (NDIS_SUPPORT_NDIS680)
-        0,
-        NDIS_HASH_IPV4,
-        NDIS_HASH_TCP_IPV4,
-        NDIS_HASH_UDP_IPV4,
-        NDIS_HASH_IPV6,
-        NDIS_HASH_TCP_IPV6,
-        NDIS_HASH_UDP_IPV6,
-        NDIS_HASH_IPV6_EX,
-        NDIS_HASH_TCP_IPV6_EX,
-        NDIS_HASH_UDP_IPV6_EX
-#else
-        0,
-        NDIS_HASH_IPV4,
-        NDIS_HASH_TCP_IPV4,
-        0,
-        NDIS_HASH_IPV6,
-        NDIS_HASH_TCP_IPV6,
-        0,
-        NDIS_HASH_IPV6_EX,
-        NDIS_HASH_TCP_IPV6_EX,
-        0
-#endif
-    };
-    if (report > VIRTIO_NET_HASH_REPORT_MAX)
-    {
-        return 0;
-    }
-    return table[report];
-}
-#endif
-
 static __inline VOID NBLSetRSSInfo(PPARANDIS_ADAPTER pContext,
                                    PNET_BUFFER_LIST pNBL,
                                    PNET_PACKET_INFO PacketInfo,
@@ -854,7 +819,7 @@ static __inline VOID NBLSetRSSInfo(PPARANDIS_ADAPTER pContext,
         if (PacketInfo->RSSHash.Type && pContext->bHashReportedByDevice)
         {
             virtio_net_hdr_v1_hash *ph = (virtio_net_hdr_v1_hash *)virtioHeader;
-            ULONG val = HashReportToHashType(ph->hash_report);
+            ULONG val = ParaNdis6_RSSHashReportToHashType(ph->hash_report);
             if (val != PacketInfo->RSSHash.Type || ph->hash_value != PacketInfo->RSSHash.Value)
             {
                 pContext->extraStatistics.framesRSSError++;
@@ -1023,8 +988,18 @@ tPacketIndicationType ParaNdis_PrepareReceivedPacket(PARANDIS_ADAPTER *pContext,
             nBytesStripped = ParaNdis_StripVlanHeaderMoveHead(pPacketInfo);
         }
 
-        ParaNdis_PadPacketToMinimalLength(pPacketInfo);
-        ParaNdis_AdjustRxBufferHolderLength(pBuffersDesc, nBytesStripped);
+        if (pBuffersDesc->CoalescedNext)
+        {
+            // the payload of the coalesced segments follows the data of the first one
+            ParaNdis_AdjustRxBufferHolderLength(pBuffersDesc, nBytesStripped);
+            NDIS_MDL_LINKAGE(pMDL) = pBuffersDesc->CoalescedNext->CoalescedMdl;
+            pPacketInfo->dataLength += pBuffersDesc->CoalescedLength;
+        }
+        else
+        {
+            ParaNdis_PadPacketToMinimalLength(pPacketInfo);
+            ParaNdis_AdjustRxBufferHolderLength(pBuffersDesc, nBytesStripped);
+        }
         pNBL = NdisAllocateNetBufferAndNetBufferList(pContext->BufferListsPool,
                                                      0,
                                                      0,
@@ -1048,7 +1023,16 @@ tPacketIndicationType ParaNdis_PrepareReceivedPacket(PARANDIS_ADAPTER *pContext,
             csRes.value = 0;
             csRes.flags.IpOK = true;
             csRes.flags.TcpOK = true;
-            if (pHeader->hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE)
+            if (pBuffersDesc->CoalescedNext)
+            {
+                // coalesced in CParaNdisRX::ProcessRxRing, each segment had a valid checksum
+                *pnCoalescedSegmentsCount = pBuffersDesc->CoalescedSegments;
+                pContext->extraStatistics.framesCoalescedDriver++;
+                NBLSetRSCInfo(pContext, pNBL, pPacketInfo, *pnCoalescedSegmentsCount, 0);
+                qCSInfo.Receive.IpChecksumValueInvalid = true;
+                qCSInfo.Receive.TcpChecksumValueInvalid = true;
+            }
+            else if (pHeader->hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE)
             {
                 USHORT nDupAcks = 0;
                 if (pHeader->hdr.flags & VIRTIO_NET_HDR_F_RSC_INFO)
@@ -59,10 +59,41 @@ Return value:
 ***********************************************************/
 static NDIS_STATUS OnSetInterruptModeration(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
 {
-    UNREFERENCED_PARAMETER(pContext);
-    UNREFERENCED_PARAMETER(pOid);
+    NDIS_STATUS status;
+    NDIS_INTERRUPT_MODERATION_PARAMETERS params = {};
+
+    if (!pContext->bNotifyCoalescingSupported)
+    {
+        return NDIS_STATUS_INVALID_DATA;
+    }
+
+    status = ParaNdis_OidSetCopy(pOid, &params, sizeof(params));
+    if (status != NDIS_STATUS_SUCCESS)
+    {
+        return status;
+    }
+
+    if (params.Header.Type != NDIS_OBJECT_TYPE_DEFAULT ||
+        params.Header.Revision < NDIS_INTERRUPT_MODERATION_PARAMETERS_REVISION_1 ||
+        params.Header.Size < NDIS_SIZEOF_INTERRUPT_MODERATION_PARAMETERS_REVISION_1)
+    {
+        return NDIS_STATUS_INVALID_DATA;
+    }
 
-    return NDIS_STATUS_INVALID_DATA;
+    switch (params.InterruptModeration)
+    {
+        case NdisInterruptModerationEnabled:
+            pContext->bInterruptModeration = TRUE;
+            break;
+        case NdisInterruptModerationDisabled:
+            pContext->bInterruptModeration = FALSE;
+            break;
+        default:
+            return NDIS_STATUS_INVALID_DATA;
+    }
+    DPrintf(0, "[%s] interrupt moderation %s\n", __FUNCTION__, pContext->bInterruptModeration ? "on" : "off");
+    ParaNdis_UpdateNotificationCoalescing(pContext);
+    return NDIS_STATUS_SUCCESS;
 }
 
 static NDIS_STATUS OnSetOffloadParameters(PARANDIS_ADAPTER *pContext, tOidDesc *pOid);
@@ -375,6 +406,8 @@ static void ResetRssStatistics(PARANDIS_ADAPTER *pContext)
     pContext->extraStatistics.framesRSSMisses = 0;
     pContext->extraStatistics.framesRSSUnclassified = 0;
     pContext->extraStatistics.framesRSSError = 0;
+    pContext->extraStatistics.framesRSSHashDevice = 0;
+    pContext->extraStatistics.framesRSSHashDriver = 0;
 }
 
 /**********************************************************
@@ -408,6 +441,7 @@ static NDIS_STATUS OnSetVendorSpecific4(PARANDIS_ADAPTER *pContext, tOidDesc *pO
         pContext->extraStatistics.framesRxCSHwOK = 0;
         pContext->extraStatistics.framesCoalescedHost = 0;
         pContext->extraStatistics.framesCoalescedWindows = 0;
+        pContext->extraStatistics.framesCoalescedDriver = 0;
         pContext->extraStatistics.framesRxPriority = 0;
         pContext->extraStatistics.rxIndicatesWithResourcesFlag.QuadPart = 0;
         // keep this one
@@ -420,6 +454,11 @@ static NDIS_STATUS OnSetVendorSpecific4(PARANDIS_ADAPTER *pContext, tOidDesc *pO
         pContext->extraStatistics.framesCSOffload = 0;
         pContext->extraStatistics.droppedTxPackets = 0;
         pContext->extraStatistics.copiedTxPackets = 0;
+        pContext->extraStatistics.coalescedTxPackets = 0;
+        pContext->extraStatistics.framesSoftwareSegmented = 0;
+        pContext->extraStatistics.softwareSegments = 0;
+        pContext->extraStatistics.copiedTxBytes = 0;
+        pContext->extraStatistics.mappedTxBytes = 0;
         // keep this one
         pContext->extraStatistics.minFreeTxBuffers;
     }
@@ -550,7 +589,18 @@ static NDIS_STATUS ParaNdis_OidQuery(PARANDIS_ADAPTER *pContext, tOidDesc *pOid)
             u.InterruptModeration.Header.Size = NDIS_SIZEOF_INTERRUPT_MODERATION_PARAMETERS_REVISION_1;
             u.InterruptModeration.Header.Revision = NDIS_INTERRUPT_MODERATION_PARAMETERS_REVISION_1;
             u.InterruptModeration.Flags = 0;
-            u.InterruptModeration.InterruptModeration = NdisInterruptModerationNotSupported;
+            if (!pContext->bNotifyCoalescingSupported)
+            {
+                u.InterruptModeration.InterruptModeration = NdisInterruptModerationNotSupported;
+            }
+            else if (pContext->bInterruptModeration)
+            {
+                u.InterruptModeration.InterruptModeration = NdisInterruptModerationEnabled;
+            }
+            else
+            {
+                u.InterruptModeration.InterruptModeration = NdisInterruptModerationDisabled;
+            }
             pInfo = &u.InterruptModeration;
             ulSize = sizeof(u.InterruptModeration);
             break;
@@ -960,8 +1010,8 @@ void ParaNdis6_FillOffloadCapabilities(PARANDIS_ADAPTER *pContext)
     ParaNdis_ResetOffloadSettings(pContext, &f, NULL);
     FillOffloadStructure(po, f);
 #if PARANDIS_SUPPORT_RSC
-    po->Rsc.IPv4.Enabled = pContext->RSC.bIPv4SupportedHW;
-    po->Rsc.IPv6.Enabled = pContext->RSC.bIPv6SupportedHW;
+    po->Rsc.IPv4.Enabled = pContext->RSC.bIPv4SupportedHW || pContext->RSC.bIPv4Software;
+    po->Rsc.IPv6.Enabled = pContext->RSC.bIPv6SupportedHW || pContext->RSC.bIPv6Software;
 #endif
 }
 
@@ -1392,13 +1442,13 @@ static NDIS_STATUS OnSetRSCParameters(PPARANDIS_ADAPTER pContext, PNDIS_OFFLOAD_
     }
 
     if ((op->RscIPv4 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE) &&
-        (!pContext->RSC.bIPv4SupportedSW || !pContext->RSC.bIPv4SupportedHW))
+        (!pContext->RSC.bIPv4SupportedSW || !(pContext->RSC.bIPv4SupportedHW || pContext->RSC.bIPv4Software)))
     {
         return NDIS_STATUS_NOT_SUPPORTED;
     }
 
     if ((op->RscIPv6 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE) &&
-        (!pContext->RSC.bIPv6SupportedSW || !pContext->RSC.bIPv6SupportedHW))
+        (!pContext->RSC.bIPv6SupportedSW || !(pContext->RSC.bIPv6SupportedHW || pContext->RSC.bIPv6Software)))
     {
         return NDIS_STATUS_NOT_SUPPORTED;
     }
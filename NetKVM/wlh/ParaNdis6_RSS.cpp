@@ -29,6 +29,8 @@ static VOID ApplySettings(PPARANDIS_RSS_PARAMS RSSParameters,
         if (ReceiveHashingSettings != NULL)
         {
             RSSParameters->ActiveHashingSettings = *ReceiveHashingSettings;
+            ToeplitzBuildTable(&RSSParameters->ToeplitzTable,
+                               (const UCHAR *)RSSParameters->ActiveHashingSettings.HashSecretKey);
         }
 
         if (NewRSSMode == PARANDIS_RSS_MODE::PARANDIS_RSS_FULL && ReceiveScalingSettings != NULL)
@@ -714,39 +716,18 @@ typedef struct _tagHASH_CALC_SG_BUF_ENTRY
     ULONG chunkLen;
 } HASH_CALC_SG_BUF_ENTRY, *PHASH_CALC_SG_BUF_ENTRY;
 
-// Little Endian version ONLY
-static UINT32 ToeplitzHash(const PHASH_CALC_SG_BUF_ENTRY sgBuff, int sgEntriesNum, PCCHAR fullKey)
+static UINT32 ToeplitzHash(const PHASH_CALC_SG_BUF_ENTRY sgBuff, int sgEntriesNum, const tToeplitzTable *Table)
 {
-#define TOEPLITZ_MAX_BIT_NUM               (7)
-#define TOEPLITZ_BYTE_HAS_BIT(byte, bit)   ((byte) & (1 << (TOEPLITZ_MAX_BIT_NUM - (bit))))
-#define TOEPLITZ_BYTE_BIT_STATE(byte, bit) (((byte) >> (TOEPLITZ_MAX_BIT_NUM - (bit))) & 1)
-
-    UINT32 firstKeyWord, res = 0;
-    UINT byte, bit;
+    UINT32 res = 0;
+    ULONG position = 0;
     PHASH_CALC_SG_BUF_ENTRY sgEntry;
-    PCCHAR next_key_byte = fullKey + sizeof(firstKeyWord);
-    firstKeyWord = RtlUlongByteSwap(*(UINT32 *)fullKey);
 
     for (sgEntry = sgBuff; sgEntry < sgBuff + sgEntriesNum; ++sgEntry)
     {
-        for (byte = 0; byte < sgEntry->chunkLen; ++byte)
-        {
-            for (bit = 0; bit <= TOEPLITZ_MAX_BIT_NUM; ++bit)
-            {
-                if (TOEPLITZ_BYTE_HAS_BIT(sgEntry->chunkPtr[byte], bit))
-                {
-                    res ^= firstKeyWord;
-                }
-                firstKeyWord = (firstKeyWord << 1) | TOEPLITZ_BYTE_BIT_STATE(*next_key_byte, bit);
-            }
-            ++next_key_byte;
-        }
+        res ^= ToeplitzHashChunk(Table, (const UCHAR *)sgEntry->chunkPtr, sgEntry->chunkLen, position);
+        position += sgEntry->chunkLen;
     }
     return res;
-
-#undef TOEPLITZ_BYTE_HAS_BIT
-#undef TOEPLITZ_BYTE_BIT_STATE
-#undef TOEPLITZ_MAX_BIT_NUM
 }
 
 static __inline IPV6_ADDRESS *GetIP6SrcAddrForHash(PVOID dataBuffer, PNET_PACKET_INFO packetInfo, bool xEnabled)
@@ -784,7 +765,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
             sgBuff[1].chunkPtr = RtlOffsetToPointer(pTCPHeader, FIELD_OFFSET(TCPHeader, tcp_src));
             sgBuff[1].chunkLen = RTL_FIELD_SIZE(TCPHeader, tcp_src) + RTL_FIELD_SIZE(TCPHeader, tcp_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, &RSSParameters->ActiveHashingSettings.HashSecretKey[0]);
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, &RSSParameters->ToeplitzTable);
             packetInfo->RSSHash.Type = NDIS_HASH_TCP_IPV4;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -801,7 +782,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
             sgBuff[1].chunkPtr = RtlOffsetToPointer(pUDPHeader, FIELD_OFFSET(UDPHeader, udp_src));
             sgBuff[1].chunkLen = RTL_FIELD_SIZE(UDPHeader, udp_src) + RTL_FIELD_SIZE(UDPHeader, udp_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, &RSSParameters->ToeplitzTable);
             packetInfo->RSSHash.Type = NDIS_HASH_UDP_IPV4;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -815,7 +796,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
             sgBuff[0].chunkPtr = RtlOffsetToPointer(dataBuffer, chunkOffset);
             sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv4Header, ip_src) + RTL_FIELD_SIZE(IPv4Header, ip_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 1, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 1, &RSSParameters->ToeplitzTable);
             packetInfo->RSSHash.Type = NDIS_HASH_IPV4;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -838,7 +819,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
                 sgBuff[2].chunkPtr = RtlOffsetToPointer(pTCPHeader, FIELD_OFFSET(TCPHeader, tcp_src));
                 sgBuff[2].chunkLen = RTL_FIELD_SIZE(TCPHeader, tcp_src) + RTL_FIELD_SIZE(TCPHeader, tcp_dest);
 
-                packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, RSSParameters->ActiveHashingSettings.HashSecretKey);
+                packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, &RSSParameters->ToeplitzTable);
                 packetInfo->RSSHash.Type = xEnabled ? NDIS_HASH_TCP_IPV6_EX : NDIS_HASH_TCP_IPV6;
                 packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
                 return;
@@ -859,7 +840,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
             sgBuff[2].chunkPtr = RtlOffsetToPointer(pUDPHeader, FIELD_OFFSET(UDPHeader, udp_src));
             sgBuff[2].chunkLen = RTL_FIELD_SIZE(UDPHeader, udp_src) + RTL_FIELD_SIZE(UDPHeader, udp_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, &RSSParameters->ToeplitzTable);
             packetInfo->RSSHash.Type = xEnabled ? NDIS_HASH_UDP_IPV6_EX : NDIS_HASH_UDP_IPV6;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -875,7 +856,7 @@ static VOID RSSCalcHash_Unsafe(PARANDIS_RSS_PARAMS *RSSParameters, PVOID dataBuf
             sgBuff[1].chunkPtr = (PCHAR)GetIP6DstAddrForHash(dataBuffer, packetInfo, xEnabled);
             sgBuff[1].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_dst_address);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, &RSSParameters->ToeplitzTable);
             packetInfo->RSSHash.Type = xEnabled ? NDIS_HASH_IPV6_EX : NDIS_HASH_IPV6;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -899,6 +880,61 @@ VOID ParaNdis6_RSSAnalyzeReceivedPacket(PARANDIS_RSS_PARAMS *RSSParameters,
     }
 }
 
+ULONG ParaNdis6_RSSHashReportToHashType(USHORT report)
+{
+    static const ULONG table[VIRTIO_NET_HASH_REPORT_MAX + 1] = {
+#if (NDIS_SUPPORT_NDIS680)
+        0,
+        NDIS_HASH_IPV4,
+        NDIS_HASH_TCP_IPV4,
+        NDIS_HASH_UDP_IPV4,
+        NDIS_HASH_IPV6,
+        NDIS_HASH_TCP_IPV6,
+        NDIS_HASH_UDP_IPV6,
+        NDIS_HASH_IPV6_EX,
+        NDIS_HASH_TCP_IPV6_EX,
+        NDIS_HASH_UDP_IPV6_EX
+#else
+        0,
+        NDIS_HASH_IPV4,
+        NDIS_HASH_TCP_IPV4,
+        0,
+        NDIS_HASH_IPV6,
+        NDIS_HASH_TCP_IPV6,
+        0,
+        NDIS_HASH_IPV6_EX,
+        NDIS_HASH_TCP_IPV6_EX,
+        0
+#endif
+    };
+    if (report > VIRTIO_NET_HASH_REPORT_MAX)
+    {
+        return 0;
+    }
+    return table[report];
+}
+
+// the device hashes with the key and the hash types of SetDeviceRSSSettings,
+// so its report is used as is when its type is enabled
+bool ParaNdis6_RSSSetReportedHash(PARANDIS_RSS_PARAMS *RSSParameters,
+                                  USHORT hashReport,
+                                  ULONG hashValue,
+                                  PNET_PACKET_INFO packetInfo)
+{
+    CNdisDispatchReadAutoLock autoLock(RSSParameters->rwLock);
+    ULONG hashType = ParaNdis6_RSSHashReportToHashType(hashReport);
+
+    if (RSSParameters->RSSMode == PARANDIS_RSS_MODE::PARANDIS_RSS_DISABLED || !hashType ||
+        !(hashType & NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(RSSParameters->ActiveHashingSettings.HashInformation)))
+    {
+        return false;
+    }
+    packetInfo->RSSHash.Value = hashValue;
+    packetInfo->RSSHash.Type = hashType;
+    packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
+    return true;
+}
+
 CCHAR ParaNdis6_RSSGetScalingDataForPacket(PARANDIS_RSS_PARAMS *RSSParameters,
                                            PNET_PACKET_INFO packetInfo,
                                            PPROCESSOR_NUMBER targetProcessor)
@@ -133,7 +133,7 @@ void NdisPollHandler::HandlePoll(NDIS_POLL_DATA *PollData)
     if ((UINT)m_Index < m_AdapterContext->nPathBundles)
     {
         CPUPathBundle *bundle = &m_AdapterContext->pPathBundles[m_Index];
-        if (bundle->txPath.DoPendingTasks(NULL))
+        if (bundle->txPath.DoPendingTasks(true))
         {
             PollData->Transmit.NumberOfRemainingNbls = NDIS_ANY_NUMBER_OF_NBLS;
             DPrintf(POLL_PRINT_LEVEL, "[%s] TX #%d requests attention\n", __FUNCTION__, bundle->txPath.getQueueIndex());
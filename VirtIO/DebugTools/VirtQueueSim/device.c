@@ -0,0 +1,390 @@
+/*
+ * Simulated device side of a virtqueue
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "osdep.h"
+#include "virtio_pci.h"
+#include "virtio.h"
+#include "device.h"
+
+/* Ring layout as defined by the virtio specification */
+#define DESC_F_NEXT             1
+#define DESC_F_WRITE            2
+#define DESC_F_INDIRECT         4
+
+#define USED_F_NO_NOTIFY        1
+#define AVAIL_F_NO_INTERRUPT    1
+
+#define PACKED_DESC_F_AVAIL     (1 << 7)
+#define PACKED_DESC_F_USED      (1 << 15)
+#define PACKED_EVENT_F_ENABLE   0x0
+#define PACKED_EVENT_F_DISABLE  0x1
+#define PACKED_EVENT_F_DESC     0x2
+#define PACKED_EVENT_F_WRAP_CTR 15
+
+#include <pshpack1.h>
+
+struct split_desc {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+};
+
+struct split_avail {
+    u16 flags;
+    u16 idx;
+    u16 ring[];
+};
+
+struct split_used_elem {
+    u32 id;
+    u32 len;
+};
+
+struct split_used {
+    u16 flags;
+    u16 idx;
+    struct split_used_elem ring[];
+};
+
+struct packed_desc {
+    u64 addr;
+    u32 len;
+    u16 id;
+    u16 flags;
+};
+
+struct packed_event {
+    u16 off_wrap;
+    u16 flags;
+};
+
+#include <poppack.h>
+
+#define ACCESS(x)             (*(volatile __typeof__(x) *)&(x))
+
+#define split_used_event(dev) (((struct split_avail *)(dev)->avail)->ring[(dev)->num])
+#define split_avail_event(dev) \
+    (*(u16 *)&((struct split_used *)(dev)->used)->ring[(dev)->num])
+
+static inline bool need_event(u16 event_idx, u16 new_idx, u16 old)
+{
+    return (u16)(new_idx - event_idx - 1) < (u16)(new_idx - old);
+}
+
+void sim_device_init(struct sim_device *dev, bool packed, bool event_idx, bool in_order,
+                     unsigned int num, void *ring, unsigned long align)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->packed = packed;
+    dev->event_idx = event_idx;
+    dev->in_order = in_order;
+    dev->num = num;
+    if (packed) {
+        dev->desc = ring;
+        dev->driver_event = (u8 *)ring + num * sizeof(struct packed_desc);
+        dev->device_event = (u8 *)dev->driver_event + sizeof(struct packed_event);
+        dev->avail_wrap = true;
+        dev->used_wrap = true;
+        ((struct packed_event *)dev->device_event)->off_wrap = 1 << PACKED_EVENT_F_WRAP_CTR;
+        ((struct packed_event *)dev->device_event)->flags = event_idx ? PACKED_EVENT_F_DESC :
+                                                                        PACKED_EVENT_F_ENABLE;
+    } else {
+        struct split_avail *avail;
+        dev->desc = ring;
+        dev->avail = avail = (struct split_avail *)((u8 *)ring + num * sizeof(struct split_desc));
+        dev->used = (void *)(((ULONG_PTR)&avail->ring[num] + sizeof(u16) + align - 1) &
+                             ~((ULONG_PTR)align - 1));
+    }
+}
+
+/* Sums up the device-writable length of a descriptor table walked from index i */
+static u32 walk_table(struct sim_device *dev, struct split_desc *table, unsigned int size, u16 i)
+{
+    unsigned int n = 0;
+    u32 len = 0;
+
+    for (;;) {
+        u16 flags = ACCESS(table[i].flags);
+        if (++n > size || i >= size) {
+            dev->bad_chains++;
+            break;
+        }
+        dev->descriptors++;
+        if (flags & DESC_F_WRITE) {
+            len += ACCESS(table[i].len);
+        }
+        if (!(flags & DESC_F_NEXT)) {
+            break;
+        }
+        i = ACCESS(table[i].next);
+    }
+    return len;
+}
+
+static bool split_pop(struct sim_device *dev)
+{
+    struct split_avail *avail = dev->avail;
+    struct split_used *used = dev->used;
+    struct split_desc *desc = dev->desc;
+    u16 head;
+    u32 len;
+
+    if (dev->last_avail_idx == __atomic_load_n(&avail->idx, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    head = ACCESS(avail->ring[dev->last_avail_idx & (dev->num - 1)]);
+    dev->last_avail_idx++;
+
+    if (ACCESS(desc[head].flags) & DESC_F_INDIRECT) {
+        struct split_desc *table = (struct split_desc *)(ULONG_PTR)ACCESS(desc[head].addr);
+        dev->descriptors++;
+        len = walk_table(dev, table, ACCESS(desc[head].len) / sizeof(*table), 0);
+    } else {
+        len = walk_table(dev, desc, dev->num, head);
+    }
+
+    if (dev->in_order) {
+        dev->batch = true;
+        dev->batch_id = head;
+        dev->batch_len = len;
+        return true;
+    }
+    used->ring[dev->used_idx & (dev->num - 1)].id = head;
+    used->ring[dev->used_idx & (dev->num - 1)].len = len;
+    dev->used_idx++;
+    return true;
+}
+
+static void split_publish(struct sim_device *dev)
+{
+    struct split_used *used = dev->used;
+    struct split_avail *avail = dev->avail;
+    bool notify;
+
+    if (dev->batch) {
+        used->ring[dev->used_idx & (dev->num - 1)].id = dev->batch_id;
+        used->ring[dev->used_idx & (dev->num - 1)].len = dev->batch_len;
+        dev->used_idx++;
+        dev->batch = false;
+    }
+    __atomic_store_n(&used->idx, dev->used_idx, __ATOMIC_RELEASE);
+    __sync_synchronize();
+    if (dev->event_idx) {
+        notify = need_event(ACCESS(split_used_event(dev)), dev->used_idx, dev->signalled_used);
+    } else {
+        notify = !(ACCESS(avail->flags) & AVAIL_F_NO_INTERRUPT);
+    }
+    dev->signalled_used = dev->used_idx;
+    if (notify) {
+        dev->interrupts++;
+        __atomic_store_n(&dev->interrupt, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void split_notifications(struct sim_device *dev, bool enable)
+{
+    struct split_used *used = dev->used;
+
+    if (dev->event_idx) {
+        if (enable) {
+            ACCESS(split_avail_event(dev)) = dev->last_avail_idx;
+        }
+    } else {
+        ACCESS(used->flags) = enable ? 0 : USED_F_NO_NOTIFY;
+    }
+}
+
+static bool packed_pop(struct sim_device *dev)
+{
+    struct packed_desc *desc = dev->desc;
+    u16 flags = __atomic_load_n(&desc[dev->next_avail].flags, __ATOMIC_ACQUIRE);
+    u16 head = dev->next_avail, id, n = 0;
+    u32 len = 0;
+
+    if (!!(flags & PACKED_DESC_F_AVAIL) != dev->avail_wrap ||
+        !!(flags & PACKED_DESC_F_USED) == dev->avail_wrap) {
+        return false;
+    }
+
+    for (;;) {
+        u16 pos = dev->next_avail;
+        flags = ACCESS(desc[pos].flags);
+        id = ACCESS(desc[pos].id);
+        dev->descriptors++;
+        if (flags & DESC_F_INDIRECT) {
+            struct packed_desc *table = (struct packed_desc *)(ULONG_PTR)ACCESS(desc[pos].addr);
+            unsigned int i, size = ACCESS(desc[pos].len) / sizeof(*table);
+            for (i = 0; i < size; i++) {
+                dev->descriptors++;
+                if (table[i].flags & DESC_F_WRITE) {
+                    len += table[i].len;
+                }
+            }
+        } else if (flags & DESC_F_WRITE) {
+            len += ACCESS(desc[pos].len);
+        }
+        n++;
+        if (++dev->next_avail >= dev->num) {
+            dev->next_avail = 0;
+            dev->avail_wrap = !dev->avail_wrap;
+        }
+        if (!(flags & DESC_F_NEXT)) {
+            break;
+        }
+        if (n >= dev->num) {
+            dev->bad_chains++;
+            break;
+        }
+    }
+
+    /* The device completes in order, so the used entry overwrites the chain head */
+    if (dev->in_order) {
+        /* Written at the position of the first chain of the batch when published */
+        if (!dev->batch) {
+            dev->batch = true;
+            dev->batch_pos = head;
+            dev->batch_wrap = dev->used_wrap;
+        }
+        dev->batch_id = id;
+        dev->batch_len = len;
+    } else {
+        ACCESS(desc[head].id) = id;
+        ACCESS(desc[head].len) = len;
+        __atomic_store_n(&desc[head].flags,
+                         (u16)(dev->used_wrap ? (PACKED_DESC_F_AVAIL | PACKED_DESC_F_USED) : 0),
+                         __ATOMIC_RELEASE);
+    }
+    dev->used_pos += n;
+    if (dev->used_pos >= dev->num) {
+        dev->used_pos -= (u16)dev->num;
+        dev->used_wrap = !dev->used_wrap;
+    }
+    return true;
+}
+
+/* Packed ring positions extended by the wrap counter: free-running modulo 2 * num,
+ * so a batch covering the whole ring is not mistaken for an empty one */
+static inline u16 packed_ext_idx(struct sim_device *dev, u16 pos, bool wrap)
+{
+    return wrap ? pos : (u16)(pos + dev->num);
+}
+
+static void packed_publish(struct sim_device *dev)
+{
+    struct packed_event *event = dev->driver_event;
+    u16 mask = (u16)(2 * dev->num - 1);
+    u16 flags, off_wrap, new_idx;
+    bool notify;
+
+    if (dev->batch) {
+        struct packed_desc *desc = dev->desc;
+
+        ACCESS(desc[dev->batch_pos].id) = dev->batch_id;
+        ACCESS(desc[dev->batch_pos].len) = dev->batch_len;
+        __atomic_store_n(&desc[dev->batch_pos].flags,
+                         (u16)(dev->batch_wrap ? (PACKED_DESC_F_AVAIL | PACKED_DESC_F_USED) : 0),
+                         __ATOMIC_RELEASE);
+        dev->batch = false;
+    }
+    __sync_synchronize();
+    flags = ACCESS(event->flags);
+    off_wrap = ACCESS(event->off_wrap);
+    new_idx = packed_ext_idx(dev, dev->used_pos, dev->used_wrap);
+    if (flags == PACKED_EVENT_F_DESC) {
+        u16 event_idx = packed_ext_idx(dev,
+                                       off_wrap & ~(1 << PACKED_EVENT_F_WRAP_CTR),
+                                       off_wrap >> PACKED_EVENT_F_WRAP_CTR);
+        notify = ((u16)(new_idx - event_idx - 1) & mask) <
+                 ((u16)(new_idx - dev->signalled_used) & mask);
+    } else {
+        notify = flags != PACKED_EVENT_F_DISABLE;
+    }
+    dev->signalled_used = new_idx;
+    if (notify) {
+        dev->interrupts++;
+        __atomic_store_n(&dev->interrupt, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void packed_notifications(struct sim_device *dev, bool enable)
+{
+    struct packed_event *event = dev->device_event;
+
+    if (!enable) {
+        ACCESS(event->flags) = PACKED_EVENT_F_DISABLE;
+    } else if (dev->event_idx) {
+        ACCESS(event->off_wrap) = dev->next_avail |
+                                  (u16)(dev->avail_wrap << PACKED_EVENT_F_WRAP_CTR);
+        __sync_synchronize();
+        ACCESS(event->flags) = PACKED_EVENT_F_DESC;
+    } else {
+        ACCESS(event->flags) = PACKED_EVENT_F_ENABLE;
+    }
+}
+
+unsigned int sim_device_run(struct sim_device *dev, unsigned int budget)
+{
+    unsigned int done = 0;
+    bool (*pop)(struct sim_device *) = dev->packed ? packed_pop : split_pop;
+    void (*publish)(struct sim_device *) = dev->packed ? packed_publish : split_publish;
+    void (*notifications)(struct sim_device *, bool) = dev->packed ? packed_notifications :
+                                                                     split_notifications;
+
+    if (!dev->active) {
+        if (!__atomic_exchange_n(&dev->kicked, 0, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        dev->active = true;
+        notifications(dev, false);
+    }
+
+    while (done < budget && pop(dev)) {
+        done++;
+    }
+    if (done) {
+        dev->chains += done;
+        publish(dev);
+    }
+
+    if (done < budget) {
+        /* Out of work: ask for kicks and re-check to close the race with the driver */
+        notifications(dev, true);
+        __sync_synchronize();
+        if (pop(dev)) {
+            notifications(dev, false);
+            dev->chains++;
+            done++;
+            publish(dev);
+        } else {
+            dev->active = false;
+        }
+    }
+    return done;
+}
@@ -0,0 +1,104 @@
+/*
+ * Simulated device side of a virtqueue
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* The device consumes the driver area of the ring and produces the device area,
+ * the same way vhost does: it suppresses kicks while it is processing and
+ * re-enables them (and re-checks the ring) only when it runs out of work.
+ * Buffers are never dereferenced, except for indirect descriptor tables
+ * whose "physical" address is the virtual address of the table. */
+struct sim_device {
+    bool packed;
+    bool event_idx;
+    bool in_order;
+    unsigned int num;
+
+    /* split layout */
+    void *desc;
+    void *avail;
+    void *used;
+    u16 last_avail_idx;
+    u16 used_idx;
+
+    /* packed layout */
+    void *driver_event;
+    void *device_event;
+    u16 next_avail;
+    u16 used_pos;
+    bool avail_wrap;
+    bool used_wrap;
+
+    u16 signalled_used;
+
+    /* in-order mode: one used entry is written per batch, for its last chain */
+    bool batch;
+    u16 batch_id;
+    u32 batch_len;
+    u16 batch_pos;
+    bool batch_wrap;
+
+    /* true while the device processes without waiting for a kick */
+    bool active;
+    /* set by the driver's notification callback */
+    volatile LONG kicked;
+    /* set by the device when it decides to interrupt the driver */
+    volatile LONG interrupt;
+
+    ULONGLONG chains;
+    ULONGLONG descriptors;
+    ULONGLONG interrupts;
+    ULONGLONG bad_chains;
+};
+
+void sim_device_init(struct sim_device *dev, bool packed, bool event_idx, bool in_order,
+                     unsigned int num, void *ring, unsigned long align);
+
+/* Consumes up to budget chains if the device was kicked or is still active,
+ * returns the number of chains consumed */
+unsigned int sim_device_run(struct sim_device *dev, unsigned int budget);
+
+static inline void sim_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline void sim_device_kick(struct sim_device *dev)
+{
+    __atomic_store_n(&dev->kicked, 1, __ATOMIC_RELEASE);
+}
+
+static inline bool sim_device_take_interrupt(struct sim_device *dev)
+{
+    return __atomic_exchange_n(&dev->interrupt, 0, __ATOMIC_ACQUIRE) != 0;
+}
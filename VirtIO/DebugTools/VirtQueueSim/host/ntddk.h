@@ -0,0 +1,119 @@
+/*
+ * Minimal user-mode replacement of the WDK definitions used by the
+ * virtqueue implementation (VirtIORing.c, VirtIORing-Packed.c) so the
+ * ring code can be compiled and exercised on a Linux host.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+/* Windows integer types are LLP64, keep the sizes used by the ring layout */
+typedef unsigned char UCHAR;
+typedef unsigned char BOOLEAN;
+typedef unsigned short USHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef void *PVOID;
+typedef int32_t NTSTATUS;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, PHYSICAL_ADDRESS;
+
+typedef struct _PCI_COMMON_HEADER *PPCI_COMMON_HEADER;
+
+/* Take over linux/types.h: its 'unsigned long' based u32 is 64 bits wide here */
+#define _LINUX_TYPES_H
+#define __bitwise__
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint16_t __le16;
+typedef uint32_t __u32;
+typedef uint32_t __le32;
+typedef uint64_t __u64;
+
+#define TRUE                          1
+#define FALSE                         0
+
+#define STATUS_SUCCESS                ((NTSTATUS)0x00000000L)
+#define STATUS_INVALID_PARAMETER      ((NTSTATUS)0xC000000DL)
+#define STATUS_DEVICE_NOT_CONNECTED   ((NTSTATUS)0xC000009DL)
+#define NT_SUCCESS(Status)            (((NTSTATUS)(Status)) >= 0)
+
+#define PAGE_SIZE                     4096
+#define MAXUSHORT                     0xffff
+#define ARRAYSIZE(a)                  (sizeof(a) / sizeof((a)[0]))
+
+#define __forceinline                 __inline__
+
+#define ASSERT(x)                     assert(x)
+#define KeBugCheck(code)              abort()
+#define KeMemoryBarrier()             __sync_synchronize()
+#define ReadUShortAcquire(Source)     __atomic_load_n((Source), __ATOMIC_ACQUIRE)
+#define WriteUShortRelease(Dest, V)   __atomic_store_n((Dest), (V), __ATOMIC_RELEASE)
+#define PF_TEMPORAL_LEVEL_1           3
+#define PreFetchCacheLine(l, a)       __builtin_prefetch((a), 0, (l))
+#if defined(__i386__) || defined(__x86_64__)
+#define YieldProcessor()              __builtin_ia32_pause()
+#else
+#define YieldProcessor()              __asm__ __volatile__("" ::: "memory")
+#endif
+#define RtlZeroMemory(Destination, L) memset((Destination), 0, (L))
+#define UNREFERENCED_PARAMETER(P)     ((void)(P))
+
+/* Nanosecond resolution */
+static inline LARGE_INTEGER KeQueryPerformanceCounter(LARGE_INTEGER *PerformanceFrequency)
+{
+    struct timespec ts;
+    LARGE_INTEGER counter;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    counter.QuadPart = (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (PerformanceFrequency) {
+        PerformanceFrequency->QuadPart = 1000000000;
+    }
+    return counter;
+}
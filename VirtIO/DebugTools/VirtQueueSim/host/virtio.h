@@ -0,0 +1,2 @@
+/* The ring sources include "virtio.h", the header is VirtIO.h */
+#include "VirtIO.h"
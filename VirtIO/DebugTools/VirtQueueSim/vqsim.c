@@ -0,0 +1,642 @@
+/*
+ * Host-side virtqueue simulator and microbenchmark
+ *
+ * Runs the split and packed ring implementations of VirtioLib against a
+ * simulated device and reports throughput, notification and interrupt
+ * counts and (when available) cache misses per operation.
+ *
+ * Copyright (c) 2024 Red Hat, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "osdep.h"
+#include "virtio_pci.h"
+#include "virtio.h"
+#include "kdebugprint.h"
+#include "virtio_ring.h"
+#include "windows/virtio_ring_allocation.h"
+#include "device.h"
+#include "perf.h"
+
+#define SIM_MAX_CHAIN     64
+#define SIM_SEGMENT_SIZE  1536
+#define SIM_MAX_BATCH     64
+
+int virtioDebugLevel = 0;
+int bDebugPrint = 1;
+
+static void sim_debug_print(const char *format, ...)
+{
+    va_list list;
+    va_start(list, format);
+    vfprintf(stderr, format, list);
+    va_end(list);
+}
+
+tDebugPrintFunc VirtioDebugPrintProc = sim_debug_print;
+
+/* With a single CPU the spinning side must let the other one run */
+static bool yield_on_spin;
+
+static void spin_wait(void)
+{
+    if (yield_on_spin) {
+        sched_yield();
+    } else {
+        sim_cpu_relax();
+    }
+}
+
+struct sim_config {
+    unsigned int num;
+    unsigned int chain;
+    unsigned int indirect_percent;
+    unsigned int burst;
+    unsigned int budget;
+    ULONGLONG ops;
+    bool packed;
+    bool event_idx;
+    bool threaded;
+    bool batched;
+    bool in_order;
+    unsigned int coalescing_delay;
+    unsigned int pool_sg;
+    unsigned int busy_poll_us;
+    bool pool_blocks;
+};
+
+struct sim_request {
+    struct sim_request *next_free;
+    u32 expected_len;
+    void *va_indirect;
+};
+
+struct sim_stats {
+    ULONGLONG adds;
+    ULONGLONG gets;
+    ULONGLONG kick_checks;
+    ULONGLONG kicks;
+    ULONGLONG enospc;
+    ULONGLONG errors;
+    ULONGLONG interrupts;
+    ULONGLONG descriptors;
+    LONGLONG cache_misses;
+    double seconds;
+    ULONGLONG poll_hits;
+    ULONGLONG poll_misses;
+    bool has_queue_stats;
+    struct virtqueue_stats queue;
+};
+
+struct sim_queue {
+    VirtIODevice vdev;
+    struct virtqueue *vq;
+    void *ring;
+    void *control;
+    struct sim_device dev;
+    struct sim_request *requests;
+    struct sim_request *free_list;
+    u8 *indirect_pages;
+    void *indirect_pool;
+    void **pool_block_va;
+    ULONGLONG *pool_block_pa;
+    unsigned int pool_blocks;
+    volatile LONG stop;
+    ULONGLONG kicks;
+};
+
+static struct sim_queue *queue_of(struct virtqueue *vq)
+{
+    return (struct sim_queue *)vq->vdev;
+}
+
+/* VirtioLib entry points normally provided by VirtIOPCICommon.c */
+void virtqueue_notify(struct virtqueue *vq)
+{
+    vq->notification_cb(vq);
+}
+
+void virtqueue_kick(struct virtqueue *vq)
+{
+    if (virtqueue_kick_prepare(vq)) {
+        virtqueue_notify(vq);
+    }
+}
+
+static void sim_notify(struct virtqueue *vq)
+{
+    struct sim_queue *q = queue_of(vq);
+    q->kicks++;
+    sim_device_kick(&q->dev);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool sim_queue_create(struct sim_queue *q, const struct sim_config *cfg)
+{
+    unsigned long ring_size = vring_size(cfg->num, PAGE_SIZE, cfg->packed);
+    unsigned int i;
+
+    memset(q, 0, sizeof(*q));
+    q->vdev.event_suppression_enabled = cfg->event_idx;
+    q->vdev.packed_ring = cfg->packed;
+    q->vdev.in_order = cfg->in_order;
+
+    ring_size = (ring_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    q->ring = aligned_alloc(PAGE_SIZE, ring_size);
+    q->control = calloc(1, vring_control_block_size((u16)cfg->num, cfg->packed));
+    q->requests = calloc(cfg->num, sizeof(*q->requests));
+    q->indirect_pages = aligned_alloc(PAGE_SIZE, (size_t)cfg->num * PAGE_SIZE);
+    if (!q->ring || !q->control || !q->requests || !q->indirect_pages) {
+        return false;
+    }
+    memset(q->ring, 0, ring_size);
+
+    if (cfg->packed) {
+        q->vq = vring_new_virtqueue_packed(0, cfg->num, PAGE_SIZE, &q->vdev, q->ring, sim_notify,
+                                           q->control);
+    } else {
+        q->vq = vring_new_virtqueue_split(0, cfg->num, PAGE_SIZE, &q->vdev, q->ring, sim_notify,
+                                          q->control);
+    }
+    if (!q->vq) {
+        return false;
+    }
+    if (cfg->pool_sg && cfg->pool_blocks) {
+        /* The layout of virtio_alloc_indirect_pool: a page of tables per block */
+        size_t table_size = virtqueue_indirect_pool_size(1, cfg->pool_sg);
+        unsigned int per_block = table_size < PAGE_SIZE ? (unsigned int)(PAGE_SIZE / table_size) : 1;
+        size_t block_size = (virtqueue_indirect_pool_size(per_block, cfg->pool_sg) + PAGE_SIZE - 1) &
+                            ~(PAGE_SIZE - 1);
+
+        q->pool_blocks = (cfg->num + per_block - 1) / per_block;
+        q->pool_block_va = calloc(q->pool_blocks, sizeof(*q->pool_block_va));
+        q->pool_block_pa = calloc(q->pool_blocks, sizeof(*q->pool_block_pa));
+        if (!q->pool_block_va || !q->pool_block_pa) {
+            return false;
+        }
+        for (i = 0; i < q->pool_blocks; i++) {
+            q->pool_block_va[i] = aligned_alloc(PAGE_SIZE, block_size);
+            if (!q->pool_block_va[i]) {
+                return false;
+            }
+            q->pool_block_pa[i] = (ULONGLONG)(ULONG_PTR)q->pool_block_va[i];
+        }
+        virtqueue_set_indirect_pool_blocks(q->vq, q->pool_block_va, q->pool_block_pa, per_block,
+                                           cfg->pool_sg);
+    } else if (cfg->pool_sg) {
+        size_t pool_size = virtqueue_indirect_pool_size(cfg->num, cfg->pool_sg);
+
+        q->indirect_pool = aligned_alloc(PAGE_SIZE, (pool_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+        if (!q->indirect_pool) {
+            return false;
+        }
+        virtqueue_set_indirect_pool(q->vq, q->indirect_pool, (ULONGLONG)(ULONG_PTR)q->indirect_pool,
+                                    cfg->pool_sg);
+    }
+    if (cfg->coalescing_delay) {
+        virtqueue_set_coalescing(q->vq, VIRTQUEUE_COALESCING_ADAPTIVE, cfg->coalescing_delay, 0);
+    }
+    if (cfg->busy_poll_us) {
+        virtqueue_set_busy_poll(q->vq, cfg->busy_poll_us, 0);
+    }
+    sim_device_init(&q->dev, cfg->packed, cfg->event_idx, cfg->in_order, cfg->num, q->ring,
+                    PAGE_SIZE);
+
+    /* One request per ring slot, each with its own indirect table */
+    for (i = 0; i < cfg->num; i++) {
+        q->requests[i].va_indirect = q->indirect_pages + (size_t)i * PAGE_SIZE;
+        q->requests[i].next_free = q->free_list;
+        q->free_list = &q->requests[i];
+    }
+    return true;
+}
+
+static void sim_queue_destroy(struct sim_queue *q)
+{
+    unsigned int i;
+
+    for (i = 0; q->pool_block_va && i < q->pool_blocks; i++) {
+        free(q->pool_block_va[i]);
+    }
+    free(q->pool_block_va);
+    free(q->pool_block_pa);
+    free(q->indirect_pool);
+    free(q->indirect_pages);
+    free(q->requests);
+    free(q->control);
+    free(q->ring);
+}
+
+static void *device_thread(void *param)
+{
+    struct sim_queue *q = param;
+    while (!__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE)) {
+        if (!sim_device_run(&q->dev, (unsigned int)-1)) {
+            spin_wait();
+        }
+    }
+    return NULL;
+}
+
+/* Returns completed buffers to the request pool the way a driver DPC does:
+ * with callbacks disabled, re-enabling them when the used ring is drained */
+static ULONGLONG harvest(struct sim_queue *q, bool batched, bool delayed, struct sim_stats *stats)
+{
+    ULONGLONG done = 0;
+    struct sim_request *req;
+    unsigned int len;
+
+    do {
+        virtqueue_disable_cb(q->vq);
+        if (batched) {
+            void *reqs[SIM_MAX_BATCH];
+            unsigned int lens[SIM_MAX_BATCH], n, i;
+
+            while ((n = virtqueue_get_bufs(q->vq, reqs, lens, SIM_MAX_BATCH)) != 0) {
+                for (i = 0; i < n; i++) {
+                    req = reqs[i];
+                    if (req < q->requests || req >= q->requests + q->dev.num ||
+                        lens[i] != req->expected_len) {
+                        stats->errors++;
+                    }
+                    req->next_free = q->free_list;
+                    q->free_list = req;
+                }
+                done += n;
+            }
+        } else {
+            while ((req = virtqueue_get_buf(q->vq, &len)) != NULL) {
+                if (req < q->requests || req >= q->requests + q->dev.num ||
+                    len != req->expected_len) {
+                    stats->errors++;
+                }
+                req->next_free = q->free_list;
+                q->free_list = req;
+                done++;
+            }
+        }
+    } while (!(delayed ? virtqueue_enable_cb_delayed(q->vq) : virtqueue_enable_cb(q->vq)));
+
+    stats->gets += done;
+    return done;
+}
+
+static int run_one(const struct sim_config *cfg, struct sim_stats *stats)
+{
+    struct scatterlist sg[SIM_MAX_CHAIN];
+    struct sim_queue q;
+    pthread_t thread;
+    ULONGLONG submitted = 0, completed = 0;
+    unsigned int i, out, in, seed = 1;
+    u32 expected_len = 0;
+    int perf_fd;
+    double start;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!sim_queue_create(&q, cfg)) {
+        fprintf(stderr, "Failed to create the virtqueue\n");
+        sim_queue_destroy(&q);
+        return -1;
+    }
+
+    /* One device-readable header followed by device-writable segments */
+    out = cfg->chain > 1 ? 1 : 0;
+    in = cfg->chain - out;
+    for (i = 0; i < cfg->chain; i++) {
+        sg[i].physAddr.QuadPart = 0x100000ULL + (ULONGLONG)i * PAGE_SIZE;
+        sg[i].length = i < out ? 12 : SIM_SEGMENT_SIZE;
+        if (i >= out) {
+            expected_len += sg[i].length;
+        }
+    }
+
+    perf_fd = perf_cache_misses_open();
+    if (cfg->threaded && pthread_create(&thread, NULL, device_thread, &q)) {
+        fprintf(stderr, "Failed to start the device thread\n");
+        sim_queue_destroy(&q);
+        return -1;
+    }
+    perf_cache_misses_start(perf_fd);
+    start = now_seconds();
+
+    while (completed < cfg->ops) {
+        unsigned int posted = 0;
+        bool full = !q.free_list;
+
+        while (cfg->batched && submitted < cfg->ops && posted < cfg->burst && q.free_list) {
+            struct virtqueue_buf bufs[SIM_MAX_BATCH];
+            struct sim_request *req = q.free_list;
+            unsigned int n, added;
+
+            /* Chains are taken from the head of the free list only when added */
+            for (n = 0; n < SIM_MAX_BATCH && req && submitted + n < cfg->ops &&
+                        posted + n < cfg->burst;
+                 n++, req = req->next_free) {
+                bool indirect;
+
+                seed = seed * 1103515245 + 12345;
+                indirect = ((seed >> 16) % 100) < cfg->indirect_percent;
+                req->expected_len = expected_len;
+                bufs[n].sg = sg;
+                bufs[n].out_num = out;
+                bufs[n].in_num = in;
+                bufs[n].opaque = req;
+                bufs[n].va_indirect = indirect ? req->va_indirect : NULL;
+                bufs[n].phys_indirect = indirect ? (ULONGLONG)(ULONG_PTR)req->va_indirect : 0;
+            }
+            added = virtqueue_add_bufs(q.vq, bufs, n);
+            for (i = 0; i < added; i++) {
+                q.free_list = q.free_list->next_free;
+            }
+            submitted += added;
+            posted += added;
+            if (added < n) {
+                stats->enospc++;
+                full = true;
+                break;
+            }
+        }
+
+        while (!cfg->batched && submitted < cfg->ops && posted < cfg->burst && q.free_list) {
+            struct sim_request *req = q.free_list;
+            bool indirect;
+
+            seed = seed * 1103515245 + 12345;
+            indirect = ((seed >> 16) % 100) < cfg->indirect_percent;
+            req->expected_len = expected_len;
+            if (virtqueue_add_buf(q.vq,
+                                  sg,
+                                  out,
+                                  in,
+                                  req,
+                                  indirect ? req->va_indirect : NULL,
+                                  indirect ? (ULONGLONG)(ULONG_PTR)req->va_indirect : 0) < 0) {
+                stats->enospc++;
+                full = true;
+                break;
+            }
+            q.free_list = req->next_free;
+            submitted++;
+            posted++;
+        }
+        stats->adds += posted;
+
+        if (posted) {
+            stats->kick_checks++;
+            if (virtqueue_kick_prepare(q.vq)) {
+                virtqueue_notify(q.vq);
+            }
+        }
+
+        if (!cfg->threaded) {
+            sim_device_run(&q.dev, cfg->budget);
+        }
+
+        /* The way the storage drivers poll after a kick, before the interrupt */
+        if (posted && virtqueue_busy_poll(q.vq)) {
+            completed += harvest(&q, cfg->batched, cfg->coalescing_delay != 0, stats);
+        }
+
+        if (sim_device_take_interrupt(&q.dev) || full || submitted == cfg->ops) {
+            ULONGLONG done = harvest(&q, cfg->batched, cfg->coalescing_delay != 0, stats);
+            if (!done && !posted && cfg->threaded) {
+                spin_wait();
+            }
+            completed += done;
+        }
+    }
+
+    stats->seconds = now_seconds() - start;
+    if (cfg->threaded) {
+        __atomic_store_n(&q.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(thread, NULL);
+    }
+    stats->cache_misses = perf_cache_misses_stop(perf_fd);
+
+    stats->has_queue_stats = virtqueue_get_stats(q.vq, &stats->queue);
+    stats->poll_hits = q.vq->busy_poll.hits;
+    stats->poll_misses = q.vq->busy_poll.misses;
+    stats->kicks = q.kicks;
+    stats->interrupts = q.dev.interrupts;
+    stats->descriptors = q.dev.descriptors;
+    stats->errors += q.dev.bad_chains;
+    if (stats->gets != stats->adds || q.dev.chains != stats->adds) {
+        stats->errors++;
+    }
+    sim_queue_destroy(&q);
+    return stats->errors ? 1 : 0;
+}
+
+static void print_header(void)
+{
+    printf("%-6s %-5s %-5s %-6s %5s %5s %5s %5s %10s %9s %9s %9s %8s %11s %s\n",
+           "layout", "evidx", "order", "api", "qsize", "chain", "ind%", "burst", "ops", "Mops/s", "kicks/op",
+           "irqs/op", "enospc", "cmisses/op", "result");
+}
+
+static void print_result(const struct sim_config *cfg, const struct sim_stats *stats)
+{
+    double ops = (double)stats->gets;
+    char misses[32];
+
+    if (stats->cache_misses >= 0) {
+        snprintf(misses, sizeof(misses), "%.3f", stats->cache_misses / ops);
+    } else {
+        snprintf(misses, sizeof(misses), "n/a");
+    }
+    printf("%-6s %-5s %-5s %-6s %5u %5u %5u %5u %10llu %9.3f %9.4f %9.4f %8llu %11s %s\n",
+           cfg->packed ? "packed" : "split", cfg->event_idx ? "yes" : "no",
+           cfg->in_order ? "in" : "any", cfg->batched ? "batch" : "single", cfg->num, cfg->chain,
+           cfg->indirect_percent, cfg->burst, (unsigned long long)stats->gets,
+           ops / stats->seconds / 1e6, stats->kicks / ops, stats->interrupts / ops,
+           (unsigned long long)stats->enospc, misses, stats->errors ? "FAILED" : "OK");
+}
+
+/* Counters collected by VirtioLib itself when built with VIRTIO_QUEUE_STATS */
+static void print_queue_stats(const struct virtqueue_stats *stats)
+{
+    unsigned int i;
+
+    printf("queue: adds %llu gets %llu kicks %llu suppressed %llu enospc %llu indirect %llu "
+           "in-flight avg %.1f max %u\n",
+           (unsigned long long)stats->adds, (unsigned long long)stats->gets,
+           (unsigned long long)stats->kicks, (unsigned long long)stats->kicks_suppressed,
+           (unsigned long long)stats->enospc, (unsigned long long)stats->indirect,
+           stats->adds ? (double)stats->in_flight_sum / stats->adds : 0.0, stats->max_in_flight);
+    printf("latency, units of 1/%llu s:\n", (unsigned long long)stats->latency_frequency);
+    for (i = 0; i < VIRTQUEUE_STATS_LATENCY_BUCKETS; i++) {
+        if (stats->latency[i]) {
+            printf("  %12llu+ %12llu\n", i ? 1ULL << i : 0ULL,
+                   (unsigned long long)stats->latency[i]);
+        }
+    }
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "  -q <num>    queue size, power of 2 (default 256)\n"
+           "  -c <num>    descriptors per chain, 1..%u (default 2)\n"
+           "  -i <pct>    percentage of chains added as indirect (default 0)\n"
+           "  -b <num>    chains added between kick checks (default 16)\n"
+           "  -d <num>    chains the device consumes per step (default unlimited)\n"
+           "  -n <num>    operations to run (default 10000000)\n"
+           "  -p          use the packed ring layout\n"
+           "  -E          do not negotiate VIRTIO_RING_F_EVENT_IDX\n"
+           "  -t          run the device in its own thread instead of inline\n"
+           "  -B          use virtqueue_add_bufs/virtqueue_get_bufs instead of single buffers\n"
+           "  -O          negotiate VIRTIO_F_IN_ORDER, the device returns one used entry per batch\n"
+           "  -I <num>    indirect table pool of the queue, tables of num descriptors;\n"
+           "              chains not made indirect by -i are left to the pool\n"
+           "  -G          with -I, the pool in page-sized blocks (virtio_alloc_indirect_pool)\n"
+           "  -a <usec>   adaptive interrupt coalescing with the given maximal delay\n"
+           "  -P <usec>   busy poll the used ring for up to usec after each kick\n"
+           "  -m          run the whole matrix of layouts, sizes, chains and indirect mixes\n",
+           name, SIM_MAX_CHAIN);
+}
+
+int main(int argc, char **argv)
+{
+    struct sim_config cfg = {256,   2,     0,    16,    (unsigned int)-1, 10000000, false,
+                             true,  false, false, false, 0,                0,        0,
+                             false};
+    struct sim_stats stats;
+    bool matrix = false;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "q:c:i:b:d:n:pEtBOa:I:GP:mh")) != -1) {
+        switch (opt) {
+            case 'q':
+                cfg.num = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                cfg.chain = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                cfg.indirect_percent = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                cfg.burst = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                cfg.budget = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                cfg.ops = strtoull(optarg, NULL, 0);
+                break;
+            case 'p':
+                cfg.packed = true;
+                break;
+            case 'E':
+                cfg.event_idx = false;
+                break;
+            case 't':
+                cfg.threaded = true;
+                break;
+            case 'B':
+                cfg.batched = true;
+                break;
+            case 'O':
+                cfg.in_order = true;
+                break;
+            case 'I':
+                cfg.pool_sg = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'G':
+                cfg.pool_blocks = true;
+                break;
+            case 'a':
+                cfg.coalescing_delay = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'P':
+                cfg.busy_poll_us = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                matrix = true;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (cfg.num < 2 || cfg.num > 32768 || (cfg.num & (cfg.num - 1)) || cfg.chain < 1 ||
+        cfg.chain > SIM_MAX_CHAIN || cfg.indirect_percent > 100 || !cfg.burst || !cfg.budget) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    yield_on_spin = cfg.threaded && sysconf(_SC_NPROCESSORS_ONLN) < 2;
+    print_header();
+    if (matrix) {
+        static const unsigned int sizes[] = {64, 256, 1024};
+        static const unsigned int chains[] = {1, 2, 4, 16};
+        static const unsigned int indirect[] = {0, 50, 100};
+        unsigned int p, s, c, i;
+
+        for (p = 0; p < 2; p++) {
+            for (s = 0; s < ARRAYSIZE(sizes); s++) {
+                for (c = 0; c < ARRAYSIZE(chains); c++) {
+                    for (i = 0; i < ARRAYSIZE(indirect); i++) {
+                        cfg.packed = p != 0;
+                        cfg.num = sizes[s];
+                        cfg.chain = chains[c];
+                        cfg.indirect_percent = indirect[i];
+                        if (cfg.chain > cfg.num) {
+                            continue;
+                        }
+                        failed |= run_one(&cfg, &stats);
+                        print_result(&cfg, &stats);
+                    }
+                }
+            }
+        }
+    } else {
+        failed = run_one(&cfg, &stats);
+        print_result(&cfg, &stats);
+        if (cfg.busy_poll_us) {
+            printf("busy poll: hits %llu misses %llu\n", (unsigned long long)stats.poll_hits,
+                   (unsigned long long)stats.poll_misses);
+        }
+        if (stats.has_queue_stats) {
+            print_queue_stats(&stats.queue);
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -10,16 +10,96 @@ struct VirtIOBufferDescriptor {
     ULONG length;
 };
 
+/* One descriptor chain to be added by virtqueue_add_bufs, fields as in virtqueue_add_buf */
+struct virtqueue_buf {
+    struct scatterlist *sg;
+    unsigned int out_num;
+    unsigned int in_num;
+    void *opaque;
+    void *va_indirect;
+    ULONGLONG phys_indirect;
+};
+
+#define VIRTQUEUE_STATS_LATENCY_BUCKETS 32
+
+/* Counters of one virtqueue, collected only if VirtioLib is built with VIRTIO_QUEUE_STATS.
+ * They are updated under the lock the driver holds for the queue operations and are reset
+ * when the queue is (re)initialized. */
+struct virtqueue_stats {
+    ULONGLONG adds;             /* buffers added */
+    ULONGLONG gets;             /* buffers returned by the device */
+    ULONGLONG kicks;            /* notifications sent to the device */
+    ULONGLONG kicks_suppressed; /* notifications found unnecessary by kick_prepare */
+    ULONGLONG enospc;           /* buffers not added for lack of free descriptors */
+    ULONGLONG indirect;         /* buffers added as one indirect descriptor */
+    ULONGLONG in_flight_sum;    /* sum of in_flight sampled after each add, average = sum / adds */
+    ULONG in_flight;            /* buffers currently owned by the device */
+    ULONG max_in_flight;
+    ULONGLONG latency_frequency; /* latency units per second */
+    /* latency[i] counts buffers returned 2^i to 2^(i+1)-1 units after being added,
+     * latency[0] also counts those returned within the same unit */
+    ULONGLONG latency[VIRTQUEUE_STATS_LATENCY_BUCKETS];
+};
+
+/* Placement of the used event by virtqueue_enable_cb_delayed */
+enum virtqueue_coalescing_mode {
+    /* interrupt after ~3/4 of the outstanding buffers are used, the default */
+    VIRTQUEUE_COALESCING_FIXED,
+    /* interrupt after the buffers expected to be used within max_delay_us at the
+     * completion rate observed between the calls to virtqueue_enable_cb_delayed;
+     * for queues of requests in flight only, not for queues of receive buffers */
+    VIRTQUEUE_COALESCING_ADAPTIVE,
+};
+
+struct virtqueue_coalescing {
+    enum virtqueue_coalescing_mode mode;
+    u16 max_bufs;          /* upper bound of the adaptive threshold, 0 - none */
+    ULONG used;            /* buffers returned by the device */
+    ULONG last_used;       /* used at the previous virtqueue_enable_cb_delayed */
+    ULONG rate;            /* average of buffers used per max delay, 1/16 units */
+    ULONGLONG delay_ticks; /* max delay in KeQueryPerformanceCounter units */
+    ULONGLONG last_time;
+};
+
+/* Indirect tables owned by the queue, used for buffers added without va_indirect.
+ * The tables are kept in blocks of tables_per_block tables each. */
+struct virtqueue_indirect_pool {
+    void **block_va;
+    ULONGLONG *block_pa;
+    void *va;                      /* the only block of virtqueue_set_indirect_pool */
+    ULONGLONG pa;
+    unsigned int tables_per_block;
+    unsigned int blocks;           /* allocated by virtio_alloc_indirect_pool */
+    unsigned int max_sg;           /* descriptors per table, 0 - no pool */
+    ULONG table_size;              /* bytes per table */
+    bool allocated;                /* by virtio_alloc_indirect_pool, freed with the queue */
+};
+
+/* Budget and counters of virtqueue_busy_poll */
+struct virtqueue_busy_poll {
+    ULONG budget_us;        /* maximal spin time, 0 - not limited by time */
+    ULONG budget_spins;     /* maximal number of polls, 0 - not limited by count */
+    ULONGLONG budget_ticks; /* budget_us in KeQueryPerformanceCounter units */
+    ULONGLONG hits;         /* spins ended by a used buffer */
+    ULONGLONG misses;       /* spins ended by the budget */
+};
+
 typedef int (*proc_virtqueue_add_buf)(struct virtqueue *vq, struct scatterlist sg[],
                                       unsigned int out_num, unsigned int in_num, void *opaque,
                                       void *va_indirect, ULONGLONG phys_indirect);
 
+typedef unsigned int (*proc_virtqueue_add_bufs)(struct virtqueue *vq, struct virtqueue_buf bufs[],
+                                                unsigned int num);
+
 typedef bool (*proc_virtqueue_kick_prepare)(struct virtqueue *vq);
 
 typedef void (*proc_virtqueue_kick_always)(struct virtqueue *vq);
 
 typedef void *(*proc_virtqueue_get_buf)(struct virtqueue *vq, unsigned int *len);
 
+typedef unsigned int (*proc_virtqueue_get_bufs)(struct virtqueue *vq, void *opaque[],
+                                                unsigned int len[], unsigned int num);
+
 typedef void (*proc_virtqueue_disable_cb)(struct virtqueue *vq);
 
 typedef bool (*proc_virtqueue_enable_cb)(struct virtqueue *vq);
@@ -43,9 +123,11 @@ struct virtqueue {
     void *avail_va;
     void *used_va;
     proc_virtqueue_add_buf add_buf;
+    proc_virtqueue_add_bufs add_bufs;
     proc_virtqueue_kick_prepare kick_prepare;
     proc_virtqueue_kick_always kick_always;
     proc_virtqueue_get_buf get_buf;
+    proc_virtqueue_get_bufs get_bufs;
     proc_virtqueue_disable_cb disable_cb;
     proc_virtqueue_enable_cb enable_cb;
     proc_virtqueue_enable_cb_delayed enable_cb_delayed;
@@ -53,6 +135,10 @@ struct virtqueue {
     proc_virtqueue_is_interrupt_enabled is_interrupt_enabled;
     proc_virtqueue_has_buf has_buf;
     proc_virtqueue_shutdown shutdown;
+    struct virtqueue_coalescing coalescing;
+    struct virtqueue_indirect_pool indirect_pool;
+    struct virtqueue_busy_poll busy_poll;
+    struct virtqueue_stats stats;
 };
 
 static inline int virtqueue_add_buf(struct virtqueue *vq, struct scatterlist sg[],
@@ -62,6 +148,14 @@ static inline int virtqueue_add_buf(struct virtqueue *vq, struct scatterlist sg[
     return vq->add_buf(vq, sg, out_num, in_num, opaque, va_indirect, phys_indirect);
 }
 
+/* Adds up to num chains publishing them to the device at once,
+ * returns the number of chains added (stops at the first one that does not fit) */
+static inline unsigned int virtqueue_add_bufs(struct virtqueue *vq, struct virtqueue_buf bufs[],
+                                              unsigned int num)
+{
+    return vq->add_bufs(vq, bufs, num);
+}
+
 static inline bool virtqueue_kick_prepare(struct virtqueue *vq)
 {
     return vq->kick_prepare(vq);
@@ -77,6 +171,14 @@ static inline void *virtqueue_get_buf(struct virtqueue *vq, unsigned int *len)
     return vq->get_buf(vq, len);
 }
 
+/* Gets up to num returned buffers with a single used event update,
+ * returns the number of entries filled in opaque[] and len[] */
+static inline unsigned int virtqueue_get_bufs(struct virtqueue *vq, void *opaque[],
+                                              unsigned int len[], unsigned int num)
+{
+    return vq->get_bufs(vq, opaque, len, num);
+}
+
 static inline void virtqueue_disable_cb(struct virtqueue *vq)
 {
     vq->disable_cb(vq);
@@ -115,4 +217,46 @@ static inline void virtqueue_shutdown(struct virtqueue *vq)
 void virtqueue_notify(struct virtqueue *vq);
 void virtqueue_kick(struct virtqueue *vq);
 
+/* Copies the counters of a virtqueue, returns false if VirtioLib does not collect them */
+bool virtqueue_get_stats(struct virtqueue *vq, struct virtqueue_stats *stats);
+void virtqueue_reset_stats(struct virtqueue *vq);
+
+/* Selects the policy of virtqueue_enable_cb_delayed, max_delay_us and max_bufs apply to
+ * VIRTQUEUE_COALESCING_ADAPTIVE only. Call before the queue is used or under its lock. */
+void virtqueue_set_coalescing(struct virtqueue *vq, enum virtqueue_coalescing_mode mode,
+                              ULONG max_delay_us, u16 max_bufs);
+
+/* Attaches physically contiguous memory of virtqueue_indirect_pool_size(queue size, max_sg)
+ * bytes, from which the queue takes the indirect tables of buffers added with va_indirect
+ * NULL. Whether such a buffer is added as indirect is decided by its chain length and the
+ * free descriptors; a buffer added with va_indirect is always indirect as before. Call
+ * before any buffer is added, max_sg 0 detaches the pool. */
+void virtqueue_set_indirect_pool(struct virtqueue *vq, void *va, ULONGLONG pa,
+                                 unsigned int max_sg);
+unsigned long virtqueue_indirect_pool_size(unsigned int num, unsigned int max_sg);
+
+/* The same with the tables in blocks of physically contiguous memory of
+ * virtqueue_indirect_pool_size(tables_per_block, max_sg) bytes, table i of the pool is
+ * table i % tables_per_block of block i / tables_per_block. The arrays are not copied. */
+void virtqueue_set_indirect_pool_blocks(struct virtqueue *vq, void **block_va,
+                                        ULONGLONG *block_pa, unsigned int tables_per_block,
+                                        unsigned int max_sg);
+
+/* Sets the budget of virtqueue_busy_poll, the spin ends when either limit is reached.
+ * Both 0 (the default) disable busy polling. Also resets the hit and miss counters. */
+void virtqueue_set_busy_poll(struct virtqueue *vq, ULONG budget_us, ULONG budget_spins);
+
+/* Spins on virtqueue_has_buf within the budget of the queue, typically after a kick
+ * for a request expected to complete shortly, and returns true if a used buffer showed
+ * up. The caller then processes it as on an interrupt, otherwise it keeps relying on
+ * the interrupt. Returns false at once if busy polling is disabled. May be called
+ * without the lock of the queue: the result is only a hint and the counters are not
+ * exact if several CPUs poll the same queue. */
+bool virtqueue_busy_poll(struct virtqueue *vq);
+
+static inline bool virtqueue_busy_poll_enabled(struct virtqueue *vq)
+{
+    return vq->busy_poll.budget_us != 0 || vq->busy_poll.budget_spins != 0;
+}
+
 #endif /* _LINUX_VIRTIO_H */
@@ -286,11 +286,78 @@ error_find:
     return status;
 }
 
+static void virtio_free_indirect_blocks(VirtIODevice *vdev, ULONGLONG *block_pa,
+                                        unsigned int blocks)
+{
+    void **block_va = (void **)(block_pa + blocks);
+    unsigned int i;
+
+    for (i = 0; i < blocks; i++) {
+        if (block_va[i] != NULL) {
+            mem_free_contiguous_pages(vdev, block_va[i]);
+        }
+    }
+    mem_free_nonpaged_block(vdev, block_pa);
+}
+
+/* The pool is allocated in blocks of a page (or of one table when it is larger than a
+ * page), so no large physically contiguous allocation is needed */
+NTSTATUS virtio_alloc_indirect_pool(struct virtqueue *vq, unsigned int max_sg)
+{
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int num = vdev->info[vq->index].num;
+    unsigned long table_size = virtqueue_indirect_pool_size(1, max_sg);
+    unsigned int tables_per_block;
+    unsigned int blocks, i;
+    ULONGLONG *block_pa;
+    void **block_va;
+
+    if (max_sg == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    tables_per_block = table_size < PAGE_SIZE ? (unsigned int)(PAGE_SIZE / table_size) : 1;
+    blocks = (num + tables_per_block - 1) / tables_per_block;
+
+    /* The physical addresses first, they are 8-byte aligned then */
+    block_pa = mem_alloc_nonpaged_block(vdev, blocks * (sizeof(ULONGLONG) + sizeof(void *)));
+    if (block_pa == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    block_va = (void **)(block_pa + blocks);
+    RtlZeroMemory(block_va, blocks * sizeof(void *));
+
+    for (i = 0; i < blocks; i++) {
+        block_va[i] = mem_alloc_contiguous_pages(vdev,
+                                                 virtqueue_indirect_pool_size(tables_per_block,
+                                                                              max_sg));
+        if (block_va[i] == NULL) {
+            virtio_free_indirect_blocks(vdev, block_pa, blocks);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        block_pa[i] = mem_get_physical_address(vdev, block_va[i]);
+    }
+    virtqueue_set_indirect_pool_blocks(vq, block_va, block_pa, tables_per_block, max_sg);
+    vq->indirect_pool.blocks = blocks;
+    vq->indirect_pool.allocated = true;
+    return STATUS_SUCCESS;
+}
+
+/* The pool memory is not part of the queue allocation */
+static void virtio_free_indirect_pool(struct virtqueue *vq)
+{
+    if (vq->indirect_pool.allocated) {
+        virtio_free_indirect_blocks(vq->vdev, vq->indirect_pool.block_pa,
+                                    vq->indirect_pool.blocks);
+        virtqueue_set_indirect_pool(vq, NULL, 0, 0);
+    }
+}
+
 void virtio_delete_queue(struct virtqueue *vq)
 {
     VirtIODevice *vdev = vq->vdev;
     unsigned i = vq->index;
 
+    virtio_free_indirect_pool(vq);
     vdev->device->delete_queue(&vdev->info[i]);
     vdev->info[i].vq = NULL;
 }
@@ -307,6 +374,7 @@ void virtio_delete_queues(VirtIODevice *vdev)
     for (i = 0; i < vdev->maxQueues; i++) {
         vq = vdev->info[i].vq;
         if (vq != NULL) {
+            virtio_free_indirect_pool(vq);
             vdev->device->delete_queue(&vdev->info[i]);
             vdev->info[i].vq = NULL;
         }
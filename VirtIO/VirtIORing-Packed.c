@@ -35,7 +35,10 @@
 #include "virtio.h"
 #include "kdebugprint.h"
 #include "virtio_ring.h"
-#include "windows\virtio_ring_allocation.h"
+#include "windows/virtio_ring_allocation.h"
+#include "windows/virtio_ring_stats.h"
+#include "windows/virtio_ring_coalescing.h"
+#include "windows/virtio_ring_indirect.h"
 
 #include <pshpack1.h>
 
@@ -100,6 +103,9 @@ struct vring_packed_desc {
   */
 #define VRING_PACKED_EVENT_F_WRAP_CTR   15
 
+/* Descriptors sharing a cache line, the used side prefetches the next line */
+#define VRING_PACKED_DESCS_PER_LINE     (SMP_CACHE_BYTES / sizeof(struct vring_packed_desc))
+
 /* The following is used with USED_EVENT_IDX and AVAIL_EVENT_IDX */
 /* Assuming a given event_idx value from the other side, if
  * we have just incremented index from old to new_idx,
@@ -116,10 +122,14 @@ static inline bool vring_need_event(__u16 event_idx, __u16 new_idx, __u16 old)
 }
 
 struct vring_desc_state_packed {
-    void *data; /* Data for callback. */
-    u16 num;    /* Descriptor list length. */
-    u16 next;   /* The next desc state in a list. */
-    u16 last;   /* The last desc state in a list. */
+    void *data;       /* Data for callback. */
+    u16 num;          /* Descriptor list length. */
+    u16 next;         /* The next desc state in a list. */
+    u16 last;         /* The last desc state in a list. */
+    u32 total_in_len; /* Device-writable length, in-order mode only. */
+#ifdef VIRTIO_QUEUE_STATS
+    ULONGLONG add_time; /* When the buffer was added. */
+#endif
 };
 
 struct virtqueue_packed {
@@ -134,6 +144,17 @@ struct virtqueue_packed {
     u16 last_used_idx;
     /* Avail used flags. */
     u16 avail_used_flags;
+    /*
+     * VIRTIO_F_IN_ORDER: buffer ids are recycled sequentially and the
+     * device may return a batch of buffers with a single used descriptor
+     * carrying the id of the last one.
+     */
+    bool in_order;
+    struct {
+        u32 len;
+        u16 id;
+        bool pending;
+    } used_batch;
     struct {
         /* Driver ring wrap counter. */
         bool avail_wrap_counter;
@@ -174,16 +195,21 @@ unsigned long vring_size_packed(unsigned int num, unsigned long align)
     return res;
 }
 
-static int
-virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
-                         struct scatterlist sg[], /* sg array of length out + in */
-                         unsigned int out,  /* number of driver->device buffer descriptors in sg */
-                         unsigned int in,   /* number of device->driver buffer descriptors in sg */
-                         void *opaque,      /* later returned from virtqueue_get_buf */
-                         void *va_indirect, /* VA of the indirect page or NULL */
-                         ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
+/*
+ * Writes the descriptors of one buffer except the flags of its head descriptor,
+ * which are returned in head_flags together with the head index. The buffer
+ * becomes available to the device when the caller writes the head flags.
+ */
+static inline int virtqueue_add_desc_packed(struct virtqueue_packed *vq,
+                                            struct scatterlist sg[],
+                                            unsigned int out,
+                                            unsigned int in,
+                                            void *opaque,
+                                            void *va_indirect,
+                                            ULONGLONG phys_indirect,
+                                            u16 *head_idx,
+                                            u16 *head_flags)
 {
-    struct virtqueue_packed *vq = packedvq(_vq);
     unsigned int descs_used;
     struct vring_packed_desc *desc;
     u16 head, id, i;
@@ -195,6 +221,11 @@ virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
     BUG_ON(descs_used == 0);
     BUG_ON(id >= vq->packed.vring.num);
 
+    if (!va_indirect) {
+        vring_indirect_from_pool(&vq->vq, descs_used, vq->num_free, vq->packed.vring.num, id,
+                                 &va_indirect, &phys_indirect);
+    }
+
     if (va_indirect && vq->num_free > 0) {
         desc = va_indirect;
         for (i = 0; i < descs_used; i++) {
@@ -206,8 +237,8 @@ virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
         vq->packed.vring.desc[head].len = descs_used * sizeof(struct vring_packed_desc);
         vq->packed.vring.desc[head].id = id;
 
-        KeMemoryBarrier();
-        vq->packed.vring.desc[head].flags = VRING_DESC_F_INDIRECT | vq->avail_used_flags;
+        *head_idx = head;
+        *head_flags = VRING_DESC_F_INDIRECT | vq->avail_used_flags;
 
         DPrintf(5, "Added buffer head %i to Q%d\n", head, vq->vq.index);
         head++;
@@ -227,12 +258,14 @@ virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
         vq->packed.desc_state[id].num = 1;
         vq->packed.desc_state[id].data = opaque;
         vq->packed.desc_state[id].last = id;
+        vring_stats_indirect(&vq->vq);
 
     } else {
         unsigned int n;
-        u16 curr, prev, head_flags;
+        u16 curr, prev;
         if (vq->num_free < descs_used) {
             DPrintf(6, "Can't add buffer to Q%d\n", vq->vq.index);
+            vring_stats_enospc(&vq->vq);
             return -ENOSPC;
         }
         desc = vq->packed.vring.desc;
@@ -248,7 +281,7 @@ virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
             desc[i].len = sg[n].length;
             desc[i].id = id;
             if (n == 0) {
-                head_flags = flags;
+                *head_flags = flags;
             } else {
                 desc[i].flags = flags;
             }
@@ -279,21 +312,91 @@ virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
         vq->packed.desc_state[id].data = opaque;
         vq->packed.desc_state[id].last = prev;
 
-        /*
-         * A driver MUST NOT make the first descriptor in the list
-         * available before all subsequent descriptors comprising
-         * the list are made available.
-         */
-        KeMemoryBarrier();
-        vq->packed.vring.desc[head].flags = head_flags;
+        *head_idx = head;
         vq->num_added += descs_used;
 
         DPrintf(5, "Added buffer head @%i+%d to Q%d\n", head, descs_used, vq->vq.index);
     }
 
+    if (vq->in_order) {
+        vq->packed.desc_state[id].total_in_len = 0;
+        for (i = (u16)out; i < descs_used; i++) {
+            vq->packed.desc_state[id].total_in_len += sg[i].length;
+        }
+    }
+    vring_stats_stamp(&vq->packed.desc_state[id]);
+    vring_stats_add(&vq->vq);
+
     return VQ_ADD_BUFFER_SUCCESS;
 }
 
+static int
+virtqueue_add_buf_packed(struct virtqueue *_vq,   /* the queue */
+                         struct scatterlist sg[], /* sg array of length out + in */
+                         unsigned int out,  /* number of driver->device buffer descriptors in sg */
+                         unsigned int in,   /* number of device->driver buffer descriptors in sg */
+                         void *opaque,      /* later returned from virtqueue_get_buf */
+                         void *va_indirect, /* VA of the indirect page or NULL */
+                         ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    u16 head, head_flags;
+    int ret;
+
+    ret = virtqueue_add_desc_packed(vq, sg, out, in, opaque, va_indirect, phys_indirect, &head,
+                                    &head_flags);
+    if (ret == VQ_ADD_BUFFER_SUCCESS) {
+        /*
+         * A driver MUST NOT make the first descriptor in the list
+         * available before all subsequent descriptors comprising
+         * the list are made available. The release store orders
+         * all of them before the head flags without a full fence.
+         */
+        WriteUShortRelease(&vq->packed.vring.desc[head].flags, head_flags);
+    }
+    return ret;
+}
+
+/*
+ * Adds up to num buffers, returns the number of buffers added. The device
+ * processes the descriptors in ring order, so only the head of the first
+ * buffer needs to be ordered after all others: the heads of the following
+ * buffers are written immediately and the whole batch is made available
+ * with a single release store.
+ */
+static unsigned int virtqueue_add_bufs_packed(struct virtqueue *_vq,        /* the queue */
+                                              struct virtqueue_buf bufs[], /* buffers to add */
+                                              unsigned int num) /* number of entries in bufs */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    u16 first_head = 0, first_flags = 0, head, head_flags;
+    unsigned int n;
+
+    for (n = 0; n < num; n++) {
+        if (virtqueue_add_desc_packed(vq,
+                                      bufs[n].sg,
+                                      bufs[n].out_num,
+                                      bufs[n].in_num,
+                                      bufs[n].opaque,
+                                      bufs[n].va_indirect,
+                                      bufs[n].phys_indirect,
+                                      &head,
+                                      &head_flags) != VQ_ADD_BUFFER_SUCCESS) {
+            break;
+        }
+        if (n == 0) {
+            first_head = head;
+            first_flags = head_flags;
+        } else {
+            vq->packed.vring.desc[head].flags = head_flags;
+        }
+    }
+    if (n) {
+        WriteUShortRelease(&vq->packed.vring.desc[first_head].flags, first_flags);
+    }
+    return n;
+}
+
 static void detach_buf_packed(struct virtqueue_packed *vq, unsigned int id)
 {
     struct vring_desc_state_packed *state = &vq->packed.desc_state[id];
@@ -301,6 +404,12 @@ static void detach_buf_packed(struct virtqueue_packed *vq, unsigned int id)
     /* Clear data ptr. */
     state->data = NULL;
 
+    if (vq->in_order) {
+        /* The oldest ids just join the end of the free range. */
+        vq->num_free += state->num;
+        return;
+    }
+
     vq->packed.desc_state[state->last].next = (u16)vq->free_head;
     vq->free_head = id;
     vq->num_free += state->num;
@@ -318,6 +427,7 @@ static void *virtqueue_detach_unused_buf_packed(struct virtqueue *_vq)
         }
         /* detach_buf clears data, so grab it now. */
         buf = vq->packed.desc_state[i].data;
+        vring_stats_detach(_vq);
         detach_buf_packed(vq, i);
         return buf;
     }
@@ -337,13 +447,17 @@ static void virtqueue_disable_cb_packed(struct virtqueue *_vq)
     }
 }
 
+/*
+ * The flags are read with acquire semantics, so the id and length of a used
+ * descriptor can be read right after this returns true.
+ */
 static inline bool is_used_desc_packed(const struct virtqueue_packed *vq, u16 idx,
                                        bool used_wrap_counter)
 {
     bool avail, used;
     u16 flags;
 
-    flags = vq->packed.vring.desc[idx].flags;
+    flags = ReadUShortAcquire(&vq->packed.vring.desc[idx].flags);
     avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
     used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
 
@@ -394,7 +508,7 @@ static bool virtqueue_enable_cb_packed(struct virtqueue *_vq)
     struct virtqueue_packed *vq = packedvq(_vq);
     unsigned last_used_idx = virtqueue_enable_cb_prepare_packed(vq);
 
-    return !virtqueue_poll_packed(vq, (u16)last_used_idx);
+    return !vq->used_batch.pending && !virtqueue_poll_packed(vq, (u16)last_used_idx);
 }
 
 static bool virtqueue_enable_cb_delayed_packed(struct virtqueue *_vq)
@@ -410,8 +524,7 @@ static bool virtqueue_enable_cb_delayed_packed(struct virtqueue *_vq)
      */
 
     if (event_suppression_enabled) {
-        /* TODO: tune this threshold */
-        bufs = (vq->packed.vring.num - vq->num_free) * 3 / 4;
+        bufs = vring_coalescing_threshold(_vq, (u16)(vq->packed.vring.num - vq->num_free));
         wrap_counter = vq->packed.used_wrap_counter;
 
         used_idx = vq->last_used_idx + bufs;
@@ -442,7 +555,8 @@ static bool virtqueue_enable_cb_delayed_packed(struct virtqueue *_vq)
      */
     KeMemoryBarrier();
 
-    if (is_used_desc_packed(vq, vq->last_used_idx, vq->packed.used_wrap_counter)) {
+    if (vq->used_batch.pending ||
+        is_used_desc_packed(vq, vq->last_used_idx, vq->packed.used_wrap_counter)) {
         return false;
     }
 
@@ -469,24 +583,88 @@ static void virtqueue_shutdown_packed(struct virtqueue *_vq)
 
 static inline bool more_used_packed(const struct virtqueue_packed *vq)
 {
-    return is_used_desc_packed(vq, vq->last_used_idx, vq->packed.used_wrap_counter);
+    return vq->used_batch.pending ||
+           is_used_desc_packed(vq, vq->last_used_idx, vq->packed.used_wrap_counter);
 }
 
-static void *
-virtqueue_get_buf_packed(struct virtqueue *_vq, /* the queue */
-                         unsigned int *len)     /* number of bytes returned by the device */
+/*
+ * Brings in the cache line following the one of last_used_idx, where the
+ * device writes its next used descriptors, while the current ones are
+ * being detached.
+ */
+static inline void prefetch_used_packed(const struct virtqueue_packed *vq)
 {
-    struct virtqueue_packed *vq = packedvq(_vq);
-    u16 last_used, id;
+    unsigned int idx = vq->last_used_idx + VRING_PACKED_DESCS_PER_LINE;
+
+    if (idx >= vq->packed.vring.num) {
+        idx -= vq->packed.vring.num;
+    }
+    PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, &vq->packed.vring.desc[idx]);
+}
+
+/*
+ * Detaches the oldest buffer in in-order mode. Ids are allocated
+ * sequentially, so the oldest one follows the range of free ids and
+ * the used descriptor is only read once per batch returned by the device.
+ */
+static inline void *virtqueue_detach_used_in_order_packed(struct virtqueue_packed *vq,
+                                                          unsigned int *len)
+{
+    struct vring_desc_state_packed *state;
+    unsigned int id = vq->free_head + vq->num_free;
     void *ret;
 
-    if (!more_used_packed(vq)) {
-        DPrintf(6, "%s: No more buffers in queue\n", __FUNCTION__);
+    if (id >= vq->packed.vring.num) {
+        id -= vq->packed.vring.num;
+    }
+    state = &vq->packed.desc_state[id];
+    ASSERT(id == vq->last_used_idx);
+
+    if (!vq->used_batch.pending) {
+        vq->used_batch.id = vq->packed.vring.desc[vq->last_used_idx].id;
+        vq->used_batch.len = vq->packed.vring.desc[vq->last_used_idx].len;
+        if (vq->used_batch.id >= vq->packed.vring.num) {
+            BAD_RING(vq, "id %u out of range\n", vq->used_batch.id);
+            return NULL;
+        }
+        vq->used_batch.pending = true;
+    }
+    if (!state->data) {
+        BAD_RING(vq, "id %u is not a head!\n", id);
+        vq->used_batch.pending = false;
         return NULL;
     }
 
-    /* Only get used elements after they have been exposed by host. */
-    KeMemoryBarrier();
+    if (id == vq->used_batch.id) {
+        *len = vq->used_batch.len;
+        vq->used_batch.pending = false;
+    } else {
+        /* Skipped by the device, which uses the whole buffer. */
+        *len = state->total_in_len;
+    }
+
+    ret = state->data;
+    vring_stats_get(&vq->vq, state->add_time);
+    vring_coalescing_used(&vq->vq);
+    detach_buf_packed(vq, id);
+
+    vq->last_used_idx += state->num;
+    if (vq->last_used_idx >= vq->packed.vring.num) {
+        vq->last_used_idx -= (u16)vq->packed.vring.num;
+        vq->packed.used_wrap_counter ^= 1;
+    }
+    return ret;
+}
+
+/* Detaches the buffer at last_used_idx, the caller checks that one is available */
+static inline void *virtqueue_detach_used_packed(struct virtqueue_packed *vq, unsigned int *len)
+{
+    u16 last_used, id;
+    void *ret;
+
+    if (vq->in_order) {
+        return virtqueue_detach_used_in_order_packed(vq, len);
+    }
 
     last_used = vq->last_used_idx;
     id = vq->packed.vring.desc[last_used].id;
@@ -503,6 +681,8 @@ virtqueue_get_buf_packed(struct virtqueue *_vq, /* the queue */
 
     /* detach_buf_packed clears data, so grab it now. */
     ret = vq->packed.desc_state[id].data;
+    vring_stats_get(&vq->vq, vq->packed.desc_state[id].add_time);
+    vring_coalescing_used(&vq->vq);
     detach_buf_packed(vq, id);
 
     vq->last_used_idx += vq->packed.desc_state[id].num;
@@ -510,21 +690,72 @@ virtqueue_get_buf_packed(struct virtqueue *_vq, /* the queue */
         vq->last_used_idx -= (u16)vq->packed.vring.num;
         vq->packed.used_wrap_counter ^= 1;
     }
+    return ret;
+}
 
+static inline void virtqueue_update_used_event_packed(struct virtqueue_packed *vq)
+{
     /*
      * If we expect an interrupt for the next entry, tell host
      * by writing event index and flush out the write before
-     * the read in the next get_buf call.
+     * the read in the next get_buf call. In the middle of an in-order
+     * batch last_used_idx is not where the device writes next.
      */
-    if (vq->packed.event_flags_shadow == VRING_PACKED_EVENT_FLAG_DESC) {
+    if (!vq->used_batch.pending &&
+        vq->packed.event_flags_shadow == VRING_PACKED_EVENT_FLAG_DESC) {
         vq->packed.vring.driver->off_wrap = vq->last_used_idx | ((u16)vq->packed.used_wrap_counter
                                                                  << VRING_PACKED_EVENT_F_WRAP_CTR);
         KeMemoryBarrier();
     }
+}
+
+static void *
+virtqueue_get_buf_packed(struct virtqueue *_vq, /* the queue */
+                         unsigned int *len)     /* number of bytes returned by the device */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    void *ret;
 
+    /* Used elements are only read after the acquire of their flags. */
+    if (!more_used_packed(vq)) {
+        DPrintf(6, "%s: No more buffers in queue\n", __FUNCTION__);
+        return NULL;
+    }
+
+    ret = virtqueue_detach_used_packed(vq, len);
+    if (ret) {
+        virtqueue_update_used_event_packed(vq);
+    }
     return ret;
 }
 
+static unsigned int
+virtqueue_get_bufs_packed(struct virtqueue *_vq, /* the queue */
+                          void *opaque[],        /* receives the opaque pointers */
+                          unsigned int len[],    /* receives the numbers of bytes returned */
+                          unsigned int num)      /* number of entries in opaque and len */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    unsigned int n;
+
+    /*
+     * Harvests all the used descriptors in one pass: each one is only
+     * ordered by the acquire of its own flags and the next cache line of
+     * the ring is prefetched while the current one is processed.
+     */
+    for (n = 0; n < num && more_used_packed(vq); n++) {
+        prefetch_used_packed(vq);
+        opaque[n] = virtqueue_detach_used_packed(vq, &len[n]);
+        if (!opaque[n]) {
+            break;
+        }
+    }
+    if (n) {
+        virtqueue_update_used_event_packed(vq);
+    }
+    return n;
+}
+
 static BOOLEAN virtqueue_has_buf_packed(struct virtqueue *_vq)
 {
     struct virtqueue_packed *vq = packedvq(_vq);
@@ -572,6 +803,7 @@ static bool virtqueue_kick_prepare_packed(struct virtqueue *_vq)
 
     needs_kick = vring_need_event(event_idx, new, old);
 out:
+    vring_stats_kick(_vq, needs_kick);
     return needs_kick;
 }
 
@@ -580,6 +812,7 @@ static void virtqueue_kick_always_packed(struct virtqueue *_vq)
     struct virtqueue_packed *vq = packedvq(_vq);
     KeMemoryBarrier();
     vq->num_added = 0;
+    vring_stats_kick(_vq, true);
     virtqueue_notify(_vq);
 }
 
@@ -620,21 +853,28 @@ vring_new_virtqueue_packed(unsigned int index,       /* virtqueue index */
     vq->packed.event_flags_shadow = 0;
     vq->packed.desc_state = vq->desc_states;
 
+    vq->in_order = vdev->in_order;
+    vq->used_batch.pending = false;
+
     RtlZeroMemory(vq->packed.desc_state, num * sizeof(*vq->packed.desc_state));
-    for (i = 0; i < num - 1; i++) {
-        vq->packed.desc_state[i].next = i + 1;
+    /* circular for the sequential recycling of the in-order mode */
+    for (i = 0; i < num; i++) {
+        vq->packed.desc_state[i].next = (u16)(i + 1 < num ? i + 1 : 0);
     }
 
     vq->vq.add_buf = virtqueue_add_buf_packed;
+    vq->vq.add_bufs = virtqueue_add_bufs_packed;
     vq->vq.detach_unused_buf = virtqueue_detach_unused_buf_packed;
     vq->vq.disable_cb = virtqueue_disable_cb_packed;
     vq->vq.enable_cb = virtqueue_enable_cb_packed;
     vq->vq.enable_cb_delayed = virtqueue_enable_cb_delayed_packed;
     vq->vq.get_buf = virtqueue_get_buf_packed;
+    vq->vq.get_bufs = virtqueue_get_bufs_packed;
     vq->vq.has_buf = virtqueue_has_buf_packed;
     vq->vq.is_interrupt_enabled = virtqueue_is_interrupt_enabled_packed;
     vq->vq.kick_always = virtqueue_kick_always_packed;
     vq->vq.kick_prepare = virtqueue_kick_prepare_packed;
     vq->vq.shutdown = virtqueue_shutdown_packed;
+    vring_stats_init(&vq->vq);
     return &vq->vq;
 }
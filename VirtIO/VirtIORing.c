@@ -34,7 +34,10 @@
 #include "virtio.h"
 #include "kdebugprint.h"
 #include "virtio_ring.h"
-#include "windows\virtio_ring_allocation.h"
+#include "windows/virtio_ring_allocation.h"
+#include "windows/virtio_ring_stats.h"
+#include "windows/virtio_ring_coalescing.h"
+#include "windows/virtio_ring_indirect.h"
 
 #define DESC_INDEX(num, i)         ((i) & ((num)-1))
 
@@ -174,6 +177,20 @@ static inline int vring_need_event(__u16 event_idx, __u16 new_idx, __u16 old)
     return (__u16)(new_idx - event_idx - 1) < (__u16)(new_idx - old);
 }
 
+/* Driver-private state of a descriptor. The free list and the chains are
+ * tracked here rather than in vring.desc, so that reclaiming a chain never
+ * reads the descriptor table shared with the device. */
+struct vring_desc_state_split {
+    void *data;       /* Opaque of the buffer, set on the head of a chain only. */
+    u16 num;          /* Descriptor chain length, valid on the head. */
+    u16 next;         /* The next descriptor in a chain or in the free list. */
+    u16 last;         /* The last descriptor of a chain, valid on the head. */
+    u32 total_in_len; /* Device-writable length of the chain, in-order mode only. */
+#ifdef VIRTIO_QUEUE_STATS
+    ULONGLONG add_time; /* When the buffer was added, valid on the head. */
+#endif
+};
+
 struct virtqueue_split {
     struct virtqueue vq;
     struct vring vring;
@@ -185,7 +202,15 @@ struct virtqueue_split {
     unsigned int num_added_since_kick;
     u16 first_unused;
     u16 last_used;
-    void *opaque[];
+    /* VIRTIO_F_IN_ORDER: descriptors are recycled sequentially and the device
+     * may return a batch of buffers with a single used entry for the last one */
+    bool in_order;
+    struct {
+        u32 len;
+        u16 id;
+        bool pending;
+    } used_batch;
+    struct vring_desc_state_split desc_state[];
 };
 
 #define splitvq(vq) ((struct virtqueue_split *)vq)
@@ -198,7 +223,7 @@ static inline u16 get_unused_desc(struct virtqueue_split *vq)
     u16 idx = vq->first_unused;
     ASSERT(vq->num_unused > 0);
 
-    vq->first_unused = vq->vring.desc[idx].next;
+    vq->first_unused = vq->desc_state[idx].next;
     vq->num_unused--;
     return idx;
 }
@@ -206,36 +231,39 @@ static inline u16 get_unused_desc(struct virtqueue_split *vq)
 /* Marks the descriptor chain starting at index idx as unused */
 static inline void put_unused_desc_chain(struct virtqueue_split *vq, u16 idx)
 {
-    u16 start = idx;
+    struct vring_desc_state_split *state = &vq->desc_state[idx];
 
-    vq->opaque[idx] = NULL;
-    while (vq->vring.desc[idx].flags & VIRTQ_DESC_F_NEXT) {
-        idx = vq->vring.desc[idx].next;
-        vq->num_unused++;
+    state->data = NULL;
+    if (vq->in_order) {
+        /* The chain is the oldest one, it just joins the end of the free range */
+        vq->num_unused += state->num;
+        return;
     }
+    vq->desc_state[state->last].next = vq->first_unused;
+    vq->num_unused += state->num;
 
-    vq->vring.desc[idx].flags = VIRTQ_DESC_F_NEXT;
-    vq->vring.desc[idx].next = vq->first_unused;
-    vq->num_unused++;
-
-    vq->first_unused = start;
+    vq->first_unused = idx;
 }
 
-/* Adds a buffer to a virtqueue, returns 0 on success, negative number on error */
-static int
-virtqueue_add_buf_split(struct virtqueue *_vq,   /* the queue */
-                        struct scatterlist sg[], /* sg array of length out + in */
-                        unsigned int out,  /* number of driver->device buffer descriptors in sg */
-                        unsigned int in,   /* number of device->driver buffer descriptors in sg */
-                        void *opaque,      /* later returned from virtqueue_get_buf */
-                        void *va_indirect, /* VA of the indirect page or NULL */
-                        ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
+/* Writes the descriptors of one buffer and its entry in the available ring without
+ * exposing it to the device, returns 0 on success, negative number on error */
+static inline int virtqueue_add_desc_split(struct virtqueue_split *vq,
+                                           struct scatterlist sg[],
+                                           unsigned int out,
+                                           unsigned int in,
+                                           void *opaque,
+                                           void *va_indirect,
+                                           ULONGLONG phys_indirect)
 {
-    struct virtqueue_split *vq = splitvq(_vq);
     struct vring *vring = &vq->vring;
     unsigned int i;
     u16 idx;
 
+    if (!va_indirect) {
+        vring_indirect_from_pool(&vq->vq, out + in, vq->num_unused, vq->vring.num,
+                                 vq->first_unused, &va_indirect, &phys_indirect);
+    }
+
     if (va_indirect && (out + in) > 1 && vq->num_unused > 0) {
         /* Use one indirect descriptor */
         struct vring_desc *desc = (struct vring_desc *)va_indirect;
@@ -254,18 +282,21 @@ virtqueue_add_buf_split(struct virtqueue *_vq,   /* the queue */
         vq->vring.desc[idx].addr = phys_indirect;
         vq->vring.desc[idx].len = i * sizeof(struct vring_desc);
 
-        vq->opaque[idx] = opaque;
+        vq->desc_state[idx].data = opaque;
+        vq->desc_state[idx].num = 1;
+        vq->desc_state[idx].last = idx;
+        vring_stats_indirect(&vq->vq);
     } else {
         u16 last_idx;
 
         /* Use out + in regular descriptors */
         if (out + in > vq->num_unused) {
+            vring_stats_enospc(&vq->vq);
             return -ENOSPC;
         }
 
         /* First descriptor */
         idx = last_idx = get_unused_desc(vq);
-        vq->opaque[idx] = opaque;
 
         vring->desc[idx].addr = sg[0].physAddr.QuadPart;
         vring->desc[idx].len = sg[0].length;
@@ -288,63 +319,210 @@ virtqueue_add_buf_split(struct virtqueue *_vq,   /* the queue */
             vring->desc[last_idx].next = vq->first_unused;
         }
         vring->desc[last_idx].flags &= ~VIRTQ_DESC_F_NEXT;
+
+        vq->desc_state[idx].data = opaque;
+        vq->desc_state[idx].num = (u16)(out + in);
+        vq->desc_state[idx].last = last_idx;
     }
 
+    if (vq->in_order) {
+        vq->desc_state[idx].total_in_len = 0;
+        for (i = out; i < out + in; i++) {
+            vq->desc_state[idx].total_in_len += sg[i].length;
+        }
+    }
+    vring_stats_stamp(&vq->desc_state[idx]);
+    vring_stats_add(&vq->vq);
+
     /* Write the first descriptor into the available ring */
     vring->avail->ring[DESC_INDEX(vring->num, vq->master_vring_avail.idx)] = idx;
-    KeMemoryBarrier();
-    vring->avail->idx = ++vq->master_vring_avail.idx;
+    vq->master_vring_avail.idx++;
     vq->num_added_since_kick++;
 
     return VQ_ADD_BUFFER_SUCCESS;
 }
 
-/* Gets the opaque pointer associated with a returned buffer, or NULL if no buffer is available */
-static void *virtqueue_get_buf_split(struct virtqueue *_vq, /* the queue */
-                                     unsigned int *len) /* number of bytes returned by the device */
+/* Exposes all buffers added so far to the device */
+static inline void virtqueue_publish_avail_split(struct virtqueue_split *vq)
+{
+    KeMemoryBarrier();
+    vq->vring.avail->idx = vq->master_vring_avail.idx;
+}
+
+/* Adds a buffer to a virtqueue, returns 0 on success, negative number on error */
+static int
+virtqueue_add_buf_split(struct virtqueue *_vq,   /* the queue */
+                        struct scatterlist sg[], /* sg array of length out + in */
+                        unsigned int out,  /* number of driver->device buffer descriptors in sg */
+                        unsigned int in,   /* number of device->driver buffer descriptors in sg */
+                        void *opaque,      /* later returned from virtqueue_get_buf */
+                        void *va_indirect, /* VA of the indirect page or NULL */
+                        ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+    int ret = virtqueue_add_desc_split(vq, sg, out, in, opaque, va_indirect, phys_indirect);
+
+    if (ret == VQ_ADD_BUFFER_SUCCESS) {
+        virtqueue_publish_avail_split(vq);
+    }
+    return ret;
+}
+
+/* Adds up to num buffers to a virtqueue and exposes them with a single avail index update,
+ * returns the number of buffers added */
+static unsigned int virtqueue_add_bufs_split(struct virtqueue *_vq,        /* the queue */
+                                             struct virtqueue_buf bufs[], /* buffers to add */
+                                             unsigned int num) /* number of entries in bufs */
 {
     struct virtqueue_split *vq = splitvq(_vq);
+    unsigned int n;
+
+    for (n = 0; n < num; n++) {
+        if (virtqueue_add_desc_split(vq,
+                                     bufs[n].sg,
+                                     bufs[n].out_num,
+                                     bufs[n].in_num,
+                                     bufs[n].opaque,
+                                     bufs[n].va_indirect,
+                                     bufs[n].phys_indirect) != VQ_ADD_BUFFER_SUCCESS) {
+            break;
+        }
+    }
+    if (n) {
+        virtqueue_publish_avail_split(vq);
+    }
+    return n;
+}
+
+/* Returns true if at least one returned buffer is available given the used index */
+static inline bool more_used_split(const struct virtqueue_split *vq, u16 used_idx)
+{
+    return vq->used_batch.pending || vq->last_used != used_idx;
+}
+
+/* Detaches the oldest buffer in in-order mode. Its head follows the range of unused
+ * descriptors, so neither the used entry id nor the free list is needed to find it;
+ * the used ring is only read once per batch returned by the device. */
+static inline void *virtqueue_detach_used_in_order_split(struct virtqueue_split *vq,
+                                                         unsigned int *len)
+{
+    u16 head = (u16)DESC_INDEX(vq->vring.num, vq->first_unused + vq->num_unused);
+    struct vring_desc_state_split *state = &vq->desc_state[head];
+    void *opaque = state->data;
+
+    if (!vq->used_batch.pending) {
+        u16 idx = DESC_INDEX(vq->vring.num, vq->last_used);
+
+        vq->used_batch.id = (u16)vq->vring.used->ring[idx].id;
+        vq->used_batch.len = vq->vring.used->ring[idx].len;
+        vq->used_batch.pending = true;
+        vq->last_used++;
+    }
+    if (head == vq->used_batch.id) {
+        *len = vq->used_batch.len;
+        vq->used_batch.pending = false;
+    } else {
+        /* Skipped by the device, which uses the whole buffer */
+        *len = state->total_in_len;
+    }
+
+    vring_stats_get(&vq->vq, state->add_time);
+    vring_coalescing_used(&vq->vq);
+    state->data = NULL;
+    vq->num_unused += state->num;
+    ASSERT(opaque != NULL);
+    return opaque;
+}
+
+/* Detaches the next entry of the used ring, the caller checks that one is available */
+static inline void *virtqueue_detach_used_split(struct virtqueue_split *vq, unsigned int *len)
+{
     void *opaque;
     u16 idx;
 
-    if (vq->last_used == (int)vq->vring.used->idx) {
-        /* No descriptor index in the used ring */
-        return NULL;
+    if (vq->in_order) {
+        return virtqueue_detach_used_in_order_split(vq, len);
     }
-    KeMemoryBarrier();
 
     idx = DESC_INDEX(vq->vring.num, vq->last_used);
     *len = vq->vring.used->ring[idx].len;
 
     /* Get the first used descriptor */
     idx = (u16)vq->vring.used->ring[idx].id;
-    opaque = vq->opaque[idx];
+    opaque = vq->desc_state[idx].data;
+    vring_stats_get(&vq->vq, vq->desc_state[idx].add_time);
+    vring_coalescing_used(&vq->vq);
 
     /* Put all descriptors back to the free list */
     put_unused_desc_chain(vq, idx);
 
     vq->last_used++;
-    if (_vq->vdev->event_suppression_enabled && virtqueue_is_interrupt_enabled(_vq)) {
+    ASSERT(opaque != NULL);
+    return opaque;
+}
+
+/* Tells the device which used entry we expect the next interrupt for */
+static inline void virtqueue_update_used_event_split(struct virtqueue_split *vq)
+{
+    if (vq->vq.vdev->event_suppression_enabled && virtqueue_is_interrupt_enabled(&vq->vq)) {
         vring_used_event(&vq->vring) = vq->last_used;
         KeMemoryBarrier();
     }
+}
 
-    ASSERT(opaque != NULL);
+/* Gets the opaque pointer associated with a returned buffer, or NULL if no buffer is available */
+static void *virtqueue_get_buf_split(struct virtqueue *_vq, /* the queue */
+                                     unsigned int *len) /* number of bytes returned by the device */
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+    void *opaque;
+
+    if (!more_used_split(vq, vq->vring.used->idx)) {
+        /* No descriptor index in the used ring */
+        return NULL;
+    }
+    KeMemoryBarrier();
+
+    opaque = virtqueue_detach_used_split(vq, len);
+    virtqueue_update_used_event_split(vq);
     return opaque;
 }
 
+/* Gets up to num returned buffers, returns the number of entries filled in opaque and len */
+static unsigned int
+virtqueue_get_bufs_split(struct virtqueue *_vq, /* the queue */
+                         void *opaque[],        /* receives the opaque pointers */
+                         unsigned int len[],    /* receives the numbers of bytes returned */
+                         unsigned int num)      /* number of entries in opaque and len */
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+    u16 used_idx = vq->vring.used->idx;
+    unsigned int n;
+
+    if (!more_used_split(vq, used_idx) || num == 0) {
+        return 0;
+    }
+    KeMemoryBarrier();
+
+    for (n = 0; n < num && more_used_split(vq, used_idx); n++) {
+        opaque[n] = virtqueue_detach_used_split(vq, &len[n]);
+    }
+    virtqueue_update_used_event_split(vq);
+    return n;
+}
+
 /* Returns true if at least one returned buffer is available, false otherwise */
 static BOOLEAN virtqueue_has_buf_split(struct virtqueue *_vq)
 {
     struct virtqueue_split *vq = splitvq(_vq);
-    return (vq->last_used != vq->vring.used->idx);
+    return more_used_split(vq, vq->vring.used->idx);
 }
 
 /* Returns true if the device should be notified, false otherwise */
 static bool virtqueue_kick_prepare_split(struct virtqueue *_vq)
 {
     struct virtqueue_split *vq = splitvq(_vq);
-    bool wrap_around;
+    bool wrap_around, kick;
     u16 old, new;
     KeMemoryBarrier();
 
@@ -355,10 +533,12 @@ static bool virtqueue_kick_prepare_split(struct virtqueue *_vq)
     vq->num_added_since_kick = 0;
 
     if (_vq->vdev->event_suppression_enabled) {
-        return wrap_around || (bool)vring_need_event(vring_avail_event(&vq->vring), new, old);
+        kick = wrap_around || (bool)vring_need_event(vring_avail_event(&vq->vring), new, old);
     } else {
-        return !(vq->vring.used->flags & VIRTQ_USED_F_NO_NOTIFY);
+        kick = !(vq->vring.used->flags & VIRTQ_USED_F_NO_NOTIFY);
     }
+    vring_stats_kick(_vq, kick);
+    return kick;
 }
 
 /* Notifies the device even if it's not necessary according to the event suppression logic */
@@ -367,6 +547,7 @@ static void virtqueue_kick_always_split(struct virtqueue *_vq)
     struct virtqueue_split *vq = splitvq(_vq);
     KeMemoryBarrier();
     vq->num_added_since_kick = 0;
+    vring_stats_kick(_vq, true);
     virtqueue_notify(_vq);
 }
 
@@ -384,11 +565,12 @@ static bool virtqueue_enable_cb_split(struct virtqueue *_vq)
 
     vring_used_event(&vq->vring) = vq->last_used;
     KeMemoryBarrier();
-    return (vq->last_used == vq->vring.used->idx);
+    return !more_used_split(vq, vq->vring.used->idx);
 }
 
-/* Enables interrupts on a virtqueue after ~3/4 of the currently pushed buffers have been
- * returned, returns false if this condition currently holds, false otherwise */
+/* Enables interrupts on a virtqueue after some of the currently pushed buffers have been
+ * returned (~3/4 or as the coalescing policy decides), returns false if this condition
+ * currently holds, true otherwise */
 static bool virtqueue_enable_cb_delayed_split(struct virtqueue *_vq)
 {
     struct virtqueue_split *vq = splitvq(_vq);
@@ -401,11 +583,10 @@ static bool virtqueue_enable_cb_delayed_split(struct virtqueue *_vq)
         }
     }
 
-    /* Note that 3/4 is an arbitrary threshold */
-    bufs = (u16)(vq->master_vring_avail.idx - vq->last_used) * 3 / 4;
+    bufs = vring_coalescing_threshold(_vq, (u16)(vq->master_vring_avail.idx - vq->last_used));
     vring_used_event(&vq->vring) = vq->last_used + bufs;
     KeMemoryBarrier();
-    return ((vq->vring.used->idx - vq->last_used) <= bufs);
+    return !vq->used_batch.pending && ((vq->vring.used->idx - vq->last_used) <= bufs);
 }
 
 /* Disables interrupts on a virtqueue */
@@ -449,8 +630,9 @@ static void *virtqueue_detach_unused_buf_split(struct virtqueue *_vq)
     void *opaque = NULL;
 
     for (idx = 0; idx < (u16)vq->vring.num; idx++) {
-        opaque = vq->opaque[idx];
+        opaque = vq->desc_state[idx].data;
         if (opaque) {
+            vring_stats_detach(_vq);
             put_unused_desc_chain(vq, idx);
             vq->vring.avail->idx = --vq->master_vring_avail.idx;
             break;
@@ -468,7 +650,7 @@ unsigned int vring_control_block_size(u16 qsize, bool packed)
         return vring_control_block_size_packed(qsize);
     }
     res = sizeof(struct virtqueue_split);
-    res += sizeof(void *) * qsize;
+    res += sizeof(struct vring_desc_state_split) * qsize;
     return res;
 }
 
@@ -490,36 +672,153 @@ vring_new_virtqueue_split(unsigned int index,       /* virtqueue index */
         return NULL;
     }
 
-    RtlZeroMemory(vq, sizeof(*vq) + num * sizeof(void *));
+    RtlZeroMemory(vq, sizeof(*vq) + num * sizeof(struct vring_desc_state_split));
 
     vring_init(&vq->vring, num, pages, vring_align);
     vq->vq.vdev = vdev;
     vq->vq.notification_cb = notify;
     vq->vq.index = index;
 
-    /* Build a linked list of unused descriptors */
+    /* Build a linked list of unused descriptors, circular for the sequential
+     * recycling of the in-order mode */
     vq->num_unused = num;
     vq->first_unused = 0;
-    for (i = 0; i < num - 1; i++) {
-        vq->vring.desc[i].flags = VIRTQ_DESC_F_NEXT;
-        vq->vring.desc[i].next = i + 1;
+    for (i = 0; i < num; i++) {
+        vq->desc_state[i].next = (u16)DESC_INDEX(num, i + 1);
     }
+    vq->in_order = vdev->in_order;
     vq->vq.avail_va = vq->vring.avail;
     vq->vq.used_va = vq->vring.used;
     vq->vq.add_buf = virtqueue_add_buf_split;
+    vq->vq.add_bufs = virtqueue_add_bufs_split;
     vq->vq.detach_unused_buf = virtqueue_detach_unused_buf_split;
     vq->vq.disable_cb = virtqueue_disable_cb_split;
     vq->vq.enable_cb = virtqueue_enable_cb_split;
     vq->vq.enable_cb_delayed = virtqueue_enable_cb_delayed_split;
     vq->vq.get_buf = virtqueue_get_buf_split;
+    vq->vq.get_bufs = virtqueue_get_bufs_split;
     vq->vq.has_buf = virtqueue_has_buf_split;
     vq->vq.is_interrupt_enabled = virtqueue_is_interrupt_enabled_split;
     vq->vq.kick_always = virtqueue_kick_always_split;
     vq->vq.kick_prepare = virtqueue_kick_prepare_split;
     vq->vq.shutdown = virtqueue_shutdown_split;
+    vring_stats_init(&vq->vq);
     return &vq->vq;
 }
 
+bool virtqueue_get_stats(struct virtqueue *vq, struct virtqueue_stats *stats)
+{
+#ifdef VIRTIO_QUEUE_STATS
+    *stats = vq->stats;
+    return true;
+#else
+    UNREFERENCED_PARAMETER(vq);
+    UNREFERENCED_PARAMETER(stats);
+    return false;
+#endif
+}
+
+void virtqueue_reset_stats(struct virtqueue *vq)
+{
+    /* Keep the state, reset the counters */
+    ULONG in_flight = vq->stats.in_flight;
+    ULONGLONG latency_frequency = vq->stats.latency_frequency;
+
+    RtlZeroMemory(&vq->stats, sizeof(vq->stats));
+    vq->stats.in_flight = in_flight;
+    vq->stats.max_in_flight = in_flight;
+    vq->stats.latency_frequency = latency_frequency;
+}
+
+void virtqueue_set_coalescing(struct virtqueue *vq, enum virtqueue_coalescing_mode mode,
+                              ULONG max_delay_us, u16 max_bufs)
+{
+    struct virtqueue_coalescing *c = &vq->coalescing;
+    LARGE_INTEGER frequency;
+
+    c->last_time = KeQueryPerformanceCounter(&frequency).QuadPart;
+    c->delay_ticks = (ULONGLONG)max_delay_us * frequency.QuadPart / 1000000;
+    c->max_bufs = max_bufs;
+    c->last_used = c->used;
+    c->rate = 0;
+    c->mode = mode;
+}
+
+void virtqueue_set_indirect_pool_blocks(struct virtqueue *vq, void **block_va,
+                                        ULONGLONG *block_pa, unsigned int tables_per_block,
+                                        unsigned int max_sg)
+{
+    vq->indirect_pool.block_va = block_va;
+    vq->indirect_pool.block_pa = block_pa;
+    vq->indirect_pool.tables_per_block = tables_per_block;
+    vq->indirect_pool.blocks = 0;
+    vq->indirect_pool.max_sg = block_va ? max_sg : 0;
+    /* Split and packed descriptors have the same size */
+    vq->indirect_pool.table_size = vq->indirect_pool.max_sg * sizeof(struct vring_desc);
+    vq->indirect_pool.allocated = false;
+}
+
+void virtqueue_set_indirect_pool(struct virtqueue *vq, void *va, ULONGLONG pa,
+                                 unsigned int max_sg)
+{
+    vq->indirect_pool.va = va;
+    vq->indirect_pool.pa = pa;
+    /* One block holding the tables of all the slots, which are below 0x10000 */
+    virtqueue_set_indirect_pool_blocks(vq, va ? &vq->indirect_pool.va : NULL,
+                                       &vq->indirect_pool.pa, 0x10000, max_sg);
+}
+
+unsigned long virtqueue_indirect_pool_size(unsigned int num, unsigned int max_sg)
+{
+    return num * max_sg * sizeof(struct vring_desc);
+}
+
+/* Polls between the reads of the performance counter in virtqueue_busy_poll */
+#define BUSY_POLL_CLOCK_INTERVAL 16
+
+void virtqueue_set_busy_poll(struct virtqueue *vq, ULONG budget_us, ULONG budget_spins)
+{
+    struct virtqueue_busy_poll *bp = &vq->busy_poll;
+    LARGE_INTEGER frequency;
+
+    KeQueryPerformanceCounter(&frequency);
+    bp->budget_ticks = (ULONGLONG)budget_us * frequency.QuadPart / 1000000;
+    bp->budget_us = budget_us;
+    bp->budget_spins = budget_spins;
+    bp->hits = 0;
+    bp->misses = 0;
+}
+
+bool virtqueue_busy_poll(struct virtqueue *vq)
+{
+    struct virtqueue_busy_poll *bp = &vq->busy_poll;
+    ULONGLONG deadline = 0;
+    ULONG spins = 0;
+
+    if (!virtqueue_busy_poll_enabled(vq)) {
+        return false;
+    }
+    if (bp->budget_ticks) {
+        deadline = KeQueryPerformanceCounter(NULL).QuadPart + bp->budget_ticks;
+    }
+
+    while (!virtqueue_has_buf(vq)) {
+        spins++;
+        if (bp->budget_spins && spins >= bp->budget_spins) {
+            bp->misses++;
+            return false;
+        }
+        if (deadline && (spins % BUSY_POLL_CLOCK_INTERVAL) == 0 &&
+            (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart >= deadline) {
+            bp->misses++;
+            return false;
+        }
+        YieldProcessor();
+    }
+    bp->hits++;
+    return true;
+}
+
 /* Negotiates virtio transport features */
 void vring_transport_features(
     VirtIODevice *vdev,
@@ -533,10 +832,16 @@ void vring_transport_features(
             virtio_feature_disable(*features, i);
         }
     }
+
+    /* In-order completion is only defined for virtio 1.0 devices */
+    if (!virtio_is_feature_enabled(*features, VIRTIO_F_VERSION_1)) {
+        virtio_feature_disable(*features, VIRTIO_F_IN_ORDER);
+    }
+    vdev->in_order = virtio_is_feature_enabled(*features, VIRTIO_F_IN_ORDER);
 }
 
 /* Returns the max number of scatter-gather elements that fit in an indirect pages */
-u32 virtio_get_indirect_page_capacity()
+unsigned long virtio_get_indirect_page_capacity()
 {
     return PAGE_SIZE / sizeof(struct vring_desc);
 }
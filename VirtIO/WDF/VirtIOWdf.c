@@ -294,6 +294,20 @@ NTSTATUS VirtIOWdfDestroyQueues(PVIRTIO_WDF_DRIVER pWdfDriver)
     return STATUS_SUCCESS;
 }
 
+NTSTATUS VirtIOWdfGetQueueStats(PVIRTIO_WDF_DRIVER pWdfDriver, ULONG uQueueIndex,
+                                struct virtqueue_stats *pStats)
+{
+    VirtIODevice *vdev = &pWdfDriver->VIODevice;
+
+    if (uQueueIndex >= vdev->maxQueues || vdev->info[uQueueIndex].vq == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (!virtqueue_get_stats(vdev->info[uQueueIndex].vq, pStats)) {
+        return STATUS_NOT_SUPPORTED;
+    }
+    return STATUS_SUCCESS;
+}
+
 void VirtIOWdfDeviceGet(PVIRTIO_WDF_DRIVER pWdfDriver, ULONG offset, PVOID buf, ULONG len)
 {
     virtio_get_config(&pWdfDriver->VIODevice, offset, buf, len);
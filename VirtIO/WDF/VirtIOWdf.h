@@ -127,6 +127,14 @@ NTSTATUS VirtIOWdfShutdown(PVIRTIO_WDF_DRIVER pWdfDriver);
  */
 UCHAR VirtIOWdfGetISRStatus(PVIRTIO_WDF_DRIVER pWdfDriver);
 
+/* Copies the counters of the queue with the given index to pStats. Returns
+ * STATUS_NOT_SUPPORTED if VirtioLib was built without VIRTIO_QUEUE_STATS and
+ * STATUS_INVALID_PARAMETER if the queue does not exist. IRQL: <= DISPATCH,
+ * the counters are not synchronized with the queue and may be slightly off.
+ */
+NTSTATUS VirtIOWdfGetQueueStats(PVIRTIO_WDF_DRIVER pWdfDriver, ULONG uQueueIndex,
+                                struct virtqueue_stats *pStats);
+
 /* Device config space access routines. Follow specific device documentation
  * for rules on when and how these can be called. If interrupt on device
  * config change is desired, a valid WDFINTERRUPT should be passed to
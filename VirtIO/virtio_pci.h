@@ -243,6 +243,9 @@ struct virtio_device {
     // true if the VIRTIO_F_RING_PACKED feature flag has been negotiated
     bool packed_ring;
 
+    // true if the VIRTIO_F_IN_ORDER feature flag has been negotiated
+    bool in_order;
+
     // internal device operations, implemented separately for legacy and modern
     const struct virtio_device_ops *device;
 
@@ -352,6 +355,12 @@ void virtio_delete_queues(VirtIODevice *vdev);
 u32 virtio_get_queue_size(struct virtqueue *vq);
 unsigned long virtio_get_indirect_page_capacity();
 
+/* Allocates a pool of indirect tables of max_sg descriptors for the queue, see
+ * virtqueue_set_indirect_pool_blocks. The memory comes in page-sized blocks from
+ * mem_alloc_contiguous_pages of the system ops and is freed when the queue is deleted.
+ */
+NTSTATUS virtio_alloc_indirect_pool(struct virtqueue *vq, unsigned int max_sg);
+
 ULONG __inline virtio_get_queue_descriptor_size()
 {
     return sizeof(VirtIOQueueInfo);
@@ -0,0 +1,59 @@
+#ifndef _VIRTIO_RING_COALESCING_H
+#define _VIRTIO_RING_COALESCING_H
+
+/* Used event placement of virtqueue_enable_cb_delayed, shared by the split and
+ * packed ring implementations. */
+
+/* Weight of a new rate sample, 1 / 2^VRING_COALESCING_EWMA_SHIFT */
+#define VRING_COALESCING_EWMA_SHIFT 3
+/* Fraction bits of the rate average */
+#define VRING_COALESCING_RATE_SHIFT 4
+
+#define vring_coalescing_used(vq) ((vq)->coalescing.used++)
+
+/* Returns how many of the outstanding buffers may be used by the device before
+ * it interrupts. In the adaptive mode this is the number of buffers expected to
+ * complete within max_delay at the completion rate observed between the calls,
+ * so the interrupt is delayed by about max_delay at most. Sparse completions make
+ * the rate and the threshold drop to 0, i.e. an immediate interrupt.
+ * This holds only where the outstanding buffers are requests in flight. On a
+ * receive queue all the posted buffers are outstanding and the rate is not
+ * sampled without interrupts, so a few packets after a burst would wait for
+ * further ones. */
+static inline u16 vring_coalescing_threshold(struct virtqueue *_vq, u16 outstanding)
+{
+    struct virtqueue_coalescing *c = &_vq->coalescing;
+    ULONGLONG now, elapsed, sample;
+    ULONG used, bufs;
+
+    if (c->mode != VIRTQUEUE_COALESCING_ADAPTIVE) {
+        /* Note that 3/4 is an arbitrary threshold */
+        return outstanding * 3 / 4;
+    }
+
+    now = KeQueryPerformanceCounter(NULL).QuadPart;
+    elapsed = now - c->last_time;
+    used = c->used - c->last_used;
+    c->last_time = now;
+    c->last_used = c->used;
+
+    /* Buffers used per max_delay in the last interval */
+    sample = elapsed ? ((ULONGLONG)used * c->delay_ticks << VRING_COALESCING_RATE_SHIFT) / elapsed : 0;
+    if (sample > ((ULONGLONG)MAXUSHORT << VRING_COALESCING_RATE_SHIFT)) {
+        sample = (ULONGLONG)MAXUSHORT << VRING_COALESCING_RATE_SHIFT;
+    }
+    c->rate = c->rate - (c->rate >> VRING_COALESCING_EWMA_SHIFT) +
+              (ULONG)(sample >> VRING_COALESCING_EWMA_SHIFT);
+
+    bufs = c->rate >> VRING_COALESCING_RATE_SHIFT;
+    if (c->max_bufs && bufs > c->max_bufs) {
+        bufs = c->max_bufs;
+    }
+    /* The device must still interrupt when all the outstanding buffers are used */
+    if (bufs >= outstanding) {
+        bufs = outstanding ? outstanding - 1 : 0;
+    }
+    return (u16)bufs;
+}
+
+#endif /* _VIRTIO_RING_COALESCING_H */
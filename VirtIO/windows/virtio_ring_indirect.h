@@ -0,0 +1,38 @@
+#ifndef _VIRTIO_RING_INDIRECT_H
+#define _VIRTIO_RING_INDIRECT_H
+
+/* Indirect tables taken from the pool of virtqueue_set_indirect_pool(_blocks), shared by the
+ * split and packed ring implementations. The pool has one table per ring entry and
+ * the table is selected by the head descriptor (split) or the buffer id (packed),
+ * both unique while the buffer is owned by the device. */
+
+/* Chains of up to VRING_DIRECT_MAX_SG descriptors are added as regular descriptors
+ * while at least half of the ring is free: the device then reads them together with
+ * the ring instead of fetching one more table. */
+#define VRING_DIRECT_MAX_SG 4
+
+/* Sets *va and *pa to the pool table of the slot if the chain is better added as
+ * indirect, leaves them unchanged otherwise */
+static inline void vring_indirect_from_pool(struct virtqueue *_vq, unsigned int total_sg,
+                                            unsigned int num_free, unsigned int num, u16 slot,
+                                            void **va, ULONGLONG *pa)
+{
+    struct virtqueue_indirect_pool *pool = &_vq->indirect_pool;
+    unsigned int block;
+    ULONG offset;
+
+    /* Also false without a pool, its max_sg is 0 */
+    if (total_sg < 2 || total_sg > pool->max_sg || num_free == 0) {
+        return;
+    }
+    if (total_sg <= VRING_DIRECT_MAX_SG && num_free >= total_sg + num / 2) {
+        return;
+    }
+
+    block = slot / pool->tables_per_block;
+    offset = (ULONG)(slot % pool->tables_per_block) * pool->table_size;
+    *va = (u8 *)pool->block_va[block] + offset;
+    *pa = pool->block_pa[block] + offset;
+}
+
+#endif /* _VIRTIO_RING_INDIRECT_H */
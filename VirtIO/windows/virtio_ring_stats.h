@@ -0,0 +1,90 @@
+#ifndef _VIRTIO_RING_STATS_H
+#define _VIRTIO_RING_STATS_H
+
+/* Collection of struct virtqueue_stats, shared by the split and packed ring
+ * implementations. Without VIRTIO_QUEUE_STATS all of it compiles to nothing. */
+
+#ifdef VIRTIO_QUEUE_STATS
+
+static inline ULONGLONG vring_stats_timestamp(void)
+{
+    return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+#define vring_stats_stamp(state) ((state)->add_time = vring_stats_timestamp())
+
+static inline void vring_stats_init(struct virtqueue *vq)
+{
+    LARGE_INTEGER frequency;
+
+    RtlZeroMemory(&vq->stats, sizeof(vq->stats));
+    KeQueryPerformanceCounter(&frequency);
+    vq->stats.latency_frequency = frequency.QuadPart;
+}
+
+static inline void vring_stats_add(struct virtqueue *vq)
+{
+    struct virtqueue_stats *stats = &vq->stats;
+
+    stats->adds++;
+    stats->in_flight++;
+    if (stats->in_flight > stats->max_in_flight) {
+        stats->max_in_flight = stats->in_flight;
+    }
+    stats->in_flight_sum += stats->in_flight;
+}
+
+static inline void vring_stats_get(struct virtqueue *vq, ULONGLONG add_time)
+{
+    struct virtqueue_stats *stats = &vq->stats;
+    ULONGLONG latency = vring_stats_timestamp() - add_time;
+    unsigned int bucket = 0;
+
+    while ((latency >>= 1) != 0 && bucket < VIRTQUEUE_STATS_LATENCY_BUCKETS - 1) {
+        bucket++;
+    }
+    stats->latency[bucket]++;
+    stats->gets++;
+    stats->in_flight--;
+}
+
+/* The buffer is reclaimed by the driver without being returned by the device */
+static inline void vring_stats_detach(struct virtqueue *vq)
+{
+    vq->stats.in_flight--;
+}
+
+static inline void vring_stats_kick(struct virtqueue *vq, bool kick)
+{
+    if (kick) {
+        vq->stats.kicks++;
+    } else {
+        vq->stats.kicks_suppressed++;
+    }
+}
+
+static inline void vring_stats_enospc(struct virtqueue *vq)
+{
+    vq->stats.enospc++;
+}
+
+static inline void vring_stats_indirect(struct virtqueue *vq)
+{
+    vq->stats.indirect++;
+}
+
+#else
+
+#define vring_stats_timestamp()         0
+#define vring_stats_stamp(state)
+#define vring_stats_init(vq)            RtlZeroMemory(&(vq)->stats, sizeof((vq)->stats))
+#define vring_stats_add(vq)
+#define vring_stats_get(vq, add_time)
+#define vring_stats_detach(vq)
+#define vring_stats_kick(vq, kick)
+#define vring_stats_enospc(vq)
+#define vring_stats_indirect(vq)
+
+#endif /* VIRTIO_QUEUE_STATS */
+
+#endif /* _VIRTIO_RING_STATS_H */
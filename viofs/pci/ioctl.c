@@ -102,6 +102,39 @@ static int FillScatterGatherFromMdl(OUT struct scatterlist sg[], IN PMDL Mdl, IN
     return i;
 }
 
+// the tables of the request queue pool hold up to VIRT_FS_INDIRECT_POOL_SG
+// descriptors, a longer request takes one of the long tables if there is
+// a free one, called under the lock of the queue
+static void VirtFsGetIndirectTable(IN PDEVICE_CONTEXT Context,
+                                   IN PVIRTIO_FS_REQUEST Request,
+                                   IN struct virtqueue *vq,
+                                   IN ULONG sg_num)
+{
+    PVIRTIO_DMA_MEMORY_SLICED tables = Context->IndirectTables;
+
+    if (tables == NULL || vq != Context->VirtQueues[VQ_TYPE_REQUEST] || sg_num <= VIRT_FS_INDIRECT_POOL_SG ||
+        sg_num > VIRT_FS_INDIRECT_AREA_CAPACITY)
+    {
+        return;
+    }
+
+    Request->IndirectVA = tables->get_slice(tables, &Request->IndirectPA);
+    if (Request->IndirectVA == NULL)
+    {
+        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL, "No free indirect table for %d descriptors", sg_num);
+    }
+}
+
+// called under the lock of the request queue
+void VirtFsPutIndirectTable(IN PDEVICE_CONTEXT Context, IN PVIRTIO_FS_REQUEST Request)
+{
+    if (Request->IndirectVA != NULL)
+    {
+        Context->IndirectTables->return_slice(Context->IndirectTables, Request->IndirectVA);
+        Request->IndirectVA = NULL;
+    }
+}
+
 #if !VIRT_FS_DMAR
 static NTSTATUS VirtFsEnqueueRequest(IN PDEVICE_CONTEXT Context, IN PVIRTIO_FS_REQUEST Request, IN BOOLEAN HighPrio)
 {
@@ -112,8 +145,6 @@ static NTSTATUS VirtFsEnqueueRequest(IN PDEVICE_CONTEXT Context, IN PVIRTIO_FS_R
     int vq_index;
     int ret;
     int out_num, in_num;
-    void *indirect_va = NULL;
-    ULONGLONG indirect_pa = 0;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL, "--> %!FUNC!");
 
@@ -139,16 +170,19 @@ static NTSTATUS VirtFsEnqueueRequest(IN PDEVICE_CONTEXT Context, IN PVIRTIO_FS_R
     PushEntryList(&Context->RequestsList, &Request->ListEntry);
     WdfSpinLockRelease(Context->RequestsLock);
 
-    if (2 < sg_size && sg_size <= VIRT_FS_INDIRECT_AREA_CAPACITY && Context->UseIndirect && !HighPrio)
-    {
-        indirect_va = Context->IndirectVA;
-        indirect_pa = (ULONGLONG)Context->IndirectPA.QuadPart;
-    }
-
+    // indirect tables come from the pool of the request queue or are the long ones
     WdfSpinLockAcquire(vq_lock);
-    ret = virtqueue_add_buf(vq, sg, out_num, in_num, Request, indirect_va, indirect_pa);
+    VirtFsGetIndirectTable(Context, Request, vq, out_num + in_num);
+    ret = virtqueue_add_buf(vq,
+                            sg,
+                            out_num,
+                            in_num,
+                            Request,
+                            Request->IndirectVA,
+                            (ULONGLONG)Request->IndirectPA.QuadPart);
     if (ret < 0)
     {
+        VirtFsPutIndirectTable(Context, Request);
         WdfSpinLockRelease(vq_lock);
 
         VirtFsDequeueRequest(Context, Request);
@@ -260,8 +294,6 @@ static BOOLEAN VirtioFsRxTransactionCallback(PVIRTIO_DMA_TRANSACTION_PARAMS Para
 {
     PDEVICE_CONTEXT context = Params->param1;
     PVIRTIO_FS_REQUEST fs_req = Params->param2;
-    void *indirect_va = NULL;
-    ULONGLONG indirect_pa = 0;
     ULONG sgNum, sgNumIn, sgNumOut;
 
     // save actual RX DMA data
@@ -285,19 +317,23 @@ static BOOLEAN VirtioFsRxTransactionCallback(PVIRTIO_DMA_TRANSACTION_PARAMS Para
         return TRUE;
     }
 #endif
-    fs_req->Use_Indirect = fs_req->Use_Indirect && 2 < sgNum && sgNum <= VIRT_FS_INDIRECT_AREA_CAPACITY;
-    if (fs_req->Use_Indirect)
-    {
-        indirect_va = context->IndirectVA;
-        indirect_pa = (ULONGLONG)context->IndirectPA.QuadPart;
-        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL, "%s: using indirect transfer", __FUNCTION__);
-    }
     // populate fs_req->SGTable with SG elements
     sgNumIn = PopulateSG(fs_req->SGTable, fs_req->H2D_Params.sgList);
     sgNumOut = PopulateSG(fs_req->SGTable + sgNumIn, fs_req->D2H_Params.sgList);
-    // push buffers to virtqueue
+    // push buffers to virtqueue, indirect tables come from the pool of the request queue or are the long ones
     WdfSpinLockAcquire(fs_req->VQ_Lock);
-    int ret = virtqueue_add_buf(fs_req->VQ, fs_req->SGTable, sgNumIn, sgNumOut, fs_req, indirect_va, indirect_pa);
+    VirtFsGetIndirectTable(context, fs_req, fs_req->VQ, sgNum);
+    int ret = virtqueue_add_buf(fs_req->VQ,
+                                fs_req->SGTable,
+                                sgNumIn,
+                                sgNumOut,
+                                fs_req,
+                                fs_req->IndirectVA,
+                                (ULONGLONG)fs_req->IndirectPA.QuadPart);
+    if (ret < 0)
+    {
+        VirtFsPutIndirectTable(context, fs_req);
+    }
     WdfSpinLockRelease(fs_req->VQ_Lock);
     if (ret < 0)
     {
@@ -336,7 +372,6 @@ static NTSTATUS VirtFsEnqueueRequest(IN PDEVICE_CONTEXT Context, IN PVIRTIO_FS_R
     vq_index = GetVirtQueueIndex(Context, HighPrio);
     Request->VQ = Context->VirtQueues[vq_index];
     Request->VQ_Lock = Context->VirtQueueLocks[vq_index];
-    Request->Use_Indirect = Context->UseIndirect && !HighPrio;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL, "Push %p Request: %p", Request, Request->Request);
 
@@ -465,6 +500,8 @@ static VOID HandleSubmitFuseRequest(IN PDEVICE_CONTEXT Context,
     fs_req = WdfMemoryGetBuffer(handle, NULL);
     fs_req->Handle = handle;
     fs_req->Request = Request;
+    fs_req->IndirectVA = NULL;
+    fs_req->IndirectPA.QuadPart = 0;
 #if !VIRT_FS_DMAR
     fs_req->InputBuffer = VirtFsAllocatePages(InputBufferLength);
     fs_req->InputBufferLength = InputBufferLength;
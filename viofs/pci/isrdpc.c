@@ -209,6 +209,7 @@ static VOID VirtFsReadFromQueue(PDEVICE_CONTEXT context, struct virtqueue *vq, W
             break;
         }
 
+        VirtFsPutIndirectTable(context, fs_req);
         WdfSpinLockRelease(vq_lock);
 
         TraceEvents(TRACE_LEVEL_VERBOSE, DBG_DPC, "Got %p Request: %p", fs_req, fs_req->Request);
@@ -37,19 +37,16 @@
 #pragma alloc_text(PAGE, VirtFsEvtDeviceD0Exit)
 #endif
 
-static BOOLEAN VirtFsAllocIndirectArea(PDEVICE_CONTEXT context)
+static BOOLEAN VirtFsAllocIndirectTables(PDEVICE_CONTEXT context)
 {
     VirtIODevice *dev = &context->VDevice.VIODevice;
 
-    context->IndirectVA = VirtIOWdfDeviceAllocDmaMemory(dev, VIRT_FS_INDIRECT_AREA_PAGES * PAGE_SIZE, 0);
-    if (context->IndirectVA == NULL)
-    {
-        return FALSE;
-    }
-
-    context->IndirectPA = VirtIOWdfDeviceGetPhysicalAddress(dev, context->IndirectVA);
+    context->IndirectTables = VirtIOWdfDeviceAllocDmaMemorySliced(dev,
+                                                                  VIRT_FS_INDIRECT_LONG_TABLES *
+                                                                      VIRT_FS_INDIRECT_AREA_PAGES * PAGE_SIZE,
+                                                                  VIRT_FS_INDIRECT_AREA_PAGES * PAGE_SIZE);
 
-    return TRUE;
+    return context->IndirectTables != NULL;
 }
 
 NTSTATUS VirtFsEvtDevicePrepareHardware(IN WDFDEVICE Device,
@@ -153,9 +150,9 @@ NTSTATUS VirtFsEvtDevicePrepareHardware(IN WDFDEVICE Device,
 
     if (context->UseIndirect && NT_SUCCESS(status))
     {
-        if (VirtFsAllocIndirectArea(context) == FALSE)
+        if (VirtFsAllocIndirectTables(context) == FALSE)
         {
-            TraceEvents(TRACE_LEVEL_ERROR, DBG_POWER, "Failed to allocate indirect area");
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_POWER, "Failed to allocate indirect tables");
             status = STATUS_INSUFFICIENT_RESOURCES;
         }
     }
@@ -177,10 +174,10 @@ NTSTATUS VirtFsEvtDeviceReleaseHardware(IN WDFDEVICE Device, IN WDFCMRESLIST Res
 
     VirtIOWdfShutdown(&context->VDevice);
 
-    if (context->UseIndirect && context->IndirectVA != NULL)
+    if (context->IndirectTables != NULL)
     {
-        VirtIOWdfDeviceFreeDmaMemory(&context->VDevice.VIODevice, context->IndirectVA);
-        context->IndirectVA = NULL;
+        context->IndirectTables->destroy(context->IndirectTables);
+        context->IndirectTables = NULL;
     }
 
     if (context->VirtQueues != NULL)
@@ -229,6 +226,15 @@ NTSTATUS VirtFsEvtDeviceD0Entry(IN WDFDEVICE Device, IN WDF_POWER_DEVICE_STATE P
                     __FUNCTION__,
                     queue_size,
                     context->QueueSize);
+
+        // the pool is freed with the queue by VirtIOWdfDestroyQueues
+        if (context->UseIndirect &&
+            !NT_SUCCESS(virtio_alloc_indirect_pool(context->VirtQueues[VQ_TYPE_REQUEST], VIRT_FS_INDIRECT_POOL_SG)))
+        {
+            TraceEvents(TRACE_LEVEL_WARNING,
+                        DBG_POWER,
+                        "Failed to allocate indirect pool, short requests use regular descriptors");
+        }
         VirtIOWdfSetDriverOK(&context->VDevice);
     }
     else
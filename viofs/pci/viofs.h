@@ -48,9 +48,14 @@
 #define VIRT_FS_MEMORY_TAG             ((ULONG)'sf_V')
 
 #define VIRT_FS_ENABLE_INDIRECT        1
+// descriptors per indirect table of the request queue pool
+#define VIRT_FS_INDIRECT_POOL_SG       64
+// a longer request takes one of VIRT_FS_INDIRECT_LONG_TABLES
+// tables of VIRT_FS_INDIRECT_AREA_CAPACITY descriptors
 #define VIRT_FS_INDIRECT_AREA_PAGES    4
 #define VIRT_FS_INDIRECT_PAGE_CAPACITY 256
 #define VIRT_FS_INDIRECT_AREA_CAPACITY (VIRT_FS_INDIRECT_AREA_PAGES * VIRT_FS_INDIRECT_PAGE_CAPACITY)
+#define VIRT_FS_INDIRECT_LONG_TABLES   4
 #define VIRT_FS_MAX_QUEUE_SIZE         1024
 
 enum
@@ -77,6 +82,10 @@ typedef struct _VIRTIO_FS_REQUEST
 
     WDFREQUEST Request;
 
+    // the long indirect table of the request, NULL if none
+    PVOID IndirectVA;
+    PHYSICAL_ADDRESS IndirectPA;
+
 #if !VIRT_FS_DMAR
     // Device-readable part.
     PMDL InputBuffer;
@@ -90,7 +99,6 @@ typedef struct _VIRTIO_FS_REQUEST
     VIRTIO_DMA_TRANSACTION_PARAMS D2H_Params;
     struct virtqueue *VQ;
     WDFSPINLOCK VQ_Lock;
-    BOOLEAN Use_Indirect;
     struct VirtIOBufferDescriptor SGTable[VIRT_FS_MAX_QUEUE_SIZE];
 #endif
 } VIRTIO_FS_REQUEST, *PVIRTIO_FS_REQUEST;
@@ -105,8 +113,7 @@ typedef struct _DEVICE_CONTEXT
     UINT32 QueueSize;
     struct virtqueue **VirtQueues;
     BOOLEAN UseIndirect;
-    PVOID IndirectVA;
-    PHYSICAL_ADDRESS IndirectPA;
+    PVIRTIO_DMA_MEMORY_SLICED IndirectTables;
 
     WDFINTERRUPT WdfInterrupt[VQ_TYPE_MAX];
     WDFSPINLOCK *VirtQueueLocks;
@@ -151,4 +158,5 @@ EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL VirtFsEvtIoDeviceControl;
 EVT_WDF_IO_QUEUE_IO_STOP VirtFsEvtIoStop;
 
 BOOLEAN VirtFsDequeueRequest(PDEVICE_CONTEXT Context, PVIRTIO_FS_REQUEST Req);
+void VirtFsPutIndirectTable(PDEVICE_CONTEXT Context, PVIRTIO_FS_REQUEST Request);
 BOOLEAN VirtFsDequeueWdfRequest(PDEVICE_CONTEXT Context, WDFREQUEST WdfRequest);
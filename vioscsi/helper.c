@@ -158,6 +158,12 @@ VOID SendSRB(IN PVOID DeviceExtension, IN PSRB_TYPE Srb)
         virtqueue_notify(adaptExt->vq[QueueNumber]);
     }
 
+    // Complete the request on this CPU if the device returns it within the busy poll budget
+    if (add_buffer_req_status == VQ_ADD_BUFFER_SUCCESS && virtqueue_busy_poll(adaptExt->vq[QueueNumber]))
+    {
+        ProcessBuffer(DeviceExtension, QUEUE_TO_MESSAGE(QueueNumber), DpcLock);
+    }
+
     EXIT_FN_SRB();
 }
 
@@ -251,6 +257,17 @@ VOID ShutDown(IN PVOID DeviceExtension)
     PADAPTER_EXTENSION adaptExt = (PADAPTER_EXTENSION)DeviceExtension;
     ENTER_FN();
     virtio_device_reset(&adaptExt->vdev);
+    for (index = VIRTIO_SCSI_REQUEST_QUEUE_0; index < adaptExt->num_queues + VIRTIO_SCSI_REQUEST_QUEUE_0; ++index)
+    {
+        if (adaptExt->vq[index] && virtqueue_busy_poll_enabled(adaptExt->vq[index]))
+        {
+            RhelDbgPrint(TRACE_LEVEL_INFORMATION,
+                         " queue %d busy poll hits %llu misses %llu\n",
+                         index,
+                         adaptExt->vq[index]->busy_poll.hits,
+                         adaptExt->vq[index]->busy_poll.misses);
+        }
+    }
     virtio_delete_queues(&adaptExt->vdev);
     for (index = VIRTIO_SCSI_CONTROL_QUEUE; index < adaptExt->num_queues + VIRTIO_SCSI_REQUEST_QUEUE_0; ++index)
     {
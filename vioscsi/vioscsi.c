@@ -451,6 +451,30 @@ VioScsiFindAdapter(IN PVOID DeviceExtension,
     adaptExt->resp_time = 0;
     VioScsiReadRegistryParameter(DeviceExtension, REGISTRY_RESP_TIME_LIMIT, FIELD_OFFSET(ADAPTER_EXTENSION, resp_time));
 
+    /* Adaptive interrupt coalescing of the request queues, the value is the maximal
+     * delay of a completion interrupt in microseconds, 0 (default) disables it.
+     */
+    adaptExt->coalescing_delay = 0;
+    if (!adaptExt->dump_mode)
+    {
+        VioScsiReadRegistryParameter(DeviceExtension,
+                                     REGISTRY_COALESCING_DELAY,
+                                     FIELD_OFFSET(ADAPTER_EXTENSION, coalescing_delay));
+        adaptExt->coalescing_delay = min(adaptExt->coalescing_delay, MAX_COALESCING_DELAY);
+    }
+
+    /* Busy polling of the request queues after a kick, the value is the maximal
+     * spin time in microseconds, 0 (default) disables it.
+     */
+    adaptExt->busy_poll_budget = 0;
+    if (!adaptExt->dump_mode)
+    {
+        VioScsiReadRegistryParameter(DeviceExtension,
+                                     REGISTRY_BUSY_POLL_BUDGET,
+                                     FIELD_OFFSET(ADAPTER_EXTENSION, busy_poll_budget));
+        adaptExt->busy_poll_budget = min(adaptExt->busy_poll_budget, MAX_BUSY_POLL_BUDGET);
+    }
+
     RhelDbgPrint(TRACE_LEVEL_INFORMATION, " Queues %d CPUs %d\n", adaptExt->num_queues, num_cpus);
 
     /* Figure out the maximum number of queues we will ever need to set up. Note that this may
@@ -605,6 +629,7 @@ VioScsiPassiveInitializeRoutine(IN PVOID DeviceExtension)
 static BOOLEAN InitializeVirtualQueues(PADAPTER_EXTENSION adaptExt, ULONG numQueues)
 {
     NTSTATUS status;
+    ULONG index;
 
     status = virtio_find_queues(&adaptExt->vdev, numQueues, adaptExt->vq);
     if (!NT_SUCCESS(status))
@@ -613,6 +638,25 @@ static BOOLEAN InitializeVirtualQueues(PADAPTER_EXTENSION adaptExt, ULONG numQue
         return FALSE;
     }
 
+    if (adaptExt->coalescing_delay)
+    {
+        for (index = VIRTIO_SCSI_REQUEST_QUEUE_0; index < numQueues; ++index)
+        {
+            virtqueue_set_coalescing(adaptExt->vq[index],
+                                     VIRTQUEUE_COALESCING_ADAPTIVE,
+                                     adaptExt->coalescing_delay,
+                                     0);
+        }
+    }
+
+    if (adaptExt->busy_poll_budget)
+    {
+        for (index = VIRTIO_SCSI_REQUEST_QUEUE_0; index < numQueues; ++index)
+        {
+            virtqueue_set_busy_poll(adaptExt->vq[index], adaptExt->busy_poll_budget, 0);
+        }
+    }
+
     return TRUE;
 }
 
@@ -1436,7 +1480,9 @@ VOID FORCEINLINE DispatchQueue(IN PVOID DeviceExtension, IN ULONG MessageId)
 VOID ProcessBuffer(IN PVOID DeviceExtension, IN ULONG MessageId, IN STOR_SPINLOCK LockMode)
 {
     ULONG_PTR srbId;
-    unsigned int len;
+    void *bufs[MAX_COMPLETIONS_PER_BATCH];
+    unsigned int lens[MAX_COMPLETIONS_PER_BATCH];
+    unsigned int n, i;
     PADAPTER_EXTENSION adaptExt = (PADAPTER_EXTENSION)DeviceExtension;
     ULONG QueueNumber = MESSAGE_TO_QUEUE(MessageId);
     STOR_LOCK_HANDLE LockHandle = {0};
@@ -1468,34 +1514,38 @@ VOID ProcessBuffer(IN PVOID DeviceExtension, IN ULONG MessageId, IN STOR_SPINLOC
     do
     {
         virtqueue_disable_cb(vq);
-        while ((srbId = (ULONG_PTR)virtqueue_get_buf(vq, &len)) != 0)
+        while ((n = virtqueue_get_bufs(vq, bufs, lens, ARRAYSIZE(bufs))) != 0)
         {
-            PLIST_ENTRY le = NULL;
-            BOOLEAN bFound = FALSE;
-
-            for (le = element->srb_list.Flink; le != &element->srb_list && !bFound; le = le->Flink)
+            for (i = 0; i < n; i++)
             {
-                srbExt = CONTAINING_RECORD(le, SRB_EXTENSION, list_entry);
-                if (srbExt->id == srbId)
+                PLIST_ENTRY le = NULL;
+                BOOLEAN bFound = FALSE;
+
+                srbId = (ULONG_PTR)bufs[i];
+                for (le = element->srb_list.Flink; le != &element->srb_list && !bFound; le = le->Flink)
                 {
-                    RemoveEntryList(le);
-                    bFound = TRUE;
-                    element->srb_cnt--;
-                    break;
+                    srbExt = CONTAINING_RECORD(le, SRB_EXTENSION, list_entry);
+                    if (srbExt->id == srbId)
+                    {
+                        RemoveEntryList(le);
+                        bFound = TRUE;
+                        element->srb_cnt--;
+                        break;
+                    }
                 }
-            }
 
-            if (!bFound)
-            {
-                RhelDbgPrint(TRACE_LEVEL_WARNING, " No SRB found for ID 0x%p\n", (void *)srbId);
-            }
+                if (!bFound)
+                {
+                    RhelDbgPrint(TRACE_LEVEL_WARNING, " No SRB found for ID 0x%p\n", (void *)srbId);
+                }
 
-            if (bFound)
-            {
-                HandleResponse(DeviceExtension, &srbExt->cmd);
+                if (bFound)
+                {
+                    HandleResponse(DeviceExtension, &srbExt->cmd);
+                }
             }
         }
-    } while (!virtqueue_enable_cb(vq));
+    } while (!(adaptExt->coalescing_delay ? virtqueue_enable_cb_delayed(vq) : virtqueue_enable_cb(vq)));
 
     StorPortReleaseSpinLock(DeviceExtension, &LockHandle);
 
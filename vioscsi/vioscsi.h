@@ -53,6 +53,7 @@ typedef struct VirtIOBufferDescriptor VIO_SG, *PVIO_SG;
 #define MAX_PHYS_SEGMENTS                    512
 #define VIOSCSI_POOL_TAG                     'SoiV'
 #define VIRTIO_MAX_SG                        (1 + 1 + MAX_PHYS_SEGMENTS + 1) // cmd + resp + (MAX_PHYS_SEGMENTS + extra_page)
+#define MAX_COMPLETIONS_PER_BATCH            32 // used buffers retrieved from the virtqueue at once
 
 #define SECTOR_SIZE                          512
 #define IO_PORT_LENGTH                       0x40
@@ -61,6 +62,10 @@ typedef struct VirtIOBufferDescriptor VIO_SG, *PVIO_SG;
 #define REGISTRY_MAX_PH_BREAKS               "PhysicalBreaks"
 #define REGISTRY_ACTION_ON_RESET             "VioscsiActionOnReset"
 #define REGISTRY_RESP_TIME_LIMIT             "TraceResponseTime"
+#define REGISTRY_COALESCING_DELAY            "CoalescingMaxDelay"
+#define MAX_COALESCING_DELAY                 1000 // microseconds
+#define REGISTRY_BUSY_POLL_BUDGET            "BusyPollBudget"
+#define MAX_BUSY_POLL_BUDGET                 1000 // microseconds
 
 /* Feature Bits */
 #define VIRTIO_SCSI_F_INOUT                  0
@@ -352,6 +357,8 @@ typedef struct _ADAPTER_EXTENSION
     ACTION_ON_RESET action_on_reset;
     ULONGLONG fw_ver;
     ULONG resp_time;
+    ULONG coalescing_delay;
+    ULONG busy_poll_budget;
     BOOLEAN bRemoved;
     ULONG_PTR last_srb_id;
 } ADAPTER_EXTENSION, *PADAPTER_EXTENSION;
@@ -228,6 +228,36 @@ static ULONG InitVirtIODevice(PVOID DeviceExtension)
     return SP_RETURN_FOUND;
 }
 
+static BOOLEAN VioStorReadRegistryParameter(IN PVOID DeviceExtension, IN PUCHAR ValueName, IN PULONG Value)
+{
+    BOOLEAN Ret = FALSE;
+    ULONG Len = sizeof(ULONG);
+    UCHAR *pBuf = NULL;
+
+    pBuf = StorPortAllocateRegistryBuffer(DeviceExtension, &Len);
+    if (pBuf == NULL)
+    {
+        RhelDbgPrint(TRACE_LEVEL_FATAL, " StorPortAllocateRegistryBuffer failed to allocate buffer\n");
+        return FALSE;
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    Ret = StorPortRegistryRead(DeviceExtension, ValueName, 1, MINIPORT_REG_DWORD, pBuf, &Len);
+    if ((Ret == FALSE) || (Len == 0))
+    {
+        RhelDbgPrint(TRACE_LEVEL_INFORMATION, " StorPortRegistryRead returned 0x%x, Len = %d\n", Ret, Len);
+        StorPortFreeRegistryBuffer(DeviceExtension, pBuf);
+        return FALSE;
+    }
+
+    StorPortCopyMemory(Value, pBuf, sizeof(ULONG));
+
+    StorPortFreeRegistryBuffer(DeviceExtension, pBuf);
+
+    return TRUE;
+}
+
 ULONG
 VirtIoFindAdapter(IN PVOID DeviceExtension,
                   IN PVOID HwContext,
@@ -458,6 +488,30 @@ VirtIoFindAdapter(IN PVOID DeviceExtension,
 
     RhelDbgPrint(TRACE_LEVEL_INFORMATION, " Queues %d CPUs %d\n", adaptExt->num_queues, num_cpus);
 
+    /* Adaptive interrupt coalescing of the request queues, the value is the maximal
+     * delay of a completion interrupt in microseconds, 0 (default) disables it.
+     * [HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Services\viostor\Parameters\Device]
+     * "CoalescingMaxDelay"={dword value here}
+     */
+    adaptExt->coalescing_delay = 0;
+    if (!adaptExt->dump_mode)
+    {
+        VioStorReadRegistryParameter(DeviceExtension, REGISTRY_COALESCING_DELAY, &adaptExt->coalescing_delay);
+        adaptExt->coalescing_delay = min(adaptExt->coalescing_delay, MAX_COALESCING_DELAY);
+    }
+
+    /* Busy polling of the request queues after a kick, the value is the maximal
+     * spin time in microseconds, 0 (default) disables it.
+     * [HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Services\viostor\Parameters\Device]
+     * "BusyPollBudget"={dword value here}
+     */
+    adaptExt->busy_poll_budget = 0;
+    if (!adaptExt->dump_mode)
+    {
+        VioStorReadRegistryParameter(DeviceExtension, REGISTRY_BUSY_POLL_BUDGET, &adaptExt->busy_poll_budget);
+        adaptExt->busy_poll_budget = min(adaptExt->busy_poll_budget, MAX_BUSY_POLL_BUDGET);
+    }
+
     max_queues = min(max_cpus, adaptExt->num_queues);
     adaptExt->pageAllocationSize = 0;
     adaptExt->poolAllocationSize = 0;
@@ -551,6 +605,7 @@ VirtIoPassiveInitializeRoutine(IN PVOID DeviceExtension)
 static BOOLEAN InitializeVirtualQueues(PADAPTER_EXTENSION adaptExt)
 {
     NTSTATUS status;
+    ULONG index;
     ULONG numQueues = adaptExt->num_queues;
 
     RhelDbgPrint(TRACE_LEVEL_INFORMATION, " InitializeVirtualQueues numQueues %d\n", numQueues);
@@ -561,6 +616,25 @@ static BOOLEAN InitializeVirtualQueues(PADAPTER_EXTENSION adaptExt)
         return FALSE;
     }
 
+    if (adaptExt->coalescing_delay)
+    {
+        for (index = 0; index < numQueues; ++index)
+        {
+            virtqueue_set_coalescing(adaptExt->vq[index],
+                                     VIRTQUEUE_COALESCING_ADAPTIVE,
+                                     adaptExt->coalescing_delay,
+                                     0);
+        }
+    }
+
+    if (adaptExt->busy_poll_budget)
+    {
+        for (index = 0; index < numQueues; ++index)
+        {
+            virtqueue_set_busy_poll(adaptExt->vq[index], adaptExt->busy_poll_budget, 0);
+        }
+    }
+
     return TRUE;
 }
 
@@ -2098,7 +2172,9 @@ UCHAR DeviceToSrbStatus(UCHAR status)
 
 VOID VioStorCompleteRequest(IN PVOID DeviceExtension, IN ULONG MessageID, IN BOOLEAN bIsr)
 {
-    unsigned int len = 0;
+    void *bufs[MAX_COMPLETIONS_PER_BATCH];
+    unsigned int lens[MAX_COMPLETIONS_PER_BATCH];
+    unsigned int n, i;
     PADAPTER_EXTENSION adaptExt = NULL;
     ULONG QueueNumber = MessageID - 1;
     STOR_LOCK_HANDLE queueLock = {0};
@@ -2120,104 +2196,109 @@ VOID VioStorCompleteRequest(IN PVOID DeviceExtension, IN ULONG MessageID, IN BOO
     do
     {
         virtqueue_disable_cb(vq);
-        while ((srbId = (ULONG_PTR)virtqueue_get_buf(vq, &len)) != 0)
+        while ((n = virtqueue_get_bufs(vq, bufs, lens, ARRAYSIZE(bufs))) != 0)
         {
-            PLIST_ENTRY le = NULL;
-            BOOLEAN bFound = FALSE;
+            for (i = 0; i < n; i++)
+            {
+                PLIST_ENTRY le = NULL;
+                BOOLEAN bFound = FALSE;
+
+                srbId = (ULONG_PTR)bufs[i];
 #ifdef DBG
-            InterlockedDecrement((LONG volatile *)&adaptExt->inqueue_cnt);
+                InterlockedDecrement((LONG volatile *)&adaptExt->inqueue_cnt);
 #endif
-            for (le = element->srb_list.Flink; le != &element->srb_list && !bFound; le = le->Flink)
-            {
-                pblk_req req = CONTAINING_RECORD(le, blk_req, list_entry);
-
-                Srb = (PSRB_TYPE)req->req;
-                srbExt = SRB_EXTENSION(Srb);
-                // Only SRBs with existing (i.e. non-NULL) extension
-                // are inserted into our queues, thus, we may help
-                // the Code Analysis and provide it with this information
-                // in order to avoid false-positive warnings.
-                _Analysis_assume_(srbExt != NULL);
-                if (srbExt->id == srbId)
+                for (le = element->srb_list.Flink; le != &element->srb_list && !bFound; le = le->Flink)
                 {
-                    RemoveEntryList(le);
-                    element->srb_cnt--;
-                    bFound = TRUE;
-                    break;
+                    pblk_req req = CONTAINING_RECORD(le, blk_req, list_entry);
+
+                    Srb = (PSRB_TYPE)req->req;
+                    srbExt = SRB_EXTENSION(Srb);
+                    // Only SRBs with existing (i.e. non-NULL) extension
+                    // are inserted into our queues, thus, we may help
+                    // the Code Analysis and provide it with this information
+                    // in order to avoid false-positive warnings.
+                    _Analysis_assume_(srbExt != NULL);
+                    if (srbExt->id == srbId)
+                    {
+                        RemoveEntryList(le);
+                        element->srb_cnt--;
+                        bFound = TRUE;
+                        break;
+                    }
                 }
-            }
 
-            if (!bFound)
-            {
-                RhelDbgPrint(TRACE_LEVEL_WARNING, " No Srb to complete for ID 0x%p\n", (void *)srbId);
-            }
-
-            if (bFound && srbExt->vbr.out_hdr.type == VIRTIO_BLK_T_GET_ID)
-            {
-                adaptExt->sn_ok = TRUE;
-                if (Srb)
+                if (!bFound)
                 {
-                    PCDB cdb = SRB_CDB(Srb);
+                    RhelDbgPrint(TRACE_LEVEL_WARNING, " No Srb to complete for ID 0x%p\n", (void *)srbId);
+                }
 
-                    if (!cdb)
+                if (bFound && srbExt->vbr.out_hdr.type == VIRTIO_BLK_T_GET_ID)
+                {
+                    adaptExt->sn_ok = TRUE;
+                    if (Srb)
                     {
-                        continue;
-                    }
+                        PCDB cdb = SRB_CDB(Srb);
 
-                    if ((cdb->CDB6INQUIRY3.PageCode == VPD_SERIAL_NUMBER) &&
-                        (cdb->CDB6INQUIRY3.EnableVitalProductData == 1))
-                    {
-                        PVPD_SERIAL_NUMBER_PAGE SerialPage;
-                        ULONG dataLen = SRB_DATA_TRANSFER_LENGTH(Srb);
-                        UCHAR len = strlen(adaptExt->sn);
-
-                        SerialPage = (PVPD_SERIAL_NUMBER_PAGE)SRB_DATA_BUFFER(Srb);
-                        RhelDbgPrint(TRACE_LEVEL_INFORMATION, "dataLen = %d\n", dataLen);
-                        RtlZeroMemory(SerialPage, dataLen);
-                        SerialPage->DeviceType = DIRECT_ACCESS_DEVICE;
-                        SerialPage->DeviceTypeQualifier = DEVICE_CONNECTED;
-                        SerialPage->PageCode = VPD_SERIAL_NUMBER;
-
-                        SerialPage->PageLength = min(BLOCK_SERIAL_STRLEN, len);
-                        StorPortCopyMemory(&SerialPage->SerialNumber, &adaptExt->sn, SerialPage->PageLength);
-                        RhelDbgPrint(TRACE_LEVEL_INFORMATION, "PageLength = %d (%d)\n", SerialPage->PageLength, len);
-
-                        SRB_SET_DATA_TRANSFER_LENGTH(Srb, (sizeof(VPD_SERIAL_NUMBER_PAGE) + SerialPage->PageLength));
-                        CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
-                    }
-                    else if ((cdb->CDB6INQUIRY3.PageCode == VPD_DEVICE_IDENTIFIERS) &&
-                             (cdb->CDB6INQUIRY3.EnableVitalProductData == 1))
-                    {
-                        ReportDeviceIdentifier(DeviceExtension, Srb);
-                        CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
+                        if (!cdb)
+                        {
+                            continue;
+                        }
+
+                        if ((cdb->CDB6INQUIRY3.PageCode == VPD_SERIAL_NUMBER) &&
+                            (cdb->CDB6INQUIRY3.EnableVitalProductData == 1))
+                        {
+                            PVPD_SERIAL_NUMBER_PAGE SerialPage;
+                            ULONG dataLen = SRB_DATA_TRANSFER_LENGTH(Srb);
+                            UCHAR len = strlen(adaptExt->sn);
+
+                            SerialPage = (PVPD_SERIAL_NUMBER_PAGE)SRB_DATA_BUFFER(Srb);
+                            RhelDbgPrint(TRACE_LEVEL_INFORMATION, "dataLen = %d\n", dataLen);
+                            RtlZeroMemory(SerialPage, dataLen);
+                            SerialPage->DeviceType = DIRECT_ACCESS_DEVICE;
+                            SerialPage->DeviceTypeQualifier = DEVICE_CONNECTED;
+                            SerialPage->PageCode = VPD_SERIAL_NUMBER;
+
+                            SerialPage->PageLength = min(BLOCK_SERIAL_STRLEN, len);
+                            StorPortCopyMemory(&SerialPage->SerialNumber, &adaptExt->sn, SerialPage->PageLength);
+                            RhelDbgPrint(TRACE_LEVEL_INFORMATION, "PageLength = %d (%d)\n", SerialPage->PageLength, len);
+
+                            SRB_SET_DATA_TRANSFER_LENGTH(Srb, (sizeof(VPD_SERIAL_NUMBER_PAGE) + SerialPage->PageLength));
+                            CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
+                        }
+                        else if ((cdb->CDB6INQUIRY3.PageCode == VPD_DEVICE_IDENTIFIERS) &&
+                                 (cdb->CDB6INQUIRY3.EnableVitalProductData == 1))
+                        {
+                            ReportDeviceIdentifier(DeviceExtension, Srb);
+                            CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
+                        }
                     }
+                    continue;
                 }
-                continue;
-            }
-            if (bFound && Srb)
-            {
-                srbStatus = DeviceToSrbStatus(srbExt->vbr.status);
-                RhelDbgPrint(TRACE_LEVEL_INFORMATION,
-                             " srb %p, QueueNumber %lu, MessageId %lu.\n",
-                             Srb,
-                             QueueNumber,
-                             MessageID);
-                if (srbExt && srbExt->fua == TRUE)
+                if (bFound && Srb)
                 {
-                    SRB_SET_SRB_STATUS(Srb, SRB_STATUS_PENDING);
-                    if (!RhelDoFlush(DeviceExtension, Srb, TRUE, bIsr))
+                    srbStatus = DeviceToSrbStatus(srbExt->vbr.status);
+                    RhelDbgPrint(TRACE_LEVEL_INFORMATION,
+                                 " srb %p, QueueNumber %lu, MessageId %lu.\n",
+                                 Srb,
+                                 QueueNumber,
+                                 MessageID);
+                    if (srbExt && srbExt->fua == TRUE)
                     {
-                        CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_ERROR);
+                        SRB_SET_SRB_STATUS(Srb, SRB_STATUS_PENDING);
+                        if (!RhelDoFlush(DeviceExtension, Srb, TRUE, bIsr))
+                        {
+                            CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_ERROR);
+                        }
+                        srbExt->fua = FALSE;
+                    }
+                    else
+                    {
+                        CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, srbStatus);
                     }
-                    srbExt->fua = FALSE;
-                }
-                else
-                {
-                    CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, srbStatus);
                 }
             }
         }
-    } while (!virtqueue_enable_cb(vq));
+    } while (!(adaptExt->coalescing_delay ? virtqueue_enable_cb_delayed(vq) : virtqueue_enable_cb(vq)));
 
     VioStorVQUnlock(DeviceExtension, MessageID, &queueLock, bIsr);
 
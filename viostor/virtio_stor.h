@@ -90,6 +90,12 @@ typedef struct VirtIOBufferDescriptor VIO_SG, *PVIO_SG;
 
 #define MAX_PHYS_SEGMENTS                  512
 #define VIRTIO_MAX_SG                      (3 + MAX_PHYS_SEGMENTS)
+#define MAX_COMPLETIONS_PER_BATCH          32 // used buffers retrieved from the virtqueue at once
+
+#define REGISTRY_COALESCING_DELAY          "CoalescingMaxDelay"
+#define MAX_COALESCING_DELAY               1000 // microseconds
+#define REGISTRY_BUSY_POLL_BUDGET          "BusyPollBudget"
+#define MAX_BUSY_POLL_BUDGET               1000 // microseconds
 
 #define VIOBLK_POOL_TAG                    'BoiV'
 
@@ -257,6 +263,8 @@ typedef struct _ADAPTER_EXTENSION
     BOOLEAN reset_in_progress;
     ULONGLONG fw_ver;
     ULONG_PTR last_srb_id;
+    ULONG coalescing_delay;
+    ULONG busy_poll_budget;
 #ifdef DBG
     LONG srb_cnt;
     LONG inqueue_cnt;
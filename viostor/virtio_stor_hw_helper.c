@@ -247,7 +247,12 @@ RhelDoReadWrite(PVOID DeviceExtension, PSRB_TYPE Srb)
         virtqueue_notify(adaptExt->vq[QueueNumber]);
     }
 
-    if (adaptExt->num_queues > 1)
+    // Complete the request on this CPU if the device returns it within the busy poll budget
+    if (result && virtqueue_busy_poll(adaptExt->vq[QueueNumber]))
+    {
+        VioStorCompleteRequest(DeviceExtension, MessageId, FALSE);
+    }
+    else if (adaptExt->num_queues > 1)
     {
         if (CHECKFLAG(adaptExt->perfFlags, STOR_PERF_OPTIMIZE_FOR_COMPLETION_DURING_STARTIO))
         {
@@ -511,6 +516,17 @@ VOID RhelShutDown(IN PVOID DeviceExtension)
     PADAPTER_EXTENSION adaptExt = (PADAPTER_EXTENSION)DeviceExtension;
 
     virtio_device_reset(&adaptExt->vdev);
+    for (index = 0; index < adaptExt->num_queues; ++index)
+    {
+        if (adaptExt->vq[index] && virtqueue_busy_poll_enabled(adaptExt->vq[index]))
+        {
+            RhelDbgPrint(TRACE_LEVEL_INFORMATION,
+                         " queue %d busy poll hits %llu misses %llu\n",
+                         index,
+                         adaptExt->vq[index]->busy_poll.hits,
+                         adaptExt->vq[index]->busy_poll.misses);
+        }
+    }
     virtio_delete_queues(&adaptExt->vdev);
     for (index = 0; index < adaptExt->num_queues; ++index)
     {